@@ -1,6 +1,12 @@
 #pragma once
 #include "ext_snappy/snappy.h"
 #include "switch.h"
+#include <lz4.h>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <zstd.h>
 
 namespace Compression
 {
@@ -8,10 +14,162 @@ namespace Compression
         enum class Algo : int8_t
         {
                 UNKNOWN = -1,
-                SNAPPY
+                SNAPPY,
+                LZ4,
+                ZSTD
         };
 
-        inline bool Compress(const Algo algorithm, const void *data, const uint32_t dataLen, Buffer *dest)
+        static constexpr int ZstdDefaultLevel{3};
+
+        // Maps the codec bits of a TANK bundle header to an algorithm
+        // 0 is no compression, 1 is Snappy, 2 is LZ4 and 3 is Zstd
+        inline Algo AlgoForCodec(const uint8_t codec) noexcept
+        {
+                switch (codec)
+                {
+                        case 1:
+                                return Algo::SNAPPY;
+
+                        case 2:
+                                return Algo::LZ4;
+
+                        case 3:
+                                return Algo::ZSTD;
+
+                        default:
+                                return Algo::UNKNOWN;
+                }
+        }
+
+        inline uint8_t CodecForAlgo(const Algo algorithm) noexcept
+        {
+                switch (algorithm)
+                {
+                        case Algo::SNAPPY:
+                                return 1;
+
+                        case Algo::LZ4:
+                                return 2;
+
+                        case Algo::ZSTD:
+                                return 3;
+
+                        default:
+                                return 0;
+                }
+        }
+
+        // Compression/decompression contexts are expensive to set up, so we keep one per thread
+        inline ZSTD_CCtx *zstd_cctx()
+        {
+                static thread_local std::unique_ptr<ZSTD_CCtx, size_t (*)(ZSTD_CCtx *)> ctx(ZSTD_createCCtx(), ZSTD_freeCCtx);
+
+                return ctx.get();
+        }
+
+        inline ZSTD_DCtx *zstd_dctx()
+        {
+                static thread_local std::unique_ptr<ZSTD_DCtx, size_t (*)(ZSTD_DCtx *)> ctx(ZSTD_createDCtx(), ZSTD_freeDCtx);
+
+                return ctx.get();
+        }
+
+        // A trained Zstd dictionary, identified by the dictionary ID the trainer embedded in it
+        // Frames compressed with a dictionary record its ID, so decompression can locate it in the registry
+        struct zstd_dictionary
+        {
+                uint32_t id;
+                std::string content;
+                ZSTD_CDict *cdict;
+                ZSTD_DDict *ddict;
+        };
+
+        struct zstd_dictionaries_registry
+        {
+                std::mutex lock;
+                // Dictionaries are never unregistered, so pointers to them remain valid
+                std::unordered_map<uint32_t, std::unique_ptr<zstd_dictionary>> map;
+        };
+
+        inline zstd_dictionaries_registry &zstd_dictionaries()
+        {
+                static zstd_dictionaries_registry r;
+
+                return r;
+        }
+
+        inline const zstd_dictionary *ZstdDictionary(const uint32_t id)
+        {
+                static thread_local const zstd_dictionary *last{nullptr};
+
+                if (last && last->id == id)
+                        return last;
+
+                auto &r = zstd_dictionaries();
+                std::lock_guard<std::mutex> g(r.lock);
+                const auto it = r.map.find(id);
+
+                if (it == r.map.end())
+                        return nullptr;
+
+                last = it->second.get();
+                return last;
+        }
+
+        // Registers a Zstd dictionary(e.g as generated by `zstd --train` or ZDICT_trainFromBuffer()) and returns its ID
+        // Returns 0 if this is not a valid dictionary; raw content dictionaries are not supported because they carry no ID
+        // Frames only record the dictionary ID, so a dictionary with the ID of an already registered dictionary but different
+        // content is also rejected(returns 0); see ZstdDictionaryConflicts()
+        inline uint32_t RegisterZstdDictionary(const void *const data, const size_t len)
+        {
+                const auto id = ZSTD_getDictID_fromDict(data, len);
+
+                if (!id)
+                        return 0;
+
+                auto &r = zstd_dictionaries();
+                std::lock_guard<std::mutex> g(r.lock);
+                auto &d = r.map[id];
+
+                if (d)
+                {
+                        if (d->content.size() != len || memcmp(d->content.data(), data, len))
+                                return 0;
+                }
+                else
+                {
+                        auto n = std::make_unique<zstd_dictionary>();
+
+                        n->id = id;
+                        n->content.assign(static_cast<const char *>(data), len);
+                        n->cdict = ZSTD_createCDict(n->content.data(), n->content.size(), ZstdDefaultLevel);
+                        n->ddict = ZSTD_createDDict(n->content.data(), n->content.size());
+
+                        if (!n->cdict || !n->ddict)
+                        {
+                                ZSTD_freeCDict(n->cdict);
+                                ZSTD_freeDDict(n->ddict);
+                                r.map.erase(id);
+                                return 0;
+                        }
+
+                        d = std::move(n);
+                }
+
+                return id;
+        }
+
+        // Returns true if a dictionary with the same ID as the dictionary [data, data + len), but different content, is registered
+        inline bool ZstdDictionaryConflicts(const void *const data, const size_t len)
+        {
+                const auto id = ZSTD_getDictID_fromDict(data, len);
+                const auto d = id ? ZstdDictionary(id) : nullptr;
+
+                return d && (d->content.size() != len || memcmp(d->content.data(), data, len));
+        }
+
+        // dictId is only considered for Zstd; if set, the dictionary must have been registered with RegisterZstdDictionary()
+        inline bool Compress(const Algo algorithm, const void *data, const uint32_t dataLen, Buffer *dest, const uint32_t dictId = 0)
         {
                 switch (algorithm)
                 {
@@ -27,6 +185,55 @@ namespace Compression
                         }
                         break;
 
+                        case Algo::LZ4:
+                        {
+                                // LZ4 blocks do not encode the uncompressed length, so we prefix it
+                                if (unlikely(dataLen > LZ4_MAX_INPUT_SIZE))
+                                        return false;
+
+                                const auto bound = LZ4_compressBound(dataLen);
+
+                                dest->reserve(bound + sizeof(uint32_t));
+                                *(uint32_t *)dest->At(dest->size()) = dataLen;
+
+                                const auto outLen = LZ4_compress_default((char *)data, dest->At(dest->size() + sizeof(uint32_t)), dataLen, bound);
+
+                                if (unlikely(outLen <= 0))
+                                        return false;
+
+                                dest->advance_size(outLen + sizeof(uint32_t));
+                                return true;
+                        }
+                        break;
+
+                        case Algo::ZSTD:
+                        {
+                                const auto bound = ZSTD_compressBound(dataLen);
+
+                                dest->reserve(bound);
+
+                                size_t outLen;
+
+                                if (dictId)
+                                {
+                                        const auto dict = ZstdDictionary(dictId);
+
+                                        if (unlikely(!dict))
+                                                return false;
+
+                                        outLen = ZSTD_compress_usingCDict(zstd_cctx(), dest->At(dest->size()), bound, data, dataLen, dict->cdict);
+                                }
+                                else
+                                        outLen = ZSTD_compressCCtx(zstd_cctx(), dest->At(dest->size()), bound, data, dataLen, ZstdDefaultLevel);
+
+                                if (unlikely(ZSTD_isError(outLen)))
+                                        return false;
+
+                                dest->advance_size(outLen);
+                                return true;
+                        }
+                        break;
+
                         default:
                                 return false;
                 }
@@ -57,6 +264,60 @@ namespace Compression
                         }
                         break;
 
+                        case Algo::LZ4:
+                        {
+                                if (unlikely(sourceLen < sizeof(uint32_t)))
+                                        return false;
+
+                                const auto outLen = *(uint32_t *)source;
+
+                                if (unlikely(outLen > LZ4_MAX_INPUT_SIZE))
+                                        return false;
+
+                                dest->reserve(outLen + 8);
+
+                                const auto r = LZ4_decompress_safe((char *)source + sizeof(uint32_t), dest->At(dest->size()), sourceLen - sizeof(uint32_t), outLen);
+
+                                if (unlikely(r < 0 || uint32_t(r) != outLen))
+                                        return false;
+
+                                dest->advance_size(outLen);
+                                return true;
+                        }
+                        break;
+
+                        case Algo::ZSTD:
+                        {
+                                const auto outLen = ZSTD_getFrameContentSize(source, sourceLen);
+
+                                if (unlikely(outLen == ZSTD_CONTENTSIZE_UNKNOWN || outLen == ZSTD_CONTENTSIZE_ERROR || outLen > UINT32_MAX))
+                                        return false;
+
+                                dest->reserve(outLen + 8);
+
+                                const auto dictId = ZSTD_getDictID_fromFrame(source, sourceLen);
+                                size_t r;
+
+                                if (dictId)
+                                {
+                                        const auto dict = ZstdDictionary(dictId);
+
+                                        if (unlikely(!dict))
+                                                return false;
+
+                                        r = ZSTD_decompress_usingDDict(zstd_dctx(), dest->At(dest->size()), outLen, source, sourceLen, dict->ddict);
+                                }
+                                else
+                                        r = ZSTD_decompressDCtx(zstd_dctx(), dest->At(dest->size()), outLen, source, sourceLen);
+
+                                if (unlikely(ZSTD_isError(r) || r != outLen))
+                                        return false;
+
+                                dest->advance_size(outLen);
+                                return true;
+                        }
+                        break;
+
                         default:
                                 return false;
                 }
@@ -165,6 +426,46 @@ namespace Compression
 #undef FLIPPED
         }
 
+        // Decodes an encoded u32 from [p, e) in a single pass, and returns false if [p, e) doesn't start with
+        // a complete encoded u32 (i.e when UnpackUInt32Check() would return 0).
+        //
+        // When there are at least 8 bytes available, it loads them in one go, locates the last byte of the
+        // encoded value from the continuation bits, and gathers the 7-bit groups without any data-dependent
+        // branches; this is what we want for parsing message sets, where lengths are mostly 1 or 2 bytes long and
+        // the branch predictor can't do much. Close to the end of the buffer, it falls back to the byte at a time checks.
+        [[gnu::always_inline]] inline bool TryUnpackUInt32(const uint8_t *&p, const uint8_t *const e, uint32_t &out) noexcept
+        {
+                if (likely(e - p >= 8))
+                {
+                        uint64_t v;
+
+                        memcpy(&v, p, sizeof(v));
+
+                        // Top bit is set for each byte that terminates a value
+                        const auto stops = ~v & 0x8080808080808080ull;
+
+                        if (unlikely(!(stops & 0xffffffffffull)))
+                        {
+                                // Not terminated within 5 bytes
+                                return false;
+                        }
+
+                        const uint32_t bits = __builtin_ctzll(stops) + 1; // 8, 16, 24, 32 or 40
+
+                        v &= (uint64_t(1) << bits) - 1;
+                        out = (v & 0x7f) | ((v & 0x7f00) >> 1) | ((v & 0x7f0000) >> 2) | ((v & 0x7f000000) >> 3) | ((v & 0x7f00000000ull) >> 4);
+                        p += bits >> 3;
+                        return true;
+                }
+                else if (!UnpackUInt32Check(p, e))
+                        return false;
+                else
+                {
+                        out = UnpackUInt32(p);
+                        return true;
+                }
+        }
+
         inline auto encode_varuint32(const uint32_t n, uint8_t *out)
         {
                 return PackUInt32(n, out);
@@ -0,0 +1,251 @@
+#pragma once
+#ifdef __linux__
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define SWITCH_HAVE_IOURING 1
+#endif
+#endif
+#endif
+
+#ifdef SWITCH_HAVE_IOURING
+#include <algorithm>
+#include <linux/io_uring.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+// Minimal io_uring wrapper; we don't depend on liburing.
+// Use get_sqe() to prepare one or more SQEs, and then submit_and_wait() or submit() to submit them
+// all with a single io_uring_enter() call, and reap their CQEs with for_each_cqe().
+class IOURing
+{
+      private:
+        int ringFd{-1};
+        uint8_t *sqRing{nullptr}, *cqRing{nullptr};
+        size_t sqRingSize{0}, cqRingSize{0}, sqesSize{0};
+        struct io_uring_sqe *sqes{nullptr};
+        struct io_uring_cqe *cqes{nullptr};
+        uint32_t *sqHead, *sqTail, *sqArray, *cqHead, *cqTail;
+        uint32_t sqMask, sqEntries, cqMask;
+        uint32_t sqeTail{0}, pendingSubmit{0};
+        // IO_URING_OP_SUPPORTED opcodes; see supports()
+        uint64_t supportedOps[4]{0, 0, 0, 0};
+
+        bool probe_ops()
+        {
+                union {
+                        struct io_uring_probe probe;
+                        uint8_t buf[sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op)];
+                } u;
+
+                memset(&u, 0, sizeof(u));
+                if (syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_PROBE, &u.probe, 256) == -1)
+                        return false;
+
+                for (uint32_t i{0}; i != u.probe.ops_len; ++i)
+                {
+                        if (u.probe.ops[i].flags & IO_URING_OP_SUPPORTED)
+                                supportedOps[u.probe.ops[i].op >> 6] |= uint64_t(1) << (u.probe.ops[i].op & 63);
+                }
+
+                return true;
+        }
+
+      public:
+        ~IOURing()
+        {
+                if (sqes)
+                        munmap(sqes, sqesSize);
+                if (cqRing && cqRing != sqRing)
+                        munmap(cqRing, cqRingSize);
+                if (sqRing)
+                        munmap(sqRing, sqRingSize);
+                if (ringFd != -1)
+                        close(ringFd);
+        }
+
+        // Returns -1 and sets errno if the kernel doesn't support io_uring, or if it's not allowed(e.g seccomp), or if it
+        // doesn't support what we rely on: writev() at the current file offset(see prep_writev()) and fadvise()
+        int init(const uint32_t entries)
+        {
+                struct io_uring_params p;
+
+                memset(&p, 0, sizeof(p));
+                ringFd = syscall(__NR_io_uring_setup, entries, &p);
+                if (ringFd == -1)
+                        return -1;
+
+                // Kernels before 5.6 don't support IORING_FEAT_RW_CUR_POS, the probe, or IORING_OP_FADVISE
+                if (!(p.features & IORING_FEAT_RW_CUR_POS) || !probe_ops() || !supports(IORING_OP_WRITEV) || !supports(IORING_OP_FADVISE))
+                {
+                        errno = EOPNOTSUPP;
+                        return -1;
+                }
+
+                sqRingSize = p.sq_off.array + p.sq_entries * sizeof(uint32_t);
+                cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+
+                if (p.features & IORING_FEAT_SINGLE_MMAP)
+                        sqRingSize = cqRingSize = std::max(sqRingSize, cqRingSize);
+
+                sqRing = (uint8_t *)mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQ_RING);
+                if (sqRing == MAP_FAILED)
+                {
+                        sqRing = nullptr;
+                        return -1;
+                }
+
+                if (p.features & IORING_FEAT_SINGLE_MMAP)
+                        cqRing = sqRing;
+                else
+                {
+                        cqRing = (uint8_t *)mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_CQ_RING);
+                        if (cqRing == MAP_FAILED)
+                        {
+                                cqRing = nullptr;
+                                return -1;
+                        }
+                }
+
+                sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+                sqes = (struct io_uring_sqe *)mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ringFd, IORING_OFF_SQES);
+                if (sqes == MAP_FAILED)
+                {
+                        sqes = nullptr;
+                        return -1;
+                }
+
+                sqHead = (uint32_t *)(sqRing + p.sq_off.head);
+                sqTail = (uint32_t *)(sqRing + p.sq_off.tail);
+                sqArray = (uint32_t *)(sqRing + p.sq_off.array);
+                sqMask = *(uint32_t *)(sqRing + p.sq_off.ring_mask);
+                sqEntries = *(uint32_t *)(sqRing + p.sq_off.ring_entries);
+                cqHead = (uint32_t *)(cqRing + p.cq_off.head);
+                cqTail = (uint32_t *)(cqRing + p.cq_off.tail);
+                cqMask = *(uint32_t *)(cqRing + p.cq_off.ring_mask);
+                cqes = (struct io_uring_cqe *)(cqRing + p.cq_off.cqes);
+                sqeTail = *sqTail;
+                return 0;
+        }
+
+        // The eventfd is signaled whenever a CQE is posted, so that it can be polled along with other fds
+        int register_eventfd(const int fd)
+        {
+                return syscall(__NR_io_uring_register, ringFd, IORING_REGISTER_EVENTFD, &fd, 1);
+        }
+
+        bool supports(const uint8_t op) const
+        {
+                return supportedOps[op >> 6] & (uint64_t(1) << (op & 63));
+        }
+
+        uint32_t sq_space_left() const
+        {
+                return sqEntries - (sqeTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE));
+        }
+
+        // Returns nullptr if the submission queue is full
+        struct io_uring_sqe *get_sqe()
+        {
+                const auto head = __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+
+                if (sqeTail - head == sqEntries)
+                        return nullptr;
+
+                const auto idx = sqeTail & sqMask;
+                auto sqe = sqes + idx;
+
+                memset(sqe, 0, sizeof(*sqe));
+                sqArray[idx] = idx;
+                ++sqeTail;
+                ++pendingSubmit;
+                return sqe;
+        }
+
+        static void prep_rw(struct io_uring_sqe *const sqe, const uint8_t op, const int fd, const void *const addr, const uint32_t len, const uint64_t offset, const uint64_t userData)
+        {
+                sqe->opcode = op;
+                sqe->fd = fd;
+                sqe->addr = (uintptr_t)addr;
+                sqe->len = len;
+                sqe->off = offset;
+                sqe->user_data = userData;
+        }
+
+        // offset = -1 for the current file offset(required for O_APPEND files)
+        static void prep_writev(struct io_uring_sqe *const sqe, const int fd, const struct iovec *const iov, const uint32_t iovCnt, const uint64_t offset, const uint64_t userData)
+        {
+                prep_rw(sqe, IORING_OP_WRITEV, fd, iov, iovCnt, offset, userData);
+        }
+
+        static void prep_write(struct io_uring_sqe *const sqe, const int fd, const void *const data, const uint32_t len, const uint64_t offset, const uint64_t userData)
+        {
+                prep_rw(sqe, IORING_OP_WRITE, fd, data, len, offset, userData);
+        }
+
+        static void prep_read(struct io_uring_sqe *const sqe, const int fd, void *const data, const uint32_t len, const uint64_t offset, const uint64_t userData)
+        {
+                prep_rw(sqe, IORING_OP_READ, fd, data, len, offset, userData);
+        }
+
+        static void prep_fadvise(struct io_uring_sqe *const sqe, const int fd, const uint64_t offset, const uint32_t len, const int advice, const uint64_t userData)
+        {
+                prep_rw(sqe, IORING_OP_FADVISE, fd, nullptr, len, offset, userData);
+                sqe->fadvise_advice = advice;
+        }
+
+        // The next SQE will not be started before this one completes, and will be cancelled if this one fails
+        static void link(struct io_uring_sqe *const sqe)
+        {
+                sqe->flags |= IOSQE_IO_LINK;
+        }
+
+        // Submits all prepared SQEs and waits for at least `waitNr` completions
+        int submit_and_wait(const uint32_t waitNr)
+        {
+                __atomic_store_n(sqTail, sqeTail, __ATOMIC_RELEASE);
+
+                for (;;)
+                {
+                        const auto r = syscall(__NR_io_uring_enter, ringFd, pendingSubmit, waitNr, waitNr ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+
+                        if (r == -1)
+                        {
+                                if (errno == EINTR)
+                                        continue;
+                                return -1;
+                        }
+
+                        pendingSubmit -= r;
+                        return r;
+                }
+        }
+
+        // Submits all prepared SQEs, if any, without waiting for completions
+        int submit()
+        {
+                return pendingSubmit ? submit_and_wait(0) : 0;
+        }
+
+        // Invokes l(userData, res) for every available CQE and consumes them
+        template <typename L>
+        uint32_t for_each_cqe(L &&l)
+        {
+                auto head = *cqHead;
+                const auto tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+                uint32_t n{0};
+
+                for (; head != tail; ++head, ++n)
+                {
+                        const auto cqe = cqes + (head & cqMask);
+
+                        l(cqe->user_data, cqe->res);
+                }
+
+                __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+                return n;
+        }
+};
+#endif
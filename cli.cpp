@@ -8,6 +8,7 @@
 #include <sysexits.h>
 #include <text.h>
 #include <unordered_map>
+#include <zdict.h>
 
 static uint64_t parse_timestamp(strwlen32_t s)
 {
@@ -60,16 +61,20 @@ int main(int argc, char *argv[])
         int r;
         TankClient tankClient;
         const char *const app = argv[0];
-        bool verbose{false}, retry{false};
+        bool verbose{false}, retry{false}, useCompressionDict{false};
 
         if (argc == 1)
                 goto help;
 
         tankClient.set_retry_strategy(TankClient::RetryStrategy::RetryNever);
-        while ((r = getopt(argc, argv, "+vb:t:p:hrS:R:")) != -1) // see GETOPT(3) for '+' initial character semantics
+        while ((r = getopt(argc, argv, "+vb:t:p:hrS:R:z")) != -1) // see GETOPT(3) for '+' initial character semantics
         {
                 switch (r)
                 {
+                        case 'z':
+                                useCompressionDict = true;
+                                break;
+
                         case 'S':
                                 tankClient.set_sock_sndbuf_size(strwlen32_t(optarg).AsUint32());
                                 break;
@@ -162,7 +167,8 @@ int main(int argc, char *argv[])
                                 Print("-S bytes: set tank client's socket send buffer size\n");
                                 Print("-R bytes: set tank client's socket receive buffer size\n");
                                 Print("-v : enable verbose output\n");
-                                Print("Commands available: consume, produce, benchmark, discover_partitions, mirror, create_topic\n");
+                                Print("-z : fetch the topic's trained compression dictionary first; required for consuming topics that have one, and for producing with it\n");
+                                Print("Commands available: consume, produce, benchmark, discover_partitions, mirror, create_topic, train_dict, set_dict, get_dict\n");
                                 return 0;
 
                         default:
@@ -240,11 +246,58 @@ int main(int argc, char *argv[])
 				Print("Already Exists\n");
 				break;
 
+			case TankClient::fault::Type::NotDurable:
+				Print("Not synced within the ack timeout\n");
+				break;
+
+			case TankClient::fault::Type::UnknownCompressionDict:
+				Print("Bundle compressed with unknown Zstd dictionary ", f.ctx.dictId, "\n");
+				break;
+
                         default:
                                 break;
                 }
         };
 
+        // Waits for the response to a compression dictionary request; returns false on faults
+        const auto await_compression_dict = [&](const uint32_t reqId) -> bool {
+                if (!reqId)
+                {
+                        Print("Unable to schedule compression dictionary request\n");
+                        return false;
+                }
+
+                while (tankClient.should_poll())
+                {
+                        tankClient.poll(1e3);
+
+                        for (const auto &it : tankClient.faults())
+                        {
+                                consider_fault(it);
+                                return false;
+                        }
+
+                        for (const auto &it : tankClient.compression_dicts())
+                        {
+                                if (verbose)
+                                {
+                                        if (it.dictId)
+                                                Print("Using compression dictionary ", it.dictId, " for ", it.topic, "\n");
+                                        else
+                                                Print("No compression dictionary for ", it.topic, "\n");
+                                }
+                        }
+                }
+
+                return true;
+        };
+
+        if (useCompressionDict && !cmd.Eq(_S("set_dict")) && !cmd.Eq(_S("get_dict")))
+        {
+                if (!await_compression_dict(tankClient.fetch_compression_dict(topicPartition.first)))
+                        return 1;
+        }
+
         if (cmd.Eq(_S("get")) || cmd.Eq(_S("consume")))
         {
                 uint64_t next{0};
@@ -346,7 +399,7 @@ int main(int argc, char *argv[])
                                         Print("-S: statistics only\n");
 					Print("-E seqNum: Stop at sequence number specified\n");
 					Print("-d: drain and exit. As soon as all available messages have been consumed, exit (i.e do not tail)\n");
-                                        Print("-T: optionally, filter all consumes messages by specifying a time range in either (from,to) or (from) format, where the first allows to specify a start and an end date/time and the later a start time and no end time. Currently, only one date-time format is supported (YYYMMDDHH:MM:SS)\n");
+                                        Print("-T: optionally, filter all consumes messages by specifying a time range in either (from,to) or (from) format, where the first allows to specify a start and an end date/time and the later a start time and no end time. Currently, only one date-time format is supported (YYYMMDDHH:MM:SS). If from is \"beginning\", consuming begins from the first message in the time range\n");
                                         Print("\"from\" specifies the first message we are interested in.\n");
                                         Print("If from is \"beginning\" or \"start\","
                                               " it will start consuming from the first available message in the selected topic. If it is \"eof\" or \"end\", it will "
@@ -383,6 +436,38 @@ int main(int argc, char *argv[])
                                 next = from.AsUint64();
                 }
 
+                if (timeRange.offset && !next)
+                {
+                        // Begin from the first message in the time range, instead of filtering all messages from the beginning
+                        const auto reqId = tankClient.seqnums_for_ts(topicPartition.first, {{topicPartition.second, timeRange.offset}});
+
+                        if (!reqId)
+                        {
+                                Print("Unable to schedule seqnums_for_ts request\n");
+                                return 1;
+                        }
+
+                        while (tankClient.should_poll())
+                        {
+                                tankClient.poll(1e3);
+
+                                for (const auto &it : tankClient.faults())
+                                        consider_fault(it);
+
+                                for (const auto &it : tankClient.seqnums_for_ts())
+                                {
+                                        for (const auto p : it.partitions)
+                                        {
+                                                if (p->partition == topicPartition.second)
+                                                        next = p->seqNum;
+                                        }
+                                }
+                        }
+
+                        if (verbose)
+                                Print("Messages with timestamp >= ", timeRange.offset, " begin at ", next, "\n");
+                }
+
 		size_t totalMsgs{0}, sumBytes{0};
 		const auto b = Timings::Microseconds::Tick();
 
@@ -985,7 +1070,7 @@ int main(int argc, char *argv[])
 
                 optind = 0;
                 path[0] = '\0';
-                while ((r = getopt(argc, argv, "+s:f:F:hS:K")) != -1)
+                while ((r = getopt(argc, argv, "+s:f:F:hS:KDZ:")) != -1)
                 {
                         switch (r)
                         {
@@ -993,6 +1078,30 @@ int main(int argc, char *argv[])
 					asKV = true;
 					break;
 
+				case 'Z':
+				{
+					const strwlen32_t codec(optarg);
+
+					if (codec.EqNoCase(_S("none")))
+						tankClient.set_compression_strategy(TankClient::CompressionStrategy::CompressNever);
+					else if (codec.EqNoCase(_S("snappy")))
+						tankClient.set_compression_codec(Compression::Algo::SNAPPY);
+					else if (codec.EqNoCase(_S("lz4")))
+						tankClient.set_compression_codec(Compression::Algo::LZ4);
+					else if (codec.EqNoCase(_S("zstd")))
+						tankClient.set_compression_codec(Compression::Algo::ZSTD);
+					else
+					{
+						Print("Unsupported compression codec ", codec, "\n");
+						return 1;
+					}
+				}
+				break;
+
+				case 'D':
+					tankClient.set_durable_acks(true);
+					break;
+
                                 case 'S':
                                         baseSeqNum = strwlen32_t(optarg).AsUint64();
                                         break;
@@ -1026,6 +1135,8 @@ int main(int argc, char *argv[])
                                         Print("-f file: The messages are read from `file`, which is expected to contain the mesasges in every new line. The `file` can be \"-\" for stdin. If this option is provided, the messages list is ignored\n");
                                         Print("-F file: Like '-f file', except that the contents of the file will be stored as a single message\n");
 					Print("-K: treat each message in the message list as a key=value pair, instead of as the content(value) of a message\n");
+					Print("-D: wait until the broker has synced the messages before considering them produced\n");
+					Print("-Z codec: compress bundles with `codec`; one of none, snappy, lz4, zstd. Default is snappy\n");
                                         return 1;
 
                                 default:
@@ -1298,6 +1409,250 @@ int main(int argc, char *argv[])
                         }
                 }
         }
+        else if (cmd.Eq(_S("train_dict")))
+        {
+                size_t maxSamples{16384}, dictCapacity{112640};
+                uint64_t next{0};
+                const char *outPath{"compression.dict"};
+                bool upload{false};
+                IOBuffer samples;
+                std::vector<size_t> samplesSizes;
+
+                optind = 0;
+                while ((r = getopt(argc, argv, "+hc:S:s:o:U")) != -1)
+                {
+                        switch (r)
+                        {
+                                case 'c':
+                                        maxSamples = strwlen32_t(optarg).AsUint32();
+                                        break;
+
+                                case 'S':
+                                        dictCapacity = strwlen32_t(optarg).AsUint32();
+                                        break;
+
+                                case 's':
+                                        next = strwlen32_t(optarg).AsUint64();
+                                        break;
+
+                                case 'o':
+                                        outPath = optarg;
+                                        break;
+
+                                case 'U':
+                                        upload = true;
+                                        break;
+
+                                case 'h':
+                                        Print("train_dict [options]\n");
+                                        Print("Trains a Zstd compression dictionary from messages consumed from the selected partition\n");
+                                        Print("Topics with many small messages per bundle compress far better with a dictionary\n");
+                                        Print("Options include:\n");
+                                        Print("-c count: train with upto count messages. Default is ", maxSamples, "\n");
+                                        Print("-S size: the maximum dictionary size. Default is ", dictCapacity, "\n");
+                                        Print("-s seqNum: consume from seqNum. Default is the first available message\n");
+                                        Print("-o path: the dictionary is stored in path. Default is ", outPath, "\n");
+                                        Print("-U: also upload the dictionary to the broker, which will store it in the topic's directory\n");
+                                        return 0;
+
+                                default:
+                                        return 1;
+                        }
+                }
+
+                if (!maxSamples || !IsBetweenRangeInclusive<size_t>(dictCapacity, 1024, MaxCompressionDictSize))
+                {
+                        Print("Invalid options\n");
+                        return 1;
+                }
+
+                while (samplesSizes.size() < maxSamples)
+                {
+                        const auto reqId = tankClient.consume({{topicPartition, {next, 4 * 1024 * 1024}}}, 0, 0);
+                        bool drained{false};
+
+                        if (!reqId)
+                        {
+                                Print("Unable to issue consume request. Will abort\n");
+                                return 1;
+                        }
+
+                        while (tankClient.should_poll())
+                        {
+                                tankClient.poll(1e3);
+
+                                for (const auto &it : tankClient.faults())
+                                {
+                                        consider_fault(it);
+                                        return 1;
+                                }
+
+                                for (const auto &it : tankClient.consumed())
+                                {
+                                        for (const auto m : it.msgs)
+                                        {
+                                                if (samplesSizes.size() == maxSamples)
+                                                        break;
+
+                                                samples.append(m->content);
+                                                samplesSizes.push_back(m->content.len);
+                                        }
+
+                                        drained = !it.msgs.len;
+                                        next = it.next.seqNum;
+                                }
+                        }
+
+                        if (drained)
+                                break;
+                }
+
+                if (samplesSizes.size() < 8)
+                {
+                        Print("Not enough messages to train a dictionary\n");
+                        return 1;
+                }
+
+                Buffer dict;
+
+                dict.reserve(dictCapacity + 1);
+
+                const auto res = ZDICT_trainFromBuffer(dict.data(), dictCapacity, samples.data(), samplesSizes.data(), samplesSizes.size());
+
+                if (ZDICT_isError(res))
+                {
+                        Print("Failed to train dictionary: ", ZDICT_getErrorName(res), "\n");
+                        return 1;
+                }
+
+                dict.resize(res);
+
+                int fd = open(outPath, O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0664);
+
+                if (fd == -1)
+                {
+                        Print("Failed to open(", outPath, "): ", strerror(errno), "\n");
+                        return 1;
+                }
+                else if (write(fd, dict.data(), dict.size()) != dict.size())
+                {
+                        Print("Failed to write dictionary: ", strerror(errno), "\n");
+                        close(fd);
+                        return 1;
+                }
+
+                close(fd);
+                Print("Trained ", size_repr(dict.size()), " dictionary ", ZDICT_getDictID(dict.data(), dict.size()), " from ", dotnotation_repr(samplesSizes.size()), " messages(", size_repr(samples.size()), "), stored in ", outPath, "\n");
+
+                if (upload && !await_compression_dict(tankClient.store_compression_dict(topicPartition.first, dict.AsS32())))
+                        return 1;
+
+                return 0;
+        }
+        else if (cmd.Eq(_S("set_dict")))
+        {
+                if (argc != 2 || !strcmp(argv[1], "-h"))
+                {
+                        Print("set_dict path\n");
+                        Print("Uploads the Zstd dictionary in path(see train_dict) to the broker, which will store it in the topic's directory\n");
+                        return 1;
+                }
+
+                int fd = open(argv[1], O_RDONLY | O_LARGEFILE);
+
+                if (fd == -1)
+                {
+                        Print("Failed to open(", argv[1], "): ", strerror(errno), "\n");
+                        return 1;
+                }
+
+                const auto fileSize = lseek64(fd, 0, SEEK_END);
+                Buffer dict;
+
+                if (fileSize <= 0 || fileSize > MaxCompressionDictSize)
+                {
+                        Print("Unexpected dictionary size\n");
+                        close(fd);
+                        return 1;
+                }
+
+                dict.reserve(fileSize + 1);
+                if (pread64(fd, dict.data(), fileSize, 0) != fileSize)
+                {
+                        Print("Failed to read(", argv[1], "): ", strerror(errno), "\n");
+                        close(fd);
+                        return 1;
+                }
+
+                close(fd);
+                dict.resize(fileSize);
+
+                try
+                {
+                        if (!await_compression_dict(tankClient.store_compression_dict(topicPartition.first, dict.AsS32())))
+                                return 1;
+                }
+                catch (const std::exception &e)
+                {
+                        Print("Failed to store dictionary: ", e.what(), "\n");
+                        return 1;
+                }
+
+                return 0;
+        }
+        else if (cmd.Eq(_S("get_dict")))
+        {
+                uint32_t dictId{0};
+
+                if (argc > 2 || (argc == 2 && !strcmp(argv[1], "-h")))
+                {
+                        Print("get_dict [id]\n");
+                        Print("Fetches the topic's current Zstd dictionary, or the dictionary with the specified ID\n");
+                        return 1;
+                }
+                else if (argc == 2)
+                {
+                        const strwlen32_t s(argv[1]);
+
+                        if (!s.IsDigits() || !(dictId = s.AsUint32()))
+                        {
+                                Print("Invalid dictionary ID\n");
+                                return 1;
+                        }
+                }
+
+                const auto reqId = tankClient.fetch_compression_dict(topicPartition.first, dictId);
+
+                if (!reqId)
+                {
+                        Print("Unable to schedule compression dictionary request\n");
+                        return 1;
+                }
+
+                while (tankClient.should_poll())
+                {
+                        tankClient.poll(1e3);
+
+                        for (const auto &it : tankClient.faults())
+                                consider_fault(it);
+
+                        for (const auto &it : tankClient.compression_dicts())
+                        {
+                                if (!it.dictId && dictId)
+                                        Print("No compression dictionary ", dictId, "\n");
+                                else if (!it.dictId)
+                                        Print("No compression dictionary for '", it.topic, "'\n");
+                                else
+                                {
+                                        const auto dict = Compression::ZstdDictionary(it.dictId);
+
+                                        Print("Compression dictionary ", it.dictId, " for '", it.topic, "', ", size_repr(dict->content.size()), "\n");
+                                }
+                        }
+                }
+
+                return 0;
+        }
         else if (cmd.Eq(_S("benchmark")) || cmd.Eq(_S("bm")))
         {
                 optind = 0;
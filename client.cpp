@@ -1,7 +1,10 @@
 #include "tank_client.h"
+#include <condition_variable>
+#include <mutex>
 #include <switch_algorithms.h>
 #include <sys/uio.h>
 #include <text.h>
+#include <thread>
 #include <unistd.h>
 #include <date.h>
 
@@ -47,7 +50,7 @@ bool TankClient::should_poll() const noexcept
 	if (trace)
 	        SLog(connectionAttempts.size(), " ", pendingConsumeReqs.size(), " ", pendingProduceReqs.size(), " ", pendingCtrlReqs.size(), "\n");
 
-        return connectionAttempts.size() || pendingConsumeReqs.size() || pendingProduceReqs.size() || pendingCtrlReqs.size();
+        return connectionAttempts.size() || pendingConsumeReqs.size() || pendingProduceReqs.size() || pendingCtrlReqs.size() || produceBatches.size() || produceSubmissions.any();
 }
 
 void TankClient::wait_scheduled(const uint32_t reqID)
@@ -89,8 +92,20 @@ TankClient::TankClient(const strwlen32_t defaultLeader)
 
 TankClient::~TankClient()
 {
+        set_decompression_threads(0);
         reset();
 
+        for (auto &it : produceBatches)
+                delete it.second;
+
+        for (auto it = produceSubmissions.drain(); it;)
+        {
+                auto next = it->next;
+
+                delete it;
+                it = next;
+        }
+
         if (pipeFd[0] != -1)
                 close(pipeFd[0]);
         if (pipeFd[1] != -1)
@@ -197,6 +212,8 @@ void TankClient::reset()
 	produceAcks.clear();
 	discoverPartitionsResults.clear();
 	createdTopicsResults.clear();
+	seqNumsForTSResults.clear();
+	compressionDictsResults.clear();
 	consumptionList.clear();
 	consumeOut.clear();
 	produceOut.clear();
@@ -208,11 +225,26 @@ void TankClient::reset()
 	pendingCtrlReqs.clear();
 }
 
-uint8_t TankClient::choose_compression_codec(const msg *const msgs, const size_t msgsCnt)
+uint8_t TankClient::choose_compression_codec(const msg *const msgs, const size_t msgsCnt, const uint32_t dictId) const
 {
+        if (dictId)
+        {
+                // With a trained dictionary, Zstd does well even for a few small messages
+                size_t sum{0};
+
+                for (size_t i{0}; i != msgsCnt; ++i)
+                {
+                        sum += msgs[i].content.len;
+                        if (sum >= 64)
+                                return Compression::CodecForAlgo(Compression::Algo::ZSTD);
+                }
+
+                return 0;
+        }
+
         // arbitrary selection heuristic
         if (msgsCnt > 64)
-                return 1;
+                return Compression::CodecForAlgo(compressionAlgo);
         else
         {
                 size_t sum{0};
@@ -221,7 +253,7 @@ uint8_t TankClient::choose_compression_codec(const msg *const msgs, const size_t
                 {
                         sum += msgs[i].content.len;
                         if (sum > 1024)
-                                return 1;
+                                return Compression::CodecForAlgo(compressionAlgo);
                 }
         }
 
@@ -256,8 +288,8 @@ bool TankClient::produce_to_leader_with_base(const uint32_t clientReqId, const S
         b.Serialize<uint32_t>(reqId);
         b.Serialize(clientId.len);
         b.Serialize(clientId.p, clientId.len);
-        b.Serialize(uint8_t(0));  // required acks
-        b.Serialize(uint32_t(0)); // ack timeout
+        b.Serialize(requiredAcks);
+        b.Serialize(ackTimeout);
 
         const auto topicsCntOffset = b.size();
         b.RoomFor(sizeof(uint8_t));
@@ -266,8 +298,9 @@ bool TankClient::produce_to_leader_with_base(const uint32_t clientReqId, const S
         {
                 const auto *it = produce + i;
                 const auto topic = it->topic;
-                const uint8_t compressionCodec = compressionStrategy == CompressionStrategy::CompressIntelligently ? choose_compression_codec(it->msgs, it->msgsCnt)
-                                                                                                                   : compressionStrategy == CompressionStrategy::CompressNever ? 0 : 1;
+                const auto dictId = compression_dict_for(topic);
+                const uint8_t compressionCodec = compressionStrategy == CompressionStrategy::CompressIntelligently ? choose_compression_codec(it->msgs, it->msgsCnt, dictId)
+                                                                                                                   : compressionStrategy == CompressionStrategy::CompressNever ? 0 : dictId ? Compression::CodecForAlgo(Compression::Algo::ZSTD) : Compression::CodecForAlgo(compressionAlgo);
                 uint8_t partitionsCnt{0};
 
                 b.Serialize(topic.len);
@@ -305,7 +338,7 @@ bool TankClient::produce_to_leader_with_base(const uint32_t clientReqId, const S
                         // BEGIN:bundle header
                         if (compressionCodec)
                         {
-                                Drequire(compressionCodec < 3);
+                                Drequire(compressionCodec <= 3);
                                 bundleFlags |= compressionCodec;
                         }
 
@@ -465,7 +498,7 @@ bool TankClient::produce_to_leader_with_base(const uint32_t clientReqId, const S
                                 const auto o = cmpBuf.size();
                                 const uint64_t start = trace ? Timings::Microseconds::Tick() : 0;
 
-                                if (unlikely(!Compression::Compress(Compression::Algo::SNAPPY, b.At(msgSetOffset), msgSetLen, &cmpBuf)))
+                                if (unlikely(!Compression::Compress(Compression::AlgoForCodec(compressionCodec), b.At(msgSetOffset), msgSetLen, &cmpBuf, dictId)))
                                 {
                                         put_payload(payload, __LINE__);
                                         throw Switch::exception("Failed to compress content");
@@ -570,8 +603,8 @@ bool TankClient::produce_to_leader(const uint32_t clientReqId, const Switch::end
         b.Serialize<uint32_t>(reqId);
         b.Serialize(clientId.len);
         b.Serialize(clientId.p, clientId.len);
-        b.Serialize(uint8_t(0));  // required acks
-        b.Serialize(uint32_t(0)); // ack timeout
+        b.Serialize(requiredAcks);
+        b.Serialize(ackTimeout);
 
         const auto topicsCntOffset = b.size();
         b.RoomFor(sizeof(uint8_t));
@@ -580,8 +613,9 @@ bool TankClient::produce_to_leader(const uint32_t clientReqId, const Switch::end
         {
                 const auto *it = produce + i;
                 const auto topic = it->topic;
-                const uint8_t compressionCodec = compressionStrategy == CompressionStrategy::CompressIntelligently ? choose_compression_codec(it->msgs, it->msgsCnt)
-                                                                                                                   : compressionStrategy == CompressionStrategy::CompressNever ? 0 : 1;
+                const auto dictId = compression_dict_for(topic);
+                const uint8_t compressionCodec = compressionStrategy == CompressionStrategy::CompressIntelligently ? choose_compression_codec(it->msgs, it->msgsCnt, dictId)
+                                                                                                                   : compressionStrategy == CompressionStrategy::CompressNever ? 0 : dictId ? Compression::CodecForAlgo(Compression::Algo::ZSTD) : Compression::CodecForAlgo(compressionAlgo);
                 uint8_t partitionsCnt{0};
 
                 b.Serialize(topic.len);
@@ -612,7 +646,7 @@ bool TankClient::produce_to_leader(const uint32_t clientReqId, const Switch::end
                         // BEGIN:bundle header
                         if (compressionCodec)
                         {
-                                Drequire(compressionCodec < 3);
+                                Drequire(compressionCodec <= 3);
                                 bundleFlags |= compressionCodec;
                         }
 
@@ -698,7 +732,7 @@ bool TankClient::produce_to_leader(const uint32_t clientReqId, const Switch::end
                                 const auto o = cmpBuf.size();
                                 const uint64_t start = trace ? Timings::Microseconds::Tick() : 0;
 
-                                if (unlikely(!Compression::Compress(Compression::Algo::SNAPPY, b.At(msgSetOffset), msgSetLen, &cmpBuf)))
+                                if (unlikely(!Compression::Compress(Compression::AlgoForCodec(compressionCodec), b.At(msgSetOffset), msgSetLen, &cmpBuf, dictId)))
                                 {
                                         put_payload(payload, __LINE__);
                                         throw Switch::exception("Failed to compress content");
@@ -969,6 +1003,116 @@ uint32_t TankClient::discover_partitions(const strwlen8_t topic)
                 return clientReqId;
 }
 
+uint32_t TankClient::seqnums_for_ts(const strwlen8_t topic, const std::vector<std::pair<uint16_t, uint64_t>> &partitions)
+{
+        auto bs = broker_state(defaultLeader);
+        auto payload = get_payload();
+        auto &b = *payload->b;
+        const auto clientReqId = ids_tracker.client.next++;
+        const auto reqId = ids_tracker.leader_reqs.next++;
+
+        b.Serialize(uint8_t(TankAPIMsgType::SeqNumsForTS));
+	const auto lenOffset = b.size();
+	b.RoomFor(sizeof(uint32_t));
+
+        b.Serialize<uint32_t>(reqId);
+        b.Serialize(topic.len);
+        b.Serialize(topic.p, topic.len);
+        b.Serialize<uint16_t>(partitions.size());
+
+        for (const auto &it : partitions)
+        {
+                b.Serialize<uint16_t>(it.first);
+                b.Serialize<uint64_t>(it.second);
+        }
+
+        payload->iov[0] = {(void *)b.data(), b.size()};
+        payload->iovCnt = 1;
+
+        bs->reqs_tracker.pendingCtrl.insert(reqId);
+        payload->flags = (1u << uint8_t(outgoing_payload::Flags::ReqIsIdempotent)) | (1u << uint8_t(outgoing_payload::Flags::ReqMaybeRetried));
+        Drequire(payload->tracked_by_reqs_tracker());
+        bs->outgoing_content.push_back(payload);
+
+        pendingCtrlReqs.Add(reqId, {clientReqId, payload, nowMS});
+        track_inflight_req(reqId, nowMS, TankAPIMsgType::SeqNumsForTS);
+
+	*(uint32_t *)b.At(lenOffset) = b.size() - lenOffset - sizeof(uint32_t);
+
+        if (!try_transmit(bs))
+                return 0;
+        else
+                return clientReqId;
+}
+
+uint32_t TankClient::compression_dict_req(const strwlen8_t topic, const uint32_t dictId, const strwlen32_t dict)
+{
+        if (dict.len > MaxCompressionDictSize)
+                throw Switch::data_error("Compression dictionary too large");
+        else if (dict)
+                set_compression_dict(topic, dict);
+
+        auto bs = broker_state(defaultLeader);
+        auto payload = get_payload();
+        auto &b = *payload->b;
+        const auto clientReqId = ids_tracker.client.next++;
+        const auto reqId = ids_tracker.leader_reqs.next++;
+
+        b.Serialize(uint8_t(TankAPIMsgType::CompressionDict));
+	const auto lenOffset = b.size();
+	b.RoomFor(sizeof(uint32_t));
+
+        b.Serialize<uint32_t>(reqId);
+        b.Serialize(topic.len);
+        b.Serialize(topic.p, topic.len);
+        b.Serialize<uint32_t>(dictId);
+        b.SerializeVarUInt32(dict.len);
+        b.Serialize(dict.p, dict.len);
+
+        payload->iov[0] = {(void *)b.data(), b.size()};
+        payload->iovCnt = 1;
+
+        bs->reqs_tracker.pendingCtrl.insert(reqId);
+        payload->flags = (1u << uint8_t(outgoing_payload::Flags::ReqIsIdempotent)) | (1u << uint8_t(outgoing_payload::Flags::ReqMaybeRetried));
+        Drequire(payload->tracked_by_reqs_tracker());
+        bs->outgoing_content.push_back(payload);
+
+        pendingCtrlReqs.Add(reqId, {clientReqId, payload, nowMS});
+        track_inflight_req(reqId, nowMS, TankAPIMsgType::CompressionDict);
+
+	*(uint32_t *)b.At(lenOffset) = b.size() - lenOffset - sizeof(uint32_t);
+
+        if (!try_transmit(bs))
+                return 0;
+        else
+                return clientReqId;
+}
+
+void TankClient::set_compression_dict(const strwlen8_t topic, const strwlen32_t dict)
+{
+        const auto id = Compression::RegisterZstdDictionary(dict.p, dict.len);
+
+        if (!id)
+        {
+                if (Compression::ZstdDictionaryConflicts(dict.p, dict.len))
+                        throw Switch::data_error("Another Zstd dictionary with the same ID is already in use");
+
+                throw Switch::data_error("Invalid Zstd dictionary");
+        }
+
+        topicCompressionDicts[std::string(topic.p, topic.len)] = id;
+}
+
+uint32_t TankClient::compression_dict_for(const strwlen8_t topic) const
+{
+        if (topicCompressionDicts.empty())
+                return 0;
+
+        const auto it = topicCompressionDicts.find(std::string(topic.p, topic.len));
+
+        return it != topicCompressionDicts.end() ? it->second : 0;
+}
+
 bool TankClient::consume_from_leader(const uint32_t clientReqId, const Switch::endpoint leader, const consume_ctx *const from, const size_t total, const uint64_t maxWait, const uint32_t minSize)
 {
         auto bs = broker_state(leader);
@@ -1389,6 +1533,11 @@ bool TankClient::process_produce(connection *const c, const uint8_t *const conte
 						// Invald sequence numbers
 	                                        capturedFaults.push_back({clientReqId, fault::Type::InvalidReq, fault::Req::Produce, topicName, partitionId});
 					}
+					else if (err == 3)
+					{
+						// Appended, but not synced within the ack timeout
+	                                        capturedFaults.push_back({clientReqId, fault::Type::NotDurable, fault::Req::Produce, topicName, partitionId});
+					}
 					else
 	                                        capturedFaults.push_back({clientReqId, fault::Type::SystemFail, fault::Req::Produce, topicName, partitionId});
                                 }
@@ -1491,160 +1640,555 @@ bool TankClient::process_discover_partitions(connection *const c, const uint8_t
         return true;
 }
 
-// XXX: make sure this reflects the latest encoding scheme
-// This is somewhat complex, because of boundary checks - can and will simplify later
-bool TankClient::process_consume(connection *const c, const uint8_t *const content, const size_t len)
+bool TankClient::process_seqnums_for_ts(connection *const c, const uint8_t *const content, const size_t len)
 {
         const auto *p = content;
         auto *const bs = c->bs;
-        // Response header length (i.e excluding actual batches content) is encoded in the response
-        // so that we can quickly jump to the beginning of the bundles
-        // the bundles content is streamed right after the response header
-        const auto respHeaderLen = *(uint32_t *)p;
-        p += sizeof(uint32_t);
-        const auto *bundles = p + respHeaderLen, *const bundlesBase = bundles;
         const auto reqId = *(uint32_t *)p;
-
-        c->state.flags |= (1u << uint8_t(connection::State::Flags::LockedInputBuffer));
-
+        const auto res = pendingCtrlReqs.detach(reqId);
+        const auto reqInfo = res.value();
+        const auto clientReqId = reqInfo.clientReqId;
+        strwlen8_t topicName;
 
         p += sizeof(uint32_t);
-        const auto topicsCnt = *p++;
-        const auto res = pendingConsumeReqs.detach(reqId);
-        auto reqInfo = res.value();
-        const auto clientReqId = reqInfo.clientReqId;
-        const auto *const reqSeqNums = reqInfo.seqNums;
-        uint8_t reqOffsetIdx{0};
-        strwlen8_t key;
-	uint64_t firstMsgSeqNum, lastMsgSeqNum, logBaseSeqNum,  msgSetEnd;
 
-	// TODO:
-	// if broker reports that it is no longer the leader for (topic, broker), we need to retain
-	// reqInfo.payload and reqInfo.ctx, and retry with that node instead
         ack_payload(bs, reqInfo.reqPayload);
-        Defer({ free(reqInfo.seqNums); });
+        bs->reqs_tracker.pendingCtrl.erase(reqId);
+        forget_inflight_req(reqId, TankAPIMsgType::SeqNumsForTS);
 
-        bs->reqs_tracker.pendingConsume.erase(reqId);
-        forget_inflight_req(reqId, TankAPIMsgType::Consume);
+        topicName.Set(resultsAllocator.CopyOf((char *)p + 1, *p), *p);
+        p += topicName.len + sizeof(uint8_t);
 
-        if (trace)
-                SLog(ansifmt::color_green, "Processing consume response for ", reqId, ", of length ", len, ", topicsCnt = ", topicsCnt, ", clientReqId = ", clientReqId, ansifmt::reset, "\n");
+        const auto cnt = *(uint16_t *)p;
 
-        for (uint32_t i{0}; i != topicsCnt; ++i)
+        p += sizeof(uint16_t);
+
+        if (!cnt)
         {
-                const strwlen8_t topicName((char *)p + 1, *p);
-                p += topicName.len + sizeof(uint8_t);
-                const auto partitionsCnt = *p++;
+                capturedFaults.push_back({clientReqId, fault::Type::UnknownTopic, fault::Req::Ctrl, topicName, 0});
+                return true;
+        }
 
-                if (trace)
-                        SLog("Topic [", topicName, "] ", partitionsCnt, "\n");
+        auto *const all = resultsAllocator.Alloc<partition_seqnum>(cnt);
+        uint16_t n{0};
 
-                if (*(uint16_t *)p == UINT16_MAX)
-                {
-                        // Unknown topic
-                        if (trace)
-                                SLog("Unknown topic [", topicName, "]\n");
-                        capturedFaults.push_back({clientReqId, fault::Type::UnknownTopic, fault::Req::Consume, topicName, 0});
+        for (uint16_t i{0}; i != cnt; ++i)
+        {
+                const auto partitionId = *(uint16_t *)p;
+                p += sizeof(uint16_t);
+                const auto errorOrFlags = *p++;
 
-                        reqOffsetIdx += partitionsCnt;
-                        p += sizeof(uint16_t);
+                if (errorOrFlags == 0xff)
+                {
+                        capturedFaults.push_back({clientReqId, fault::Type::UnknownPartition, fault::Req::Ctrl, topicName, partitionId});
                         continue;
                 }
 
-                for (uint8_t k{0}; k != partitionsCnt; ++k)
-                {
-                        const auto partitionId = *(uint16_t *)p;
-                        p += sizeof(uint16_t);
-                        const auto errorOrFlags = *p++;
-			size_t totalSeenBundles{0};
-
-                        if (errorOrFlags == 0xff)
-                        {
-                                if (trace)
-                                        SLog("Undefined partition ", topicName, ".", partitionId, "\n");
+                all[n++] = {partitionId, *(uint64_t *)p};
+                p += sizeof(uint64_t);
+        }
 
-                                capturedFaults.push_back({clientReqId, fault::Type::UnknownPartition, fault::Req::Consume, topicName, partitionId});
-                                continue;
-                        }
-			else if (errorOrFlags == 0xfe)
-			{
-				// Not provided here, because the first bundle streamed has the SPARSE bit set
-				// which means it holds the sequence number itself, and we 'd like to avoid
-				// specifying this here and in the bundle header
-				//
-				// I understand all those variosu encoding semantics are complicating the parsing process, but
-				// we this is one of those case where doing that in favor of tighter encoding and better performance is worth it
-				// (you only need to build the client/broker once, but you 'll reap the benefits forever)
-				if (trace)
-					SLog("Base seq.num of first msg in the bundle ", ansifmt::bold, "_not provided here_", ansifmt::reset, "; bundle's sparse bit is set - will get it from there\n");
-				logBaseSeqNum = 0;
-			}
-			else
-                        {
-                                // base absolute sequence number of the first message in the first bundle in the chunk streamed
-                                logBaseSeqNum = *(uint64_t *)p;
-                                p += sizeof(uint64_t);
+        if (n)
+                seqNumsForTSResults.push_back({clientReqId, topicName, {all, n}});
 
-				if (trace)
-					SLog("Base seq.num of first msg in the bundle provided as ", logBaseSeqNum, "\n");
-                        }
+        return true;
+}
 
-                        // last committed sequence number for this (topic, partition).
-                        // we should check if the *last* parsed absolute sequence number < highWaterMark, and if so, it means
-                        // there's more content and we should request it starting from  *last* parsed absolute sequence number + 1
-                        const auto highWaterMark = *(uint64_t *)p;
-                        p += sizeof(uint64_t);
+bool TankClient::process_compression_dict(connection *const c, const uint8_t *const content, const size_t len)
+{
+        const auto *p = content;
+        auto *const bs = c->bs;
+        const auto reqId = *(uint32_t *)p;
+        const auto res = pendingCtrlReqs.detach(reqId);
+        const auto reqInfo = res.value();
+        const auto clientReqId = reqInfo.clientReqId;
+        strwlen8_t topicName;
 
-                        // bytes streamed from the commit log (may contain a partial bundle)
-                        const auto len = *(uint32_t *)p;
-                        p += sizeof(uint32_t);
+        p += sizeof(uint32_t);
 
-                        // Original fetch request absolute sequence number requested
-                        // Special values:
-                        // UINT64_MAX 	: get data produced from now on, don't return any old records
-                        // 0 		: fetch fromt the first available sequence number
-                        const auto requestedSeqNum = reqSeqNums[reqOffsetIdx++];
+        ack_payload(bs, reqInfo.reqPayload);
+        bs->reqs_tracker.pendingCtrl.erase(reqId);
+        forget_inflight_req(reqId, TankAPIMsgType::CompressionDict);
 
-                        if (trace)
-                                SLog("logBaseSeqNum = ", logBaseSeqNum, ", highWaterMark = ", highWaterMark, ", len = ", len, "(bytes streamed from the commit log; may be partial), requestedSeqNum(", requestedSeqNum, ") for ", reqOffsetIdx - 1, ", for partition ", partitionId, ", errorOrFlags = ", errorOrFlags, "\n");
+        topicName.Set(resultsAllocator.CopyOf((char *)p + 1, *p), *p);
+        p += topicName.len + sizeof(uint8_t);
 
-                        if (errorOrFlags == 0x1)
-                        {
-                                // A BoundaryCheck fault
-                                // server has serialized the first available sequence number here
-                                const auto firstAvailSeqNum = *(uint64_t *)p;
-                                p += sizeof(uint64_t);
+        switch (const auto err = *p++)
+        {
+                case 0:
+                {
+                        auto id = *(uint32_t *)p;
+                        p += sizeof(uint32_t);
+                        // set if this is the topic's current dictionary, as opposed to an older dictionary fetched by ID
+                        const bool current = *p++;
+                        const auto dictLen = Compression::UnpackUInt32(p);
 
-                                if (trace)
-                                        SLog("firstAvailSeqNum = ", firstAvailSeqNum, "\n");
+                        // For stores, the broker doesn't send back the dictionary, which was registered by set_compression_dict()
+                        if (dictLen)
+                                id = Compression::RegisterZstdDictionary(p, dictLen);
 
-                                capturedFaults.push_back({clientReqId, fault::Type::BoundaryCheck, fault::Req::Consume, topicName, partitionId, {{firstAvailSeqNum, highWaterMark}}});
-                                continue;
-                        }
-                        else if (errorOrFlags && errorOrFlags < 0xfe)
+                        if (!id)
                         {
-				if (trace)
-					SLog("Have FAULT: ", errorOrFlags, "\n");
-
-                                capturedFaults.push_back({clientReqId, fault::Type::Access, fault::Req::Consume, topicName, partitionId});
-                                continue;
+                                capturedFaults.push_back({clientReqId, fault::Type::InvalidReq, fault::Req::Ctrl, topicName, 0});
+                                break;
                         }
 
-                        const auto bundlesForThisTopicPartition = bundles;
-                        uint32_t lastPartialMsgMinFetchSize{128};
+                        if (current)
+                                topicCompressionDicts[std::string(topicName.p, topicName.len)] = id;
+                        compressionDictsResults.push_back({clientReqId, topicName, id});
+                }
+                break;
 
-                        bundles += len; // Skip bundles for this (topic, partition), i.e the chunk stream for that partition
-                        consumptionList.clear();
+                case 1:
+                        capturedFaults.push_back({clientReqId, fault::Type::UnknownTopic, fault::Req::Ctrl, topicName, 0});
+                        break;
 
-                        // Process all bundles in the chunk
-                        for (const auto *p = bundlesForThisTopicPartition, *const chunkEnd = p + len; p < chunkEnd;)
-                        {
+                case 2:
+                        topicCompressionDicts.erase(std::string(topicName.p, topicName.len));
+                        compressionDictsResults.push_back({clientReqId, topicName, 0});
+                        break;
+
+                case 6:
+                        // no dictionary with the requested ID
+                        compressionDictsResults.push_back({clientReqId, topicName, 0});
+                        break;
+
+                case 3:
+                case 5:
+                        // invalid dictionary, or the broker already has a different dictionary with the same ID
+                        capturedFaults.push_back({clientReqId, fault::Type::InvalidReq, fault::Req::Ctrl, topicName, 0});
+                        break;
+
+                default:
+                        if (trace)
+                                SLog("Unexpected error ", err, "\n");
+
+                        capturedFaults.push_back({clientReqId, fault::Type::SystemFail, fault::Req::Ctrl, topicName, 0});
+                        break;
+        }
+
+        return true;
+}
+
+// The thread that poll()s publishes a batch of jobs, and it and the workers claim jobs until there are none left
+// A new batch is only published once all workers are done with the previous one
+struct TankClient::decompression_pool
+{
+        std::mutex lock;
+        std::condition_variable workCond, doneCond;
+        std::vector<std::thread> threads;
+        decompression_job *jobs{nullptr};
+        size_t jobsCnt{0};
+        std::atomic<size_t> next{0};
+        uint64_t generation{0};
+        uint32_t busy{0};
+        bool stop{false};
+
+        static void run(decompression_job *const jobs, const size_t jobsCnt, std::atomic<size_t> &next)
+        {
+                for (size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < jobsCnt;)
+                {
+                        auto &j = jobs[i];
+
+                        j.out->clear();
+                        try
+                        {
+                                j.decompressed = Compression::UnCompress(Compression::AlgoForCodec(j.codec), j.content, j.len, j.out);
+                        }
+                        catch (...)
+                        {
+                                // process_consume() will try again, and report the failure
+                                j.decompressed = false;
+                        }
+                }
+        }
+
+        decompression_pool(const uint32_t threadsCnt)
+        {
+                for (uint32_t i{0}; i != threadsCnt; ++i)
+                {
+                        threads.emplace_back([this]() {
+                                uint64_t seen{0};
+
+                                for (;;)
+                                {
+                                        std::unique_lock<std::mutex> l(lock);
+
+                                        workCond.wait(l, [&]() { return stop || generation != seen; });
+                                        if (stop)
+                                                return;
+
+                                        const auto batch = jobs;
+                                        const auto batchSize = jobsCnt;
+
+                                        seen = generation;
+                                        ++busy;
+                                        l.unlock();
+
+                                        run(batch, batchSize, next);
+
+                                        l.lock();
+                                        if (--busy == 0)
+                                                doneCond.notify_all();
+                                }
+                        });
+                }
+        }
+
+        ~decompression_pool()
+        {
+                {
+                        std::lock_guard<std::mutex> g(lock);
+
+                        stop = true;
+                }
+
+                workCond.notify_all();
+                for (auto &t : threads)
+                        t.join();
+        }
+
+        void decompress(decompression_job *const all, const size_t cnt)
+        {
+                {
+                        std::unique_lock<std::mutex> l(lock);
+
+                        // Workers that woke up late may still be claiming from the previous batch
+                        doneCond.wait(l, [this]() { return busy == 0; });
+                        jobs = all;
+                        jobsCnt = cnt;
+                        next.store(0, std::memory_order_relaxed);
+                        ++generation;
+                }
+
+                workCond.notify_all();
+                run(all, cnt, next);
+
+                std::unique_lock<std::mutex> l(lock);
+
+                doneCond.wait(l, [this]() { return busy == 0; });
+        }
+};
+
+void TankClient::set_decompression_threads(const uint32_t threadsCnt)
+{
+        delete decompressionPool;
+        decompressionPool = threadsCnt ? new decompression_pool(threadsCnt) : nullptr;
+}
+
+// Walks the consume response the same way process_consume() does, and decompresses the compressed bundles
+// process_consume() is going to parse(i.e not skipped, and fully streamed) on the decompression pool, all at once
+void TankClient::decompress_bundles(const uint8_t *p, const uint8_t *bundles, const uint64_t *const reqSeqNums)
+{
+        const auto topicsCnt = *p++;
+        uint8_t reqOffsetIdx{0};
+        size_t total{0};
+
+        for (uint32_t i{0}; i != topicsCnt; ++i)
+        {
+                p += *p + sizeof(uint8_t);
+
+                const auto partitionsCnt = *p++;
+
+                if (*(uint16_t *)p == UINT16_MAX)
+                {
+                        reqOffsetIdx += partitionsCnt;
+                        p += sizeof(uint16_t);
+                        continue;
+                }
+
+                for (uint8_t k{0}; k != partitionsCnt; ++k)
+                {
+                        p += sizeof(uint16_t);
+
+                        const auto errorOrFlags = *p++;
+                        uint64_t logBaseSeqNum{0};
+
+                        if (errorOrFlags == 0xff)
+                                continue;
+                        else if (errorOrFlags != 0xfe)
+                        {
+                                logBaseSeqNum = *(uint64_t *)p;
+                                p += sizeof(uint64_t);
+                        }
+
+                        p += sizeof(uint64_t); // highWaterMark
+
+                        const auto len = *(uint32_t *)p;
+                        const auto requestedSeqNum = reqSeqNums[reqOffsetIdx++];
+
+                        p += sizeof(uint32_t);
+
+                        if (errorOrFlags == 0x1)
+                        {
+                                p += sizeof(uint64_t);
+                                continue;
+                        }
+                        else if (errorOrFlags && errorOrFlags < 0xfe)
+                                continue;
+
+                        const auto *b = bundles, *const chunkEnd = bundles + len;
+
+                        bundles += len;
+                        while (b < chunkEnd)
+                        {
+                                uint32_t bundleLen, msgsSetSize, delta;
+
+                                if (!Compression::TryUnpackUInt32(b, chunkEnd, bundleLen) || b >= chunkEnd)
+                                        break;
+
+                                const auto *const bundleEnd = b + bundleLen;
+                                const auto bundleFlags = *b++;
+                                const uint8_t codec = bundleFlags & 3;
+                                uint64_t msgSetEnd;
+
+                                if (bundleEnd > chunkEnd)
+                                        break;
+
+                                msgsSetSize = (bundleFlags >> 2) & 0xf;
+                                if (!msgsSetSize && !Compression::TryUnpackUInt32(b, chunkEnd, msgsSetSize))
+                                        break;
+
+                                if (bundleFlags & (1u << 6))
+                                {
+                                        if (b + sizeof(uint64_t) >= chunkEnd)
+                                                break;
+
+                                        const auto firstMsgSeqNum = *(uint64_t *)b;
+
+                                        b += sizeof(uint64_t);
+                                        if (msgsSetSize == 1)
+                                                msgSetEnd = firstMsgSeqNum + 1;
+                                        else if (!Compression::TryUnpackUInt32(b, chunkEnd, delta))
+                                                break;
+                                        else
+                                                msgSetEnd = firstMsgSeqNum + delta + 2;
+                                }
+                                else
+                                        msgSetEnd = logBaseSeqNum + msgsSetSize;
+
+                                if (codec && (requestedSeqNum == UINT64_MAX || requestedSeqNum < msgSetEnd) && b < bundleEnd)
+                                {
+                                        decompressionJobs.push_back({b, uint32_t(bundleEnd - b), codec, false, nullptr});
+                                        total += bundleEnd - b;
+                                }
+
+                                logBaseSeqNum = msgSetEnd;
+                                b = bundleEnd;
+                        }
+                }
+        }
+
+        // Not worth waking up the workers otherwise
+        if (decompressionJobs.size() > 1 && total >= 64 * 1024)
+        {
+                if (trace)
+                        SLog("Decompressing ", decompressionJobs.size(), " bundles, ", size_repr(total), "\n");
+
+                for (auto &it : decompressionJobs)
+                {
+                        // Released along with the rest of the consume response on the next poll()
+                        it.out = get_buffer();
+                        usedBufs.push_back(it.out);
+                }
+
+                decompressionPool->decompress(decompressionJobs.data(), decompressionJobs.size());
+        }
+        else
+                decompressionJobs.clear();
+}
+
+// Returns the decompressed message set of the bundle with compressed content at `content`, if decompress_bundles() decompressed it
+IOBuffer *TankClient::decompressed_bundle(const uint8_t *const content)
+{
+        // Bundles are looked up in the order they were scheduled, though some may be skipped
+        while (nextDecompressionJob < decompressionJobs.size())
+        {
+                const auto &j = decompressionJobs[nextDecompressionJob];
+
+                if (j.content < content)
+                        ++nextDecompressionJob;
+                else if (j.content == content && j.decompressed)
+                        return j.out;
+                else
+                        break;
+        }
+
+        return nullptr;
+}
+
+// XXX: make sure this reflects the latest encoding scheme
+// This is somewhat complex, because of boundary checks - can and will simplify later
+bool TankClient::process_consume(connection *const c, const uint8_t *const content, const size_t len)
+{
+        const auto *p = content;
+        auto *const bs = c->bs;
+        // Response header length (i.e excluding actual batches content) is encoded in the response
+        // so that we can quickly jump to the beginning of the bundles
+        // the bundles content is streamed right after the response header
+        const auto respHeaderLen = *(uint32_t *)p;
+        p += sizeof(uint32_t);
+        const auto *bundles = p + respHeaderLen, *const bundlesBase = bundles;
+        const auto reqId = *(uint32_t *)p;
+
+        c->state.flags |= (1u << uint8_t(connection::State::Flags::LockedInputBuffer));
+
+
+        p += sizeof(uint32_t);
+        const auto topicsCnt = *p++;
+        const auto res = pendingConsumeReqs.detach(reqId);
+        auto reqInfo = res.value();
+        const auto clientReqId = reqInfo.clientReqId;
+        const auto *const reqSeqNums = reqInfo.seqNums;
+        uint8_t reqOffsetIdx{0};
+        strwlen8_t key;
+	uint64_t firstMsgSeqNum, lastMsgSeqNum, logBaseSeqNum,  msgSetEnd;
+
+	// TODO:
+	// if broker reports that it is no longer the leader for (topic, broker), we need to retain
+	// reqInfo.payload and reqInfo.ctx, and retry with that node instead
+        ack_payload(bs, reqInfo.reqPayload);
+        Defer({ free(reqInfo.seqNums); });
+
+        bs->reqs_tracker.pendingConsume.erase(reqId);
+        forget_inflight_req(reqId, TankAPIMsgType::Consume);
+
+        decompressionJobs.clear();
+        nextDecompressionJob = 0;
+        if (decompressionPool && !lazyConsume && len >= 256 * 1024)
+                decompress_bundles(p, bundles, reqSeqNums);
+
+        if (trace)
+                SLog(ansifmt::color_green, "Processing consume response for ", reqId, ", of length ", len, ", topicsCnt = ", topicsCnt, ", clientReqId = ", clientReqId, ansifmt::reset, "\n");
+
+        for (uint32_t i{0}; i != topicsCnt; ++i)
+        {
+                const strwlen8_t topicName((char *)p + 1, *p);
+                p += topicName.len + sizeof(uint8_t);
+                const auto partitionsCnt = *p++;
+
+                if (trace)
+                        SLog("Topic [", topicName, "] ", partitionsCnt, "\n");
+
+                if (*(uint16_t *)p == UINT16_MAX)
+                {
+                        // Unknown topic
+                        if (trace)
+                                SLog("Unknown topic [", topicName, "]\n");
+                        capturedFaults.push_back({clientReqId, fault::Type::UnknownTopic, fault::Req::Consume, topicName, 0});
+
+                        reqOffsetIdx += partitionsCnt;
+                        p += sizeof(uint16_t);
+                        continue;
+                }
+
+                for (uint8_t k{0}; k != partitionsCnt; ++k)
+                {
+                        const auto partitionId = *(uint16_t *)p;
+                        p += sizeof(uint16_t);
+                        const auto errorOrFlags = *p++;
+			size_t totalSeenBundles{0};
+
+                        if (errorOrFlags == 0xff)
+                        {
+                                if (trace)
+                                        SLog("Undefined partition ", topicName, ".", partitionId, "\n");
+
+                                capturedFaults.push_back({clientReqId, fault::Type::UnknownPartition, fault::Req::Consume, topicName, partitionId});
+                                continue;
+                        }
+			else if (errorOrFlags == 0xfe)
+			{
+				// Not provided here, because the first bundle streamed has the SPARSE bit set
+				// which means it holds the sequence number itself, and we 'd like to avoid
+				// specifying this here and in the bundle header
+				//
+				// I understand all those variosu encoding semantics are complicating the parsing process, but
+				// we this is one of those case where doing that in favor of tighter encoding and better performance is worth it
+				// (you only need to build the client/broker once, but you 'll reap the benefits forever)
+				if (trace)
+					SLog("Base seq.num of first msg in the bundle ", ansifmt::bold, "_not provided here_", ansifmt::reset, "; bundle's sparse bit is set - will get it from there\n");
+				logBaseSeqNum = 0;
+			}
+			else
+                        {
+                                // base absolute sequence number of the first message in the first bundle in the chunk streamed
+                                logBaseSeqNum = *(uint64_t *)p;
+                                p += sizeof(uint64_t);
+
+				if (trace)
+					SLog("Base seq.num of first msg in the bundle provided as ", logBaseSeqNum, "\n");
+                        }
+
+                        // last committed sequence number for this (topic, partition).
+                        // we should check if the *last* parsed absolute sequence number < highWaterMark, and if so, it means
+                        // there's more content and we should request it starting from  *last* parsed absolute sequence number + 1
+                        const auto highWaterMark = *(uint64_t *)p;
+                        p += sizeof(uint64_t);
+
+                        // bytes streamed from the commit log (may contain a partial bundle)
+                        const auto len = *(uint32_t *)p;
+                        p += sizeof(uint32_t);
+
+                        // Original fetch request absolute sequence number requested
+                        // Special values:
+                        // UINT64_MAX 	: get data produced from now on, don't return any old records
+                        // 0 		: fetch fromt the first available sequence number
+                        const auto requestedSeqNum = reqSeqNums[reqOffsetIdx++];
+
+                        if (trace)
+                                SLog("logBaseSeqNum = ", logBaseSeqNum, ", highWaterMark = ", highWaterMark, ", len = ", len, "(bytes streamed from the commit log; may be partial), requestedSeqNum(", requestedSeqNum, ") for ", reqOffsetIdx - 1, ", for partition ", partitionId, ", errorOrFlags = ", errorOrFlags, "\n");
+
+                        if (errorOrFlags == 0x1)
+                        {
+                                // A BoundaryCheck fault
+                                // server has serialized the first available sequence number here
+                                const auto firstAvailSeqNum = *(uint64_t *)p;
+                                p += sizeof(uint64_t);
+
+                                if (trace)
+                                        SLog("firstAvailSeqNum = ", firstAvailSeqNum, "\n");
+
+                                capturedFaults.push_back({clientReqId, fault::Type::BoundaryCheck, fault::Req::Consume, topicName, partitionId, {{firstAvailSeqNum, highWaterMark}}});
+                                continue;
+                        }
+                        else if (errorOrFlags && errorOrFlags < 0xfe)
+                        {
+				if (trace)
+					SLog("Have FAULT: ", errorOrFlags, "\n");
+
+                                capturedFaults.push_back({clientReqId, fault::Type::Access, fault::Req::Consume, topicName, partitionId});
+                                continue;
+                        }
+
+                        const auto bundlesForThisTopicPartition = bundles;
+                        uint32_t lastPartialMsgMinFetchSize{128};
+
+                        bundles += len; // Skip bundles for this (topic, partition), i.e the chunk stream for that partition
+
+                        if (lazyConsume)
+                        {
+                                // Decoded on demand; see msgs_cursor
+                                consumedChunks.push_back({clientReqId, topicName, partitionId, {bundlesForThisTopicPartition, len}, logBaseSeqNum, highWaterMark, requestedSeqNum, true});
+                                continue;
+                        }
+
+                        consumptionList.clear();
+
+                        // Process all bundles in the chunk
+                        for (const auto *p = bundlesForThisTopicPartition, *const chunkEnd = p + len; p < chunkEnd;)
+                        {
 
                                 // Try to parse the next bundle from the chunk
                                 // We may have gotten a partial bundle, so we need to be defensive about it
 
                                 // length of the bundle
-                                if (!Compression::UnpackUInt32Check(p, chunkEnd))
+                                uint32_t bundleLen;
+
+				if (trace)
+					SLog("NEW bundle at ", p - bundlesBase, "(" ,consumptionList.size(), ") ", ++totalSeenBundles, "\n");
+
+                                if (!Compression::TryUnpackUInt32(p, chunkEnd, bundleLen))
                                 {
                                         if (trace)
                                                 SLog("boundaries\n");
@@ -1652,10 +2196,6 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
                                         break;
                                 }
 
-				if (trace)
-					SLog("NEW bundle at ", p - bundlesBase, "(" ,consumptionList.size(), ") ", ++totalSeenBundles, "\n");
-
-                                const auto bundleLen = Compression::UnpackUInt32(p);
                                 const auto *const bundleEnd = p + bundleLen;
 
 
@@ -1687,17 +2227,13 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
 					if (trace)
 						SLog("msgSetEnd not packed into flags\n");
 
-                                        if (unlikely(!Compression::UnpackUInt32Check(p, chunkEnd)))
+                                        if (unlikely(!Compression::TryUnpackUInt32(p, chunkEnd, msgsSetSize)))
                                         {
                                                 if (trace)
                                                         SLog("boundaries\n");
 
                                                 break;
                                         }
-                                        else
-                                        {
-                                                msgsSetSize = Compression::UnpackUInt32(p);
-                                        }
                                 }
 
 				if (sparseBundleBitSet)
@@ -1719,7 +2255,9 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
 
                                         if (msgsSetSize != 1)
                                         {
-						if (unlikely(!Compression::UnpackUInt32Check(p, chunkEnd)))
+						uint32_t delta;
+
+						if (unlikely(!Compression::TryUnpackUInt32(p, chunkEnd, delta)))
 						{
 							if (trace)
 								SLog("boundaries\n");
@@ -1727,7 +2265,7 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
 							break;
 						}
 
-                                                lastMsgSeqNum = firstMsgSeqNum + Compression::UnpackUInt32(p) + 1;
+                                                lastMsgSeqNum = firstMsgSeqNum + delta + 1;
                                         }
 					else
 					{
@@ -1791,17 +2329,45 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
                                         if (trace)
                                                 SLog("Compressed, need to decompress messages set ", bundleEnd - p, " (", size_repr(bundleEnd - p), ")\n");
 
+                                        if (auto decompressed = decompressed_bundle(p))
+                                        {
+                                                // See set_decompression_threads()
+                                                msgSetContent.Set(reinterpret_cast<const uint8_t *>(decompressed->data()), decompressed->size());
+                                                goto parseMsgSet;
+                                        }
+
                                         auto rawData = get_buffer();
 
                                         rawData->clear();
                                         switch (codec)
                                         {
                                                 case 1:
-                                                        if (unlikely(!Compression::UnCompress(Compression::Algo::SNAPPY, p, bundleEnd - p, rawData)))
+                                                case 2:
+                                                case 3:
+                                                        if (unlikely(!Compression::UnCompress(Compression::AlgoForCodec(codec), p, bundleEnd - p, rawData)))
                                                         {
                                                                 if (trace)
                                                                         SLog("Failed ", chunkEnd - bundleEnd, "\n");
 
+                                                                if (codec == 3)
+                                                                {
+                                                                        const auto dictId = ZSTD_getDictID_fromFrame(p, bundleEnd - p);
+
+                                                                        if (dictId && !Compression::ZstdDictionary(dictId))
+                                                                        {
+                                                                                // Messages up to this bundle are still reported, and the application
+                                                                                // can consume from there again once the dictionary is fetched
+                                                                                put_buffer(rawData);
+                                                                                capturedFaults.push_back({clientReqId, fault::Type::UnknownCompressionDict, fault::Req::Consume, topicName, partitionId});
+                                                                                capturedFaults.back().ctx.dictId = dictId;
+
+                                                                                if (fetchedMissingCompressionDicts.insert(dictId).second)
+                                                                                        missingCompressionDicts.push_back({std::string(topicName.p, topicName.len), dictId});
+
+                                                                                goto nextPartition;
+                                                                        }
+                                                                }
+
                                                                 throw Switch::data_error("Failed to decompress bundle message set");
                                                         }
 
@@ -1820,7 +2386,7 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
                                 else
                                         msgSetContent.Set(p, Min<size_t>(chunkEnd - p, bundleEnd - p));
 
-
+                        parseMsgSet:
 
                                 p = bundleEnd;
 
@@ -1861,7 +2427,9 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
 						}
 						else
                                                 {
-							if (unlikely(!Compression::UnpackUInt32Check(p, endOfMsgSet)))
+							uint32_t delta;
+
+							if (unlikely(!Compression::TryUnpackUInt32(p, endOfMsgSet, delta)))
 							{
                                                                 lastPartialMsgMinFetchSize = std::max<size_t>(lastPartialMsgMinFetchSize, boundaryCheckTarget - bundlesBase);
 
@@ -1870,8 +2438,6 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
                                                                 break;
                                                         }
 
-                                                        const auto delta = Compression::UnpackUInt32(p);
-
 							if (trace)
 								SLog("Delta ", delta, "\n");
 
@@ -1949,7 +2515,9 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
                                         else
                                                 key.reset();
 
-                                        if (!Compression::UnpackUInt32Check(p, endOfMsgSet))
+                                        uint32_t len;
+
+                                        if (!Compression::TryUnpackUInt32(p, endOfMsgSet, len)) // message.length
                                         {
                                                 lastPartialMsgMinFetchSize = std::max<size_t>(lastPartialMsgMinFetchSize, boundaryCheckTarget - bundlesBase);
 
@@ -1960,8 +2528,6 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
                                                 goto nextPartition;
                                         }
 
-                                        const auto len = Compression::UnpackUInt32(p); // message.length
-
                                         if (trace)
                                                 SLog("message length = ", len, ", ts = ", ts, "(", Date::ts_repr(Timings::Milliseconds::ToSeconds(ts)), " for (", msgAbsSeqNum, ")\n");
 
@@ -2064,6 +2630,218 @@ bool TankClient::process_consume(connection *const c, const uint8_t *const conte
         return true;
 }
 
+bool TankClient::msgs_cursor::next_bundle()
+{
+        const auto *const chunkEnd = chunk->content.offset + chunk->content.len;
+        const auto requestedSeqNum = chunk->requestedSeqNum;
+
+        // Same semantics as the bundles parsing in process_consume()
+        while (p < chunkEnd)
+        {
+                uint32_t bundleLen;
+
+                if (!Compression::TryUnpackUInt32(p, chunkEnd, bundleLen))
+                        return false;
+
+                const auto *const bundleEnd = p + bundleLen;
+                const auto fetchSizeTarget = (bundleEnd + 256) - chunk->content.offset;
+
+                if (p >= chunkEnd)
+                {
+                        minFetchSize = std::max<size_t>(minFetchSize, fetchSizeTarget);
+                        return false;
+                }
+
+                const auto bundleFlags = *p++;
+                const uint8_t codec = bundleFlags & 3;
+                uint64_t bundleSeqNumsEnd;
+
+                sparseBundle = bundleFlags & (1u << 6);
+                msgsSetSize = (bundleFlags >> 2) & 0xf;
+
+                if (!msgsSetSize && unlikely(!Compression::TryUnpackUInt32(p, chunkEnd, msgsSetSize)))
+                        return false;
+
+                if (sparseBundle)
+                {
+                        if (p + sizeof(uint64_t) >= chunkEnd)
+                                return false;
+
+                        firstMsgSeqNum = *(uint64_t *)p;
+                        p += sizeof(uint64_t);
+
+                        if (msgsSetSize != 1)
+                        {
+                                uint32_t delta;
+
+                                if (unlikely(!Compression::TryUnpackUInt32(p, chunkEnd, delta)))
+                                        return false;
+
+                                lastMsgSeqNum = firstMsgSeqNum + delta + 1;
+                        }
+                        else
+                                lastMsgSeqNum = firstMsgSeqNum;
+
+                        logBaseSeqNum = firstMsgSeqNum;
+                        bundleSeqNumsEnd = lastMsgSeqNum + 1;
+                }
+                else
+                        bundleSeqNumsEnd = logBaseSeqNum + msgsSetSize;
+
+                if (requestedSeqNum < UINT64_MAX && requestedSeqNum >= bundleSeqNumsEnd)
+                {
+                        // Skip the bundle altogether
+                        p = bundleEnd;
+                        if (p > chunkEnd)
+                                minFetchSize = std::max<size_t>(minFetchSize, fetchSizeTarget);
+
+                        logBaseSeqNum = bundleSeqNumsEnd;
+                        continue;
+                }
+
+                if (codec)
+                {
+                        if (bundleEnd > chunkEnd)
+                        {
+                                minFetchSize = std::max<size_t>(minFetchSize, fetchSizeTarget);
+                                return false;
+                        }
+
+                        const auto algo = Compression::AlgoForCodec(codec);
+
+                        rawData.clear();
+                        if (unlikely(algo == Compression::Algo::UNKNOWN || !Compression::UnCompress(algo, p, bundleEnd - p, &rawData)))
+                        {
+                                if (codec == 3)
+                                {
+                                        const auto dictId = ZSTD_getDictID_fromFrame(p, bundleEnd - p);
+
+                                        if (dictId && !Compression::ZstdDictionary(dictId))
+                                        {
+                                                // See missing_compression_dict()
+                                                missingDictId = dictId;
+                                                return false;
+                                        }
+                                }
+
+                                throw Switch::data_error("Failed to decompress bundle message set");
+                        }
+
+                        msgP = reinterpret_cast<const uint8_t *>(rawData.data());
+                        msgSetEnd = msgP + rawData.size();
+                }
+                else
+                {
+                        msgP = p;
+                        msgSetEnd = p + Min<size_t>(chunkEnd - p, bundleEnd - p);
+                }
+
+                // process_consume() accounts for the whole bundle, whether all of its messages are parsed or not
+                minFetchSize = std::max<size_t>(minFetchSize, fetchSizeTarget);
+                p = bundleEnd;
+                msgIdx = 0;
+                ts = 0;
+                return true;
+        }
+
+        return false;
+}
+
+bool TankClient::msgs_cursor::next(consumed_msg &out)
+{
+        const auto requestedSeqNum = chunk->requestedSeqNum;
+
+        while (!exhausted)
+        {
+                if (!msgP || msgP + sizeof(uint8_t) > msgSetEnd)
+                {
+                        msgP = nullptr;
+                        if (!next_bundle())
+                        {
+                                exhausted = true;
+                                break;
+                        }
+                        continue;
+                }
+
+                const auto *const end = msgSetEnd;
+                const auto msgFlags = *msgP++;
+
+                if (sparseBundle)
+                {
+                        if (msgFlags & uint8_t(TankFlags::BundleMsgFlags::SeqNumPrevPlusOne))
+                        {
+                                // prev + 1; logBaseSeqNum was advanced past the previous message
+                        }
+                        else if (msgIdx == 0)
+                                logBaseSeqNum = firstMsgSeqNum;
+                        else if (msgIdx == msgsSetSize - 1)
+                                logBaseSeqNum = lastMsgSeqNum;
+                        else
+                        {
+                                uint32_t delta;
+
+                                if (unlikely(!Compression::TryUnpackUInt32(msgP, end, delta)))
+                                {
+                                        // Partial message; move on to the next bundle
+                                        msgP = nullptr;
+                                        continue;
+                                }
+
+                                logBaseSeqNum += delta;
+                        }
+                }
+
+                const auto msgAbsSeqNum = logBaseSeqNum;
+                strwlen8_t key;
+                uint32_t len;
+
+                if (0 == (msgFlags & uint8_t(TankFlags::BundleMsgFlags::UseLastSpecifiedTS)))
+                {
+                        if (msgP + sizeof(uint64_t) > end)
+                                break;
+
+                        ts = *(uint64_t *)msgP;
+                        msgP += sizeof(uint64_t);
+                }
+
+                if (msgFlags & uint8_t(TankFlags::BundleMsgFlags::HaveKey))
+                {
+                        if (msgP + sizeof(uint8_t) > end || msgP + (*msgP) + sizeof(uint8_t) > end)
+                                break;
+
+                        key.Set((char *)msgP + 1, *msgP);
+                        msgP += key.len + sizeof(uint8_t);
+                }
+
+                if (!Compression::TryUnpackUInt32(msgP, end, len) || msgP + len > end || msgAbsSeqNum > chunk->highWaterMark)
+                        break;
+
+                const auto *const content = msgP;
+
+                msgP += len;
+                ++msgIdx;
+                ++logBaseSeqNum;
+
+                if (requestedSeqNum == UINT64_MAX || msgAbsSeqNum >= requestedSeqNum)
+                {
+                        out.seqNum = msgAbsSeqNum;
+                        out.ts = ts;
+                        out.key = key;
+                        out.content.Set((char *)content, len);
+
+                        lastSeqNum = msgAbsSeqNum;
+                        haveLast = true;
+                        return true;
+                }
+        }
+
+        // Partial message, or past the high water mark; process_consume() stops parsing the chunk there as well
+        exhausted = true;
+        msgP = nullptr;
+        return false;
+}
+
 bool TankClient::process(connection *const c, const uint8_t msg, const uint8_t *const content, const size_t len)
 {
         if (trace)
@@ -2083,6 +2861,12 @@ bool TankClient::process(connection *const c, const uint8_t msg, const uint8_t *
 		case TankAPIMsgType::CreateTopic:
 			return process_create_topic(c, content, len);
 
+		case TankAPIMsgType::SeqNumsForTS:
+			return process_seqnums_for_ts(c, content, len);
+
+		case TankAPIMsgType::CompressionDict:
+			return process_compression_dict(c, content, len);
+
                 case TankAPIMsgType::Ping:
                         if (trace)
                                 SLog("PING\n");
@@ -2471,16 +3255,25 @@ void TankClient::poll(uint32_t timeoutMS)
 	resultsAllocations.clear();
         resultsAllocator.reuse();
         consumedPartitionContent.clear();
+        consumedChunks.clear();
         capturedFaults.clear();
         produceAcks.clear();
 	discoverPartitionsResults.clear();
 	createdTopicsResults.clear();
+	seqNumsForTSResults.clear();
+	compressionDictsResults.clear();
 
 
 	// it is important that we update_time_cache() here before we invoke reschedule_any() and right after Poll()
 	update_time_cache();
 
         reschedule_any();
+        drain_produce_submissions();
+
+        // Dictionaries of bundles consumed in the last poll(); their results are reported in compression_dicts()
+        for (const auto &it : missingCompressionDicts)
+                compression_dict_req(strwlen8_t(it.first.data(), it.first.size()), it.second, {});
+        missingCompressionDicts.clear();
 
         // Adjust timeout if we have any ongoing connection attempts
         if (connectionAttempts.size())
@@ -2490,7 +3283,26 @@ void TankClient::poll(uint32_t timeoutMS)
                 timeoutMS = first >= nowMS ? first - nowMS : 0;
         }
 
-        polling.store(true, std::memory_order_relaxed);
+        if (produceBatches.size())
+        {
+                flush_due_produce_batches();
+
+                // Wake up in time for the next batch
+                for (const auto &it : produceBatches)
+                {
+                        const auto due = it.second->createdMS + produceLinger.lingerMS;
+
+                        timeoutMS = std::min<uint64_t>(timeoutMS, due > nowMS ? due - nowMS : 0);
+                }
+        }
+
+        polling.store(true, std::memory_order_seq_cst);
+        // Pairs with the fence in submit_produce(); any() is a relaxed load, which the store alone wouldn't order
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+
+        // submit_produce() may have queued more messages, and seen polling == false, right before we set it
+        if (produceSubmissions.any())
+                timeoutMS = 0;
 
         const auto r = poller.Poll(timeoutMS);
 
@@ -2587,6 +3399,9 @@ void TankClient::poll(uint32_t timeoutMS)
                 consider_inflight_reqs(nowMS);
                 nextInflightReqsTimeoutCheckTs = nowMS + 800;
         }
+
+        // If we were interrupted by submit_produce(), don't wait for the next poll()
+        drain_produce_submissions();
 }
 
 uint32_t TankClient::produce_to(const topic_partition &to, const std::vector<msg> &msgs)
@@ -2608,6 +3423,182 @@ uint32_t TankClient::produce_to(const topic_partition &to, const std::vector<msg
 		return clientReqId;
 }
 
+bool TankClient::produce_batch_now(produce_batch *const batch)
+{
+        const auto *const data = batch->data.data();
+        produce_ctx ctx;
+
+        batchMsgs.clear();
+        for (const auto &it : batch->msgs)
+                batchMsgs.push_back({{data + it.contentOffset, it.contentLen}, it.ts, {data + it.keyOffset, it.keyLen}});
+
+        ctx.topic.Set(batch->topic.data(), batch->topic.size());
+        ctx.partitionId = batch->partition;
+        ctx.leader = leader_for(ctx.topic, ctx.partitionId);
+        ctx.baseSeqNum = 0;
+        ctx.msgs = batchMsgs.data();
+        ctx.msgsCnt = batchMsgs.size();
+
+        if (trace)
+                SLog("Producing batch of ", ctx.msgsCnt, " messages to (", ctx.topic, ", ", ctx.partitionId, ")\n");
+
+        // On failure, flush_broker() captures a Network fault for batch->clientReqId
+        return produce_to_leader(batch->clientReqId, ctx.leader, &ctx, 1);
+}
+
+void TankClient::flush_due_produce_batches()
+{
+        for (auto it = produceBatches.begin(); it != produceBatches.end();)
+        {
+                auto batch = it->second;
+
+                if (batch->createdMS + produceLinger.lingerMS <= nowMS)
+                {
+                        it = produceBatches.erase(it);
+                        // Failures are reported as a Network fault for batch->clientReqId; see produce_batch_now()
+                        produce_batch_now(batch);
+                        delete batch;
+                }
+                else
+                        ++it;
+        }
+}
+
+void TankClient::flush_produce_batches()
+{
+        update_time_cache();
+
+        for (auto &it : produceBatches)
+        {
+                // Failures are reported as a Network fault for the batch's clientReqId; see produce_batch_now()
+                produce_batch_now(it.second);
+                delete it.second;
+        }
+
+        produceBatches.clear();
+}
+
+void TankClient::append_to_batch(produce_batch *const batch, const std::vector<msg> &msgs)
+{
+        for (const auto &m : msgs)
+        {
+                const uint32_t keyOffset = batch->data.size();
+
+                batch->data.Serialize(m.key.p, m.key.len);
+
+                const uint32_t contentOffset = batch->data.size();
+
+                batch->data.Serialize(m.content.p, m.content.len);
+                batch->msgs.push_back({m.ts, keyOffset, m.key.len, contentOffset, m.content.len});
+        }
+}
+
+uint32_t TankClient::submit_produce(const topic_partition &to, const std::vector<msg> &msgs)
+{
+        if (msgs.empty())
+                return 0;
+
+        auto s = new produce_batch();
+        const auto clientReqId = ids_tracker.client.next++;
+
+        s->topic.assign(to.first.p, to.first.len);
+        s->partition = to.second;
+        s->clientReqId = clientReqId;
+        append_to_batch(s, msgs);
+
+        produceSubmissions.push_back(s);
+        // Pairs with the polling.store() in poll(), so that either we see polling == true here, or poll() sees this submission
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        interrupt_poll();
+        return clientReqId;
+}
+
+// Produces messages queued with submit_produce(); invoked by the thread that poll()s
+void TankClient::drain_produce_submissions()
+{
+        produce_batch *list{nullptr};
+
+        // Restore submission order, so that messages submitted by the same thread to the same partition are produced in order
+        for (auto it = produceSubmissions.drain(); it;)
+        {
+                auto next = it->next;
+
+                it->next = list;
+                list = it;
+                it = next;
+        }
+
+        while (auto it = list)
+        {
+                list = it->next;
+                produce_batch_now(it);
+                delete it;
+        }
+}
+
+uint32_t TankClient::produce_batched(const topic_partition &to, const std::vector<msg> &msgs)
+{
+        if (!produceLinger.lingerMS && produceBatches.empty())
+                return produce_to(to, msgs);
+        else if (msgs.empty() && produceLinger.lingerMS)
+                return 0;
+
+        std::string k(to.first.p, to.first.len);
+
+        k.append(reinterpret_cast<const char *>(&to.second), sizeof(uint16_t));
+
+        if (!produceLinger.lingerMS)
+        {
+                // The linger was disabled while messages were accumulated for some partitions
+                // If that's the case for this partition, its batch needs to be produced first, so that the messages are produced in order
+                const auto it = produceBatches.find(k);
+
+                if (it != produceBatches.end())
+                {
+                        auto b = it->second;
+
+                        produceBatches.erase(it);
+                        update_time_cache();
+                        // On failure, a Network fault is captured for b->clientReqId; see produce_batch_now()
+                        produce_batch_now(b);
+                        delete b;
+                }
+
+                return produce_to(to, msgs);
+        }
+
+        auto res = produceBatches.emplace(std::move(k), nullptr);
+        auto &batch = res.first->second;
+
+        update_time_cache();
+        if (res.second)
+        {
+                batch = new produce_batch();
+                batch->topic.assign(to.first.p, to.first.len);
+                batch->partition = to.second;
+                batch->clientReqId = ids_tracker.client.next++;
+                batch->createdMS = nowMS;
+        }
+
+        const auto clientReqId = batch->clientReqId;
+
+        append_to_batch(batch, msgs);
+
+        if (batch->data.size() >= produceLinger.maxBytes || batch->msgs.size() >= produceLinger.maxMsgs)
+        {
+                auto b = batch;
+
+                produceBatches.erase(res.first);
+
+                const auto produced = produce_batch_now(b);
+
+                delete b;
+                return produced ? clientReqId : 0;
+        }
+
+        return clientReqId;
+}
+
 uint32_t TankClient::produce_with_base(const std::vector< std::pair<topic_partition, std::pair<uint64_t, std::vector<msg>>>> &req)
 {
 	return produce_with_base(req.data(), req.size());
@@ -2845,7 +3836,8 @@ void TankClient::interrupt_poll()
 {
         bool to{true};
 
-        if (polling.compare_exchange_weak(to, false, std::memory_order_release, std::memory_order_relaxed))
+        // A spurious failure of compare_exchange_weak() would lose the wakeup
+        if (polling.compare_exchange_strong(to, false, std::memory_order_release, std::memory_order_relaxed))
 	{
                 if (write(pipeFd[1], " ", 1) == -1) 	// write()'s declared with [[gnu::warn_unused_result]] so keep compiler happy
 		{
@@ -6,6 +6,7 @@
  *
  */
 #pragma once
+#include <atomic>
 #include <switch.h>
 
 #define TANK_VERSION (0 * 100 + 54)
@@ -46,5 +47,47 @@ enum class TankAPIMsgType : uint8_t
 	ProduceWithBaseSeqNum=0x5,
 	DiscoverPartitions=0x6,
 
-	CreateTopic
+	CreateTopic,
+
+	// For each requested partition, returns the sequence number of the first message with timestamp >= the
+	// requested timestamp, so that clients can begin consuming from that time
+	SeqNumsForTS,
+
+	// Fetches(or, if one is provided, stores) the topic's trained Zstd compression dictionary
+	CompressionDict
+};
+
+// Zstd recommends ~100KB dictionaries; anything much larger is most likely not a dictionary
+static constexpr uint32_t MaxCompressionDictSize{1024 * 1024};
+
+// Lock-free multiple producers, single consumer queue; T must have a `T *next` member
+// drain() returns all pushed items, most recently pushed first
+template <typename T>
+struct PubSubQueue
+{
+        alignas(64 /* cache line size */) std::atomic<T *> list{nullptr};
+
+        void push_back(T *const v)
+        {
+                T *old;
+
+                do
+                {
+                        old = list.load(std::memory_order_relaxed);
+                        v->next = old;
+                } while (!list.compare_exchange_weak(old, v, std::memory_order_release, std::memory_order_relaxed));
+        }
+
+        bool any() const
+        {
+                return list.load(std::memory_order_relaxed);
+        }
+
+        inline T *drain()
+        {
+                if (!list.load(std::memory_order_relaxed))
+                        return nullptr;
+                else
+                        return list.exchange(nullptr, std::memory_order_acquire);
+        }
 };
@@ -1,6 +1,7 @@
 #include "service.h"
 #include <ansifmt.h>
 #include <compress.h>
+#include <condition_variable>
 #include <date.h>
 #include <fcntl.h>
 #include <fs.h>
@@ -9,6 +10,7 @@
 #include <set>
 #include <signal.h>
 #include <switch_mallocators.h>
+#include <sys/eventfd.h>
 #include <sys/stat.h>
 #include <sys/uio.h>
 #include <text.h>
@@ -16,6 +18,7 @@
 #include <thread>
 #include <timings.h>
 #include <unistd.h>
+#include <uring.h>
 #ifndef LEAN_SWITCH
 #include <switch_debug.h>
 #endif
@@ -27,11 +30,141 @@
 
 static constexpr bool trace{false};
 
-static Switch::mutex mboxLock;
-static Switch::vector<std::pair<int, int>> mbox;
 static Buffer basePath_;
 static bool cleanupTrackerIsDirty{false};
 static std::vector<topic_partition_log *> cleanupTracker;
+// All reactors; the primary reactor is always the first. Populated before any reactor thread is started
+static Switch::vector<Service *> reactors;
+std::atomic<uint32_t> Service::nextDistinctPartitionId{0};
+
+// Disk threads page-in file ranges not in the page cache, so that try_send() won't block on disk I/O
+// See -D option, warm_up()
+struct disk_task
+{
+        fd_handle *fdh; // retained
+        range32_t range;
+        Service *reactor;
+        connection *c;
+};
+
+static uint32_t diskThreadsCnt{2};
+// We don't need to page-in too much at once; if we need more, try_send() will schedule it
+static constexpr uint32_t diskTaskMaxSpan{8 * 1024 * 1024};
+static Switch::mutex diskTasksLock;
+static std::condition_variable diskTasksCond;
+static Switch::vector<disk_task> diskTasks;
+static bool diskThreadsExit{false};
+
+// Compactions are performed by a pool of compaction threads, and each is limited to its share of the memory budget
+// See -c and -m options, compact_partition()
+static uint32_t compactionThreadsCnt{1};
+static uint64_t compactionMemBudget{512 * 1024 * 1024};
+
+// Compaction I/O is limited to that many bytes/sec(0 for no limit); see -t option, throttle_compaction_io()
+static uint64_t compactionIOBudget{0};
+
+static struct
+{
+        std::atomic<uint64_t> bytesRead{0}, bytesWritten{0};
+        // time spent waiting for the I/O budget
+        std::atomic<uint64_t> throttledUs{0};
+} compactionStats;
+
+static thread_local uint64_t compactionThrottledUs{0};
+
+// Segment logs are written back and synced by a flusher thread per device, so that reactors never block on writeback, and
+// syncing partitions on one device won't delay syncing those on another. Requests are submitted via a lock-free queue.
+// See flusher_thread(), topic_partition_log::schedule_flush() and schedule_writeback()
+struct flush_req
+{
+        enum class Type : uint8_t
+        {
+                // Initiate writeback of range, and wait for the writeback of waitRange(the previous range) to complete, so that
+                // the dirty pages of a log are bounded and written back incrementally
+                Writeback,
+                // fdatasync() the log and its index, and advance the log's durableSeqNum to seqNum
+                Sync
+        } type;
+
+        topic_partition *partition;   // retained
+        fd_handle *logFdh, *indexFdh; // retained; indexFdh may be nullptr
+        range32_t range, waitRange;
+        uint64_t seqNum;
+        // If set, the reactor is notified once synced; see Service::consider_durable_acks()
+        Service *reactor;
+        flush_req *next;
+};
+
+struct flusher
+{
+        dev_t dev;
+        int eventFd;
+        PubSubQueue<flush_req> queue;
+        // Only signal eventFd if it hasn't been signaled since the queue was last drained
+        std::atomic<bool> wakeupPending{false};
+        std::thread thread;
+};
+
+static Switch::mutex flushersLock;
+static std::vector<flusher *> flushers;
+static std::atomic<bool> flushersExit{false};
+
+// Flushers process requests at most once every that many microseconds, so that syncs requested for the same log in the meantime
+// are coalesced into a single fdatasync(); see -g option
+static uint64_t flushGroupUs{0};
+
+// Work that would otherwise block a reactor; unlinking files of deleted segments, syncing and closing fds of
+// rolled or released segments, and preparing the next segment of partitions. See housekeeping_thread()
+struct housekeeping_task
+{
+        enum class Type : uint8_t
+        {
+                Unlink,
+                SyncClose,
+                PrepareSegment,
+                Trim
+        } type;
+
+        int fd;
+        spare_segment *spare; // retained
+        std::string path;
+        fd_handle *fdh; // retained
+        uint64_t size;
+};
+
+static Switch::mutex housekeepingLock;
+static std::condition_variable housekeepingCond;
+static std::vector<housekeeping_task> housekeepingTasks;
+static bool housekeepingRunning{false}, housekeepingExit{false};
+
+#ifdef SWITCH_HAVE_IOURING
+// See -u option
+static bool useIOURing{false};
+
+// Each reactor gets its own ring; see init_io_ring()
+static thread_local std::unique_ptr<IOURing> ioRing;
+
+// Returns nullptr if io_uring is not enabled or not supported, in which case we use plain syscalls instead
+static IOURing *io_ring()
+{
+        return ioRing.get();
+}
+
+// Invoked by each reactor before it enters its I/O loop
+// CQEs are signaled via eventFd, so that the reactor gets to reap them even while blocked in poller.Poll(); see Service::complete_pending_appends()
+static void init_io_ring(const int eventFd)
+{
+        if (!useIOURing)
+                return;
+
+        ioRing.reset(new IOURing());
+        if (ioRing->init(256) == -1 || ioRing->register_eventfd(eventFd) == -1)
+        {
+                Print("WARNING: io_uring not available(", strerror(errno), "); will use regular syscalls instead\n");
+                ioRing.reset();
+        }
+}
+#endif
 
 static int Rename(const char *oldpath, const char *newpath)
 {
@@ -48,6 +181,489 @@ static int Unlink(const char *pathname)
         return unlink(pathname);
 }
 
+// If the housekeeping thread is not running(i.e during startup or shutdown), we do it here instead
+static bool schedule_housekeeping(housekeeping_task &&task)
+{
+        {
+                std::lock_guard<Switch::mutex> g(housekeepingLock);
+
+                if (!housekeepingRunning)
+                        return false;
+
+                housekeepingTasks.push_back(std::move(task));
+        }
+
+        housekeepingCond.notify_one();
+        return true;
+}
+
+void retire_fd(int fd)
+{
+        if (!schedule_housekeeping({housekeeping_task::Type::SyncClose, fd, nullptr, {}}))
+        {
+                fdatasync(fd);
+                close(fd);
+        }
+}
+
+static void unlink_deferred(const char *const pathname)
+{
+        if (!schedule_housekeeping({housekeeping_task::Type::Unlink, -1, nullptr, pathname}))
+        {
+                if (Unlink(pathname) == -1 && errno != ENOENT)
+                        Print("Failed to unlink ", pathname, ": ", strerror(errno), "\n");
+        }
+}
+
+// Releases the blocks past `size` preallocated for a segment that's no longer written to; see prealloc_cur_segment()
+static void trim_deferred(fd_handle *const fdh, const uint64_t size)
+{
+        fdh->Retain();
+        if (!schedule_housekeeping({housekeeping_task::Type::Trim, -1, nullptr, {}, fdh, size}))
+        {
+                if (ftruncate(fdh->fd, size) == -1)
+                        RFLog("ftruncate() failed:", strerror(errno), "\n");
+                fdh->Release();
+        }
+}
+
+spare_segment::~spare_segment()
+{
+        if (indexData)
+                munmap(indexData, indexCapacity * sizeof(index_record));
+
+        if (logFd != -1)
+        {
+                // Never used; the partition was deleted, or we are shutting down
+                close(logFd);
+                Unlink(Buffer::build(basePath.data(), ".next.log").data());
+        }
+
+        if (indexFd != -1)
+        {
+                close(indexFd);
+                Unlink(Buffer::build(basePath.data(), ".next.index").data());
+        }
+
+        if (timeIndexFd != -1)
+        {
+                close(timeIndexFd);
+                Unlink(Buffer::build(basePath.data(), ".next.tindex").data());
+        }
+}
+
+// Creates the spare segment's files and preallocates and maps its index, as map_cur_index() would for an empty segment
+static void prepare_spare_segment(spare_segment *const s)
+{
+        const auto fail = [s](const char *const op, const Buffer &path) {
+                Print("WARNING: ", op, "(", path, ") failed:", strerror(errno), ". Segment will be created when rolled\n");
+                s->state.store(spare_segment::State::Failed, std::memory_order_release);
+        };
+        Buffer path;
+
+        path.append(s->basePath.data(), ".next.log");
+        s->logFd = open(path.data(), O_RDWR | O_LARGEFILE | O_CREAT | O_TRUNC | O_NOATIME | O_APPEND, 0775);
+        if (s->logFd == -1)
+                return fail("open", path);
+
+        if (s->logPrealloc)
+        {
+                if (fallocate(s->logFd, FALLOC_FL_KEEP_SIZE, 0, s->logPrealloc) == 0)
+                        s->logPreallocated = s->logPrealloc;
+                else if (trace)
+                        SLog("fallocate() failed:", strerror(errno), "\n");
+        }
+
+        path.clear();
+        path.append(s->basePath.data(), ".next.tindex");
+        s->timeIndexFd = open(path.data(), O_RDWR | O_LARGEFILE | O_CREAT | O_TRUNC | O_NOATIME, 0775);
+        if (s->timeIndexFd == -1)
+                return fail("open", path);
+
+        path.clear();
+        path.append(s->basePath.data(), ".next.index");
+        s->indexFd = open(path.data(), O_RDWR | O_LARGEFILE | O_CREAT | O_TRUNC | O_NOATIME, 0775);
+        if (s->indexFd == -1)
+                return fail("open", path);
+
+        const size_t span = s->indexCapacity * sizeof(index_record);
+
+        if (ftruncate(s->indexFd, span) == -1)
+                return fail("ftruncate", path);
+
+        auto data = static_cast<index_record *>(mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_SHARED, s->indexFd, 0));
+
+        if (unlikely(data == MAP_FAILED))
+                return fail("mmap", path);
+
+        s->indexData = data;
+        s->state.store(spare_segment::State::Ready, std::memory_order_release);
+}
+
+static void housekeeping_thread()
+{
+        std::vector<housekeeping_task> tasks;
+
+        for (;;)
+        {
+                {
+                        std::unique_lock<Switch::mutex> g(housekeepingLock);
+
+                        housekeepingCond.wait(g, [] { return !housekeepingTasks.empty() || housekeepingExit; });
+                        if (housekeepingTasks.empty())
+                        {
+                                // Only exit once we are done with all scheduled tasks
+                                housekeepingRunning = false;
+                                return;
+                        }
+
+                        tasks.swap(housekeepingTasks);
+                }
+
+                for (auto &it : tasks)
+                {
+                        switch (it.type)
+                        {
+                                case housekeeping_task::Type::Unlink:
+                                        if (Unlink(it.path.data()) == -1 && errno != ENOENT)
+                                                Print("Failed to unlink ", it.path.data(), ": ", strerror(errno), "\n");
+                                        break;
+
+                                case housekeeping_task::Type::SyncClose:
+                                        fdatasync(it.fd);
+                                        close(it.fd);
+                                        break;
+
+                                case housekeeping_task::Type::PrepareSegment:
+                                        // No point if the partition's gone
+                                        if (it.spare->use_count() > 1)
+                                                prepare_spare_segment(it.spare);
+                                        it.spare->Release();
+                                        break;
+
+                                case housekeeping_task::Type::Trim:
+                                        if (ftruncate(it.fdh->fd, it.size) == -1)
+                                                Print("ftruncate() failed:", strerror(errno), "\n");
+                                        it.fdh->Release();
+                                        break;
+                        }
+                }
+
+                tasks.clear();
+        }
+}
+
+static void flusher_thread(flusher *const f)
+{
+        Switch::vector<flush_req *> synced;
+        Switch::vector<Service *> notify;
+        uint64_t lastPass{0};
+
+        for (;;)
+        {
+                if (flushersExit.load(std::memory_order_acquire) && !f->queue.any())
+                        return;
+
+                uint64_t v;
+
+                if (read(f->eventFd, &v, sizeof(v)) == -1 && errno != EINTR)
+                {
+                        Print("Failed to read from eventfd:", strerror(errno), "\n");
+                        return;
+                }
+
+                if (flushGroupUs)
+                {
+                        const auto now = Timings::Microseconds::Tick();
+
+                        if (now < lastPass + flushGroupUs)
+                                std::this_thread::sleep_for(std::chrono::microseconds(lastPass + flushGroupUs - now));
+
+                        lastPass = Timings::Microseconds::Tick();
+                }
+
+                f->wakeupPending = false;
+
+                auto it = f->queue.drain();
+                flush_req *rh{nullptr};
+
+                // restore submission order
+                while (it)
+                {
+                        auto t{it};
+
+                        it = t->next;
+                        t->next = rh;
+                        rh = t;
+                }
+
+                for (auto req = rh; req;)
+                {
+                        const auto next = req->next;
+                        const auto fd = req->logFdh->fd;
+
+                        if (req->type == flush_req::Type::Writeback)
+                        {
+                                if (sync_file_range(fd, req->range.offset, req->range.len, SYNC_FILE_RANGE_WRITE) == -1)
+                                        Print("sync_file_range() failed:", strerror(errno), "\n");
+                                else if (req->waitRange.len && sync_file_range(fd, req->waitRange.offset, req->waitRange.len, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER) == -1)
+                                        Print("sync_file_range() failed:", strerror(errno), "\n");
+
+                                req->logFdh->Release();
+                                if (req->indexFdh)
+                                        req->indexFdh->Release();
+                                req->partition->Release();
+                                delete req;
+                        }
+                        else
+                        {
+                                // Syncs for the same log in this batch are coalesced into a single fdatasync() of the log and its index
+                                auto it = std::find_if(synced.begin(), synced.end(), [req](const auto o) { return o->logFdh == req->logFdh; });
+
+                                if (it == synced.end())
+                                        synced.push_back(req);
+                                else
+                                {
+                                        auto o = *it;
+
+                                        o->seqNum = std::max(o->seqNum, req->seqNum);
+                                        if (!o->indexFdh)
+                                                std::swap(o->indexFdh, req->indexFdh);
+                                        if (req->reactor && std::find(notify.begin(), notify.end(), req->reactor) == notify.end())
+                                                notify.push_back(req->reactor);
+
+                                        req->logFdh->Release();
+                                        if (req->indexFdh)
+                                                req->indexFdh->Release();
+                                        req->partition->Release();
+                                        delete req;
+                                }
+                        }
+
+                        req = next;
+                }
+
+                for (auto req : synced)
+                {
+                        if (fdatasync(req->logFdh->fd) == -1)
+                                Print("fdatasync() failed:", strerror(errno), "\n");
+                        if (req->indexFdh && fdatasync(req->indexFdh->fd) == -1)
+                                Print("fdatasync() failed:", strerror(errno), "\n");
+                }
+
+                // Only published once all logs in the batch have been synced; a partition may have had syncs
+                // for more than one log in this batch(segment rolled), and reactors may observe durableSeqNum at any time
+                for (auto req : synced)
+                {
+                        auto &w = req->partition->log_->durableSeqNum;
+
+                        for (auto cur = w.load(std::memory_order_relaxed); cur < req->seqNum && !w.compare_exchange_weak(cur, req->seqNum, std::memory_order_release, std::memory_order_relaxed);)
+                                continue;
+
+                        if (req->reactor && std::find(notify.begin(), notify.end(), req->reactor) == notify.end())
+                                notify.push_back(req->reactor);
+
+                        req->logFdh->Release();
+                        if (req->indexFdh)
+                                req->indexFdh->Release();
+                        req->partition->Release();
+                        delete req;
+                }
+
+                synced.clear();
+
+                for (auto r : notify)
+                {
+                        r->run_on_reactor(new mainthread_closure([r]() {
+                                r->consider_durable_acks();
+                        }));
+                }
+                notify.clear();
+        }
+}
+
+// Returns the flusher thread of the device of fd, starting one if necessary, or nullptr if we are shutting down
+static flusher *flusher_for(const int fd)
+{
+        struct stat st;
+
+        if (fstat(fd, &st) == -1)
+                throw Switch::system_error("fstat() failed:", strerror(errno));
+
+        std::lock_guard<Switch::mutex> g(flushersLock);
+
+        if (flushersExit)
+                return nullptr;
+
+        for (auto it : flushers)
+        {
+                if (it->dev == st.st_dev)
+                        return it;
+        }
+
+        auto f = new flusher();
+
+        f->dev = st.st_dev;
+        f->eventFd = eventfd(0, EFD_CLOEXEC);
+        if (f->eventFd == -1)
+                throw Switch::system_error("eventfd() failed:", strerror(errno));
+
+        f->thread = std::thread(flusher_thread, f);
+        flushers.push_back(f);
+        return f;
+}
+
+// Returns false if the flushers are no longer running, in which case the caller should do it itself
+static bool submit_flush(topic_partition_log *const log, const flush_req::Type type, fd_handle *const logFdh, fd_handle *const indexFdh, const uint64_t seqNum, Service *const reactor = nullptr, const range32_t range = {}, const range32_t waitRange = {})
+{
+        if (!log->flusher_)
+        {
+                log->flusher_ = flusher_for(logFdh->fd);
+                if (!log->flusher_)
+                        return false;
+        }
+        else if (flushersExit.load(std::memory_order_relaxed))
+                return false;
+
+        auto f = log->flusher_;
+        auto req = new flush_req();
+
+        req->type = type;
+        req->partition = log->partition;
+        req->partition->Retain();
+        req->logFdh = logFdh;
+        logFdh->Retain();
+        req->indexFdh = indexFdh;
+        if (indexFdh)
+                indexFdh->Retain();
+        req->range = range;
+        req->waitRange = waitRange;
+        req->seqNum = seqNum;
+        req->reactor = reactor;
+
+        f->queue.push_back(req);
+        if (!f->wakeupPending.exchange(true))
+        {
+                const uint64_t v{1};
+
+                if (write(f->eventFd, &v, sizeof(v)) == -1)
+                        RFLog("Failed to signal flusher:", strerror(errno), "\n");
+        }
+
+        return true;
+}
+
+// Returns the timestamp of the first message of the bundle [p, e), where p points to the bundle header(i.e past the bundle length)
+// The first message of a bundle always specifies its timestamp.
+//
+// For Snappy and LZ4 compressed messages sets, the compressed stream always begins with a literal, which almost always includes
+// the first message's (flags, ts), so we only need to decompress the whole set if it doesn't.
+// For Zstd we stream-decompress just enough output to get to the timestamp
+static uint64_t bundle_first_msg_ts(const uint8_t *p, const uint8_t *const e)
+{
+        const auto bundleFlags = *p++;
+        const auto codec = bundleFlags & 3;
+        uint32_t msgSetSize = (bundleFlags >> 2) & 0xf;
+
+        if (!msgSetSize)
+                msgSetSize = Compression::UnpackUInt32(p);
+
+        if (bundleFlags & (1u << 6))
+        {
+                p += sizeof(uint64_t);
+                if (msgSetSize != 1)
+                        Compression::UnpackUInt32(p);
+        }
+
+        if (!codec)
+                return p + sizeof(uint8_t) + sizeof(uint64_t) <= e ? *(uint64_t *)(p + sizeof(uint8_t)) : 0;
+
+        const auto *const setBase = p;
+        const auto algo = Compression::AlgoForCodec(codec);
+
+        if (algo == Compression::Algo::SNAPPY)
+        {
+                Compression::UnpackUInt32(p); // uncompressed length
+
+                if (p < e && (*p & 3) == 0)
+                {
+                        // literal
+                        uint32_t litLen = *p++ >> 2;
+
+                        if (litLen >= 60)
+                        {
+                                const auto n = litLen - 59;
+
+                                litLen = 0;
+                                for (uint32_t i{0}; i != n && p < e; ++i)
+                                        litLen |= uint32_t(*p++) << (i * 8);
+                        }
+
+                        if (litLen + 1 >= sizeof(uint8_t) + sizeof(uint64_t) && p + sizeof(uint8_t) + sizeof(uint64_t) <= e)
+                                return *(uint64_t *)(p + sizeof(uint8_t));
+                }
+        }
+        else if (algo == Compression::Algo::LZ4)
+        {
+                p += sizeof(uint32_t); // uncompressed length
+
+                if (p < e)
+                {
+                        // the first sequence's token; high nibble is the literals length
+                        uint32_t litLen = *p++ >> 4;
+
+                        if (litLen == 15)
+                        {
+                                uint8_t v;
+
+                                do
+                                {
+                                        v = p < e ? *p++ : 0;
+                                        litLen += v;
+                                } while (v == 255);
+                        }
+
+                        if (litLen >= sizeof(uint8_t) + sizeof(uint64_t) && p + sizeof(uint8_t) + sizeof(uint64_t) <= e)
+                                return *(uint64_t *)(p + sizeof(uint8_t));
+                }
+        }
+        else if (algo == Compression::Algo::ZSTD)
+        {
+                auto dctx = Compression::zstd_dctx();
+                uint8_t head[sizeof(uint8_t) + sizeof(uint64_t)];
+                ZSTD_inBuffer in{setBase, size_t(e - setBase), 0};
+                ZSTD_outBuffer out{head, sizeof(head), 0};
+
+                if (const auto dictId = ZSTD_getDictID_fromFrame(setBase, e - setBase))
+                {
+                        const auto dict = Compression::ZstdDictionary(dictId);
+
+                        if (!dict)
+                                return 0;
+
+                        ZSTD_DCtx_refDDict(dctx, dict->ddict);
+                }
+
+                while (out.pos != out.size && in.pos != in.size)
+                {
+                        const auto r = ZSTD_decompressStream(dctx, &out, &in);
+
+                        if (ZSTD_isError(r) || !r)
+                                break;
+                }
+                ZSTD_DCtx_reset(dctx, ZSTD_reset_session_and_parameters);
+
+                return out.pos == out.size ? *(uint64_t *)(head + sizeof(uint8_t)) : 0;
+        }
+
+        IOBuffer b;
+
+        if (!Compression::UnCompress(algo, setBase, e - setBase, &b) || b.size() < sizeof(uint8_t) + sizeof(uint64_t))
+                return 0;
+
+        return *(uint64_t *)(b.data() + sizeof(uint8_t));
+}
+
 ro_segment::ro_segment(const uint64_t absSeqNum, const uint64_t lastAbsSeqNum, const strwlen32_t base, const uint32_t creationTS, const bool wideEntries)
     : baseSeqNum{absSeqNum}, lastAvailSeqNum{lastAbsSeqNum}, createdTS{creationTS}, haveWideEntries{wideEntries}
 {
@@ -60,6 +676,10 @@ ro_segment::ro_segment(const uint64_t absSeqNum, const uint64_t lastAbsSeqNum, c
         require(lastAbsSeqNum >= baseSeqNum);
 
         index.data = nullptr;
+        bundles.data = nullptr;
+        bundles.size = 0;
+        timeIndex.data = nullptr;
+        timeIndex.size = 0;
         if (createdTS)
                 fd = open(Buffer::build(base, "/", absSeqNum, "-", lastAbsSeqNum, "_", createdTS, ".ilog").data(), O_RDONLY | O_LARGEFILE | O_NOATIME);
         else
@@ -149,18 +769,180 @@ ro_segment::ro_segment(const uint64_t absSeqNum, const uint64_t lastAbsSeqNum, c
         }
         else
                 index.data = nullptr;
+
+        if (!fileSize)
+                return;
+
+        map_time_index(Buffer::build(base, "/", absSeqNum, ".tindex").data());
 }
 
-std::pair<uint32_t, uint32_t> ro_segment::snapDown(const uint64_t absSeqNum) const
+// Maps the segment's time index at `path`, and (re)builds it first if it is missing or doesn't cover the whole log
+void ro_segment::map_time_index(const char *const path)
 {
-        if (haveWideEntries)
+        const auto timeIndexFd = open(path, O_RDWR | O_LARGEFILE | O_CREAT | O_NOATIME, 0775);
+        time_index_record last;
+        off64_t size;
+
+        if (timeIndexFd == -1)
+                throw Switch::system_error("Failed to access time index:", strerror(errno));
+
+        Defer({ close(timeIndexFd); });
+
+        size = lseek64(timeIndexFd, 0, SEEK_END);
+        if (size < sizeof(time_index_record) || size % sizeof(time_index_record) || pread64(timeIndexFd, &last, sizeof(last), size - sizeof(last)) != sizeof(last) || last.absPhysical != fileSize)
         {
-                if (trace)
-                        SLog("haveWideEntries for ", ptr_repr(this), "\n");
-                IMPLEMENT_ME();
+                // Missing, or it doesn't cover the whole log(e.g this segment was rolled before we maintained time indices)
+                Service::rebuild_index(fdh->fd, -1, timeIndexFd, true);
+                size = lseek64(timeIndexFd, 0, SEEK_END);
         }
 
-        const auto relSeqNum = uint32_t(absSeqNum - baseSeqNum);
+        auto data = mmap(nullptr, size, PROT_READ, MAP_SHARED, timeIndexFd, 0);
+
+        if (unlikely(data == MAP_FAILED))
+                throw Switch::system_error("Failed to access the time index file. mmap() failed:", strerror(errno));
+
+        timeIndex.data = static_cast<const time_index_record *>(data);
+        timeIndex.size = size / sizeof(time_index_record);
+}
+
+// Appends a bundle_index_record to `out` for each bundle in [p, e), where p is the start of a segment log
+// whose first message's sequence number is `baseSeqNum`. Stops at the first incomplete bundle
+static void index_bundles(const uint8_t *p, const uint8_t *const e, uint64_t baseSeqNum, Switch::vector<bundle_index_record> &out)
+{
+        for (const auto *const base = p; p < e;)
+        {
+                const auto bundleBase = p;
+                const auto bundleLen = Compression::UnpackUInt32(p);
+                const auto nextBundle = p + bundleLen;
+
+                if (unlikely(!bundleLen || nextBundle > e))
+                        break;
+
+                const auto bundleFlags = *p++;
+                const bool sparseBundleBitSet = bundleFlags & (1u << 6);
+                uint32_t msgSetSize = (bundleFlags >> 2) & 0xf;
+                uint64_t firstMsgSeqNum, lastMsgSeqNum;
+
+                if (!msgSetSize)
+                        msgSetSize = Compression::UnpackUInt32(p);
+
+                if (sparseBundleBitSet)
+                {
+                        firstMsgSeqNum = *(uint64_t *)p;
+                        p += sizeof(uint64_t);
+
+                        if (msgSetSize != 1)
+                                lastMsgSeqNum = firstMsgSeqNum + Compression::UnpackUInt32(p) + 1;
+                        else
+                                lastMsgSeqNum = firstMsgSeqNum;
+                }
+                else
+                {
+                        firstMsgSeqNum = baseSeqNum;
+                        lastMsgSeqNum = baseSeqNum + msgSetSize - 1;
+                }
+
+                out.push_back({firstMsgSeqNum, lastMsgSeqNum, uint32_t(bundleBase - base), uint32_t(nextBundle - bundleBase), sparseBundleBitSet});
+                baseSeqNum = lastMsgSeqNum + 1;
+                p = nextBundle;
+        }
+}
+
+void ro_segment::set_bundle_index(const strwlen32_t base, const bundle_index_record *const all, const uint32_t cnt)
+{
+        const auto path = Buffer::build(base, "/", baseSeqNum, ".bindex");
+        const size_t size = cnt * sizeof(bundle_index_record);
+        int fd = open(path.data(), O_RDWR | O_LARGEFILE | O_CREAT | O_TRUNC | O_NOATIME, 0775);
+
+        if (fd == -1)
+        {
+                Print("Failed to create ", path, ": ", strerror(errno), "\n");
+                return;
+        }
+
+        Defer({ close(fd); });
+
+        if (write(fd, all, size) != ssize_t(size))
+        {
+                // It's optional, so we 'll just do without it
+                Print("Failed to write ", path, ": ", strerror(errno), "\n");
+                Unlink(path.data());
+                return;
+        }
+        else if (!size)
+                return;
+
+        auto data = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+
+        if (unlikely(data == MAP_FAILED))
+        {
+                Print("Failed to access ", path, ": ", strerror(errno), "\n");
+                return;
+        }
+
+        bundles.data = static_cast<const bundle_index_record *>(data);
+        bundles.size = cnt;
+}
+
+void ro_segment::map_bundle_index(const strwlen32_t base)
+{
+        const auto path = Buffer::build(base, "/", baseSeqNum, ".bindex");
+        int fd = open(path.data(), O_RDONLY | O_LARGEFILE | O_NOATIME);
+
+        if (fd != -1)
+        {
+                const auto size = lseek64(fd, 0, SEEK_END);
+                const uint32_t cnt = size / sizeof(bundle_index_record);
+                auto data = size > 0 && size % sizeof(bundle_index_record) == 0 ? mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+                close(fd);
+                if (data != MAP_FAILED)
+                {
+                        const auto *const all = static_cast<const bundle_index_record *>(data);
+                        const auto &last = all[cnt - 1];
+
+                        // The bundles must account for the whole segment log; otherwise this index is stale(e.g compaction was interrupted)
+                        if (all[0].fileOffset == 0 && all[0].firstSeqNum >= baseSeqNum && last.fileOffset + last.len == fileSize && last.lastSeqNum <= lastAvailSeqNum)
+                        {
+                                bundles.data = all;
+                                bundles.size = cnt;
+                                return;
+                        }
+
+                        munmap(data, size);
+                }
+        }
+
+        auto *const fileData = fileSize ? mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fdh->fd, 0) : nullptr;
+        Switch::vector<bundle_index_record> all;
+
+        if (fileData == MAP_FAILED)
+                throw Switch::system_error("Unable to mmap():", strerror(errno));
+
+        Defer({ if (fileData) munmap(fileData, fileSize); });
+
+        if (fileData)
+        {
+                madvise(fileData, fileSize, MADV_SEQUENTIAL);
+                index_bundles(static_cast<const uint8_t *>(fileData), static_cast<const uint8_t *>(fileData) + fileSize, baseSeqNum, all);
+        }
+
+        if (trace)
+                SLog("Rebuilt ", path, ": ", all.size(), " bundles\n");
+
+        set_bundle_index(base, all.data(), all.size());
+}
+
+std::pair<uint32_t, uint32_t> ro_segment::snapDown(const uint64_t absSeqNum) const
+{
+        if (haveWideEntries)
+        {
+                if (trace)
+                        SLog("haveWideEntries for ", ptr_repr(this), "\n");
+                IMPLEMENT_ME();
+        }
+
+        const auto relSeqNum = uint32_t(absSeqNum - baseSeqNum);
 
         if (relSeqNum == baseSeqNum)
         {
@@ -283,6 +1065,45 @@ static uint32_t search_before_offset(uint64_t baseSeqNum, const uint32_t maxSize
         return fileOffset;
 }
 
+// Uses the per-bundle index(all, all + n) to locate the bundle that holds `absSeqNum`(or the first bundle after it), and
+// where the bundles up to `maxAbsSeqNum` end, respecting `maxSize` like search_before_offset() does, without reading from the log.
+// Returns false if there is no such bundle, in which case `res` is not updated
+static bool lookup_bundles(const bundle_index_record *const all, const uint32_t n, const uint32_t fileSize, const uint64_t absSeqNum, const uint32_t maxSize, const uint64_t maxAbsSeqNum, lookup_res &res)
+{
+        const auto *const e = all + n;
+        const auto it = std::lower_bound(all, e, absSeqNum, [](const auto &r, const uint64_t seqNum) {
+                return r.lastSeqNum < seqNum;
+        });
+
+        if (it == e)
+                return false;
+
+        res.fileOffset = it->fileOffset;
+        res.absBaseSeqNum = it->firstSeqNum;
+        res.firstBundleIsSparse = it->sparse;
+        res.exact = true;
+
+        if (maxAbsSeqNum != UINT64_MAX)
+        {
+                const uint64_t limit = maxSize != UINT32_MAX ? Min<uint64_t>(fileSize, uint64_t(it->fileOffset) + maxSize) : fileSize;
+                const auto upto = std::upper_bound(it, e, maxAbsSeqNum, [](const uint64_t seqNum, const auto &r) {
+                        return seqNum < r.firstSeqNum;
+                });
+                const auto ceil = std::lower_bound(it, upto, limit, [](const auto &r, const uint64_t o) {
+                        return r.fileOffset < o;
+                });
+
+                res.fileOffsetCeiling = ceil != e ? ceil->fileOffset : fileSize;
+        }
+        else
+                res.fileOffsetCeiling = fileSize;
+
+        if (trace)
+                SLog("Bundle index: (", res.absBaseSeqNum, ", ", res.fileOffset, "), fileOffsetCeiling = ", res.fileOffsetCeiling, "\n");
+
+        return true;
+}
+
 // We are operating on index boundaries, so our res.fileOffset is aligned on an index boundary, which means
 // we may stream (0, partition_config::indexInterval] excess bytes.
 // This is probably fine, but we may as well
@@ -300,6 +1121,12 @@ static bool adjust_range_start(lookup_res &res, const uint64_t absSeqNum)
 {
         uint64_t baseSeqNum = res.absBaseSeqNum;
 
+        if (res.exact)
+        {
+                // Resolved using the per-bundle index; see lookup_bundles()
+                return res.firstBundleIsSparse;
+        }
+
         if (trace == false) // explicitly allow so that we can verify it does the right thing when tracing
         {
                 if (baseSeqNum == absSeqNum || absSeqNum <= 1)
@@ -398,192 +1225,280 @@ static bool adjust_range_start(lookup_res &res, const uint64_t absSeqNum)
         return firstBundleIsSparse;
 }
 
-lookup_res topic_partition_log::read_cur(const uint64_t absSeqNum, const uint32_t maxSize, const uint64_t maxAbsSeqNum)
+// Invokes l(msgSeqNum, msgTs) for each message of the bundles of the segment log `fd` in [from, to), where `baseSeqNum`
+// is the sequence number of the first message of the bundle at `from`, until l() returns true
+template <typename L>
+static void scan_msgs(int fd, const uint32_t from, const uint32_t to, uint64_t baseSeqNum, L &&l)
 {
-        // lock is expected to be locked
-        require(absSeqNum >= cur.baseSeqNum);
+        if (from >= to)
+                return;
 
-        if (cur.index.haveWideEntries)
-        {
-                // need to use the appropriate skipList64 and a different index encoding format
-                IMPLEMENT_ME();
-        }
+        const auto pageBase = from & ~uint32_t(4095);
+        const size_t span = to - pageBase;
+        auto *const fileData = mmap(nullptr, span, PROT_READ, MAP_SHARED, fd, pageBase);
+        IOBuffer b;
 
-        lookup_res res;
-        const auto highWatermark = lastAssignedSeqNum;
-        bool inSkiplist;
-        const auto relSeqNum = uint32_t(absSeqNum - cur.baseSeqNum);
-        const auto &skipList = cur.index.skipList;
-        const auto end = skipList.end();
-        const auto it = std::upper_bound_or_match(skipList.begin(), end, relSeqNum, [](const auto &a, const auto seqNum) {
-                return TrivialCmp(seqNum, a.first);
-        });
+        if (fileData == MAP_FAILED)
+                throw Switch::system_error("mmap() failed:", strerror(errno));
 
-        res.fdh = cur.fdh;
+        Defer({ munmap(fileData, span); });
 
-        if (it != end)
+        for (const auto *p = static_cast<const uint8_t *>(fileData) + (from - pageBase), *const e = static_cast<const uint8_t *>(fileData) + span; p < e;)
         {
-                if (trace)
-                        SLog("Found in skiplist\n");
-
-                res.absBaseSeqNum = cur.baseSeqNum + it->first;
-                res.fileOffset = it->second;
+                const auto bundleLen = Compression::UnpackUInt32(p);
+                const auto nextBundle = p + bundleLen;
 
-                inSkiplist = true;
-        }
-        else
-        {
-                require(cur.index.ondisk.span); // we checked if it's in this current segment
+                if (unlikely(!bundleLen || nextBundle > e))
+                        break;
 
-                if (trace)
-                        SLog("Considering ondisk index (cur.fileSize = ", cur.fileSize, ")\n");
+                const auto bundleFlags = *p++;
+                const auto codec = bundleFlags & 3;
+                const bool sparseBundleBitSet = bundleFlags & (1u << 6);
+                uint32_t msgSetSize = (bundleFlags >> 2) & 0xf;
+                uint64_t firstMsgSeqNum{baseSeqNum}, lastMsgSeqNum;
+                range_base<const uint8_t *, size_t> msgSetContent;
 
-                const auto size = cur.index.ondisk.span;
-                const auto *const all = reinterpret_cast<const index_record *>(cur.index.ondisk.data);
-                const auto *const e = all + size / sizeof(index_record);
-                const auto i = std::upper_bound_or_match(all, e, relSeqNum, [](const auto &a, const auto seqNum) {
-                        return TrivialCmp(seqNum, a.relSeqNum);
-                });
+                if (!msgSetSize)
+                        msgSetSize = Compression::UnpackUInt32(p);
 
-                if (i != e)
+                if (sparseBundleBitSet)
                 {
-                        if (trace)
-                                SLog("In ondisk index (relSeqNum:", i->relSeqNum, ", absPhysical:", i->absPhysical, ")\n");
+                        firstMsgSeqNum = *(uint64_t *)p;
+                        p += sizeof(uint64_t);
 
-                        res.absBaseSeqNum = cur.baseSeqNum + i->relSeqNum;
-                        res.fileOffset = i->absPhysical;
+                        if (msgSetSize != 1)
+                                lastMsgSeqNum = firstMsgSeqNum + Compression::UnpackUInt32(p) + 1;
+                        else
+                                lastMsgSeqNum = firstMsgSeqNum;
                 }
                 else
-                {
-                        res.absBaseSeqNum = cur.baseSeqNum;
-                        res.fileOffset = 0;
-                }
-
-                inSkiplist = false;
-        }
-
-        if (maxAbsSeqNum != UINT64_MAX)
-        {
-                index_record ref;
+                        lastMsgSeqNum = baseSeqNum + msgSetSize - 1;
 
-                if (inSkiplist)
+                if (codec)
                 {
-                        const auto it = std::upper_bound_or_match(skipList.begin(), skipList.end(), uint32_t(maxAbsSeqNum - cur.baseSeqNum), [](const auto &a, const auto seqNum) {
-                                return TrivialCmp(seqNum, a.first);
-                        });
+                        b.clear();
+                        if (!Compression::UnCompress(Compression::AlgoForCodec(codec), p, nextBundle - p, &b))
+                                throw Switch::data_error("Failed to decompress messages set");
 
-                        ref.relSeqNum = it->first;
-                        ref.absPhysical = it->second;
+                        msgSetContent.Set(reinterpret_cast<const uint8_t *>(b.data()), b.size());
                 }
                 else
+                        msgSetContent.Set(p, nextBundle - p);
+
+                uint64_t msgTs{0}, msgSeqNum{firstMsgSeqNum};
+                uint32_t msgIdx{0};
+
+                for (const auto *p = msgSetContent.offset, *const e = p + msgSetContent.len; p < e; ++msgIdx, ++msgSeqNum)
                 {
-                        const auto size = cur.index.ondisk.span;
-                        const auto *const all = reinterpret_cast<const index_record *>(cur.index.ondisk.data);
-                        const auto *const e = all + size / sizeof(index_record);
-                        const auto it = std::upper_bound_or_match(all, e, uint32_t(maxAbsSeqNum - cur.baseSeqNum), [](const auto &a, const uint32_t seqNum) {
-                                return TrivialCmp(seqNum, a.relSeqNum);
-                        });
+                        const auto flags = *p++;
 
-                        ref = *it;
-                }
+                        if (sparseBundleBitSet && msgIdx)
+                        {
+                                if (msgIdx == msgSetSize - 1)
+                                        msgSeqNum = lastMsgSeqNum;
+                                else if (!(flags & uint8_t(TankFlags::BundleMsgFlags::SeqNumPrevPlusOne)))
+                                        msgSeqNum += Compression::UnpackUInt32(p);
+                        }
 
-#if 0
-		res.fileOffsetCeiling = ref.absPhysical; 	// XXX: we actually need to set this to (it + 1).absPhysical so that we may not skip a bundle that includes
-								// both the highwater mark but also messages with seqnum < highwater mark
-#else
-                // Yes, incur some tiny I/O overhead so that we 'll properly cut-off the content
-                res.fileOffsetCeiling = search_before_offset(cur.baseSeqNum, maxSize, maxAbsSeqNum, cur.fdh->fd, cur.fileSize, ref.absPhysical);
-#endif
+                        if (!(flags & uint8_t(TankFlags::BundleMsgFlags::UseLastSpecifiedTS)))
+                        {
+                                msgTs = *(uint64_t *)p;
+                                p += sizeof(uint64_t);
+                        }
 
-                if (trace)
-                        SLog("maxAbsSeqNum = ", maxAbsSeqNum, " ", res.fileOffsetCeiling, "\n");
+                        if (flags & uint8_t(TankFlags::BundleMsgFlags::HaveKey))
+                                p += *p + sizeof(uint8_t);
+
+                        const auto msgLen = Compression::UnpackUInt32(p);
+
+                        p += msgLen;
+
+                        if (l(msgSeqNum, msgTs))
+                                return;
+                }
+
+                baseSeqNum = lastMsgSeqNum + 1;
+                p = nextBundle;
         }
-        else
-        {
-                res.fileOffsetCeiling = cur.fileSize;
+}
+
+// Scans the bundles of the segment log `fd` in [from, to) for the first message with timestamp >= ts, where `baseSeqNum`
+// is the sequence number of the first message of the bundle at `from`
+// Returns 0 if there is no such message
+static uint64_t search_ts(int fd, const uint32_t from, const uint32_t to, const uint64_t baseSeqNum, const uint64_t ts)
+{
+        uint64_t res{0};
+
+        if (trace)
+                SLog("Searching for ts ", ts, " in [", from, ", ", to, "), baseSeqNum = ", baseSeqNum, "\n");
+
+        scan_msgs(fd, from, to, baseSeqNum, [ts, &res](const uint64_t msgSeqNum, const uint64_t msgTs) {
+                if (msgTs < ts)
+                        return false;
 
                 if (trace)
-                        SLog("res.fileOffsetCeiling = ", res.fileOffsetCeiling, "\n");
-        }
+                        SLog("Found ", msgSeqNum, " (", msgTs, ")\n");
+
+                res = msgSeqNum;
+                return true;
+        });
 
-        res.highWatermark = highWatermark;
         return res;
 }
 
-template <typename T>
-struct PubSubQueue
+// Returns the max timestamp of all messages of the bundles of the segment log `fd` in [from, to)
+static uint64_t max_msg_ts(int fd, const uint32_t from, const uint32_t to)
 {
-        alignas(64 /* cache line size */) std::atomic<T *> list{nullptr};
-
-        void push_back(T *const v)
-        {
-                T *old;
+        uint64_t res{0};
 
-                do
-                {
-                        old = list.load(std::memory_order_relaxed);
-                        v->next = old;
-                } while (!list.compare_exchange_weak(old, v, std::memory_order_release, std::memory_order_relaxed));
-        }
+        scan_msgs(fd, from, to, 0, [&res](const uint64_t, const uint64_t msgTs) {
+                res = std::max(res, msgTs);
+                return false;
+        });
 
-        bool any() const
-        {
-                return list.load(std::memory_order_relaxed);
-        }
+        return res;
+}
 
-        inline T *drain()
+// Uses a segment's time index [all, all + n) to only search the bundles that may hold the first message with timestamp >= ts
+// If there is no time index(n == 0), the whole segment is searched; that's only the case for empty segments, or
+// current segments that have yet to grow past config.indexInterval
+static uint64_t segment_seqnum_for_ts(const time_index_record *const all, const uint32_t n, int fd, const uint32_t fileSize, const uint64_t baseSeqNum, const uint64_t ts)
+{
+        const auto *const e = all + n;
+        // All bundles before it[-1].absPhysical have first messages with timestamps < ts, and at least
+        // one bundle before it->absPhysical has a first message with timestamp >= ts
+        const auto it = std::lower_bound(all, e, ts, [](const auto &r, const uint64_t ts) {
+                return r.ts < ts;
+        });
+        // Records only track the first message of each bundle, so the last bundle before it[-1].absPhysical may still
+        // hold messages with timestamps >= ts; begin searching one record earlier so that we won't miss them
+        const auto from = it - all >= 2 ? it[-2].absPhysical : 0;
+        const auto fromSeqNum = it - all >= 2 ? baseSeqNum + it[-2].relSeqNum : baseSeqNum;
+        const auto to = it != e ? it->absPhysical : fileSize;
+
+        if (const auto seqNum = search_ts(fd, from, to, fromSeqNum, ts))
+                return seqNum;
+        else if (it != e)
         {
-                if (!list.load(std::memory_order_relaxed))
-                        return nullptr;
-                else
-                        return list.exchange(nullptr, std::memory_order_acquire);
+                // e.g if ts == 0 (there are no bundles before the first record), or if timestamps are not monotonic
+                // We only consider the bundles up to the next record, so that a lookup is always bounded
+                return search_ts(fd, it->absPhysical, it + 1 != e ? it[1].absPhysical : fileSize, baseSeqNum + it->relSeqNum, ts);
         }
-};
+        else
+                return 0;
+}
 
-// basic type-erasure for the callable of std::bind
-struct mainthread_closure
+// Returns the sequence number of the first message with timestamp >= ts, or committed_seqnum() + 1 if there is no such message
+// Timestamps are assigned by the producers; like Kafka, we assume they are (mostly) non-decreasing
+uint64_t topic_partition_log::seqnum_for_ts(const uint64_t ts)
 {
-        struct callable
+        // lock is expected to be locked
+        if (roSegments)
         {
-                virtual void invoke() = 0;
-                virtual ~callable()
+                for (const auto it : *roSegments)
                 {
+                        const auto n = it->timeIndex.size;
+
+                        if (n && it->timeIndex.data[n - 1].ts < ts)
+                        {
+                                // all messages in this segment are older; see time_index_record
+                                continue;
+                        }
+
+                        if (const auto seqNum = segment_seqnum_for_ts(it->timeIndex.data, n, it->fdh->fd, it->fileSize, it->baseSeqNum, ts))
+                                return seqNum;
                 }
-        };
+        }
 
-        template <typename T>
-        struct internal
-            : public callable
+        // cur.timeIndex.maxTS only tracks first messages, so it can't be used to skip the current segment
+        // The search is bounded by the last two records anyway
+        if (cur.fdh && cur.fileSize != UINT32_MAX)
         {
-                T v;
+                if (const auto seqNum = segment_seqnum_for_ts(cur.timeIndex.records.data(), committed_time_index_size(), cur.fdh->fd, committed_file_size(), cur.baseSeqNum, ts))
+                        return seqNum;
+        }
 
-                internal(T &&call)
-                    : v(std::move(call))
-                {
-                }
+        return committed_seqnum() + 1;
+}
 
-                virtual void invoke() override
-                {
-                        v();
-                }
-        };
+lookup_res topic_partition_log::read_cur(const uint64_t absSeqNum, const uint32_t maxSize, const uint64_t maxAbsSeqNum)
+{
+        // lock is expected to be locked
+        require(absSeqNum >= cur.baseSeqNum);
 
-        template <typename T>
-        mainthread_closure(T &&foo)
-            : L{new internal<T>(std::move(foo))}
+        if (cur.index.haveWideEntries)
         {
+                // need to use a different index encoding format
+                IMPLEMENT_ME();
         }
 
-        void operator()()
+        lookup_res res;
+        const auto highWatermark = committed_seqnum();
+        const auto fileSize = committed_file_size();
+
+        if (const auto n = committed_bundles_cnt())
         {
-                L->invoke();
+                res.fdh = cur.fdh;
+                res.highWatermark = highWatermark;
+
+                if (lookup_bundles(cur.bundles.data(), n, fileSize, absSeqNum, maxSize, maxAbsSeqNum, res))
+                        return res;
         }
 
-        mainthread_closure *next;
-        std::unique_ptr<callable> L;
-};
+        const auto relSeqNum = uint32_t(absSeqNum - cur.baseSeqNum);
+        const auto *const all = cur.index.data;
+        const auto *const e = all + committed_index_size();
+        const auto it = std::upper_bound_or_match(all, e, relSeqNum, [](const auto &a, const auto seqNum) {
+                return TrivialCmp(seqNum, a.relSeqNum);
+        });
 
-static PubSubQueue<mainthread_closure> mainThreadClosures;
+        res.fdh = cur.fdh;
+
+        if (it != e)
+        {
+                if (trace)
+                        SLog("In index (relSeqNum:", it->relSeqNum, ", absPhysical:", it->absPhysical, ")\n");
+
+                res.absBaseSeqNum = cur.baseSeqNum + it->relSeqNum;
+                res.fileOffset = it->absPhysical;
+        }
+        else
+        {
+                res.absBaseSeqNum = cur.baseSeqNum;
+                res.fileOffset = 0;
+        }
+
+        if (maxAbsSeqNum != UINT64_MAX)
+        {
+                const auto it = std::upper_bound_or_match(all, e, uint32_t(maxAbsSeqNum - cur.baseSeqNum), [](const auto &a, const uint32_t seqNum) {
+                        return TrivialCmp(seqNum, a.relSeqNum);
+                });
+                const index_record ref = it != e ? *it : index_record{0, 0};
+
+#if 0
+		res.fileOffsetCeiling = ref.absPhysical; 	// XXX: we actually need to set this to (it + 1).absPhysical so that we may not skip a bundle that includes
+								// both the highwater mark but also messages with seqnum < highwater mark
+#else
+                // Yes, incur some tiny I/O overhead so that we 'll properly cut-off the content
+                res.fileOffsetCeiling = search_before_offset(cur.baseSeqNum, maxSize, maxAbsSeqNum, cur.fdh->fd, fileSize, ref.absPhysical);
+#endif
+
+                if (trace)
+                        SLog("maxAbsSeqNum = ", maxAbsSeqNum, " ", res.fileOffsetCeiling, "\n");
+        }
+        else
+        {
+                res.fileOffsetCeiling = fileSize;
+
+                if (trace)
+                        SLog("res.fileOffsetCeiling = ", res.fileOffsetCeiling, "\n");
+        }
+
+        res.highWatermark = highWatermark;
+        return res;
+}
+
+static PubSubQueue<mainthread_closure> mainThreadClosures;
 
 template <typename F, typename... Arg>
 static void run_on_main_thread(F &&l, Arg &&... args)
@@ -591,749 +1506,912 @@ static void run_on_main_thread(F &&l, Arg &&... args)
         mainThreadClosures.push_back(new mainthread_closure(std::bind(l, std::forward<Arg>(args)...)));
 }
 
-static void compact_partition(topic_partition_log *const log, const char *const basePartitionPath, std::vector<ro_segment *> prevSegments)
+static bool range_is_resident(int, const range32_t);
+
+// Paces compaction reads and writes to compactionIOBudget bytes/sec across all compaction threads
+// The time spent waiting is tracked in compactionStats, and in compactionThrottledUs for the calling thread
+static void throttle_compaction_io(const size_t n)
 {
-        struct msg
+        static std::mutex lock;
+        static uint64_t nextAvailUs{0};
+        uint64_t waitUs;
+
+        if (!compactionIOBudget)
+                return;
+
         {
-                strwlen8_t key;
-                uint64_t seqNum;
-                uint64_t ts;
-                strwlen32_t content;
-        };
+                std::lock_guard<std::mutex> g(lock);
+                const auto now = Timings::Microseconds::Tick();
+
+                if (nextAvailUs < now)
+                        nextAvailUs = now;
+
+                waitUs = nextAvailUs - now;
+                nextAvailUs += n * 1000000 / compactionIOBudget;
+        }
 
+        if (waitUs)
+        {
+                compactionStats.throttledUs += waitUs;
+                compactionThrottledUs += waitUs;
+                std::this_thread::sleep_for(std::chrono::microseconds(waitUs));
+        }
+}
+
+// Invokes l(seqNum, ts, key, content) for every message of the complete bundles in [p, e), where msgSeqNum is the
+// sequence number of the first message of the first bundle(it's updated so that it can be used for the bundles that follow)
+// Message sets are decompressed one bundle at a time into `b`, so key and content are only valid until l() returns
+//
+// Returns the start of the first incomplete bundle, or e
+template <typename L>
+static const uint8_t *for_each_segment_msg(const uint8_t *p, const uint8_t *const e, uint64_t &msgSeqNum, IOBuffer &b, L &&l)
+{
         static constexpr bool trace{false};
-        uint64_t firstMsgSeqNum, lastMsgSeqNum, msgSeqNum;
+        uint64_t firstMsgSeqNum, lastMsgSeqNum;
         range_base<const uint8_t *, size_t> msgSetContent;
         strwlen8_t key;
-        strwlen32_t msgContent, msgValue;
-        bool anyDropped{false};
-        std::vector<std::unique_ptr<IOBuffer>> pool;
-        IOBuffer *cur{nullptr};
-        size_t base{0};
-        static constexpr uint64_t ptrBit{uint64_t(1) << (sizeof(uintptr_t) * 8 - 1)};
-
-        const auto compact = [&anyDropped](Switch::vector<msg> &msgs) {
-
-                std::sort(msgs.begin(), msgs.end(), [](const auto &a, const auto &b) {
-                        return a.key.Cmp(b.key) < 0;
-                });
 
-                auto *out = msgs.data();
+        while (p != e)
+        {
+                const auto bundleBase = p;
+                uint32_t bundleLen;
 
-                for (const auto *it = out, *const e = it + msgs.size(); it != e;)
-                {
-                        const auto k = it->key;
+                if (!Compression::TryUnpackUInt32(p, e, bundleLen))
+                        return bundleBase;
 
-                        if (!k)
-                        {
-                                do
-                                {
-                                        *out++ = *it;
-                                } while (++it != e && !it->key);
-                        }
-                        else
-                        {
-                                auto last = it->seqNum;
-                                auto sel = it;
+                const auto nextBundle = p + bundleLen;
 
-                                for (++it; it != e && it->key == k; ++it)
-                                {
-                                        if (it->seqNum > last)
-                                        {
-                                                last = it->seqNum;
-                                                sel = it;
-                                        }
-                                }
+                if (nextBundle > e)
+                        return bundleBase;
+                const auto bundleFlags = *p++;
+                const auto codec = bundleFlags & 3;
+                const bool sparseBundleBitSet = bundleFlags & (1u << 6);
+                uint32_t msgsSetSize = (bundleFlags >> 2) & 0xf;
 
-                                *out++ = *sel;
-                        }
-                }
+                if (!msgsSetSize)
+                        msgsSetSize = Compression::UnpackUInt32(p);
 
-                const auto n = out - msgs.data();
+                if (trace)
+                        SLog("New bundle msgSetSize = ", msgsSetSize, ", bundleFlags = ", bundleFlags, ", codec = ", codec, "\n");
 
-                if (n == msgs.size())
-                {
-                        if (!anyDropped)
-                        {
-                                // Nothing to do here, and no tombstones found, no compaction necessary
-                                return false;
-                        }
-                }
-                else
+                if (sparseBundleBitSet)
                 {
-                        // need to resize anyway
-                        msgs.resize(n);
+                        firstMsgSeqNum = *(uint64_t *)p;
+                        p += sizeof(uint64_t);
 
-                        std::sort(msgs.begin(), msgs.end(), [](const auto &a, const auto &b) {
-                                return a.seqNum < b.seqNum;
-                        });
+                        if (msgsSetSize != 1)
+                                lastMsgSeqNum = firstMsgSeqNum + Compression::UnpackUInt32(p) + 1;
+                        else
+                                lastMsgSeqNum = firstMsgSeqNum;
                 }
 
-                return true;
-        };
-
-        Switch::vector<msg> msgs;
-        std::vector<std::pair<void *, size_t>> vmas;
-
-        Defer(
-            {
-                    while (vmas.size())
-                    {
-                            auto it = vmas.back();
-
-                            madvise(it.first, it.second, MADV_DONTNEED);
-                            munmap(it.first, it.second);
-                            vmas.pop_back();
-                    }
-            });
-
-        if (trace)
-                SLog(prevSegments.size(), " segments\n");
-
-        for (auto it : prevSegments)
-        {
-                int fd = it->fdh->fd;
-                const auto fileSize = it->fileSize;
-                const auto baseSeqNum = it->baseSeqNum;
-                auto *const fileData = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+                if (codec)
+                {
+                        b.clear();
+                        if (!Compression::UnCompress(Compression::AlgoForCodec(codec), p, nextBundle - p, &b))
+                                throw Switch::system_error("failed to decompress message set");
 
-                if (fileData == MAP_FAILED)
-                        throw Switch::system_error("mmap() failed:", strerror(errno));
+                        msgSetContent.Set(reinterpret_cast<const uint8_t *>(b.data()), b.size());
+                }
+                else
+                        msgSetContent.Set(p, nextBundle - p);
 
-                vmas.push_back({fileData, fileSize});
+                p = nextBundle;
 
-                if (trace)
-                        SLog("baseSeqNum for segment ", baseSeqNum, "\n");
+                uint64_t msgTs{0};
+                uint32_t msgIdx{0};
 
-                msgSeqNum = baseSeqNum;
-                for (const auto *p = static_cast<const uint8_t *>(fileData), *const e = p + fileSize; p != e;)
+                for (const auto *p = msgSetContent.offset, *const e = p + msgSetContent.len; p != e; ++msgIdx, ++msgSeqNum)
                 {
-                        const auto bundleLen = Compression::UnpackUInt32(p);
-                        const auto nextBundle = p + bundleLen;
-                        const auto bundleFlags = *p++;
-                        const auto codec = bundleFlags & 3;
-                        const bool sparseBundleBitSet = bundleFlags & (1u << 6);
-                        uint32_t msgsSetSize = (bundleFlags >> 2) & 0xf;
-
-                        if (!msgsSetSize)
-                                msgsSetSize = Compression::UnpackUInt32(p);
-
-                        if (trace)
-                                SLog("New bundle msgSetSize = ", msgsSetSize, ", bundleFlags = ", bundleFlags, ", codec = ", codec, "\n");
+                        const auto flags = *p++;
 
                         if (sparseBundleBitSet)
                         {
-                                firstMsgSeqNum = *(uint64_t *)p;
-                                p += sizeof(uint64_t);
-
-                                if (msgsSetSize != 1)
+                                if (msgIdx == 0)
+                                        msgSeqNum = firstMsgSeqNum;
+                                else if (msgIdx == msgsSetSize - 1)
+                                        msgSeqNum = lastMsgSeqNum;
+                                else if (flags & uint8_t(TankFlags::BundleMsgFlags::SeqNumPrevPlusOne))
                                 {
-                                        lastMsgSeqNum = firstMsgSeqNum + Compression::UnpackUInt32(p) + 1;
+                                        // incremented in for()
                                 }
                                 else
                                 {
-                                        lastMsgSeqNum = firstMsgSeqNum;
+                                        // we encode delta from last - 1, but we already ++msgSeqNum in for()
+                                        msgSeqNum += Compression::UnpackUInt32(p);
                                 }
-
-                                if (trace)
-                                        SLog("sparse bundle (first ", firstMsgSeqNum, ", last ", lastMsgSeqNum, ")\n");
                         }
 
-                        if (codec)
+                        if (!(flags & uint8_t(TankFlags::BundleMsgFlags::UseLastSpecifiedTS)))
                         {
-                                if (!cur || cur->Reserved() > 64 * 1024 * 1024) // XXX: arbitrary
-                                {
-                                        const auto n = msgs.size();
-
-                                        while (base != n)
-                                        {
-                                                auto &it = msgs[base++];
-                                                const auto ptr = uintptr_t(it.content.p);
-                                                const auto to = ptr & (~ptrBit);
+                                msgTs = *(uint64_t *)p;
+                                p += sizeof(uint64_t);
+                        }
 
-                                                if (ptr != to)
-                                                        it.content.p = cur->At(to);
+                        if (flags & uint8_t(TankFlags::BundleMsgFlags::HaveKey))
+                        {
+                                key.Set((char *)p + 1, *p);
+                                p += key.len + sizeof(uint8_t);
+                        }
+                        else
+                                key.reset();
 
-                                                if (it.key)
-                                                {
-                                                        const auto ptr = uintptr_t(it.key.p);
-                                                        const auto to = ptr & (~ptrBit);
+                        const auto msgLen = Compression::UnpackUInt32(p);
 
-                                                        if (ptr != to)
-                                                                it.key.p = cur->At(to);
-                                                }
-                                        }
+                        l(msgSeqNum, msgTs, key, strwlen32_t((char *)p, msgLen));
+                        p += msgLen;
+                }
+        }
 
-                                        auto owner = std::make_unique<IOBuffer>();
+        return e;
+}
 
-                                        cur = owner.get();
-                                        pool.push_back(std::move(owner));
-                                }
+// Invokes l(p, e) for chunks of the ro segment `s`, where l() returns the start of the first incomplete bundle in [p, e), or
+// nullptr if no more chunks are needed. The incomplete bundle is carried over to the next chunk
+//
+// The segment is read in chunks, paced by throttle_compaction_io(). Chunks that were not in the page cache before we read them
+// are dropped from it afterwards, so that compactions won't evict the pages of hot segments in favor of pages no one else needs
+template <typename L>
+static void for_each_segment_chunk(const ro_segment *const s, L &&l)
+{
+        static constexpr size_t chunkSize{1024 * 1024};
+        const auto fileSize = s->fileSize;
+        int fd = s->fdh->fd;
+        size_t capacity{chunkSize}, have{0};
+        auto buf = std::make_unique<uint8_t[]>(capacity);
 
-                                const auto len = cur->size();
+        posix_fadvise(fd, 0, fileSize, POSIX_FADV_SEQUENTIAL);
 
-                                if (!Compression::UnCompress(Compression::Algo::SNAPPY, p, nextBundle - p, cur))
-                                        throw Switch::system_error("failed to decompress message set");
+        for (uint32_t offset{0}; offset != fileSize;)
+        {
+                const auto n = std::min<size_t>(capacity - have, fileSize - offset);
+                const bool resident = range_is_resident(fd, {offset, uint32_t(n)});
 
-                                msgSetContent.Set(reinterpret_cast<const uint8_t *>(cur->at(len)), cur->size() - len);
-                        }
-                        else
-                        {
-                                msgSetContent.Set(p, nextBundle - p);
-                        }
+                throttle_compaction_io(n);
 
-                        p = nextBundle;
+                if (pread64(fd, buf.get() + have, n, offset) != n)
+                        throw Switch::system_error("pread64() failed:", strerror(errno));
 
-                        uint64_t msgTs{0};
-                        uint32_t msgIdx{0};
-                        const auto *const ptrBase = cur ? cur->data() : nullptr;
+                if (!resident)
+                        posix_fadvise(fd, offset, n, POSIX_FADV_DONTNEED);
 
-                        if (trace)
-                                SLog("Parsing Message Set\n");
+                compactionStats.bytesRead += n;
+                offset += n;
+                have += n;
 
-                        for (const auto *p = msgSetContent.offset, *const e = p + msgSetContent.len; p != e; ++msgIdx, ++msgSeqNum)
-                        {
-                                const auto flags = *p++;
+                const uint8_t *const end = l(static_cast<const uint8_t *>(buf.get()), static_cast<const uint8_t *>(buf.get() + have));
 
-                                if (trace)
-                                        SLog("Message ", msgIdx, ", flags ", flags, "\n");
+                if (!end)
+                        return;
 
-                                if (sparseBundleBitSet)
-                                {
-                                        if (msgIdx == 0)
-                                                msgSeqNum = firstMsgSeqNum;
-                                        else if (msgIdx == msgsSetSize - 1)
-                                                msgSeqNum = lastMsgSeqNum;
-                                        else if (flags & uint8_t(TankFlags::BundleMsgFlags::SeqNumPrevPlusOne))
-                                        {
-                                                // incremented in for()
-                                                if (trace)
-                                                        SLog("SeqNumPrevPlusOne set\n");
-                                        }
-                                        else
-                                        {
-                                                // we encode delta from last - 1, but we already ++msgSeqNum in for()
-                                                msgSeqNum += Compression::UnpackUInt32(p);
+                const size_t consumed = end - buf.get();
 
-                                                if (trace)
-                                                        SLog("Adjusting delta\n");
-                                        }
-                                }
+                have -= consumed;
+                if (!consumed && have == capacity)
+                {
+                        // bundle larger than the buffer
+                        auto newBuf = std::make_unique<uint8_t[]>(capacity * 2);
 
-                                if (trace)
-                                        SLog("SeqNum = ", msgSeqNum, "\n");
+                        memcpy(newBuf.get(), buf.get(), have);
+                        buf = std::move(newBuf);
+                        capacity *= 2;
+                }
+                else if (have)
+                        memmove(buf.get(), end, have);
+        }
 
-                                if (!(flags & uint8_t(TankFlags::BundleMsgFlags::UseLastSpecifiedTS)))
-                                {
-                                        msgTs = *(uint64_t *)p;
-                                        p += sizeof(uint64_t);
-                                }
+        if (have)
+                throw Switch::data_error("Unexpected end of segment");
+}
 
-                                if (flags & uint8_t(TankFlags::BundleMsgFlags::HaveKey))
-                                {
-                                        key.Set((char *)p + 1, *p);
-                                        p += key.len + sizeof(uint8_t);
+// Invokes l(seqNum, ts, key, content) for every message of the ro segment `s`; see for_each_segment_chunk()
+template <typename L>
+static void for_each_segment_msg(const ro_segment *const s, IOBuffer &b, L &&l)
+{
+        uint64_t msgSeqNum{s->baseSeqNum};
 
-                                        if (trace)
-                                                SLog("MSG ", msgSeqNum, ", key [", key, "] ", Date::ts_repr(Timings::Milliseconds::ToSeconds(msgTs)), "\n");
+        for_each_segment_chunk(s, [&](const uint8_t *const p, const uint8_t *const e) {
+                return for_each_segment_msg(p, e, msgSeqNum, b, l);
+        });
+}
 
-                                        if (codec)
-                                                key.p = (char *)uintptr_t(key.p - ptrBase);
-                                }
-                                else
-                                {
-                                        key.reset();
-                                }
+// Messages staged by compact_partition() and recompress_segment() until there are enough of them for a bundle; see encode_bundle()
+struct staged_bundle
+{
+        struct msg
+        {
+                uint64_t seqNum;
+                uint64_t ts;
+                uint32_t keyOffset;
+                uint8_t keyLen;
+                uint32_t contentOffset;
+                uint32_t contentLen;
+        };
 
-                                const auto msgLen = Compression::UnpackUInt32(p);
+        Switch::vector<msg> msgs;
+        // The keys and contents of msgs
+        IOBuffer content;
+        size_t sum{0};
 
-                                if (msgLen || !key)
-                                {
-                                        msgValue.Set((char *)p, msgLen);
-                                        p += msgLen;
+        void push_back(const uint64_t seqNum, const uint64_t ts, const strwlen8_t key, const strwlen32_t data)
+        {
+                const auto keyOffset = content.size();
 
-                                        if (trace)
-                                                SLog("value [", msgValue, "]\n");
+                content.Serialize(key.p, key.len);
 
-                                        if (codec)
-                                                msgValue.p = (char *)uintptr_t(msgValue.p - ptrBase);
+                const auto contentOffset = content.size();
 
-                                        msgs.push_back({key, msgSeqNum, msgTs, msgValue});
-                                }
-                                else
-                                {
-                                        // Drop deleted messages(messages with a key and no content)
-                                        anyDropped = true;
-                                }
-                        }
-                }
+                content.Serialize(data.p, data.len);
+                msgs.push_back({seqNum, ts, uint32_t(keyOffset), key.len, uint32_t(contentOffset), data.len});
+                sum += key.len + data.len + 8;
         }
 
-        if (cur)
+        void clear()
         {
-                const auto n = msgs.size();
-
-                while (base != n)
-                {
-                        auto &it = msgs[base++];
-                        const auto ptr = uintptr_t(it.content.p);
-                        const auto to = ptr & (~ptrBit);
+                msgs.clear();
+                content.clear();
+                sum = 0;
+        }
+};
 
-                        if (ptr != to)
-                                it.content.p = cur->At(to);
+// Appends the bundle of the messages staged in `b` to out; its header, followed by its message set, the offset of which in out is returned
+// The bundle is sparse unless its messages are consecutive, starting from expected, which is advanced past its last message
+// It's up to the caller to compress the message set, in which case the codec needs to be set in the header's first byte; see Compression::CodecForAlgo()
+static uint32_t encode_bundle(const staged_bundle &b, uint64_t &expected, IOBuffer &out)
+{
+        const uint32_t msgSetSize = b.msgs.size();
+        const auto *const all = b.msgs.data();
+        bool asSparse{false};
+        uint8_t bundleFlags;
+        uint64_t lastTS{0};
 
-                        if (it.key)
-                        {
-                                const auto ptr = uintptr_t(it.key.p);
-                                const auto to = ptr & (~ptrBit);
+        for (uint32_t k{0}; k != msgSetSize; ++k)
+        {
+                if (all[k].seqNum != expected)
+                        asSparse = true;
 
-                                if (ptr != to)
-                                        it.key.p = cur->At(to);
-                        }
-                }
+                expected = all[k].seqNum + 1;
         }
 
-        if (!compact(msgs))
-        {
-#if 1
-                if (trace)
-                        SLog("No need for compaction\n");
+        bundleFlags = asSparse ? (1u << 6) : 0;
 
-                run_on_main_thread([log]() {
-                        log->compacting = false;
-                        Print("Did not need to compact log\n");
-                });
+        if (msgSetSize < 16)
+        {
+                bundleFlags |= (msgSetSize << 2);
+                out.Serialize(bundleFlags);
+        }
+        else
+        {
+                out.Serialize(bundleFlags);
+                out.SerializeVarUInt32(msgSetSize);
+        }
 
-                return;
-#else
-                Print("ENABLE AGAIN\n");
+        if (asSparse)
+        {
+                const auto first = all[0].seqNum, last = all[msgSetSize - 1].seqNum;
 
-                std::sort(msgs.begin(), msgs.end(), [](const auto &a, const auto &b) {
-                        return a.seqNum < b.seqNum;
-                });
-#endif
+                out.Serialize<uint64_t>(first);
+                if (msgSetSize != 1)
+                        out.SerializeVarUInt32(last - first - 1);
         }
 
-        if (trace)
+        const uint32_t msgSetOffset = out.size();
+
+        for (uint32_t k{0}; k != msgSetSize; ++k)
         {
-                for (const auto &it : msgs)
-                        Print(it.seqNum, " [", it.key, "] [", it.content, "]\n");
-        }
+                const auto &m = all[k];
+                uint8_t msgFlags = m.keyLen ? uint8_t(TankFlags::BundleMsgFlags::HaveKey) : uint8_t(0);
+                bool encodeTS, encodeSparseDelta;
 
-        // go through all segments, rebuild each of them by keeping only the messages that existed in that segment (we can just use a range check for first available, last assigned)
-        // but if after compaction a segment's too small (in terms of file size), then include into it messages from successive segments, and in that case
-        // use the last segment's timestamp that is to be encoded in the filename
-        static constexpr size_t sinceLastUpdateBytesThreshold{10000}, sinceLastUpdateMsgsCntThreshold{128}, maxBundleMsgsSetSize{5}, maxBundleMsgsSetSizeBytes{65536}; // XXX: arbitrary
-        static constexpr size_t minSegmentLogFileSize{64 * 1024};                                                                                                      // XXX: arbitrary
-        std::vector<ro_segment *> newSegments;
-        int fd;
-        char logPath[PATH_MAX];
-        const auto n = msgs.size();
-        const auto *const all = msgs.data();
-        IOBuffer out, cbuf, index;
-        struct iovec iov[1024];
-        uint32_t iovLen{0};
-        const auto flush = [&iovLen, &iov, &out, &cbuf, &fd]() {
-                for (uint32_t i{0}; i != iovLen; ++i)
+                if (asSparse && k && k != msgSetSize - 1)
                 {
-                        auto &it = iov[i];
-                        auto ptr = uintptr_t(it.iov_base);
-
-                        if (ptr & (1u << 31))
+                        if (m.seqNum == all[k - 1].seqNum + 1)
                         {
-                                ptr &= ~(1u << 31);
-                                it.iov_base = out.At(ptr);
+                                msgFlags |= uint8_t(TankFlags::BundleMsgFlags::SeqNumPrevPlusOne);
+                                encodeSparseDelta = false;
                         }
                         else
-                        {
-                                ptr &= ~(1u << 30);
-                                it.iov_base = cbuf.At(ptr);
-                        }
+                                encodeSparseDelta = true;
                 }
+                else
+                        encodeSparseDelta = false;
 
-                if (trace)
-                        SLog("Flushing ", iovLen, "\n");
-
-                const auto r = writev(fd, iov, iovLen);
-
-                if (unlikely(r == -1))
-                        throw Switch::system_error("writev() failed:", strerror(errno));
+                if (m.ts == lastTS && k)
+                {
+                        msgFlags |= uint8_t(TankFlags::BundleMsgFlags::UseLastSpecifiedTS);
+                        encodeTS = false;
+                }
+                else
+                {
+                        lastTS = m.ts;
+                        encodeTS = true;
+                }
 
-                out.clear();
-                cbuf.clear();
-                iovLen = 0;
-        };
+                out.Serialize(msgFlags);
 
-        try
-        {
-                const char *destPartitionPath;
-                uint32_t curSegmentIdx{0};
+                if (encodeSparseDelta)
+                        out.SerializeVarUInt32(m.seqNum - all[k - 1].seqNum - 1);
 
-#if 0
-                if (getenv("FOOOOO"))
-                        destPartitionPath = "/tmp/foo/0/";
-                else
-		{
-                        destPartitionPath = "/tmp/tankREPO/msgs/0/";
-		}
-#else
-                destPartitionPath = basePartitionPath;
-#endif
+                if (encodeTS)
+                        out.Serialize<uint64_t>(m.ts);
 
-                // Process all collected messages, pack into segments
-                for (uint32_t i{0}; i != n;)
+                if (m.keyLen)
                 {
-                        uint8_t bundleFlags;
-                        size_t outFileSize{0};
-                        size_t sinceLastUpdateBytes{UINT32_MAX}, sinceLastUpdateMsgsCnt{UINT32_MAX};
-                        auto curSegment = prevSegments[curSegmentIdx];
-                        const auto baseSeqNum{all[i].seqNum};
-                        auto curSegmentLastAvailSeqNum = curSegment->lastAvailSeqNum;
-                        index_record indexLastRecorded;
-                        auto expected = all[i].seqNum;
-
-                        if (trace)
-                                SLog(ansifmt::bold, ansifmt::color_blue, "Now processing segment ", curSegmentIdx, "/", prevSegments.size(), " (", baseSeqNum, ", ", curSegment->lastAvailSeqNum, ")", ansifmt::reset, "\n");
+                        out.Serialize(m.keyLen);
+                        out.Serialize(b.content.At(m.keyOffset), m.keyLen);
+                }
 
-                        // new segment
-                        index.clear();
-                        out.clear();
-                        cbuf.clear();
-                        iovLen = 0;
+                out.SerializeVarUInt32(m.contentLen);
+                out.Serialize(b.content.At(m.contentOffset), m.contentLen);
+        }
 
-                        Snprint(logPath, sizeof(logPath), destPartitionPath, baseSeqNum, "-", 0, "_", 0, ".ilog.cleaned");
-                        fd = open(logPath, O_RDWR | O_CREAT | O_LARGEFILE | O_TRUNC, 0775);
-                        require(fd != -1);
+        return msgSetOffset;
+}
 
-                        Defer({
-                                if (fd != -1)
-                                        close(fd);
-                        });
+// Compaction is incremental. The partition's ro segments are split into the clean head(segments with messages up to
+// log->lastCleanupMaxSeqNum, which were produced by a previous compaction) and the dirty tail.
+// The partition's key map(.compaction.keys) holds the sequence number of the message of each key in the clean head; see
+// compaction_keys_header.
+//
+// 1. A map of key => latest sequence number of a message with that key is built from the dirty tail segments(as many as the memory budget
+// allows for; segments past the budget will be considered in a later compaction)
+// 2. That map is merged with the key map of the clean head, which is streamed from disk, and a new key map is persisted. Any clean head segment
+// that contains a message superseded by a message in the dirty tail is marked for rewrite
+// 3. Only segments that contain superseded messages or tombstones(messages with a key and no content) are rewritten, retaining only messages
+// without a key and the latest message of each key, unless it's a tombstone
+//
+// Only the map, one decompressed bundle, and the output segment's pending writes are held in memory, so that compacting large partitions
+// won't require memory proportional to their size, and the cost of compaction is proportional to the dirty tail's size.
+// If the key map is missing or doesn't match lastCleanupMaxSeqNum(e.g the broker crashed before it had a chance to persist it), all segments are
+// considered dirty.
+static void compact_partition(topic_partition_log *const log, const char *const basePartitionPath, std::vector<ro_segment *> prevSegments, uint64_t firstDirtyOffset, const uint64_t memBudget)
+{
+        struct latest_msg
+        {
+                uint64_t seqNum;
+                bool tombstone;
+        };
 
-                        for (;;)
-                        {
-                                // new bundle
-                                const auto base{i};
-                                const auto upto = Min<size_t>(n, i + maxBundleMsgsSetSize);
-                                bool asSparse{false};
-                                size_t sum{0};
+        static constexpr bool trace{false};
+        Switch::unordered_map<strwlen8_t, latest_msg> latest;
+        simple_allocator keysAllocator{512 * 1024};
+        IOBuffer b;
+        const auto map_footprint = [&]() {
+                return keysAllocator.footprint() + latest.size() * (sizeof(std::pair<const strwlen8_t, latest_msg>) + sizeof(void *) * 2) + latest.bucket_count() * sizeof(void *);
+        };
+        // Returns the index in prevSegments[] of the segment that holds seqNum
+        const auto segment_of = [&prevSegments](const uint64_t seqNum) {
+                return std::upper_bound(prevSegments.begin(), prevSegments.end(), seqNum, [](const uint64_t seqNum, const ro_segment *const s) {
+                               return seqNum < s->baseSeqNum;
+                       }) -
+                       prevSegments.begin() - 1;
+        };
+        const auto keysPath = Buffer::build(basePartitionPath, "/.compaction.keys");
+        const auto newKeysPath = Buffer::build(basePartitionPath, "/.compaction.keys.int");
+        uint32_t headCnt{0};
+        const auto throttledBefore = compactionThrottledUs;
+        void *keysData{nullptr};
+        size_t keysFileSize{0};
 
-                                do
-                                {
-                                        const auto n = all[i].seqNum;
+        if (trace)
+                SLog(prevSegments.size(), " segments, firstDirtyOffset = ", firstDirtyOffset, "\n");
 
-                                        if (n != expected)
-                                                asSparse = true;
+        while (headCnt != prevSegments.size() && prevSegments[headCnt]->lastAvailSeqNum < firstDirtyOffset)
+                ++headCnt;
 
-                                        if (trace)
-                                                SLog("consider ", i, " ", all[i].seqNum, "\n");
+        if (headCnt)
+        {
+                int fd = open(keysPath.data(), O_RDONLY | O_LARGEFILE | O_NOATIME);
+                compaction_keys_header hdr;
 
-                                        expected = n + 1;
-                                        sum += all[i].key.len + all[i].content.len + 8;
-                                } while (++i != upto && sum < maxBundleMsgsSetSizeBytes && all[i].seqNum <= curSegmentLastAvailSeqNum);
+                if (fd != -1)
+                {
+                        keysFileSize = lseek64(fd, 0, SEEK_END);
 
-                                if (trace)
-                                        SLog("expected = ", expected, ", asSparse = ", asSparse, "\n");
+                        if (keysFileSize >= sizeof(hdr) && pread64(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) && hdr.cleanMaxSeqNum == firstDirtyOffset - 1)
+                        {
+                                keysData = mmap(nullptr, keysFileSize, PROT_READ, MAP_SHARED, fd, 0);
 
-                                if (sinceLastUpdateBytes > sinceLastUpdateBytesThreshold || sinceLastUpdateMsgsCnt > sinceLastUpdateMsgsCntThreshold)
-                                {
-                                        // TODO: if (all[base].seqNum - baseSeqNum > threshold, need to
-                                        // switch to wide-entries index
-                                        indexLastRecorded.relSeqNum = all[base].seqNum - baseSeqNum;
-                                        indexLastRecorded.absPhysical = outFileSize;
-
-                                        index.Serialize<uint32_t>(indexLastRecorded.relSeqNum);
-                                        index.Serialize<uint32_t>(indexLastRecorded.absPhysical);
-                                        sinceLastUpdateBytes = 0;
-                                        sinceLastUpdateMsgsCnt = 0;
-                                }
+                                if (keysData == MAP_FAILED)
+                                        keysData = nullptr;
+                                else
+                                        madvise(keysData, keysFileSize, MADV_SEQUENTIAL);
+                        }
 
-                                const uint32_t msgSetSize = i - base;
-                                const auto bundleHeaderFlagsOffset = out.size();
-                                const auto bundleLengthIOVIdx = iovLen++;
+                        close(fd);
+                }
 
-                                out.reserve(sum + 1024);
-                                if (asSparse)
-                                {
-                                        bundleFlags = (1u << 6);
+                if (!keysData)
+                {
+                        if (trace)
+                                SLog("Key map not available, will consider all segments\n");
 
-                                        if (msgSetSize < 16)
-                                        {
-                                                bundleFlags |= (msgSetSize << 2);
-                                                out.Serialize(bundleFlags);
-                                        }
-                                        else
-                                        {
-                                                out.Serialize(bundleFlags);
-                                                out.SerializeVarUInt32(msgSetSize);
-                                        }
+                        headCnt = 0;
+                }
+        }
 
-                                        const auto first = all[base].seqNum, last = all[i - 1].seqNum;
+        Defer({
+                if (keysData)
+                        munmap(keysData, keysFileSize);
+        });
 
-                                        if (trace)
-                                                SLog("Sparse bundle first = ", first, ", last = ", last, ", set size = ", msgSetSize, "\n");
+        if (headCnt == prevSegments.size())
+        {
+                run_on_main_thread([log]() {
+                        std::lock_guard<Switch::mutex> g(log->partition->lock);
 
-                                        out.Serialize<uint64_t>(first);
-                                        if (msgSetSize != 1)
-                                                out.SerializeVarUInt32(last - first - 1);
-                                }
-                                else
-                                {
-                                        bundleFlags = 0;
+                        log->compacting = false;
+                        Print("Did not need to compact log\n");
+                        log->consider_pending_recompressions();
+                });
 
-                                        if (msgSetSize < 16)
-                                        {
-                                                bundleFlags |= (msgSetSize << 2);
-                                                out.Serialize(bundleFlags);
-                                        }
-                                        else
-                                        {
-                                                out.Serialize(bundleFlags);
-                                                out.SerializeVarUInt32(msgSetSize);
-                                        }
-                                }
+                return;
+        }
 
-                                const auto savedOutFileSize = outFileSize;
-                                const auto bundleHeaderLength = out.size() - bundleHeaderFlagsOffset;
-                                uint64_t lastTS{0};
-                                const auto msgSetOffset = out.size();
+        std::vector<bool> dirty(prevSegments.size(), false);
 
-                                sinceLastUpdateMsgsCnt += msgSetSize;
-                                outFileSize += bundleHeaderLength;
+        // Pass 1: key => latest sequence number, for the dirty tail segments
+        {
+                auto i = headCnt;
 
-                                iov[iovLen++] = {(void *)uintptr_t(bundleHeaderFlagsOffset | (1u << 31)), bundleHeaderLength};
+                do
+                {
+                        for_each_segment_msg(prevSegments[i], b, [&](const uint64_t seqNum, const uint64_t ts, const strwlen8_t key, const strwlen32_t content) {
+                                if (!key)
+                                        return;
 
-                                if (trace)
-                                        SLog("Encoding Messages Set asSparse = ", asSparse, "\n");
+                                auto it = latest.find(key);
 
-                                for (uint32_t k{base}; k != i; ++k)
+                                if (!content)
                                 {
-                                        const auto &m = all[k];
-                                        uint8_t msgFlags = m.key ? uint8_t(TankFlags::BundleMsgFlags::HaveKey) : uint8_t(0);
-                                        bool encodeTS, encodeSparseDelta;
+                                        // Tombstone; it's dropped along with all previous messages with the same key
+                                        dirty[i] = true;
+                                }
 
-                                        if (asSparse && k != base && k != i - 1)
-                                        {
-                                                if (m.seqNum == all[k - 1].seqNum + 1)
-                                                {
-                                                        msgFlags |= uint8_t(TankFlags::BundleMsgFlags::SeqNumPrevPlusOne);
-                                                        encodeSparseDelta = false;
-                                                }
-                                                else
-                                                        encodeSparseDelta = true;
-                                        }
-                                        else
-                                        {
-                                                encodeSparseDelta = false;
-                                        }
+                                if (it == latest.end())
+                                        latest.insert({strwlen8_t(keysAllocator.CopyOf(key.p, key.len), key.len), {seqNum, !content}});
+                                else
+                                {
+                                        dirty[segment_of(it->second.seqNum)] = true;
+                                        it->second = {seqNum, !content};
+                                }
+                        });
+                } while (++i != prevSegments.size() && map_footprint() < memBudget);
 
-                                        if (trace)
-                                                SLog("message ", k - base, " ", m.seqNum, ", asSparse = ", asSparse, ", encodeSparseDelta = ", encodeSparseDelta, "\n");
+                if (i != prevSegments.size())
+                {
+                        if (trace)
+                                SLog("Memory budget exceeded; will compact up to ", i, "/", prevSegments.size(), " segments\n");
 
-                                        if (m.ts == lastTS && k != base)
-                                        {
-                                                msgFlags |= uint8_t(TankFlags::BundleMsgFlags::UseLastSpecifiedTS);
-                                                encodeTS = false;
-                                        }
-                                        else
-                                        {
-                                                lastTS = m.ts;
-                                                encodeTS = true;
-                                        }
+                        prevSegments.resize(i);
+                        dirty.resize(i);
+                }
+        }
 
-                                        out.Serialize(msgFlags);
+        const auto cleanMaxSeqNum = prevSegments.back()->lastAvailSeqNum;
+        int keysFd = open(newKeysPath.data(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0775);
 
-                                        if (encodeSparseDelta)
-                                        {
-                                                out.SerializeVarUInt32(m.seqNum - all[k - 1].seqNum - 1);
-                                                if (trace)
-                                                        SLog("Serializing delta ", m.seqNum - all[k - 1].seqNum - 1, "\n");
-                                        }
+        if (keysFd == -1)
+                throw Switch::system_error("Failed to create key map:", strerror(errno));
 
-                                        if (encodeTS)
-                                        {
-                                                out.Serialize<uint64_t>(m.ts);
-                                        }
+        Defer({
+                if (keysFd != -1)
+                        close(keysFd);
+        });
 
-                                        if (m.key)
-                                        {
-                                                out.Serialize(m.key.len);
-                                                out.Serialize(m.key.p, m.key.len);
-                                        }
+        // Pass 2: merge the map with the clean head's key map
+        //
+        // Key map records are sorted by key, so that this is a streaming merge
+        {
+                std::vector<std::pair<strwlen8_t, latest_msg>> sorted;
+                IOBuffer kb;
+                const compaction_keys_header hdr{cleanMaxSeqNum};
+                const auto persist = [&](const strwlen8_t key, const uint64_t seqNum) {
+                        kb.Serialize(key.len);
+                        kb.Serialize(key.p, key.len);
+                        kb.Serialize<uint64_t>(seqNum);
+
+                        if (kb.size() > 4 * 1024 * 1024)
+                        {
+                                if (write(keysFd, kb.data(), kb.size()) != kb.size())
+                                        throw Switch::system_error("Failed to persist key map:", strerror(errno));
 
-                                        out.SerializeVarUInt32(m.content.len);
-                                        out.Serialize(m.content.p, m.content.len);
-                                }
+                                kb.clear();
+                        }
+                };
 
-                                const auto msgSetLen = out.size() - msgSetOffset;
+                sorted.reserve(latest.size());
+                for (const auto &it : latest)
+                        sorted.push_back(it);
 
-                                if (trace)
-                                        SLog("msgSetLen = ", msgSetLen, ", bundleFlags = ", bundleFlags, "\n");
+                std::sort(sorted.begin(), sorted.end(), [](const auto &a, const auto &b) {
+                        return a.first.Cmp(b.first) < 0;
+                });
 
-                                if (msgSetLen > 1024) // XXX: arbitrary
-                                {
-                                        const auto offset = cbuf.size();
+                kb.Serialize(&hdr, sizeof(hdr));
 
-                                        if (!Compression::Compress(Compression::Algo::SNAPPY, out.At(msgSetOffset), msgSetLen, &cbuf))
-                                                throw Switch::system_error("Compression failed");
+                const auto *p = keysData ? static_cast<const uint8_t *>(keysData) + sizeof(hdr) : nullptr;
+                const auto *const e = keysData ? static_cast<const uint8_t *>(keysData) + keysFileSize : nullptr;
 
-                                        const auto span = cbuf.size() - offset;
+                for (auto it = sorted.begin(); p != e || it != sorted.end();)
+                {
+                        strwlen8_t key;
+                        uint64_t seqNum;
+                        int r;
 
-                                        if (span >= msgSetLen)
-                                        {
-                                                // not worth it
-                                                if (trace)
-                                                        SLog("Not worth compressing bundle msgs set\n");
+                        if (p != e)
+                        {
+                                key.Set((char *)p + 1, *p);
+                                seqNum = *(uint64_t *)(p + sizeof(uint8_t) + key.len);
+                                r = it == sorted.end() ? -1 : key.Cmp(it->first);
+                        }
+                        else
+                                r = 1;
 
-                                                cbuf.resize(offset);
-                                                goto l10;
-                                        }
-                                        else
-                                        {
-                                                iov[iovLen++] = {(void *)uintptr_t(offset | (1u << 30)), span};
-                                                out.resize(msgSetOffset);
+                        if (r <= 0)
+                        {
+                                p += sizeof(uint8_t) + key.len + sizeof(uint64_t);
 
-                                                *(uint8_t *)out.At(bundleHeaderFlagsOffset) |= 1; // set codec
-                                                outFileSize += span;
+                                if (r == 0)
+                                {
+                                        // superseded by a message in the dirty tail
+                                        const auto idx = segment_of(seqNum);
 
-                                                if (trace)
-                                                        SLog(">> Compressed ", msgSetLen, " ", span, "\n");
-                                        }
+                                        if (idx >= 0)
+                                                dirty[idx] = true;
                                 }
                                 else
                                 {
-                                l10:
-                                        iov[iovLen++] = {(void *)uintptr_t(msgSetOffset | (1u << 31)), msgSetLen};
-                                        outFileSize += msgSetLen;
+                                        persist(key, seqNum);
+                                        continue;
                                 }
+                        }
 
-                                const auto bundleLength = outFileSize - savedOutFileSize;
-                                const auto _l = out.size();
+                        if (!it->second.tombstone)
+                                persist(it->first, it->second.seqNum);
 
-                                out.SerializeVarUInt32(bundleLength);
-                                const auto bundleLengthReprLen = out.size() - _l;
-                                iov[bundleLengthIOVIdx] = {(void *)uintptr_t(_l | (1u << 31)), bundleLengthReprLen};
+                        ++it;
+                }
 
-                                outFileSize += bundleLengthReprLen;
+                if (write(keysFd, kb.data(), kb.size()) != kb.size())
+                        throw Switch::system_error("Failed to persist key map:", strerror(errno));
 
-                                sinceLastUpdateBytes += bundleLength;
-                                if (iovLen > sizeof_array(iov) - 16)
-                                        flush();
+                fdatasync(keysFd);
+                posix_fadvise(keysFd, 0, 0, POSIX_FADV_DONTNEED);
+                close(keysFd);
+                keysFd = -1;
+        }
 
-                                if (i == n)
-                                {
-                                        // done and done
-                                        break;
-                                }
-                                else if (all[i].seqNum > curSegmentLastAvailSeqNum)
-                                {
-                                        if (trace)
-                                                SLog("Consumed current segment ", curSegmentIdx, "\n");
+        // Pass 3: rewrite the segments that contain superseded messages or tombstones
+        //
+        // Retained messages are staged into bundles, which never span input segments. If an output segment is too small(in terms of file size)
+        // when an input segment has been consumed, messages from successive segments are appended to it, in which case we
+        // use the last segment's timestamp that is to be encoded in the filename
+        static constexpr size_t sinceLastUpdateBytesThreshold{10000}, sinceLastUpdateMsgsCntThreshold{128}, maxBundleMsgsSetSize{5}, maxBundleMsgsSetSizeBytes{65536}; // XXX: arbitrary
+        static constexpr size_t minSegmentLogFileSize{64 * 1024};                                                                                                      // XXX: arbitrary
+        std::vector<ro_segment *> newSegments, rewritten;
+        // (inputs, outputs) of each run of consecutive rewritten segments, i.e ranges in prevSegments[] and newSegments[]
+        std::vector<std::pair<range32_t, range32_t>> runs;
+        int fd{-1};
+        char logPath[PATH_MAX];
+        IOBuffer out, cbuf, index;
+        staged_bundle staged;
+        struct iovec iov[1024];
+        uint32_t iovLen{0};
+        const char *const destPartitionPath = basePartitionPath;
+        // Compacted bundles are small, so a topic's trained dictionary is used whenever we are compressing with Zstd
+        const uint32_t compactionDictId = log->config.compactionCodec == Compression::Algo::ZSTD && log->partition && log->partition->owner ? log->partition->owner->compressionDictId.load(std::memory_order_relaxed) : 0;
+        uint64_t baseSeqNum, lastAvailSeqNum, expected;
+        size_t outFileSize, sinceLastUpdateBytes, sinceLastUpdateMsgsCnt;
+        index_record indexLastRecorded;
+        uint32_t createdTS{0};
+        const auto flush = [&iovLen, &iov, &out, &cbuf, &fd]() {
+                for (uint32_t i{0}; i != iovLen; ++i)
+                {
+                        auto &it = iov[i];
+                        auto ptr = uintptr_t(it.iov_base);
 
-                                        ++curSegmentIdx;
-                                        if (outFileSize > minSegmentLogFileSize)
-                                        {
-                                                // we got enough messages for this segment
-                                                break;
-                                        }
-                                        else
-                                        {
-                                                // we still haven't had enough messages stored in the currently produced segment, so keep
-                                                // consuming from successive segments
-                                                curSegment = prevSegments[curSegmentIdx];
-                                                curSegmentLastAvailSeqNum = curSegment->lastAvailSeqNum;
-                                        }
-                                }
+                        if (ptr & (1u << 31))
+                        {
+                                ptr &= ~(1u << 31);
+                                it.iov_base = out.At(ptr);
                         }
+                        else
+                        {
+                                ptr &= ~(1u << 30);
+                                it.iov_base = cbuf.At(ptr);
+                        }
+                }
 
-                        if (iovLen)
-                                flush();
-
-                        auto logFd = fd;
-                        const auto lastAvailSeqNum = all[i - 1].seqNum;
+                if (trace)
+                        SLog("Flushing ", iovLen, "\n");
 
-                        fd = open(Buffer::build(destPartitionPath, "/", baseSeqNum, ".index.cleaned").data(), O_RDWR | O_CREAT | O_LARGEFILE | O_TRUNC, 0775);
+                size_t sum{0};
 
-                        if (fd == -1)
-                        {
-                                close(logFd);
-                                throw Switch::system_error("Failed to access new segment's index:", strerror(errno));
-                        }
+                for (uint32_t i{0}; i != iovLen; ++i)
+                        sum += iov[i].iov_len;
 
-                        if (write(fd, index.data(), index.size()) != index.size())
-                        {
-                                close(logFd);
-                                close(fd);
-                                throw Switch::system_error("Failed to create new segment's index:", strerror(errno));
-                        }
+                throttle_compaction_io(sum);
 
-                        fdatasync(logFd);
+                const auto r = writev(fd, iov, iovLen);
 
-                        // We could have instead used (firstSegmentConsumedForThisNewSegment->baseSeqNum, curSegmentLastAvailSeqNum)
-                        // instead of (baseSeqNum, all[i - 1].seqNum), which would have retained the filename for some segments cleaned up onto themselves
-                        // and would reduce need to scan forward for a ro_segment if the query seqNum > segment.lastSeqNum and < nextSegment.baseSeqNum
-                        // but we'd rather not do this
-                        if (Rename(logPath, Buffer::build(destPartitionPath, baseSeqNum, "-", lastAvailSeqNum, "_", curSegment->createdTS, ".ilog.cleaned")) == -1)
-                                throw Switch::system_error("Failed to rename segment:", strerror(errno));
+                if (unlikely(r == -1))
+                        throw Switch::system_error("writev() failed:", strerror(errno));
 
-                        auto newSegment = std::make_unique<ro_segment>(baseSeqNum, lastAvailSeqNum, curSegment->createdTS);
+                compactionStats.bytesWritten += r;
 
-                        newSegment->fdh.reset(new fd_handle(logFd));
-                        require(newSegment->fdh.use_count() == 2);
-                        newSegment->fdh->Release();
-                        newSegment->fileSize = outFileSize;
-                        newSegment->index.data = reinterpret_cast<const uint8_t *>(mmap(nullptr, index.size(), PROT_READ, MAP_SHARED, fd, 0));
-                        newSegment->index.fileSize = index.size();
-                        newSegment->index.lastRecorded = indexLastRecorded;
+                out.clear();
+                cbuf.clear();
+                iovLen = 0;
+        };
 
-                        if (trace)
-                                SLog(newSegment->fileSize, " ", lseek64(newSegment->fdh->fd, 0, SEEK_END), "\n");
+        // Encodes the staged messages into a new bundle of the output segment
+        const auto emit_bundle = [&]() {
+                const uint32_t msgSetSize = staged.msgs.size();
+                const auto *const all = staged.msgs.data();
 
-                        require(newSegment->index.fileSize == lseek64(fd, 0, SEEK_END));
-                        require(newSegment->fileSize == lseek64(newSegment->fdh->fd, 0, SEEK_END));
+                if (!msgSetSize)
+                        return;
 
-                        close(fd);
-                        fd = -1;
+                if (fd == -1)
+                {
+                        // new segment
+                        baseSeqNum = expected = all[0].seqNum;
+                        outFileSize = 0;
+                        sinceLastUpdateBytes = sinceLastUpdateMsgsCnt = UINT32_MAX;
+                        index.clear();
 
-                        if (newSegment->index.data == MAP_FAILED)
-                                throw Switch::system_error("mmap() failed:", strerror(errno));
+                        Snprint(logPath, sizeof(logPath), destPartitionPath, baseSeqNum, "-", 0, "_", 0, ".ilog.cleaned");
+                        fd = open(logPath, O_RDWR | O_CREAT | O_LARGEFILE | O_TRUNC, 0775);
 
-                        require(newSegment->fdh.use_count() == 1);
-                        newSegments.push_back(newSegment.release());
+                        if (fd == -1)
+                                throw Switch::system_error("Failed to create new segment:", strerror(errno));
+                }
 
-                        if (trace)
-                                SLog("Out segment, output ", outFileSize, "(", size_repr(outFileSize), ") ", dotnotation_repr(index.size()), " index entries\n");
+                if (sinceLastUpdateBytes > sinceLastUpdateBytesThreshold || sinceLastUpdateMsgsCnt > sinceLastUpdateMsgsCntThreshold)
+                {
+                        // TODO: if (all[0].seqNum - baseSeqNum > threshold, need to
+                        // switch to wide-entries index
+                        indexLastRecorded.relSeqNum = all[0].seqNum - baseSeqNum;
+                        indexLastRecorded.absPhysical = outFileSize;
+
+                        index.Serialize<uint32_t>(indexLastRecorded.relSeqNum);
+                        index.Serialize<uint32_t>(indexLastRecorded.absPhysical);
+                        sinceLastUpdateBytes = 0;
+                        sinceLastUpdateMsgsCnt = 0;
                 }
 
+                const auto bundleLengthIOVIdx = iovLen++;
+
+                out.reserve(staged.sum + 1024);
+
+                const auto bundleHeaderFlagsOffset = out.size();
+                const auto msgSetOffset = encode_bundle(staged, expected, out);
+                const auto savedOutFileSize = outFileSize;
+                const auto bundleHeaderLength = msgSetOffset - bundleHeaderFlagsOffset;
+
+                sinceLastUpdateMsgsCnt += msgSetSize;
+                outFileSize += bundleHeaderLength;
+
+                iov[iovLen++] = {(void *)uintptr_t(bundleHeaderFlagsOffset | (1u << 31)), bundleHeaderLength};
+
+                const auto msgSetLen = out.size() - msgSetOffset;
+
                 if (trace)
-                        SLog("Done scanning RO segments\n");
+                        SLog("msgSetLen = ", msgSetLen, "\n");
 
-                // We have created a new set of segments, so we need to replace their .cleaned extension with a .swap extension
-                // During startup, if we find any *.cleaned files, then we'll delete them and will also remove any .swap files left around
-                for (auto it : newSegments)
+                if (msgSetLen > (compactionDictId ? 64 : 1024)) // XXX: arbitrary
                 {
-                        if (Rename(Buffer::build(destPartitionPath, it->baseSeqNum, "-", it->lastAvailSeqNum, "_", it->createdTS, ".ilog.cleaned").data(),
-                                   Buffer::build(destPartitionPath, it->baseSeqNum, "-", it->lastAvailSeqNum, "_", it->createdTS, ".ilog.swap").data()) == -1)
-                        {
-                                throw Switch::system_error("Failed to rename files:", strerror(errno));
-                        }
+                        const auto offset = cbuf.size();
 
-                        if (Rename(Buffer::build(destPartitionPath, "/", it->baseSeqNum, ".index.cleaned").data(),
-                                   Buffer::build(destPartitionPath, "/", it->baseSeqNum, ".index.swap").data()) == -1)
+                        if (!Compression::Compress(log->config.compactionCodec, out.At(msgSetOffset), msgSetLen, &cbuf, compactionDictId))
+                                throw Switch::system_error("Compression failed");
+
+                        const auto span = cbuf.size() - offset;
+
+                        if (span >= msgSetLen)
                         {
-                                throw Switch::system_error("Failed to rename files:", strerror(errno));
+                                // not worth it
+                                cbuf.resize(offset);
+                                goto l10;
                         }
-                }
 
-                // Rename input segments by appending the .log extension to both log files and index files
-                for (auto it : prevSegments)
+                        iov[iovLen++] = {(void *)uintptr_t(offset | (1u << 30)), span};
+                        out.resize(msgSetOffset);
+
+                        *(uint8_t *)out.At(bundleHeaderFlagsOffset) |= Compression::CodecForAlgo(log->config.compactionCodec); // set codec
+                        outFileSize += span;
+                }
+                else
                 {
-                        if (const auto createdTS = it->createdTS)
-                        {
-                                if (Rename(Buffer::build(basePartitionPath, "/", it->baseSeqNum, "-", it->lastAvailSeqNum, "_", createdTS, ".ilog").data(),
-                                           Buffer::build(basePartitionPath, "/", it->baseSeqNum, "-", it->lastAvailSeqNum, "_", createdTS, ".ilog.old").data()) == -1)
-                                {
-                                        throw Switch::system_error("Failed to rename files:", strerror(errno));
+                l10:
+                        iov[iovLen++] = {(void *)uintptr_t(msgSetOffset | (1u << 31)), msgSetLen};
+                        outFileSize += msgSetLen;
+                }
+
+                const auto bundleLength = outFileSize - savedOutFileSize;
+                const auto _l = out.size();
+
+                out.SerializeVarUInt32(bundleLength);
+                const auto bundleLengthReprLen = out.size() - _l;
+                iov[bundleLengthIOVIdx] = {(void *)uintptr_t(_l | (1u << 31)), bundleLengthReprLen};
+
+                outFileSize += bundleLengthReprLen;
+                sinceLastUpdateBytes += bundleLength;
+                lastAvailSeqNum = all[msgSetSize - 1].seqNum;
+
+                if (iovLen > sizeof_array(iov) - 16)
+                        flush();
+
+                staged.clear();
+        };
+
+        // Completes the output segment: persists its index, and tracks it in newSegments[]
+        const auto finish_segment = [&]() {
+                if (iovLen)
+                        flush();
+
+                auto logFd = fd;
+
+                fd = open(Buffer::build(destPartitionPath, "/", baseSeqNum, ".index.cleaned").data(), O_RDWR | O_CREAT | O_LARGEFILE | O_TRUNC, 0775);
+
+                if (fd == -1)
+                {
+                        close(logFd);
+                        throw Switch::system_error("Failed to access new segment's index:", strerror(errno));
+                }
+
+                if (write(fd, index.data(), index.size()) != index.size())
+                {
+                        close(logFd);
+                        close(fd);
+                        fd = -1;
+                        throw Switch::system_error("Failed to create new segment's index:", strerror(errno));
+                }
+
+                fdatasync(logFd);
+                // No one's going to read the new segment any time soon
+                posix_fadvise(logFd, 0, 0, POSIX_FADV_DONTNEED);
+
+                // We could have instead used (firstSegmentConsumedForThisNewSegment->baseSeqNum, curSegmentLastAvailSeqNum)
+                // instead of (baseSeqNum, lastAvailSeqNum), which would have retained the filename for some segments cleaned up onto themselves
+                // and would reduce need to scan forward for a ro_segment if the query seqNum > segment.lastSeqNum and < nextSegment.baseSeqNum
+                // but we'd rather not do this
+                if (Rename(logPath, Buffer::build(destPartitionPath, baseSeqNum, "-", lastAvailSeqNum, "_", createdTS, ".ilog.cleaned")) == -1)
+                {
+                        close(logFd);
+                        close(fd);
+                        fd = -1;
+                        throw Switch::system_error("Failed to rename segment:", strerror(errno));
+                }
+
+                auto newSegment = std::make_unique<ro_segment>(baseSeqNum, lastAvailSeqNum, createdTS);
+
+                newSegment->fdh.reset(new fd_handle(logFd));
+                require(newSegment->fdh.use_count() == 2);
+                newSegment->fdh->Release();
+                newSegment->fileSize = outFileSize;
+                newSegment->index.data = reinterpret_cast<const uint8_t *>(mmap(nullptr, index.size(), PROT_READ, MAP_SHARED, fd, 0));
+                newSegment->index.fileSize = index.size();
+                newSegment->index.lastRecorded = indexLastRecorded;
+
+                require(newSegment->index.fileSize == lseek64(fd, 0, SEEK_END));
+                require(newSegment->fileSize == lseek64(newSegment->fdh->fd, 0, SEEK_END));
+
+                close(fd);
+                fd = -1;
+
+                if (newSegment->index.data == MAP_FAILED)
+                {
+                        newSegment->index.data = nullptr;
+                        throw Switch::system_error("mmap() failed:", strerror(errno));
+                }
+
+                // Build the time index here, so that timestamp lookups won't need to scan the new segment on the reactor
+                newSegment->map_time_index(Buffer::build(destPartitionPath, "/", baseSeqNum, ".tindex.cleaned").data());
+
+                require(newSegment->fdh.use_count() == 1);
+                newSegments.push_back(newSegment.release());
+                ++runs.back().second.len;
+
+                if (trace)
+                        SLog("Out segment, output ", outFileSize, "(", size_repr(outFileSize), ") ", dotnotation_repr(index.size()), " index entries\n");
+        };
+
+        Defer({
+                if (fd != -1)
+                        close(fd);
+        });
+
+        try
+        {
+                for (uint32_t i{0}; i != prevSegments.size(); ++i)
+                {
+                        auto it = prevSegments[i];
+
+                        if (!dirty[i])
+                        {
+                                // Output segments never span segments that are not rewritten
+                                if (fd != -1)
+                                        finish_segment();
+
+                                continue;
+                        }
+
+                        if (trace)
+                                SLog(ansifmt::bold, ansifmt::color_blue, "Now processing segment (", it->baseSeqNum, ", ", it->lastAvailSeqNum, ")", ansifmt::reset, "\n");
+
+                        if (!i || !dirty[i - 1])
+                                runs.push_back({{i, 0}, {uint32_t(newSegments.size()), 0}});
+
+                        ++runs.back().first.len;
+                        rewritten.push_back(it);
+
+                        for_each_segment_msg(it, b, [&](const uint64_t seqNum, const uint64_t ts, const strwlen8_t key, const strwlen32_t content) {
+                                if (key)
+                                {
+                                        // Drop deleted messages(messages with a key and no content), and messages superseded by a later message with the same key
+                                        // Keys not in the map are only found in clean head segments, and they haven't been superseded
+                                        const auto it = latest.find(key);
+
+                                        if (!content || (it != latest.end() && it->second.seqNum != seqNum))
+                                                return;
+                                }
+
+                                staged.push_back(seqNum, ts, key, content);
+
+                                if (staged.msgs.size() == maxBundleMsgsSetSize || staged.sum >= maxBundleMsgsSetSizeBytes)
+                                        emit_bundle();
+                        });
+
+                        emit_bundle();
+                        createdTS = it->createdTS;
+
+                        if (fd != -1 && outFileSize > minSegmentLogFileSize)
+                        {
+                                // we got enough messages for this segment
+                                finish_segment();
+                        }
+                }
+
+                if (fd != -1)
+                        finish_segment();
+
+                if (trace)
+                        SLog("Done scanning RO segments\n");
+
+                // We have created a new set of segments, so we need to replace their .cleaned extension with a .swap extension
+                // During startup, if we find any *.cleaned files, then we'll delete them and will also remove any .swap files left around
+                for (auto it : newSegments)
+                {
+                        if (Rename(Buffer::build(destPartitionPath, it->baseSeqNum, "-", it->lastAvailSeqNum, "_", it->createdTS, ".ilog.cleaned").data(),
+                                   Buffer::build(destPartitionPath, it->baseSeqNum, "-", it->lastAvailSeqNum, "_", it->createdTS, ".ilog.swap").data()) == -1)
+                        {
+                                throw Switch::system_error("Failed to rename files:", strerror(errno));
+                        }
+
+                        if (Rename(Buffer::build(destPartitionPath, "/", it->baseSeqNum, ".index.cleaned").data(),
+                                   Buffer::build(destPartitionPath, "/", it->baseSeqNum, ".index.swap").data()) == -1)
+                        {
+                                throw Switch::system_error("Failed to rename files:", strerror(errno));
+                        }
+
+                        if (Rename(Buffer::build(destPartitionPath, "/", it->baseSeqNum, ".tindex.cleaned").data(),
+                                   Buffer::build(destPartitionPath, "/", it->baseSeqNum, ".tindex.swap").data()) == -1)
+                        {
+                                throw Switch::system_error("Failed to rename files:", strerror(errno));
+                        }
+                }
+
+                // Rename input segments by appending the .log extension to both log files and index files
+                for (auto it : rewritten)
+                {
+                        if (const auto createdTS = it->createdTS)
+                        {
+                                if (Rename(Buffer::build(basePartitionPath, "/", it->baseSeqNum, "-", it->lastAvailSeqNum, "_", createdTS, ".ilog").data(),
+                                           Buffer::build(basePartitionPath, "/", it->baseSeqNum, "-", it->lastAvailSeqNum, "_", createdTS, ".ilog.old").data()) == -1)
+                                {
+                                        throw Switch::system_error("Failed to rename files:", strerror(errno));
                                 }
                         }
                         else
@@ -1350,6 +2428,12 @@ static void compact_partition(topic_partition_log *const log, const char *const
                         {
                                 throw Switch::system_error("Failed to rename files:", strerror(errno));
                         }
+
+                        // The new segments' per-bundle indices will be rebuilt when they are loaded; their time indices replace these
+                        if (Unlink(Buffer::build(basePartitionPath, "/", it->baseSeqNum, ".bindex").data()) == -1 && errno != ENOENT)
+                                throw Switch::system_error("Failed to unlink file:", strerror(errno));
+                        if (Unlink(Buffer::build(basePartitionPath, "/", it->baseSeqNum, ".tindex").data()) == -1 && errno != ENOENT)
+                                throw Switch::system_error("Failed to unlink file:", strerror(errno));
                 }
 
                 // Strip .swap extension from the set of new segments files
@@ -1366,10 +2450,16 @@ static void compact_partition(topic_partition_log *const log, const char *const
                         {
                                 throw Switch::system_error("Failed to rename files:", strerror(errno));
                         }
+
+                        if (Rename(Buffer::build(destPartitionPath, "/", it->baseSeqNum, ".tindex.swap").data(),
+                                   Buffer::build(destPartitionPath, "/", it->baseSeqNum, ".tindex").data()) == -1)
+                        {
+                                throw Switch::system_error("Failed to rename files:", strerror(errno));
+                        }
                 }
 
                 // Unlink all input segment files
-                for (auto it : prevSegments)
+                for (auto it : rewritten)
                 {
                         char path[PATH_MAX];
                         size_t pathLen;
@@ -1387,27 +2477,36 @@ static void compact_partition(topic_partition_log *const log, const char *const
                                 throw Switch::system_error("Failed to unlink file:", strerror(errno));
                 }
 
+                // The key map now reflects the new clean head
+                if (Rename(newKeysPath.data(), keysPath.data()) == -1)
+                        throw Switch::system_error("Failed to rename key map:", strerror(errno));
+
                 // Replace segments
-                run_on_main_thread([ log, segments = std::move(prevSegments), newSegments = std::move(newSegments) ]() {
+                run_on_main_thread([ log, segments = std::move(prevSegments), newSegments = std::move(newSegments), runs = std::move(runs), cleanMaxSeqNum, rewrittenCnt = rewritten.size(), throttledUs = compactionThrottledUs - throttledBefore ]() {
+                        std::lock_guard<Switch::mutex> g(log->partition->lock);
                         auto roSegments = log->roSegments.get();
-                        auto it = std::find(roSegments->begin(), roSegments->end(), segments.front());
-                        const auto upto = segments.back()->lastAvailSeqNum;
 
-                        require(it != roSegments->end());
+                        for (const auto &run : runs)
+                        {
+                                const auto inputs = run.first, outputs = run.second;
+                                auto it = std::find(roSegments->begin(), roSegments->end(), segments[inputs.offset]);
+
+                                require(it != roSegments->end());
 
-                        // remove segments from current roSegments[]
-                        std::for_each(it, it + segments.size(), [](auto ptr) { delete ptr; });
-                        roSegments->erase(it, it + segments.size());
+                                // remove segments from current roSegments[]
+                                std::for_each(it, it + inputs.len, [](auto ptr) { delete ptr; });
+                                it = roSegments->erase(it, it + inputs.len);
 
-                        // replace removed segments with new segments
-                        roSegments->insert(it, newSegments.begin(), newSegments.end());
+                                // replace removed segments with new segments
+                                roSegments->insert(it, newSegments.begin() + outputs.offset, newSegments.begin() + outputs.stop());
+                        }
 
                         log->compacting = false;
                         if (!log->lastCleanupMaxSeqNum)
                         {
                                 cleanupTracker.push_back(log);
                         }
-                        log->lastCleanupMaxSeqNum = upto;
+                        log->lastCleanupMaxSeqNum = cleanMaxSeqNum;
                         cleanupTrackerIsDirty = true;
 
                         if (trace)
@@ -1416,7 +2515,9 @@ static void compact_partition(topic_partition_log *const log, const char *const
                                         SLog("(", it->baseSeqNum, ", ", it->lastAvailSeqNum, ") ", it->fdh.use_count(), " ", it->fdh->fd, "\n");
                         }
 
-                        Print("Compacted partition segments\n");
+                        Print("Compacted partition segments, rewrote ", dotnotation_repr(rewrittenCnt), "/", dotnotation_repr(segments.size()), " segments, throttled for ", duration_repr(throttledUs), "\n");
+                        Print("Compactions since startup: ", size_repr(compactionStats.bytesRead), " read, ", size_repr(compactionStats.bytesWritten), " written, throttled for ", duration_repr(compactionStats.throttledUs), "\n");
+                        log->consider_pending_recompressions();
                 });
         }
         catch (...)
@@ -1427,14 +2528,228 @@ static void compact_partition(topic_partition_log *const log, const char *const
                         newSegments.pop_back();
                 }
 
+                Unlink(newKeysPath.data());
+
                 run_on_main_thread([log]() {
+                        std::lock_guard<Switch::mutex> g(log->partition->lock);
+
                         Print("Failed to compact partition segments\n");
                         log->compacting = false;
+                        log->consider_pending_recompressions();
+                });
+        }
+}
+
+// Rewrites the sealed segment `s` with its messages merged into larger bundles, compressed with config.recompressCodec, so that
+// bundles produced uncompressed by latency sensitive producers won't stay uncompressed for the rest of the retention period.
+// Segments that are mostly compressed already are left alone.
+//
+// The new log is created in the partition's .recompress/ directory, where ro_segment::ro_segment() builds its indices. The segment's
+// indices are unlinked before the new files replace the segment's files, so that a crash at any point leaves either the old or the
+// new log in place, and any missing indices are rebuilt when the partition is loaded. The new ro_segment replaces `s` in roSegments
+// on the main thread; `s` can't go away in the meantime, because consider_ro_segments() is a no-op while log->compacting is set
+static void recompress_segment(topic_partition_log *const log, const char *const basePartitionPath, ro_segment *const s)
+{
+        static constexpr size_t maxBundleMsgsSetSize{256}, maxBundleMsgsSetSizeBytes{128 * 1024}; // XXX: arbitrary
+        const auto codec = log->config.recompressCodec;
+        const uint32_t dictId = codec == Compression::Algo::ZSTD && log->partition && log->partition->owner ? log->partition->owner->compressionDictId.load(std::memory_order_relaxed) : 0;
+        const auto stagingPath = Buffer::build(basePartitionPath, "/.recompress");
+        const auto logName = s->createdTS ? Buffer::build(s->baseSeqNum, "-", s->lastAvailSeqNum, "_", s->createdTS, ".ilog") : Buffer::build(s->baseSeqNum, "-", s->lastAvailSeqNum, ".ilog");
+        const uint64_t throttledBefore = compactionThrottledUs;
+        const auto done = [log](ro_segment *const prev, ro_segment *const newSegment, const uint64_t throttledUs) {
+                run_on_main_thread([log, prev, newSegment, throttledUs]() {
+                        std::lock_guard<Switch::mutex> g(log->partition->lock);
+
+                        if (newSegment)
+                        {
+                                auto roSegments = log->roSegments.get();
+                                auto it = std::find(roSegments->begin(), roSegments->end(), prev);
+
+                                require(it != roSegments->end());
+                                *it = newSegment;
+
+                                Print("Recompressed segment (", prev->baseSeqNum, ", ", prev->lastAvailSeqNum, ") ", size_repr(prev->fileSize), " => ", size_repr(newSegment->fileSize), ", throttled for ", duration_repr(throttledUs), "\n");
+                                delete prev;
+                        }
+
+                        log->compacting = false;
+                        // Retention may have been deferred while we were busy
+                        log->consider_ro_segments();
+                        log->consider_pending_recompressions();
+                });
+        };
+        int fd{-1};
+        uint64_t uncompressedBytes{0};
+
+        if (codec == Compression::Algo::UNKNOWN || !s->fileSize)
+        {
+                done(s, nullptr, 0);
+                return;
+        }
+
+        // Only the bundle headers are parsed here; we stop reading as soon as we know there's enough to recompress
+        try
+        {
+                for_each_segment_chunk(s, [&](const uint8_t *p, const uint8_t *const e) -> const uint8_t * {
+                        uint32_t bundleLen;
+
+                        for (const uint8_t *bundleBase = p; p != e; bundleBase = p)
+                        {
+                                if (!Compression::TryUnpackUInt32(p, e, bundleLen) || p + bundleLen > e)
+                                        return bundleBase;
+                                else if (!bundleLen)
+                                        throw Switch::data_error("Unexpected empty bundle");
+                                else if ((*p & 3) == 0)
+                                        uncompressedBytes += bundleLen;
+
+                                p += bundleLen;
+                        }
+
+                        return uncompressedBytes >= s->fileSize / 4 ? nullptr : e;
+                });
+        }
+        catch (const std::exception &e)
+        {
+                Print("Failed to scan segment (", s->baseSeqNum, ", ", s->lastAvailSeqNum, ") for recompression: ", e.what(), "\n");
+                uncompressedBytes = 0;
+        }
+
+        if (uncompressedBytes < s->fileSize / 4)
+        {
+                done(s, nullptr, 0);
+                return;
+        }
+
+        Defer({
+                if (fd != -1)
+                        close(fd);
+        });
+
+        try
+        {
+                staged_bundle staged;
+                IOBuffer b, out, bundle, cbuf;
+                uint64_t expected{s->baseSeqNum};
+
+                if (mkdir(stagingPath.data(), 0775) == -1 && errno != EEXIST)
+                        throw Switch::system_error("Failed to create ", stagingPath, ":", strerror(errno));
+
+                const auto stagedLogPath = Buffer::build(stagingPath, "/", logName);
+
+                fd = open(stagedLogPath.data(), O_RDWR | O_CREAT | O_TRUNC | O_LARGEFILE, 0775);
+                if (fd == -1)
+                        throw Switch::system_error("Failed to create ", stagedLogPath, ":", strerror(errno));
+
+                // The index and time index will be rebuilt for the new log
+                Unlink(Buffer::build(stagingPath, "/", s->baseSeqNum, ".index").data());
+                Unlink(Buffer::build(stagingPath, "/", s->baseSeqNum, ".tindex").data());
+                Unlink(Buffer::build(stagingPath, "/", s->baseSeqNum, ".bindex").data());
+
+                const auto flush = [&]() {
+                        throttle_compaction_io(out.size());
+
+                        if (write(fd, out.data(), out.size()) != out.size())
+                                throw Switch::system_error("write() failed:", strerror(errno));
+
+                        compactionStats.bytesWritten += out.size();
+                        out.clear();
+                };
+
+                const auto emit_bundle = [&]() {
+                        if (staged.msgs.empty())
+                                return;
+
+                        bundle.clear();
+
+                        const auto msgSetOffset = encode_bundle(staged, expected, bundle);
+                        const auto msgSetLen = bundle.size() - msgSetOffset;
+
+                        cbuf.clear();
+                        if (!Compression::Compress(codec, bundle.At(msgSetOffset), msgSetLen, &cbuf, dictId))
+                                throw Switch::system_error("Compression failed");
+
+                        const bool compressed = cbuf.size() < msgSetLen;
+
+                        if (compressed)
+                                *(uint8_t *)bundle.At(0) |= Compression::CodecForAlgo(codec);
+
+                        out.SerializeVarUInt32(msgSetOffset + (compressed ? cbuf.size() : msgSetLen));
+                        out.Serialize(bundle.data(), msgSetOffset);
+                        if (compressed)
+                                out.Serialize(cbuf.data(), cbuf.size());
+                        else
+                                out.Serialize(bundle.At(msgSetOffset), msgSetLen);
+
+                        if (out.size() >= 1024 * 1024)
+                                flush();
+
+                        staged.clear();
+                };
+
+                for_each_segment_msg(s, b, [&](const uint64_t seqNum, const uint64_t ts, const strwlen8_t key, const strwlen32_t content) {
+                        staged.push_back(seqNum, ts, key, content);
+
+                        if (staged.msgs.size() == maxBundleMsgsSetSize || staged.sum >= maxBundleMsgsSetSizeBytes)
+                                emit_bundle();
                 });
+
+                emit_bundle();
+                if (out.size())
+                        flush();
+
+                if (fdatasync(fd) == -1)
+                        throw Switch::system_error("fdatasync() failed:", strerror(errno));
+
+                // No one's going to read the new segment any time soon
+                posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+                close(fd);
+                fd = -1;
+
+                // Builds the index and time index in the staging directory
+                auto newSegment = std::make_unique<ro_segment>(s->baseSeqNum, s->lastAvailSeqNum, stagingPath.AsS32(), s->createdTS, false);
+
+                if (log->config.bundleIndex)
+                        newSegment->map_bundle_index(stagingPath.AsS32());
+
+                static constexpr const char *indexExts[] = {".index", ".tindex", ".bindex"};
+
+                for (const auto ext : indexExts)
+                {
+                        const auto path = Buffer::build(stagingPath, "/", s->baseSeqNum, ext);
+                        int indexFd = open(path.data(), O_RDONLY | O_LARGEFILE);
+
+                        if (indexFd != -1)
+                        {
+                                fdatasync(indexFd);
+                                close(indexFd);
+                        }
+
+                        if (Unlink(Buffer::build(basePartitionPath, "/", s->baseSeqNum, ext).data()) == -1 && errno != ENOENT)
+                                throw Switch::system_error("Failed to unlink file:", strerror(errno));
+                }
+
+                if (Rename(stagedLogPath.data(), Buffer::build(basePartitionPath, "/", logName).data()) == -1)
+                        throw Switch::system_error("Failed to rename files:", strerror(errno));
+
+                // From here on, the new log is in place; if we fail to move the indices, they will be rebuilt when the partition is loaded
+                for (const auto ext : indexExts)
+                {
+                        if (Rename(Buffer::build(stagingPath, "/", s->baseSeqNum, ext).data(), Buffer::build(basePartitionPath, "/", s->baseSeqNum, ext).data()) == -1 && errno != ENOENT)
+                                Print("Failed to rename recompressed segment index:", strerror(errno), "\n");
+                }
+
+                done(s, newSegment.release(), compactionThrottledUs - throttledBefore);
+        }
+        catch (const std::exception &e)
+        {
+                Print("Failed to recompress segment (", s->baseSeqNum, ", ", s->lastAvailSeqNum, "): ", e.what(), "\n");
+                Unlink(Buffer::build(stagingPath, "/", logName).data());
+                done(s, nullptr, 0);
         }
 }
 
-void topic_partition_log::compact(const char *const basePartitionPath)
+// If recompressSegment is set, that segment is recompressed instead; see recompress_segment()
+void topic_partition_log::compact(const char *const basePartitionPath, ro_segment *const recompressSegment)
 {
         std::vector<ro_segment *> prevSegments;
         static std::once_flag onceFlag;
@@ -1446,6 +2761,8 @@ void topic_partition_log::compact(const char *const basePartitionPath)
                 pending_compaction *next;
                 char basePartitionPath[PATH_MAX];
                 std::vector<ro_segment *> prevSegments;
+                uint64_t firstDirtyOffset;
+                ro_segment *recompressSegment;
                 topic_partition_log *log;
         };
 
@@ -1457,49 +2774,63 @@ void topic_partition_log::compact(const char *const basePartitionPath)
 
         require(l < sizeof(compaction->basePartitionPath));
         compaction->log = this;
+        compaction->recompressSegment = recompressSegment;
         strwlen32_t(basePartitionPath, l).ToCString(compaction->basePartitionPath);
-        compaction->prevSegments.reserve(roSegments->size());
-        for (auto it : *roSegments)
-                compaction->prevSegments.push_back(it);
 
-        if (trace)
-                SLog("Compaction for [", basePartitionPath, "]\n");
+        if (!recompressSegment)
+        {
+                compaction->firstDirtyOffset = first_dirty_offset();
+                compaction->prevSegments.reserve(roSegments->size());
+                for (auto it : *roSegments)
+                        compaction->prevSegments.push_back(it);
 
-        Drequire(compaction->prevSegments.size());
+                if (trace)
+                        SLog("Compaction for [", basePartitionPath, "]\n");
 
-        std::call_once(onceFlag, [] {
+                Drequire(compaction->prevSegments.size());
+        }
 
-                std::thread([]() {
-                        std::vector<pending_compaction *> localWork;
+        std::call_once(onceFlag, [] {
+                // Each worker compacts a different partition, within its share of the memory budget; see -c and -m options
+                static std::vector<pending_compaction *> localWork;
+                const auto memBudget = compactionMemBudget / compactionThreadsCnt;
 
-                        for (;;)
-                        {
-                                std::unique_lock<std::mutex> lock(workLock);
+                for (uint32_t i{0}; i != compactionThreadsCnt; ++i)
+                {
+                        std::thread([memBudget]() {
+                                for (;;)
+                                {
+                                        std::unique_lock<std::mutex> lock(workLock);
 
-                                workCond.wait(lock, [] { return pendingCompactions.any(); });
-                                for (auto it = pendingCompactions.drain(); it; it = it->next)
-                                        localWork.push_back(it);
+                                        workCond.wait(lock, [] { return localWork.size() || pendingCompactions.any(); });
+                                        for (auto it = pendingCompactions.drain(); it;)
+                                        {
+                                                auto next = it->next;
 
-                                lock.unlock();
+                                                localWork.push_back(it);
+                                                it = next;
+                                        }
 
-                                while (localWork.size())
-                                {
                                         auto c = localWork.back();
 
+                                        localWork.pop_back();
+                                        lock.unlock();
+
                                         try
                                         {
-                                                compact_partition(c->log, c->basePartitionPath, std::move(c->prevSegments));
+                                                if (c->recompressSegment)
+                                                        recompress_segment(c->log, c->basePartitionPath, c->recompressSegment);
+                                                else
+                                                        compact_partition(c->log, c->basePartitionPath, std::move(c->prevSegments), c->firstDirtyOffset, memBudget);
                                         }
                                         catch (...)
                                         {
                                         }
 
-                                        localWork.pop_back();
                                         delete c;
                                 }
-                        }
-
-                }).detach();
+                        }).detach();
+                }
         });
 
         compacting = true;
@@ -1507,6 +2838,20 @@ void topic_partition_log::compact(const char *const basePartitionPath)
         workCond.notify_one();
 }
 
+// Schedules the recompression of the next pending sealed segment, unless the compaction threads are busy with this partition
+// Pending segments that are no longer in roSegments(e.g deleted by retention, or replaced by compaction) are skipped
+void topic_partition_log::consider_pending_recompressions()
+{
+        while (!compacting && pendingRecompressions.size())
+        {
+                auto s = pendingRecompressions.front();
+
+                pendingRecompressions.erase(pendingRecompressions.begin());
+                if (std::find(roSegments->begin(), roSegments->end(), s) != roSegments->end())
+                        compact(Buffer::build(basePath_, "/", partition->owner->name(), "/", partition->idx, "/").data(), s);
+        }
+}
+
 // Aligns to indices boundaries
 lookup_res topic_partition_log::range_for(uint64_t absSeqNum, const uint32_t maxSize, uint64_t maxAbsSeqNum)
 {
@@ -1533,7 +2878,7 @@ lookup_res topic_partition_log::range_for(uint64_t absSeqNum, const uint32_t max
                 }
         }
 
-        const auto highWatermark = lastAssignedSeqNum;
+        const auto highWatermark = committed_seqnum();
 
         if (maxSize == 0)
         {
@@ -1551,7 +2896,7 @@ lookup_res topic_partition_log::range_for(uint64_t absSeqNum, const uint32_t max
 
                 return {lookup_res::Fault::Empty, highWatermark};
         }
-        else if (absSeqNum == lastAssignedSeqNum + 1)
+        else if (absSeqNum == highWatermark + 1)
         {
                 // return empty
                 // UPDATE: let's wait instead
@@ -1560,12 +2905,12 @@ lookup_res topic_partition_log::range_for(uint64_t absSeqNum, const uint32_t max
 
                 return {lookup_res::Fault::AtEOF, highWatermark};
         }
-        else if (absSeqNum > lastAssignedSeqNum)
+        else if (absSeqNum > highWatermark)
         {
                 // past last assigned sequence number? nope
                 // throw an error
                 if (trace)
-                        SLog("PAST absSeqNum(", absSeqNum, ") > lastAssignedSeqNum(", lastAssignedSeqNum, ")\n");
+                        SLog("PAST absSeqNum(", absSeqNum, ") > highWatermark(", highWatermark, ")\n");
 
                 return {lookup_res::Fault::BoundaryCheck, highWatermark};
         }
@@ -1611,6 +2956,14 @@ lookup_res topic_partition_log::range_for(uint64_t absSeqNum, const uint32_t max
                         absSeqNum = f->baseSeqNum;
                 }
 
+                if (const auto n = f->bundles.size)
+                {
+                        lookup_res res(f->fdh.get(), f->fileSize, f->baseSeqNum, 0, highWatermark);
+
+                        if (lookup_bundles(f->bundles.data, n, f->fileSize, absSeqNum, maxSize, maxAbsSeqNum, res))
+                                return res;
+                }
+
                 const auto res = f->translateDown(absSeqNum, UINT32_MAX);
                 uint32_t offsetCeil;
 
@@ -1669,7 +3022,7 @@ lookup_res topic_partition_log::range_for(uint64_t absSeqNum, const uint32_t max
                 if (trace)
                         SLog("Will use current segment\n");
 
-                return {cur.fdh, cur.fileSize, cur.baseSeqNum, 0, highWatermark};
+                return {cur.fdh, committed_file_size(), cur.baseSeqNum, 0, highWatermark};
         }
 }
 
@@ -1710,18 +3063,21 @@ void topic_partition_log::consider_ro_segments()
                         if (trace)
                                 SLog(ansifmt::bold, ansifmt::color_red, "Removing ", segment->baseSeqNum, ansifmt::reset, "\n");
 
+                        // The files are unlinked, and the segment's log fd closed, by the housekeeping thread
                         basePath.append("/", segment->baseSeqNum, "-", segment->lastAvailSeqNum, "_", segment->createdTS, ".ilog");
-                        if (Unlink(basePath.data()) == -1)
-                                Print("Failed to unlink ", basePath, ": ", strerror(errno), "\n");
-                        else if (trace)
-                                SLog("Removed ", basePath, "\n");
+                        unlink_deferred(basePath.data());
 
                         basePath.resize(basePathLen);
                         basePath.append("/", segment->baseSeqNum, ".index");
-                        if (Unlink(basePath.data()) == -1)
-                                Print("Failed to unlink ", basePath, ": ", strerror(errno), "\n");
-                        else if (trace)
-                                SLog("Removed ", basePath, "\n");
+                        unlink_deferred(basePath.data());
+
+                        basePath.resize(basePathLen);
+                        basePath.append("/", segment->baseSeqNum, ".bindex");
+                        unlink_deferred(basePath.data());
+
+                        basePath.resize(basePathLen);
+                        basePath.append("/", segment->baseSeqNum, ".tindex");
+                        unlink_deferred(basePath.data());
 
                         basePath.resize(basePathLen);
 
@@ -1776,7 +3132,7 @@ bool topic_partition_log::should_roll(const uint32_t now) const
         else if (cur.fileSize)
         {
                 if (trace)
-                        SLog(ansifmt::color_green, " Consider roll:cur.fileSize(", cur.fileSize, "), config.maxSegmentSize(", config.maxSegmentSize, "), skipList.size(", cur.index.skipList.size(), "), config.curSegmentMaxAge (", config.curSegmentMaxAge, "), ", Timings::Seconds::SysTime() - cur.createdTS, " old,  cur.rollJitterSecs = ", cur.rollJitterSecs, ansifmt::reset, "\n");
+                        SLog(ansifmt::color_green, " Consider roll:cur.fileSize(", cur.fileSize, "), config.maxSegmentSize(", config.maxSegmentSize, "), index.size(", cur.index.size, "), config.curSegmentMaxAge (", config.curSegmentMaxAge, "), ", Timings::Seconds::SysTime() - cur.createdTS, " old,  cur.rollJitterSecs = ", cur.rollJitterSecs, ansifmt::reset, "\n");
 
                 if (cur.fileSize > config.maxSegmentSize)
                 {
@@ -1786,13 +3142,11 @@ bool topic_partition_log::should_roll(const uint32_t now) const
                         return true;
                 }
 
-                const size_t curIndexSizeBytes = cur.index.ondisk.span + (cur.index.skipList.size() * (sizeof(uint32_t) + sizeof(uint32_t)));
-
-                if (curIndexSizeBytes > config.maxIndexSize)
+                if (cur.index.size == cur.index.capacity)
                 {
                         // index is full
                         if (trace)
-                                SLog(ansifmt::bold, "curIndexSizeBytes(", curIndexSizeBytes, ") > config.maxIndexSize(", config.maxIndexSize, ")", ansifmt::reset, "\n");
+                                SLog(ansifmt::bold, "cur.index.size(", cur.index.size, ") == cur.index.capacity(", cur.index.capacity, ")", ansifmt::reset, "\n");
 
                         return true;
                 }
@@ -1829,24 +3183,199 @@ bool topic_partition_log::may_switch_index_wide(const uint64_t lastMsgSeqNum)
         return false;
 }
 
-// if (firstMsgSeqNum != 0 && lastMsgSeqNum != 0), we have expicitly specified message sequence numbers for the bundle first/last message
-append_res topic_partition_log::append_bundle(const time_t now, const void *bundle, const size_t bundleSize, const uint32_t bundleMsgsCnt, const uint64_t firstMsgSeqNum, const uint64_t lastMsgSeqNum)
+// Preallocates the current segment's index to config.maxIndexSize(or its size, if larger), maps it, and sets cur.index.size
+// to the number of entries in use
+void topic_partition_log::map_cur_index()
 {
-        const auto savedLastAssignedSeqNum = lastAssignedSeqNum;
-        const auto absSeqNum = firstMsgSeqNum ?: lastAssignedSeqNum + 1;
+        const auto fd = cur.index.fd;
+        const auto fileSize = lseek64(fd, 0, SEEK_END);
 
-	if (unlikely(absSeqNum < cur.baseSeqNum && cur.baseSeqNum != UINT64_MAX))
-	{
-		// This is odd
-		throw Switch::data_error("Unexpected absSeqNum(", absSeqNum, ") < cur.baseSeqNum(", cur.baseSeqNum, ") for ", partition->owner->name(), "/", partition->idx);
-	}
+        if (fileSize == -1)
+                throw Switch::system_error("lseek64() failed:", strerror(errno));
 
-        Drequire(bundleMsgsCnt);
+        const uint32_t capacity = std::max<size_t>(fileSize, config.maxIndexSize) / sizeof(index_record);
+        const size_t span = capacity * sizeof(index_record);
 
-        if (lastMsgSeqNum)
+        if (size_t(fileSize) < span && ftruncate(fd, span) == -1)
+                throw Switch::system_error("ftruncate() failed:", strerror(errno));
+
+        auto data = static_cast<index_record *>(mmap(nullptr, span, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+
+        if (unlikely(data == MAP_FAILED))
+                throw Switch::system_error("mmap() failed:", strerror(errno));
+
+        // Entries are appended in order of their (increasing) physical offset, and unused entries are zeroed.
+        // The first entry is always {0, 0}. If we crashed, there may also be entries for bundles that never made it to the log;
+        // they are past all valid entries, so we can binary search for the first invalid entry.
+        const auto valid = [&](const uint32_t i) {
+                return cur.fileSize && (!i || (data[i].absPhysical && data[i].absPhysical < cur.fileSize));
+        };
+        uint32_t size{0};
+
+        for (uint32_t top = capacity; size < top;)
         {
-                // Sparse bundle; last message seqNum encoded in the bundle header
-                lastAssignedSeqNum = lastMsgSeqNum;
+                const auto mid = (size + top) / 2;
+
+                if (valid(mid))
+                        size = mid + 1;
+                else
+                        top = mid;
+        }
+
+        for (auto i = size; i != capacity && (data[i].relSeqNum || data[i].absPhysical); ++i)
+                data[i] = {0, 0};
+
+        cur.index.data = data;
+        cur.index.size = size;
+        cur.index.capacity = capacity;
+}
+
+// Unmaps the current segment's index, and truncates it to the entries in use
+void topic_partition_log::close_cur_index()
+{
+        if (cur.index.fd == -1)
+                return;
+
+        if (cur.index.data)
+        {
+                munmap(cur.index.data, cur.index.capacity * sizeof(index_record));
+                cur.index.data = nullptr;
+
+                if (ftruncate(cur.index.fd, cur.index.size * sizeof(index_record)) == -1)
+                        RFLog("ftruncate() failed:", strerror(errno), "\n");
+        }
+
+        // synced and closed once no flush requests retain it
+        cur.index.fdh.reset(nullptr);
+        cur.index.fd = -1;
+}
+
+// Writes the time index records that have yet to be written to the .tindex file, with a single pwrite64()
+// Returns false on failure; the records will be written along with the next batch
+bool topic_partition_log::persist_cur_time_index()
+{
+        const auto &records = cur.timeIndex.records;
+        const auto n = records.size() - cur.timeIndex.persisted;
+        const size_t size = n * sizeof(time_index_record);
+
+        if (!n)
+                return true;
+        else if (pwrite64(cur.timeIndex.fd, records.data() + cur.timeIndex.persisted, size, cur.timeIndex.persisted * sizeof(time_index_record)) != size)
+        {
+                RFLog("Failed to update time index:", strerror(errno), "\n");
+                return false;
+        }
+
+        cur.timeIndex.persisted = records.size();
+        return true;
+}
+
+// Segment logs are opened with O_APPEND and grow by a writev() at a time, so that appends would otherwise also need to allocate
+// blocks, and the logs would end up fragmented. Instead, we allocate config.segmentPreallocSize bytes at a time past cur.preallocated, up to
+// config.maxSegmentSize. FALLOC_FL_KEEP_SIZE means the file size still tracks cur.fileSize, so appends, readers and recovery are unaffected; the
+// blocks past it are released when the segment is rolled.
+void topic_partition_log::prealloc_cur_segment(const uint64_t end)
+{
+        const auto from = cur.preallocated;
+        const auto upto = std::max<uint64_t>(end, std::min<uint64_t>(from + config.segmentPreallocSize, config.maxSegmentSize));
+
+        if (fallocate(cur.fdh->fd, FALLOC_FL_KEEP_SIZE, from, upto - from) == -1)
+        {
+                if (errno == EOPNOTSUPP)
+                {
+                        RFLog("fallocate() not supported; will not preallocate segments of ", partition->owner->name(), "/", partition->idx, "\n");
+                        config.segmentPreallocSize = 0;
+                }
+                else
+                {
+                        // e.g ENOSPC or EDQUOT; retrying on every append would only add a failing syscall to each of them
+                        // Back off until the next segment, whose preallocation will be attempted again
+                        RFLog("fallocate() failed:", strerror(errno), "; will not preallocate the current segment of ", partition->owner->name(), "/", partition->idx, " any further\n");
+                        cur.preallocated = std::max<uint64_t>(config.maxSegmentSize, end);
+                }
+
+                return;
+        }
+
+        if (trace)
+                SLog("Preallocated [", from, ", ", upto, ")\n");
+
+        cur.preallocated = upto;
+}
+
+// Schedules the creation of the next segment's files; see spare_segment
+void topic_partition_log::schedule_spare_segment()
+{
+        require(!spare);
+
+        spare = new spare_segment();
+        spare->basePath = Buffer::build(basePath_, "/", partition->owner->name(), "/", partition->idx, "/").data();
+        spare->indexCapacity = config.maxIndexSize / sizeof(index_record);
+        spare->logPrealloc = std::min<uint64_t>(config.segmentPreallocSize, config.maxSegmentSize);
+
+        spare->Retain();
+        if (!schedule_housekeeping({housekeeping_task::Type::PrepareSegment, -1, spare, {}}))
+        {
+                spare->Release();
+                spare->Release();
+                spare = nullptr;
+        }
+}
+
+// Stages bundle `b` for appending to the current segment; see staged_append and Service::append_produce_batch()
+// Sets b.status to 2 if its explicitly specified sequence numbers are invalid
+// if (firstMsgSeqNum != 0 && lastMsgSeqNum != 0), we have expicitly specified message sequence numbers for the bundle first/last message
+void topic_partition_log::stage_bundle(const time_t now, produce_bundle &b, append_batch &batch)
+{
+        const auto firstMsgSeqNum = b.firstMsgSeqNum, lastMsgSeqNum = b.lastMsgSeqNum;
+        const auto bundleMsgsCnt = b.msgsCnt;
+
+        if (lastMsgSeqNum)
+        {
+                // Sparse bundle; last message seqNum encoded in the bundle header
+                if (unlikely(lastMsgSeqNum < firstMsgSeqNum))
+                {
+                        if (trace)
+                                SLog("Unexpected, lastMsgSeqNum(", lastMsgSeqNum, ") < firstMsgSeqNum(", firstMsgSeqNum, ")\n");
+
+                        b.status = 2;
+                        return;
+                }
+                else if (unlikely(firstMsgSeqNum <= lastAssignedSeqNum))
+                {
+                        if (trace)
+                                SLog("Unexpected, firstMsgSeqNum(", firstMsgSeqNum, ") <= lastAssignedSeqNum(", lastAssignedSeqNum, ")\n");
+
+                        b.status = 2;
+                        return;
+                }
+        }
+        else if (unlikely(firstMsgSeqNum && firstMsgSeqNum <= lastAssignedSeqNum))
+        {
+                // either sparse bundle(first message encoded in the bundle header), or bundle in
+                // a TankAPIMsgType::ProduceWithBaseSeqNum request, where the bundle is encoded in the partition header
+                if (trace)
+                        SLog("Unexpected, firstMsgSeqNum(", firstMsgSeqNum, ") <= lastAssignedSeqNum(", lastAssignedSeqNum, ")\n");
+
+                b.status = 2;
+                return;
+        }
+
+        const auto savedLastAssignedSeqNum = lastAssignedSeqNum;
+        const auto absSeqNum = firstMsgSeqNum ?: lastAssignedSeqNum + 1;
+
+	if (unlikely(absSeqNum < cur.baseSeqNum && cur.baseSeqNum != UINT64_MAX))
+	{
+		// This is odd
+		throw Switch::data_error("Unexpected absSeqNum(", absSeqNum, ") < cur.baseSeqNum(", cur.baseSeqNum, ") for ", partition->owner->name(), "/", partition->idx);
+	}
+
+        Drequire(bundleMsgsCnt);
+
+        if (lastMsgSeqNum)
+        {
+                // Sparse bundle; last message seqNum encoded in the bundle header
+                lastAssignedSeqNum = lastMsgSeqNum;
         }
         else if (firstMsgSeqNum)
         {
@@ -1871,7 +3400,7 @@ append_res topic_partition_log::append_bundle(const time_t now, const void *bund
                 const auto basePathLen = basePath.size();
 
                 if (trace)
-                        SLog("Need to switch to another commit log (", cur.fileSize, "> ", config.maxSegmentSize, ") ", cur.index.skipList.size(), "\n");
+                        SLog("Need to switch to another commit log (", cur.fileSize, "> ", config.maxSegmentSize, ") ", cur.index.size, "\n");
 
                 if (cur.fileSize != UINT32_MAX)
                 {
@@ -1895,7 +3424,14 @@ append_res topic_partition_log::append_bundle(const time_t now, const void *bund
                         require(cur.fdh.use_count() == n + 1);
                         newROFile->fileSize = cur.fileSize;
 
-                        newROFile->index.fileSize = lseek64(cur.index.fd, 0, SEEK_END);
+                        if (cur.preallocated > cur.fileSize)
+                                trim_deferred(cur.fdh.get(), cur.fileSize);
+
+                        // Drop the preallocated unused entries before we map it; see map_cur_index()
+                        newROFile->index.fileSize = cur.index.size * sizeof(index_record);
+                        if (ftruncate(cur.index.fd, newROFile->index.fileSize) == -1)
+                                throw Switch::system_error("ftruncate() failed:", strerror(errno));
+
                         newROFile->index.lastRecorded.relSeqNum = newROFile->index.lastRecorded.absPhysical = 0;
 
                         if (cur.index.haveWideEntries)
@@ -1940,14 +3476,42 @@ append_res topic_partition_log::append_bundle(const time_t now, const void *bund
                         else
                                 newROFile->index.data = nullptr;
 
+                        if (config.bundleIndex)
+                                newROFile->set_bundle_index(basePath.AsS32(), cur.bundles.data(), cur.bundles.size());
+
+                        // Terminate the time index with a record for the end of the log; see time_index_record
+                        // We only need to consider all messages of the bundles past the last record, which spans about config.indexInterval bytes
+                        auto &timeRecords = cur.timeIndex.records;
+                        const auto tailMaxTS = max_msg_ts(cur.fdh->fd, timeRecords.size() ? timeRecords.back().absPhysical : 0, cur.fileSize);
+
+                        timeRecords.push_back({std::max(cur.timeIndex.maxTS, tailMaxTS), uint32_t(savedLastAssignedSeqNum + 1 - cur.baseSeqNum), cur.fileSize});
+
+                        const size_t timeIndexSize = timeRecords.size() * sizeof(time_index_record);
+
+                        if (!persist_cur_time_index())
+                                throw Switch::system_error("Failed to update time index:", strerror(errno));
+
+                        newROFile->timeIndex.data = (time_index_record *)mmap(nullptr, timeIndexSize, PROT_READ, MAP_SHARED, cur.timeIndex.fd, 0);
+
+                        if (unlikely(newROFile->timeIndex.data == MAP_FAILED))
+                        {
+                                newROFile->timeIndex.data = nullptr;
+                                throw Switch::system_error("mmap() failed:", strerror(errno));
+                        }
+
+                        newROFile->timeIndex.size = timeRecords.size();
+
                         const auto prevSize = newROFiles->size();
 
                         newROFiles->insert(newROFiles->end(), roSegments->begin(), roSegments->end());
                         require(newROFiles->size() == prevSize + roSegments->size());
+                        if (config.recompressCodec != Compression::Algo::UNKNOWN)
+                                pendingRecompressions.push_back(newROFile.get());
                         newROFiles->push_back(newROFile.release());
 
                         roSegments.reset(newROFiles.release());
                         consider_ro_segments();
+                        consider_pending_recompressions();
                 }
                 else
                 {
@@ -1963,34 +3527,86 @@ append_res topic_partition_log::append_bundle(const time_t now, const void *bund
                 cur.createdTS = Timings::Seconds::SysTime();
                 cur.nameEncodesTS = true;
                 cur.index.haveWideEntries = false;
+                cur.bundles.clear();
+                cur.timeIndex.records.clear();
+                cur.timeIndex.persisted = 0;
+                cur.timeIndex.maxTS = 0;
+
+                close_cur_index();
 
-                cur.index.skipList.clear();
-                fdatasync(cur.index.fd);
-                close(cur.index.fd);
+                if (cur.timeIndex.fd != -1)
+                        retire_fd(cur.timeIndex.fd);
 
-                if (cur.index.ondisk.data != nullptr && cur.index.ondisk.data != MAP_FAILED)
+                if (spare && spare->state.load(std::memory_order_acquire) == spare_segment::State::Ready)
                 {
-                        madvise((void *)cur.index.ondisk.data, cur.index.ondisk.span, MADV_DONTNEED);
-                        munmap((void *)cur.index.ondisk.data, cur.index.ondisk.span);
-                        cur.index.ondisk.data = nullptr;
+                        // The files were prepared ahead of time; we only need to rename them
+                        if (Rename(Buffer::build(basePath, ".next.log").data(), Buffer::build(basePath, cur.baseSeqNum, "_", cur.createdTS, ".log").data()) == -1 ||
+                            Rename(Buffer::build(basePath, ".next.index").data(), Buffer::build(basePath, cur.baseSeqNum, ".index").data()) == -1 ||
+                            Rename(Buffer::build(basePath, ".next.tindex").data(), Buffer::build(basePath, cur.baseSeqNum, ".tindex").data()) == -1)
+                        {
+                                throw Switch::system_error("Failed to Rename():", strerror(errno));
+                        }
+
+                        cur.fdh.reset(new fd_handle(spare->logFd));
+                        require(cur.fdh->use_count() == 2);
+                        cur.fdh->Release();
+
+                        cur.preallocated = spare->logPreallocated;
+                        cur.index.fd = spare->indexFd;
+                        cur.index.fdh.reset(new fd_handle(cur.index.fd));
+                        cur.index.fdh->Release();
+                        cur.index.data = spare->indexData;
+                        cur.index.size = 0;
+                        cur.index.capacity = spare->indexCapacity;
+                        cur.timeIndex.fd = spare->timeIndexFd;
+
+                        spare->logFd = spare->indexFd = spare->timeIndexFd = -1;
+                        spare->indexData = nullptr;
+                        spare->Release();
+                        spare = nullptr;
                 }
+                else
+                {
+                        if (spare && spare->state.load(std::memory_order_acquire) == spare_segment::State::Failed)
+                        {
+                                // Try again for the next roll
+                                spare->Release();
+                                spare = nullptr;
+                        }
+
+                        basePath.append(cur.baseSeqNum, "_", cur.createdTS, ".log");
+
+                        cur.preallocated = 0;
+                        cur.fdh.reset(new fd_handle(open(basePath.data(), O_RDWR | O_LARGEFILE | O_CREAT | O_NOATIME | O_APPEND, 0775)));
+                        require(cur.fdh->use_count() == 2);
+                        cur.fdh->Release();
+
+                        if (cur.fdh->fd == -1)
+                                throw Switch::system_error("open(", basePath, ") failed:", strerror(errno), ". Cannot load segment log");
+
+                        basePath.resize(basePathLen);
+                        basePath.append(cur.baseSeqNum, ".index");
+                        cur.index.fd = open(basePath.data(), O_RDWR | O_LARGEFILE | O_CREAT | O_NOATIME, 0775);
+                        basePath.resize(basePathLen);
 
-                basePath.append(cur.baseSeqNum, "_", cur.createdTS, ".log");
+                        if (cur.index.fd == -1)
+                                throw Switch::system_error("open(", basePath, ") failed:", strerror(errno), ". Cannot load segment index");
 
-                cur.fdh.reset(new fd_handle(open(basePath.data(), O_RDWR | O_LARGEFILE | O_CREAT | O_NOATIME | O_APPEND, 0775)));
-                require(cur.fdh->use_count() == 2);
-                cur.fdh->Release();
+                        cur.index.fdh.reset(new fd_handle(cur.index.fd));
+                        cur.index.fdh->Release();
+
+                        basePath.append(cur.baseSeqNum, ".tindex");
+                        cur.timeIndex.fd = open(basePath.data(), O_RDWR | O_LARGEFILE | O_CREAT | O_TRUNC | O_NOATIME, 0775);
+                        basePath.resize(basePathLen);
 
-                if (cur.fdh->fd == -1)
-                        throw Switch::system_error("open(", basePath, ") failed:", strerror(errno), ". Cannot load segment log");
+                        if (cur.timeIndex.fd == -1)
+                                throw Switch::system_error("open(", basePath, ") failed:", strerror(errno), ". Cannot load segment time index");
 
-                basePath.resize(basePathLen);
-                basePath.append(cur.baseSeqNum, ".index");
-                cur.index.fd = open(basePath.data(), O_RDWR | O_LARGEFILE | O_CREAT | O_NOATIME | O_APPEND, 0775);
-                basePath.resize(basePathLen);
+                        map_cur_index();
+                }
 
-                if (cur.index.fd == -1)
-                        throw Switch::system_error("open(", basePath, ") failed:", strerror(errno), ". Cannot load segment index");
+                if (!spare)
+                        schedule_spare_segment();
 
                 if (const uint32_t max = config.maxRollJitterSecs)
                 {
@@ -2005,6 +3621,7 @@ append_res topic_partition_log::append_bundle(const time_t now, const void *bund
 
                 cur.flush_state.pendingFlushMsgs = 0;
                 cur.flush_state.nextFlushTS = config.flushIntervalSecs ? now + config.flushIntervalSecs : UINT32_MAX;
+                cur.flush_state.writeback.Set(0, 0);
 
                 if (trace)
                         SLog("Switched\n");
@@ -2016,129 +3633,184 @@ append_res topic_partition_log::append_bundle(const time_t now, const void *bund
                         // This may be necessary
                         may_switch_index_wide(lastMsgSeqNum);
                 }
-
-                if (unlikely(cur.index.skipList.size() > 65536))
-                {
-                        // Implements https://github.com/phaistos-networks/TANK/issues/27
-                        if (trace)
-                                SLog(ansifmt::bold, ansifmt::color_red, "Emptying skiplist", ansifmt::reset, "\n");
-
-                        if (cur.index.ondisk.data != nullptr && cur.index.ondisk.data != MAP_FAILED)
-                        {
-                                madvise((void *)cur.index.ondisk.data, cur.index.ondisk.span, MADV_DONTNEED);
-                                munmap((void *)cur.index.ondisk.data, cur.index.ondisk.span);
-                        }
-
-                        cur.index.ondisk.span = lseek64(cur.index.fd, 0, SEEK_END);
-                        cur.index.ondisk.data = static_cast<const uint8_t *>(mmap(nullptr, cur.index.ondisk.span, PROT_READ, MAP_SHARED, cur.index.fd, 0));
-                        cur.index.haveWideEntries = false;
-
-                        if (cur.index.ondisk.data == MAP_FAILED)
-                                throw Switch::system_error("mmap() failed:", strerror(errno));
-
-                        cur.index.skipList.clear();
-                }
         }
 
         require(cur.fdh.use_count() >= 1);
 
-        uint8_t varint[8];
-        const uint8_t varintLen = Compression::PackUInt32(bundleSize, varint) - varint;
-        auto fd = cur.fdh->fd;
-        const struct iovec iov[] =
-            {
-                {(void *)varint, varintLen},
-                {(void *)bundle, bundleSize}};
-        const auto entryLen = iov[0].iov_len + iov[1].iov_len;
-        const range32_t fileRange(cur.fileSize, entryLen);
-        const auto before = cur.fdh.use_count();
-        Switch::shared_refptr<fd_handle> fdh(cur.fdh);
-        const auto b = trace ? Timings::Microseconds::Tick() : uint64_t(0);
-
-        require(cur.fdh.use_count() == before + 1);
+        auto s = batch.segments.size() && batch.segments.back().log == this && !batch.segments.back().committed ? &batch.segments.back() : nullptr;
 
-        // https://github.com/phaistos-networks/TANK/issues/14
-        if (unlikely(writev(fd, iov, sizeof_array(iov)) != entryLen))
+        if (!s)
         {
-                RFLog("Failed to writev():", strerror(errno), "\n");
-                lastAssignedSeqNum = savedLastAssignedSeqNum;
-                return {nullptr, {}, {}};
+                batch.segments.emplace_back();
+                s = &batch.segments.back();
+                s->log = this;
+                s->fdh = cur.fdh;
+                s->indexFdh = cur.index.fdh;
+                s->firstAbsSeqNum = absSeqNum;
+                s->iovOffset = batch.iov.size();
+                s->savedLastAssignedSeqNum = savedLastAssignedSeqNum;
+                s->savedFileSize = cur.fileSize;
+                s->savedSinceLastUpdate = cur.sinceLastUpdate;
+                s->savedIndexSize = cur.index.size;
+                s->savedBundlesCnt = cur.bundles.size();
+                s->savedTimeIndexSize = cur.timeIndex.records.size();
+                s->savedMaxTS = cur.timeIndex.maxTS;
+                s->writevRes = -ECANCELED;
         }
         else
         {
+                // Service::append_produce_batch() writes the staged bundles before we get to roll
+                require(s->fdh.get() == cur.fdh.get());
+        }
+
+        b.varintLen = Compression::PackUInt32(b.len, b.varint) - b.varint;
+        batch.iov.push_back({(void *)b.varint, b.varintLen});
+        batch.iov.push_back({(void *)b.data, b.len});
+        s->iovCnt += 2;
+
+        const uint32_t entryLen = b.varintLen + b.len;
+
+        if (cur.fileSize + entryLen > cur.preallocated && config.segmentPreallocSize)
+                prealloc_cur_segment(cur.fileSize + entryLen);
+
+        if (cur.sinceLastUpdate > config.indexInterval)
+        {
+                require(absSeqNum >= cur.baseSeqNum); // sanity check
+                require(cur.index.size < cur.index.capacity); // see should_roll()
+
+                const uint32_t relSeqNum = absSeqNum - cur.baseSeqNum;
+
+                cur.index.data[cur.index.size++] = {relSeqNum, cur.fileSize};
+
+                // Records are written in batches; see persist_cur_time_index()
+                cur.timeIndex.records.push_back({cur.timeIndex.maxTS, relSeqNum, cur.fileSize});
+                if (cur.timeIndex.records.size() - cur.timeIndex.persisted >= 64)
+                        persist_cur_time_index();
+
                 if (trace)
-                        SLog("writev() took ", duration_repr(Timings::Microseconds::Since(b)), "\n");
+                        SLog(">> ", relSeqNum, ", ", cur.fileSize, " ", cur.index.size, "\n");
 
-                // Even if we fail to update the index, that's not a big deal because
-                // 1. we can always rebuild the index 2. we use the index to locate the closest bundle to the target sequence number
-                if (cur.sinceLastUpdate > config.indexInterval)
-                {
-			require(absSeqNum >= cur.baseSeqNum); // sanity check
+                cur.sinceLastUpdate = 0;
+        }
+
+        cur.timeIndex.maxTS = std::max(cur.timeIndex.maxTS, bundle_first_msg_ts(b.data, b.data + b.len));
 
-                        const uint32_t out[] = {uint32_t(absSeqNum - cur.baseSeqNum), cur.fileSize};
+        if (config.bundleIndex)
+        {
+                const bool sparseBundleBitSet = b.data[0] & (1u << 6);
 
-                        cur.index.skipList.push_back({out[0], out[1]});
+                cur.bundles.push_back({absSeqNum, lastAssignedSeqNum, cur.fileSize, entryLen, sparseBundleBitSet});
+        }
 
-                        if (trace)
-                                SLog(">> ", out[0], ", ", out[1], " ", cur.index.skipList.size(), "\n");
+        cur.fileSize += entryLen;
+        cur.sinceLastUpdate += entryLen;
 
-                        if (unlikely(write(cur.index.fd, out, sizeof(out)) != sizeof(out)))
-                        {
-                                RFLog("Failed to write():", strerror(errno), "\n");
-                                // don't restore neither lastAssignedSeqNum from savedLastAssignedSeqNum,  nor fileSize
-                                // because this has been accepted
-                                return {nullptr, {}, {}};
-                        }
+        s->len += entryLen;
+        s->lastAbsSeqNum = lastAssignedSeqNum;
+        b.lastAbsSeqNum = lastAssignedSeqNum;
+        s->msgsCnt += bundleMsgsCnt;
+        ++s->bundlesCnt;
+        b.segmentIdx = batch.segments.size() - 1;
+}
 
-			if (0 == cur.fileSize)
-			{
-				// Make sure we get that first record synced
-				fdatasync(cur.index.fd); 
-			}
-                        cur.sinceLastUpdate = 0;
+// Invoked once the writev() of the bundles staged in `s` has completed
+// Returns false if it failed, in which case the log state is restored
+// If durableAcksReactor is set, the staged bundles are synced regardless of the flush policy, and it's notified once they are
+bool topic_partition_log::commit_staged(staged_append &s, const time_t now, Service *const durableAcksReactor)
+{
+        s.committed = true;
+
+        // https://github.com/phaistos-networks/TANK/issues/14
+        if (unlikely(s.writevRes != ssize_t(s.len)))
+        {
+                RFLog("Failed to writev():", strerror(s.writevRes < 0 ? -s.writevRes : EIO), "\n");
+                lastAssignedSeqNum = s.savedLastAssignedSeqNum;
+                cur.fileSize = s.savedFileSize;
+                cur.sinceLastUpdate = s.savedSinceLastUpdate;
+                // unused index entries are expected to be zeroed; see map_cur_index()
+                memset(cur.index.data + s.savedIndexSize, 0, (cur.index.size - s.savedIndexSize) * sizeof(index_record));
+                cur.index.size = s.savedIndexSize;
+                cur.bundles.resize(s.savedBundlesCnt);
+                cur.timeIndex.records.resize(s.savedTimeIndexSize);
+                cur.timeIndex.maxTS = s.savedMaxTS;
+                if (cur.timeIndex.persisted > s.savedTimeIndexSize)
+                {
+                        cur.timeIndex.persisted = s.savedTimeIndexSize;
+                        if (ftruncate(cur.timeIndex.fd, s.savedTimeIndexSize * sizeof(time_index_record)) == -1)
+                                RFLog("Failed to truncate time index:", strerror(errno), "\n");
                 }
+                s.failed = true;
+                return false;
+        }
 
-                cur.fileSize += entryLen;
-                cur.sinceLastUpdate += entryLen;
+        cur.flush_state.pendingFlushMsgs += s.msgsCnt;
 
-                cur.flush_state.pendingFlushMsgs += bundleMsgsCnt;
+        if (trace)
+                SLog("cur.flush_state.pendingFlushMsgs = ", cur.flush_state.pendingFlushMsgs, ", config.flushIntervalMsgs = ", config.flushIntervalMsgs, "\n");
 
+        if (durableAcksReactor)
+        {
                 if (trace)
-                        SLog("cur.flush_state.pendingFlushMsgs = ", cur.flush_state.pendingFlushMsgs, ", config.flushIntervalMsgs = ", config.flushIntervalMsgs, ", config.flushIntervalMsgs = ", config.flushIntervalMsgs, "\n");
+                        SLog("Scheduling flush for durable acks\n");
 
-                if (config.flushIntervalMsgs && cur.flush_state.pendingFlushMsgs >= config.flushIntervalMsgs)
-                {
-                        if (trace)
-                                SLog("Scheduling flush\n");
+                schedule_flush(now, s, durableAcksReactor);
+        }
+        else if (0 == s.savedFileSize)
+        {
+                // Make sure we get that first record synced
+                if (trace)
+                        SLog("Scheduling flush of first record\n");
 
-                        schedule_flush(now);
-                }
-                else if (now >= cur.flush_state.nextFlushTS)
-                {
-                        if (trace)
-                                SLog("Scheduling flush\n");
+                schedule_flush(now, s);
+        }
+        else if (config.flushIntervalMsgs && cur.flush_state.pendingFlushMsgs >= config.flushIntervalMsgs)
+        {
+                if (trace)
+                        SLog("Scheduling flush\n");
 
-                        schedule_flush(now);
-                }
+                schedule_flush(now, s);
+        }
+        else if (now >= cur.flush_state.nextFlushTS)
+        {
+                if (trace)
+                        SLog("Scheduling flush\n");
 
-                return {fdh, fileRange, {absSeqNum, uint16_t(bundleMsgsCnt)}};
+                schedule_flush(now, s);
         }
 
-        // return here and not in (writev() ! entryLen) check because some older compilers warn about
-        // a path with no return from a non-void function. Sigh
-        return {nullptr, {}, {}};
+        if (config.writebackSize && s.fdh.get() == cur.fdh.get() && cur.fileSize - cur.flush_state.writeback.stop() >= config.writebackSize)
+                schedule_writeback();
+
+        return true;
 }
 
-void topic_partition_log::schedule_flush(const uint32_t now)
+// Schedules a sync of the segment `s` was appended to, which, once completed, advances durableSeqNum to s.lastAbsSeqNum, and
+// notifies reactor, if set
+// The segment's index is synced along with it, even if the segment's been rolled since; close_cur_index() doesn't sync it
+void topic_partition_log::schedule_flush(const uint32_t now, const staged_append &s, Service *const reactor)
 {
+        auto indexFdh = s.indexFdh.get();
+
         cur.flush_state.pendingFlushMsgs = 0;
         cur.flush_state.nextFlushTS = now + config.flushIntervalSecs;
 
-        // This is obviously not optimal; we should have used a bounded queue, or some lock/wait-free construct
-        // but given this is a rare event, it's not worth it yet
-        mboxLock.lock();
-        mbox.push_back({cur.fdh->fd, cur.index.fd});
-        mboxLock.unlock();
+        if (!submit_flush(this, flush_req::Type::Sync, s.fdh.get(), indexFdh, s.lastAbsSeqNum, reactor))
+        {
+                fdatasync(s.fdh->fd);
+                if (indexFdh)
+                        fdatasync(indexFdh->fd);
+                durableSeqNum = std::max<uint64_t>(durableSeqNum, s.lastAbsSeqNum);
+        }
+}
+
+// Initiates writeback of the current segment's range appended to since the last writeback, so that we won't build up
+// dirty pages until the kernel(or a sync) gets to write them back all at once
+void topic_partition_log::schedule_writeback()
+{
+        const range32_t range(cur.flush_state.writeback.stop(), cur.fileSize - cur.flush_state.writeback.stop());
+
+        if (submit_flush(this, flush_req::Type::Writeback, cur.fdh.get(), nullptr, 0, nullptr, range, cur.flush_state.writeback))
+                cur.flush_state.writeback = range;
 }
 
 // XXX: this works great for standalone mode, but when the highwater mark is based on an ISR, which means
@@ -2146,7 +3818,8 @@ void topic_partition_log::schedule_flush(const uint32_t now)
 // any waiting consumers is not going to work. We likely need to do this only iff running in standalone mode, otherwise
 // only when the highwater mark is updated.
 // i.e opMode == OperationMode::Standalone
-void topic_partition::consider_append_res(append_res &res, Switch::vector<wait_ctx *> &waitCtxWorkL)
+// Invoked while holding lock
+void topic_partition::consider_append_res(append_res &res, Switch::vector<wait_ctx *> &waitCtxWorkL, const Service *const reactor)
 {
         bool newLogFile{false};
 
@@ -2176,7 +3849,8 @@ void topic_partition::consider_append_res(append_res &res, Switch::vector<wait_c
 
                                 ctxP.range = res.dataRange;
                                 ctxP.seqNum = res.msgSeqNumRange.offset;
-                                it->capturedSize = res.dataRange.len;
+                                ctxP.nextSeqNum = log_->lastAssignedSeqNum + 1;
+                                __atomic_store_n(&it->capturedSize, res.dataRange.len, __ATOMIC_RELAXED);
 
                                 if (trace)
                                         SLog("Just registered fdh for wait ctx, capturedSize(", it->capturedSize, "), range = ", ctxP.range, " ", ptr_repr(ctxP.fdh), " ", ctxP.fdh->use_count(), "\n");
@@ -2193,7 +3867,8 @@ void topic_partition::consider_append_res(append_res &res, Switch::vector<wait_c
                         {
                                 // extend the range
                                 ctxP.range.len += res.dataRange.len;
-                                it->capturedSize += res.dataRange.len;
+                                ctxP.nextSeqNum = log_->lastAssignedSeqNum + 1;
+                                __atomic_add_fetch(&it->capturedSize, res.dataRange.len, __ATOMIC_RELAXED);
 
                                 if (trace)
                                         SLog("Extending range, capturedSize(", it->capturedSize, "), range ", ctxP.range, "\n");
@@ -2202,72 +3877,27 @@ void topic_partition::consider_append_res(append_res &res, Switch::vector<wait_c
                         break;
                 }
 
-                if (newLogFile || it->capturedSize >= it->minBytes)
+                if (newLogFile || __atomic_load_n(&it->capturedSize, __ATOMIC_RELAXED) >= it->minBytes)
                 {
                         if (trace)
                                 SLog("Go either newLogFile(", newLogFile, "), or capturedSize(", it->capturedSize, ") >= minBytes(", it->minBytes, ")\n");
 
-                        waitCtxWorkL.push_back(it);
-                        waitingList.PopByIndex(i);
-                }
-                else
-                        ++i;
-        }
-}
-
-append_res topic_partition::append_bundle_to_leader(const time_t curTime, const uint8_t *const bundle, const size_t bundleLen, const uint32_t bundleMsgsCnt, Switch::vector<wait_ctx *> &waitCtxWorkL, const uint64_t firstMsgSeqNum, const uint64_t lastMsgSeqNum)
-{
-        // TODO: route to leader
-        try
-        {
-                if (lastMsgSeqNum)
-                {
-                        // Sparse bundle; last message seqNum encoded in the bundle header
-                        if (unlikely(lastMsgSeqNum < firstMsgSeqNum))
-                        {
-                                if (trace)
-                                        SLog("Unexpected, lastMsgSeqNum(", lastMsgSeqNum, ") < firstMsgSeqNum(", firstMsgSeqNum, ")\n");
-
-                                return {nullptr, {0, UINT32_MAX}, {}};
-                        }
-                        else if (unlikely(firstMsgSeqNum <= log_->lastAssignedSeqNum))
+                        if (it->reactor == reactor)
+                                waitCtxWorkL.push_back(it);
+                        else
                         {
-                                if (trace)
-                                        SLog("Unexpected, firstMsgSeqNum(", firstMsgSeqNum, ") <= lastAssignedSeqNum(", log_->lastAssignedSeqNum, ")\n");
-
-                                return {nullptr, {0, UINT32_MAX}, {}};
+                                // The wait context's connection is owned by another reactor
+                                it->reactor->schedule_wakeup(it);
                         }
-                }
-                else if (unlikely(firstMsgSeqNum && firstMsgSeqNum <= log_->lastAssignedSeqNum))
-                {
-                        // either sparse bundle(first message encoded in the bundle header), or bundle in
-                        // a TankAPIMsgType::ProduceWithBaseSeqNum request, where the bundle is encoded in the partition header
-                        if (trace)
-                                SLog("Unexpected, firstMsgSeqNum(", firstMsgSeqNum, ") <= lastAssignedSeqNum(", log_->lastAssignedSeqNum, ")\n");
 
-                        return {nullptr, {0, UINT32_MAX}, {}};
+                        waitingList.PopByIndex(i);
                 }
-
-                auto res = log_->append_bundle(curTime, bundle, bundleLen, bundleMsgsCnt, firstMsgSeqNum, lastMsgSeqNum);
-
-                if (trace)
-                        SLog("Appended to ", ptr_repr(this), " ", res.fdh ? res.fdh->use_count() : 0, "\n");
-
-                consider_append_res(res, waitCtxWorkL);
-
-                if (trace)
-                        SLog("after consider_append_res() ", res.fdh ? res.fdh->use_count() : 0, "\n");
-
-                return res;
-        }
-        catch (const std::exception &e)
-        {
-                RFLog("Failed, cought exception:", e.what(), "\n");
-                return {nullptr, {}, {}};
+                else
+                        ++i;
         }
 }
 
-lookup_res topic_partition::read_from_local(const bool fetchOnlyFromLeader, const bool fetchOnlyComittted, const uint64_t absSeqNum, const uint32_t fetchSize)
+lookup_res topic_partition::read_from_local(const bool fetchOnlyFromLeader, const bool fetchOnlyComittted, const uint64_t absSeqNum, const uint32_t fetchSize, const consume_cursor *const cursor)
 {
         // TODO:
         // For a multi-node configurations, maxAbsSeqNum should be set to the last committed absolute sequence number (i.e highwater mark)
@@ -2282,7 +3912,19 @@ lookup_res topic_partition::read_from_local(const bool fetchOnlyFromLeader, cons
         if (trace)
                 SLog("Fetching log segment for partition ", idx, ", abs.sequence number ", absSeqNum, ", fetchSize ", fetchSize, ", maxAbsSeqNum = ", maxAbsSeqNum, "\n");
 
-        return std::move(log_->range_for(absSeqNum, fetchSize, maxAbsSeqNum));
+        std::lock_guard<Switch::mutex> g(lock);
+        auto log = log_.get();
+
+        if (cursor && cursor->absSeqNum == absSeqNum && cursor->fdh == log->cur.fdh.get() && absSeqNum <= log->committed_seqnum() && fetchSize)
+        {
+                // Fast-path: we know exactly where that message is
+                if (trace)
+                        SLog("Using cursor for ", absSeqNum, " at ", cursor->fileOffset, "\n");
+
+                return {cursor->fdh, log->committed_file_size(), absSeqNum, cursor->fileOffset, log->committed_seqnum()};
+        }
+
+        return std::move(log->range_for(absSeqNum, fetchSize, maxAbsSeqNum));
 }
 
 static uint32_t parse_duration(strwlen32_t in)
@@ -2407,6 +4049,31 @@ void Service::parse_partition_config(const strwlen32_t contents, partition_confi
                                 if (l->logCleanRatioMin < 0 || l->logCleanRatioMin > 1)
                                         throw Switch::range_error("Invalid value for ", k);
                         }
+                        else if (k.EqNoCase(_S("log.cleaner.compression.codec")))
+                        {
+                                if (v.EqNoCase(_S("snappy")))
+                                        l->compactionCodec = Compression::Algo::SNAPPY;
+                                else if (v.EqNoCase(_S("lz4")))
+                                        l->compactionCodec = Compression::Algo::LZ4;
+                                else if (v.EqNoCase(_S("zstd")))
+                                        l->compactionCodec = Compression::Algo::ZSTD;
+                                else
+                                        throw Switch::range_error("Unexpected value for ", k, ": available options are snappy, lz4 and zstd");
+                        }
+                        else if (k.EqNoCase(_S("log.segment.recompress.codec")))
+                        {
+                                // Segments with uncompressed bundles are rewritten with merged bundles compressed with that codec when sealed
+                                if (v.EqNoCase(_S("none")))
+                                        l->recompressCodec = Compression::Algo::UNKNOWN;
+                                else if (v.EqNoCase(_S("snappy")))
+                                        l->recompressCodec = Compression::Algo::SNAPPY;
+                                else if (v.EqNoCase(_S("lz4")))
+                                        l->recompressCodec = Compression::Algo::LZ4;
+                                else if (v.EqNoCase(_S("zstd")))
+                                        l->recompressCodec = Compression::Algo::ZSTD;
+                                else
+                                        throw Switch::range_error("Unexpected value for ", k, ": available options are none, snappy, lz4 and zstd");
+                        }
                         else if (k.EqNoCase(_S("log.retention.secs")))
                         {
                                 l->lastSegmentMaxAge = parse_duration(v);
@@ -2435,6 +4102,16 @@ void Service::parse_partition_config(const strwlen32_t contents, partition_confi
                                 if (l->maxIndexSize < 128)
                                         throw Switch::range_error("Invalid value for ", k);
                         }
+                        else if (k.EqNoCase(_S("log.index.bundles")))
+                        {
+                                // Maintain a dense per-bundle index for each segment, so that we won't need to parse bundles from the log to locate the first bundle to stream
+                                l->bundleIndex = v.EqNoCase(_S("true")) || v.Eq(_S("1"));
+                        }
+                        else if (k.EqNoCase(_S("log.segment.preallocate.bytes")))
+                        {
+                                // The current segment log is preallocated in chunks of that many bytes; 0 disables preallocation
+                                l->segmentPreallocSize = parse_size(v);
+                        }
                         else if (k.EqNoCase(_S("log.roll.jitter.secs")))
                         {
                                 l->maxRollJitterSecs = parse_duration(v);
@@ -2448,6 +4125,12 @@ void Service::parse_partition_config(const strwlen32_t contents, partition_confi
                                 // The number of messages accumulated on a log partition before messages are flushed on disk
                                 l->flushIntervalMsgs = v.AsUint32();
                         }
+                        else if (k.EqNoCase(_S("flush.writeback.bytes")))
+                        {
+                                // Writeback of the current segment is initiated whenever that many bytes are appended to it, so that dirty
+                                // pages don't build up; 0 leaves it to the kernel
+                                l->writebackSize = parse_size(v);
+                        }
                         else if (k.EqNoCase(_S("flush.secs")))
                         {
                                 // The amount of time the log can have dirty data before a flush is forced
@@ -2482,25 +4165,65 @@ void Service::parse_partition_config(const char *const path, partition_config *c
         }
 }
 
-// TODO: respect configuration
-void Service::rebuild_index(int logFd, int indexFd)
+// Loads and registers a trained Zstd dictionary of a topic; returns its ID
+uint32_t Service::load_compression_dict(const char *const path)
 {
-        static constexpr bool trace{false};
-        const auto fileSize = lseek64(logFd, 0, SEEK_END);
-        auto *const fileData = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, logFd, 0);
-        IOBuffer b;
-        uint32_t relSeqNum{0};
-        static constexpr size_t step{4096};
-        uint64_t firstMsgSeqNum;
+        int fd = open(path, O_RDONLY | O_LARGEFILE | O_NOATIME);
+
+        if (fd == -1)
+                throw Switch::system_error("Failed to access compression dictionary(", path, "):", strerror(errno));
+
+        Defer({ close(fd); });
+
+        const auto fileSize = lseek64(fd, 0, SEEK_END);
+
+        if (fileSize == off64_t(-1))
+                throw Switch::system_error("Failed to access compression dictionary(", path, "):", strerror(errno));
+        else if (!fileSize || fileSize > MaxCompressionDictSize)
+                throw Switch::range_error("Unexpected compression dictionary(", path, ") size ", fileSize);
+
+        auto fileData = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
 
         if (fileData == MAP_FAILED)
-                throw Switch::system_error("Unable to mmap():", strerror(errno));
+                throw Switch::system_error("Failed to access compression dictionary(", path, ") of size ", fileSize, ":", strerror(errno));
 
         Defer({ munmap(fileData, fileSize); });
-        madvise(fileData, fileSize, MADV_SEQUENTIAL);
 
-        Print("Rebuilding index of log of size ", size_repr(fileSize), " ..\n");
-        for (const auto *p = reinterpret_cast<const uint8_t *>(fileData), *const e = p + fileSize, *const base = p, *next = p; p != e;)
+        const auto id = Compression::RegisterZstdDictionary(fileData, fileSize);
+
+        if (!id)
+        {
+                if (Compression::ZstdDictionaryConflicts(fileData, fileSize))
+                        throw Switch::data_error("Compression dictionary(", path, ") conflicts with another dictionary with the same ID");
+
+                throw Switch::data_error("Invalid compression dictionary(", path, ")");
+        }
+
+        return id;
+}
+
+// TODO: respect configuration
+// Rebuilds the index and/or the time index(either fd can be -1) of the segment log `logFd`
+// If `sealed` is set, the time index is terminated with a record for the end of the log; see time_index_record
+void Service::rebuild_index(int logFd, int indexFd, int timeIndexFd, const bool sealed)
+{
+        static constexpr bool trace{false};
+        const auto fileSize = lseek64(logFd, 0, SEEK_END);
+        auto *const fileData = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, logFd, 0);
+        IOBuffer b;
+        Switch::vector<time_index_record> timeIndex;
+        uint32_t relSeqNum{0};
+        static constexpr size_t step{4096};
+        uint64_t firstMsgSeqNum, maxTS{0};
+
+        if (fileData == MAP_FAILED)
+                throw Switch::system_error("Unable to mmap():", strerror(errno));
+
+        Defer({ munmap(fileData, fileSize); });
+        madvise(fileData, fileSize, MADV_SEQUENTIAL);
+
+        Print("Rebuilding index of log of size ", size_repr(fileSize), " ..\n");
+        for (const auto *p = reinterpret_cast<const uint8_t *>(fileData), *const e = p + fileSize, *const base = p, *next = p; p != e;)
         {
                 const auto bundleBase = p;
                 const auto bundleLen = Compression::UnpackUInt32(p);
@@ -2510,7 +4233,10 @@ void Service::rebuild_index(int logFd, int indexFd)
                 {
                         if (getenv("TANK_FORCE_SALVAGE_CURSEGMENT"))
                         {
-                                if (ftruncate(indexFd, 0) == -1)
+                                if (timeIndexFd != -1)
+                                        ftruncate(timeIndexFd, 0);
+
+                                if (indexFd != -1 && ftruncate(indexFd, 0) == -1)
                                 {
                                         Print("Failed to truncate the index:", strerror(errno), "\n");
                                         exit(1);
@@ -2533,6 +4259,7 @@ void Service::rebuild_index(int logFd, int indexFd)
 
                 expect(p < e);
 
+                const auto bundleHeader = p;
                 const auto bundleFlags = *p++;
                 const bool sparseBundleBitSet = bundleFlags & (1u << 6);
                 uint32_t msgsSetSize = (bundleFlags >> 2) & 0xf;
@@ -2577,13 +4304,40 @@ void Service::rebuild_index(int logFd, int indexFd)
 
                         b.Serialize<uint32_t>(firstMsgSeqNum);
                         b.Serialize<uint32_t>(bundleBase - base);
+                        timeIndex.push_back({maxTS, uint32_t(firstMsgSeqNum), uint32_t(bundleBase - base)});
                         next = bundleBase + step;
                 }
 
+                if (timeIndexFd != -1)
+                        maxTS = std::max(maxTS, bundle_first_msg_ts(bundleHeader, nextBundle));
+
                 p = nextBundle;
                 expect(p <= e);
         }
 
+        if (timeIndexFd != -1)
+        {
+                if (sealed)
+                {
+                        // See time_index_record
+                        const auto tailMaxTS = max_msg_ts(logFd, timeIndex.size() ? timeIndex.back().absPhysical : 0, fileSize);
+
+                        timeIndex.push_back({std::max(maxTS, tailMaxTS), relSeqNum, uint32_t(fileSize)});
+                }
+
+                const size_t size = timeIndex.size() * sizeof(time_index_record);
+
+                if (pwrite64(timeIndexFd, timeIndex.data(), size, 0) != size)
+                        throw Switch::system_error("Failed to store time index:", strerror(errno));
+                if (ftruncate(timeIndexFd, size))
+                        throw Switch::system_error("Failed to truncate time index file:", strerror(errno));
+
+                fdatasync(timeIndexFd);
+        }
+
+        if (indexFd == -1)
+                return;
+
         if (trace)
                 SLog("Rebuilt index ", size_repr(b.size()), ", last ", relSeqNum, ", ", b.size(), "\n");
 
@@ -2725,7 +4479,6 @@ uint32_t Service::verify_log(int fd)
 
                 expect(p <= e);
                 expect(msgsSetSize);
-                expect(codec == 0 || codec == 1);
 
                 if (0)
                         Print(msgSeqNum, " => OFFSET ", bundleBase - base, "\n");
@@ -2733,7 +4486,7 @@ uint32_t Service::verify_log(int fd)
                 if (codec)
                 {
                         cb.clear();
-                        if (!Compression::UnCompress(Compression::Algo::SNAPPY, p, nextBundle - p, &cb))
+                        if (!Compression::UnCompress(Compression::AlgoForCodec(codec), p, nextBundle - p, &cb))
                                 throw Switch::system_error("Failed to decompress content");
                         msgSetContent.Set((uint8_t *)cb.data(), cb.size());
                 }
@@ -2843,15 +4596,29 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
                 partition->idx = idx;
 
                 l->roSegments = nullptr;
-                l->cur.index.ondisk.data = nullptr;
-                l->cur.index.ondisk.span = 0;
+                l->cur.index.fd = -1;
+                l->cur.timeIndex.fd = -1;
+                l->cur.timeIndex.persisted = 0;
+                l->cur.timeIndex.maxTS = 0;
+                l->cur.index.data = nullptr;
+                l->cur.index.size = l->cur.index.capacity = 0;
                 l->cur.index.haveWideEntries = false;
-                l->cur.index.ondisk.lastRecorded.relSeqNum = 0;
-                l->cur.index.ondisk.lastRecorded.absPhysical = 0;
 
                 for (auto &&name : DirectoryEntries(basePath))
                 {
-                        if (*name.p == '.')
+                        if (name.Eq(_S(".recompress")))
+                        {
+                                // Segment recompression was interrupted; see recompress_segment()
+                                const auto stagingPath = Buffer::build(basePath, "/", name);
+
+                                for (auto &&it : DirectoryEntries(stagingPath.data()))
+                                {
+                                        if (*it.p != '.')
+                                                Unlink(Buffer::build(stagingPath, "/", it).data());
+                                }
+                                continue;
+                        }
+                        else if (*name.p == '.')
                                 continue;
 
                         if (name.Eq(_S("config")))
@@ -2922,6 +4689,10 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
                                         wideEntyRoLogIndices.insert(v.first.AsUint64());
                                 }
                         }
+                        else if (r.second.Eq(_S("bindex")) || r.second.Eq(_S("tindex")))
+                        {
+                                // accept; see ro_segment::map_bundle_index() and time_index_record
+                        }
                         else if (r.second.Eq(_S("ilog")))
                         {
                                 // Immutable log
@@ -3075,6 +4846,9 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
                                         SLog("Initializing [firstAvailableSeqNum=", it.firstAvailableSeqNum, ",lastAvailSeqNum=", it.lastAvailSeqNum, ", base = ", b, "]\n");
 
                                 l->roSegments->push_back(new ro_segment(it.firstAvailableSeqNum, it.lastAvailSeqNum, b, it.creationTS, wideEntyRoLogIndices.count(it.firstAvailableSeqNum)));
+
+                                if (l->config.bundleIndex)
+                                        l->roSegments->back()->map_bundle_index(b);
                         }
                 }
                 else
@@ -3100,11 +4874,13 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
                         l->cur.fdh->Release();
                         l->cur.baseSeqNum = curLogSeqNum;
                         l->cur.fileSize = lseek64(fd, 0, SEEK_END);
+                        // We don't know how much was preallocated; fallocate() of already allocated blocks is cheap anyway
+                        l->cur.preallocated = l->cur.fileSize;
 
                         // TODO: check if index has wideEntries
                         // and set l->cur.index.haveWideEntries accordingly
                         Snprint(basePath, sizeof(basePath), b, curLogSeqNum, ".index");
-                        fd = open(basePath, O_RDWR | O_LARGEFILE | O_CREAT | O_NOATIME | O_APPEND, 0775);
+                        fd = open(basePath, O_RDWR | O_LARGEFILE | O_CREAT | O_NOATIME, 0775);
 
                         if (trace)
                                 SLog("Considering ", basePath, "\n");
@@ -3115,61 +4891,36 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
                                 Service::rebuild_index(l->cur.fdh->fd, fd);
 
                         l->cur.index.fd = fd;
+                        l->cur.index.fdh.reset(new fd_handle(fd));
+                        l->cur.index.fdh->Release();
                         // if this an empty commit log, need to update the index immediately
                         l->cur.sinceLastUpdate = l->cur.fileSize == 0 ? UINT32_MAX : 0;
 
-                        if (const auto size = lseek64(fd, 0, SEEK_END))
+                        if (l->cur.index.haveWideEntries)
                         {
-                                // we don't want to deserialize the skiplist for faster startup
-                                // we 'll mmap the region though
-                                l->cur.index.ondisk.span = size;
-                                l->cur.index.ondisk.data = static_cast<const uint8_t *>(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
-
-                                if (unlikely(l->cur.index.ondisk.data == MAP_FAILED))
-                                        throw Switch::system_error("mmap() failed:", strerror(errno));
-
-                                if (l->cur.index.haveWideEntries)
-                                {
-                                        IMPLEMENT_ME();
-                                }
-                                else
-                                {
-                                        const auto *const p = (uint32_t *)(l->cur.index.ondisk.data + l->cur.index.ondisk.span - sizeof(uint32_t) - sizeof(uint32_t));
+                                IMPLEMENT_ME();
+                        }
 
-                                        l->cur.index.ondisk.lastRecorded.relSeqNum = p[0];
-                                        l->cur.index.ondisk.lastRecorded.absPhysical = p[1];
-                                }
+                        // we don't want to deserialize the index for faster startup
+                        // we 'll mmap it though
+                        l->map_cur_index();
 
-                                if (trace)
-                                {
-                                        SLog("Have cur.index.ondisk.span = ", l->cur.index.ondisk.span, " lastRecorded =  ( relSeqNum = ", l->cur.index.ondisk.lastRecorded.relSeqNum, ", absPhysical = ", l->cur.index.ondisk.lastRecorded.absPhysical, ")\n");
+                        // last recorded tuple in the index
+                        const index_record lastRecorded = l->cur.index.size ? l->cur.index.data[l->cur.index.size - 1] : index_record{0, 0};
 
-#if 1
-                                        if (l->cur.index.haveWideEntries)
-                                        {
-                                                IMPLEMENT_ME();
-                                        }
-                                        else
-                                        {
-                                                for (const auto *it = (uint32_t *)l->cur.index.ondisk.data, *const base = it, *const e = it + l->cur.index.ondisk.span / sizeof(uint32_t); it != e; it += 2)
-                                                {
-                                                        //SLog(it[0], " => ", it[1], "\n");
-                                                        if (it != base)
-                                                        {
-                                                                Drequire(it[0] != it[-2]);
-                                                        }
-                                                }
-                                        }
+                        if (trace)
+                        {
+                                SLog("Have cur.index.size = ", l->cur.index.size, " lastRecorded =  ( relSeqNum = ", lastRecorded.relSeqNum, ", absPhysical = ", lastRecorded.absPhysical, ")\n");
 
-#endif
-                                }
+                                for (uint32_t i{1}; i < l->cur.index.size; ++i)
+                                        Drequire(l->cur.index.data[i].relSeqNum != l->cur.index.data[i - 1].relSeqNum);
                         }
 
                         l->lastAssignedSeqNum = 0;
 
                         if (const auto s = l->cur.fileSize)
                         {
-                                const auto o = l->cur.index.ondisk.lastRecorded.absPhysical;
+                                const auto o = lastRecorded.absPhysical;
                                 // This is somewhat expensive; but we only need to do this once
                                 // We just start from the last tracked-recorded (relSeqNum, absPhysical) and skip bundles until EOF
                                 // keeping track of offsets as we go.
@@ -3179,13 +4930,13 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
 
                                 uint8_t *const data = (uint8_t *)malloc(span);
                                 // first message in the first bundle we 'll parse
-                                uint64_t next = l->cur.index.ondisk.lastRecorded.relSeqNum + l->cur.baseSeqNum;
+                                uint64_t next = lastRecorded.relSeqNum + l->cur.baseSeqNum;
                                 const auto savedNext{next};
                                 int fd = l->cur.fdh->fd;
 
                                 if (trace)
                                 {
-                                        SLog("From lastRecorded.relSeqNum = ", l->cur.index.ondisk.lastRecorded.relSeqNum , ", lastRecorded.absPhysical = ", o, ", cur.baseSeqNum = ", l->cur.baseSeqNum, "\n");
+                                        SLog("From lastRecorded.relSeqNum = ", lastRecorded.relSeqNum , ", lastRecorded.absPhysical = ", o, ", cur.baseSeqNum = ", l->cur.baseSeqNum, "\n");
                                         SLog("span = ", span, ", start from ", next, "\n");
                                 }
 
@@ -3213,6 +4964,21 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
 
 					if (unlikely(bundleLen == 0 || bundleEnd > e))
 					{
+                                                if (saved != data && std::all_of(saved, e, [](const uint8_t c) { return !c; }))
+                                                {
+                                                        // A zeroed tail past the last bundle; the file was extended, but its contents not
+                                                        // persisted before we crashed. Segments are preallocated with FALLOC_FL_KEEP_SIZE, so
+                                                        // this is not expected otherwise; see prealloc_cur_segment()
+                                                        const uint32_t end = o + (saved - data);
+
+                                                        Print("Dropping zeroed tail(", size_repr(s - end), ") of current segment ", bp, "\n");
+                                                        if (ftruncate(fd, end) == -1)
+                                                                throw Switch::system_error("ftruncate() failed:", strerror(errno));
+
+                                                        l->cur.fileSize = l->cur.preallocated = end;
+                                                        break;
+                                                }
+
                                                 const auto ckpt = (lastCheckpoint - data) + o;
 
                                                 Print("Likely corrupt segment(ran out of disk space?).\n");
@@ -3297,8 +5063,91 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
                                         SLog(ansifmt::bold, "Set lastAssignedSeqNum = ", l->lastAssignedSeqNum, ansifmt::reset, "\n");
                         }
 
+                        Snprint(basePath, sizeof(basePath), b, curLogSeqNum, ".tindex");
+                        l->cur.timeIndex.fd = open(basePath, O_RDWR | O_LARGEFILE | O_CREAT | O_NOATIME, 0775);
+
+                        if (l->cur.timeIndex.fd == -1)
+                                throw Switch::system_error("open(", basePath, ") failed:", strerror(errno), ". Cannot open current segment time index");
+
+                        if (const auto fileSize = l->cur.fileSize)
+                        {
+                                const auto timeIndexFd = l->cur.timeIndex.fd;
+                                auto &timeRecords = l->cur.timeIndex.records;
+                                auto *const fileData = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, l->cur.fdh->fd, 0);
+
+                                if (fileData == MAP_FAILED)
+                                        throw Switch::system_error("Unable to mmap():", strerror(errno));
+
+                                Defer({ munmap(fileData, fileSize); });
+
+                                if (lseek64(timeIndexFd, 0, SEEK_END) < sizeof(time_index_record))
+                                        Service::rebuild_index(l->cur.fdh->fd, -1, timeIndexFd, false);
+
+                                timeRecords.resize(lseek64(timeIndexFd, 0, SEEK_END) / sizeof(time_index_record));
+                                if (pread64(timeIndexFd, timeRecords.data(), timeRecords.size() * sizeof(time_index_record), 0) != timeRecords.size() * sizeof(time_index_record))
+                                        throw Switch::system_error("Failed to read time index:", strerror(errno));
+
+                                // Drop records of bundles that didn't make it to the log; see map_cur_index()
+                                while (timeRecords.size() && timeRecords.back().absPhysical >= fileSize)
+                                        timeRecords.pop_back();
+
+                                if (ftruncate(timeIndexFd, timeRecords.size() * sizeof(time_index_record)) == -1)
+                                        throw Switch::system_error("Failed to truncate time index:", strerror(errno));
+
+                                l->cur.timeIndex.persisted = timeRecords.size();
+
+                                // The max timestamp of the bundles past the last record
+                                // Records are written in batches, so we also restore the records for the index records past the last record
+                                const auto *const base = static_cast<const uint8_t *>(fileData);
+                                const auto *const indexEnd = l->cur.index.data + l->cur.index.size;
+                                const auto *indexIt = l->cur.index.data;
+                                uint64_t maxTS{0};
+
+                                if (timeRecords.size())
+                                {
+                                        const auto lastRecorded = timeRecords.back().absPhysical;
+
+                                        maxTS = timeRecords.back().ts;
+                                        indexIt = std::upper_bound(indexIt, indexEnd, lastRecorded, [](const uint32_t absPhysical, const index_record &r) {
+                                                return absPhysical < r.absPhysical;
+                                        });
+                                }
+
+                                for (const auto *p = base + (timeRecords.size() ? timeRecords.back().absPhysical : 0), *const e = base + fileSize; p < e;)
+                                {
+                                        const uint32_t bundleOffset = p - base;
+                                        const auto bundleLen = Compression::UnpackUInt32(p);
+                                        const auto nextBundle = p + bundleLen;
+
+                                        if (!bundleLen || nextBundle > e)
+                                                break;
+
+                                        while (indexIt != indexEnd && indexIt->absPhysical < bundleOffset)
+                                                ++indexIt;
+
+                                        if (indexIt != indexEnd && indexIt->absPhysical == bundleOffset)
+                                        {
+                                                timeRecords.push_back({maxTS, indexIt->relSeqNum, bundleOffset});
+                                                ++indexIt;
+                                        }
+
+                                        maxTS = std::max(maxTS, bundle_first_msg_ts(p, nextBundle));
+                                        p = nextBundle;
+                                }
+
+                                l->cur.timeIndex.maxTS = maxTS;
+                                if (!l->persist_cur_time_index())
+                                        throw Switch::system_error("Failed to update time index:", strerror(errno));
+
+                                if (l->config.bundleIndex)
+                                {
+                                        // The current segment's per-bundle index is not persisted; rebuild it from the log
+                                        madvise(fileData, fileSize, MADV_SEQUENTIAL);
+                                        index_bundles(base, base + fileSize, l->cur.baseSeqNum, l->cur.bundles);
+                                }
+                        }
+
                         // Just in case
-                        lseek64(l->cur.index.fd, 0, SEEK_END);
                         lseek64(l->cur.fdh->fd, 0, SEEK_END);
 
                         if (const uint32_t max = l->config.maxRollJitterSecs)
@@ -3318,6 +5167,7 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
                         l->cur.nameEncodesTS = curLogCreateTS;
                         l->cur.flush_state.pendingFlushMsgs = 0;
                         l->cur.flush_state.nextFlushTS = config.flushIntervalSecs ? now + config.flushIntervalSecs : UINT32_MAX;
+                        l->cur.flush_state.writeback.Set(l->cur.fileSize, 0);
 
 			Drequire(l->lastAssignedSeqNum >= l->cur.baseSeqNum); // Added 10.01.2k17
 
@@ -3343,6 +5193,9 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
                         }
                 }
 
+                // Whatever we found on disk
+                l->durableSeqNum = l->lastAssignedSeqNum;
+
                 return partition;
         }
         catch (const std::exception &e)
@@ -3353,12 +5206,15 @@ Switch::shared_refptr<topic_partition> Service::init_local_partition(const uint1
         }
 }
 
-bool Service::process_consume(connection *const c, const uint8_t *p, const size_t len)
+// If mustRespond is set, we respond with whatever is available, instead of waiting for more content; see register_consumer_wait()
+bool Service::process_consume(connection *const c, const uint8_t *p, const size_t len, const bool mustRespond)
 {
+        const auto req = p;
+
         try
         {
                 auto respHeader = get_buffer();
-                bool respondNow{false};
+                bool respondNow{mustRespond};
                 const auto replicaId = c->replicaId;
 
                 const auto clientVersion = *(uint16_t *)p;
@@ -3392,6 +5248,8 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                 size_t sum{0};
                 uint32_t patchListSize{0};
                 uint8_t patchIndices[256];
+                uint64_t deferHWMarks[256];
+                [[maybe_unused]] bool pendingReadaheads{false};
 
 		// TODO: https://github.com/phaistos-networks/TANK/issues/12
                 patchList[0].offset = 0;
@@ -3469,6 +5327,11 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                                         patchList[patchListSize++].SetEnd(l);
                                         patchIndices[deferList.size()] = patchListSize++;
                                         patchList[patchListSize].offset = l;
+                                        {
+                                                std::lock_guard<Switch::mutex> g(partition->lock);
+
+                                                deferHWMarks[deferList.size()] = partition->highwater_mark();
+                                        }
                                         deferList.push_back(partition);
                                 }
                                 else
@@ -3476,7 +5339,7 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                                         const bool fetchOnlyFromLeader = replicaId != UINT16_MAX; // UINT16_MAX replica is the debug consumer ID
                                         const bool fetchOnlyCommitted = replicaId == 0;           // for clients, only comitted
                                         auto res = partition->read_from_local(fetchOnlyFromLeader, fetchOnlyCommitted,
-                                                                              absSeqNum, fetchSize);
+                                                                              absSeqNum, fetchSize, c->cursor_for(partition));
                                         const auto hwMark = res.highWatermark;
                                         range32_t range;
                                         bool firstBundleIsSparse;
@@ -3511,6 +5374,14 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                                                         respHeader->Serialize(hwMark);
                                                         respHeader->Serialize(range.len);
 
+                                                        if (range.stop() == res.fileOffsetCeiling)
+                                                        {
+                                                                // We are streaming everything up to the end of the segment, so the next request
+                                                                // will likely be for (hwMark + 1). This is only meaningful if this is the current segment, but
+                                                                // read_from_local() will check for that
+                                                                c->update_cursor(partition, hwMark + 1, res.fdh.get(), range.stop());
+                                                        }
+
 #ifdef __linux__
                                                         // Initiate readahead on that range so that our subsequent sendfile() from that file will be satisfied from the cache, and will not block on disk I/O
                                                         // (assuming we have initiated readahead early enough and other activity on the system did not in the meantime flush pages from cache)
@@ -3531,8 +5402,19 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                                                         {
                                                                 // See https://github.com/phaistos-networks/TANK/issues/14 for measurements
                                                                 const uint64_t b = trace ? Timings::Microseconds::Tick() : 0;
+#ifdef SWITCH_HAVE_IOURING
+                                                                auto ring = io_ring();
+                                                                auto sqe = ring ? ring->get_sqe() : nullptr;
 
-                                                                readahead(res.fdh->fd, range.offset, range.len);
+                                                                if (sqe)
+                                                                {
+                                                                        // Will be submitted along with all other readahead requests for this request, see below
+                                                                        IOURing::prep_fadvise(sqe, res.fdh->fd, range.offset, range.len, POSIX_FADV_WILLNEED, 0);
+                                                                        pendingReadaheads = true;
+                                                                }
+                                                                else
+#endif
+                                                                        readahead(res.fdh->fd, range.offset, range.len);
 
                                                                 if (trace)
                                                                         SLog("Took ", duration_repr(Timings::Microseconds::Since(b)), " for readahead(", range, ") ", size_repr(range.len), "\n");
@@ -3557,6 +5439,7 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                                                         patchList[patchListSize++].SetEnd(l);
                                                         patchIndices[deferList.size()] = patchListSize++;
                                                         patchList[patchListSize].offset = l;
+                                                        deferHWMarks[deferList.size()] = hwMark;
                                                         deferList.push_back(partition);
                                                         break;
                                                 }
@@ -3576,6 +5459,8 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                                                         respHeader->Serialize(uint32_t(0));
                                                         {
                                                                 // Only for this specific fault
+                                                                std::lock_guard<Switch::mutex> g(partition->lock);
+
                                                                 respHeader->Serialize<uint64_t>(partition->log_->firstAvailableSeqNum);
                                                         }
                                                         respondNow = true;
@@ -3585,6 +5470,15 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                         }
                 }
 
+#ifdef SWITCH_HAVE_IOURING
+                if (pendingReadaheads)
+                {
+                        // All readahead requests are submitted with a single io_uring_enter(), before we get to send the response
+                        // We don't care about their outcome; their CQEs are reaped along with all others, see complete_pending_appends()
+                        io_ring()->submit();
+                }
+#endif
+
                 if (trace)
                         SLog("respondNow = ", respondNow, ", maxWait = ", maxWait, "\n");
 
@@ -3609,6 +5503,7 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                                 const auto o = respHeader->size();
                                 auto p = deferList[i];
                                 auto log = p->log_.get();
+                                std::lock_guard<Switch::mutex> g(p->lock);
 
                                 respHeader->Serialize(uint8_t(0));
                                 respHeader->Serialize(log->firstAvailableSeqNum);
@@ -3660,7 +5555,19 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
                                 c->outQ = nullptr;
                         }
 
-                        return register_consumer_wait(c, requestId, maxWait, minBytes, deferList.data(), deferList.size());
+                        if (!register_consumer_wait(c, requestId, maxWait, minBytes, deferList.data(), deferHWMarks, deferList.size()))
+                        {
+                                // Another reactor appended to one of those partitions before we got to register the wait context
+                                // Process the request again, and respond immediately this time, so that we won't retry indefinitely
+                                // if those partitions keep getting appended to
+                                if (trace)
+                                        SLog("Partitions were updated while registering wait context; retrying\n");
+
+                                require(!mustRespond);
+                                return process_consume(c, req, len, true);
+                        }
+
+                        return true;
                 }
         }
         catch (const std::exception &e)
@@ -3672,8 +5579,12 @@ bool Service::process_consume(connection *const c, const uint8_t *p, const size_
         }
 }
 
-bool Service::register_consumer_wait(connection *const c, const uint32_t requestId, const uint64_t maxWait, const uint32_t minBytes, topic_partition **const partitions, const uint32_t totalPartitions)
+// Returns false if any of the partitions highwater marks no longer match `hwMarks`, in which case
+// the wait context is not registered
+bool Service::register_consumer_wait(connection *const c, const uint32_t requestId, const uint64_t maxWait, const uint32_t minBytes, topic_partition **const partitions, const uint64_t *const hwMarks, const uint32_t totalPartitions)
 {
+        bool updated{false};
+
         auto ctx = get_waitctx(totalPartitions);
 
         if (trace)
@@ -3682,8 +5593,9 @@ bool Service::register_consumer_wait(connection *const c, const uint32_t request
         switch_dlist_init(&ctx->list);
         switch_dlist_init(&ctx->expList);
         ctx->requestId = requestId;
-	ctx->scheduledForDtor = false;
+	__atomic_store_n(&ctx->scheduledForDtor, false, __ATOMIC_RELAXED);
         ctx->c = c;
+        ctx->reactor = this;
         ctx->partitionsCnt = totalPartitions;
         ctx->minBytes = minBytes;
         ctx->capturedSize = 0;
@@ -3691,8 +5603,10 @@ bool Service::register_consumer_wait(connection *const c, const uint32_t request
 
         if (maxWait)
         {
-                ctx->expiration = Timings::Milliseconds::Tick() + maxWait;
-                switch_dlist_insert_after(&waitExpList, &ctx->expList);
+                const auto now = Timings::Milliseconds::Tick();
+
+                ctx->expiration = maxWait >= UINT64_MAX - now ? UINT64_MAX : now + maxWait;
+                waitCtxTimers.add(ctx);
         }
         else
                 ctx->expiration = 0;
@@ -3705,12 +5619,22 @@ bool Service::register_consumer_wait(connection *const c, const uint32_t request
                 if (trace)
                         SLog("Partition ", ptr_repr(p), "\n");
 
-                p->waitingList.push_back(ctx);
-
                 out->partition = p;
                 out->fdh = nullptr;
                 out->range.reset();
                 out->seqNum = 0;
+
+                std::lock_guard<Switch::mutex> g(p->lock);
+
+                p->waitingList.push_back(ctx);
+                if (p->highwater_mark() != hwMarks[i])
+                        updated = true;
+        }
+
+        if (updated)
+        {
+                destroy_wait_ctx(ctx);
+                return false;
         }
 
         return true;
@@ -3825,7 +5749,23 @@ bool Service::process_create_topic(connection *const c, const uint8_t *p, const
 
                                 t->register_partitions(list.data(), list.size());
 
-                                register_topic(t.release());
+                                register_topic(t.get());
+
+                                // Other reactors need to know about it as well
+                                for (auto r : reactors)
+                                {
+                                        if (r != this)
+                                        {
+                                                auto ptr = t.get();
+
+                                                ptr->Retain();
+                                                r->run_on_reactor(new mainthread_closure([r, ptr]() {
+                                                        r->register_topic(ptr);
+                                                }));
+                                        }
+                                }
+
+                                t.release();
                                 resp->Serialize(uint8_t(0));
                         }
                         catch (...)
@@ -3862,67 +5802,684 @@ bool Service::process_discover_partitions(connection *const c, const uint8_t *p,
                 return shutdown(c, __LINE__);
         }
 
-        auto q = c->outQ;
-        auto resp = get_buffer();
-        const auto requestId = *(uint32_t *)p;
-        p += sizeof(uint32_t);
-        const strwlen8_t topicName((char *)p + 1, *p);
+        auto q = c->outQ;
+        auto resp = get_buffer();
+        const auto requestId = *(uint32_t *)p;
+        p += sizeof(uint32_t);
+        const strwlen8_t topicName((char *)p + 1, *p);
+
+        p += topicName.len + sizeof(uint8_t);
+
+        if (!q)
+                q = c->outQ = get_outgoing_queue();
+
+        resp->Serialize(uint8_t(TankAPIMsgType::DiscoverPartitions));
+        const auto sizeOffset = resp->size();
+
+        resp->RoomFor(sizeof(uint32_t));
+        resp->Serialize(requestId);
+
+        auto topic = topic_by_name(topicName);
+
+        resp->Serialize(topicName.len);
+        resp->Serialize(topicName.p, topicName.len);
+
+        if (!topic)
+                resp->Serialize(uint16_t(0));
+        else
+        {
+                const auto n = topic->partitions_->size();
+
+                resp->Serialize(uint16_t(n));
+                resp->reserve(n * (sizeof(uint64_t) + sizeof(uint64_t)));
+
+                for (const auto it : *topic->partitions_)
+                {
+                        auto log = it->log_.get();
+                        std::lock_guard<Switch::mutex> g(it->lock);
+
+                        resp->Serialize(log->firstAvailableSeqNum);
+                        resp->Serialize(log->committed_seqnum());
+                }
+        }
+
+        *(uint32_t *)resp->At(sizeOffset) = resp->size() - sizeOffset - sizeof(uint32_t);
+
+        auto payload = q->push_back(resp);
+
+        payload->iovCnt = 1;
+        payload->iov[0] = {(void *)resp->data(), resp->size()};
+
+        return try_send_ifnot_blocked(c);
+}
+
+bool Service::process_seqnums_for_ts(connection *const c, const uint8_t *p, const size_t len)
+{
+        if (unlikely(len < sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint16_t)))
+        {
+                if (trace)
+                        SLog("Unexpected len = ", len, "\n");
+
+                return shutdown(c, __LINE__);
+        }
+
+        const auto *const e = p + len;
+        auto q = c->outQ;
+        const auto requestId = *(uint32_t *)p;
+        p += sizeof(uint32_t);
+        const strwlen8_t topicName((char *)p + 1, *p);
+
+        p += topicName.len + sizeof(uint8_t);
+
+        if (unlikely(p + sizeof(uint16_t) > e))
+                return shutdown(c, __LINE__);
+
+        const auto partitionsCnt = *(uint16_t *)p;
+
+        p += sizeof(uint16_t);
+
+        if (unlikely(p + partitionsCnt * (sizeof(uint16_t) + sizeof(uint64_t)) > e))
+                return shutdown(c, __LINE__);
+
+        auto resp = get_buffer();
+
+        if (!q)
+                q = c->outQ = get_outgoing_queue();
+
+        resp->Serialize(uint8_t(TankAPIMsgType::SeqNumsForTS));
+        const auto sizeOffset = resp->size();
+
+        resp->RoomFor(sizeof(uint32_t));
+        resp->Serialize(requestId);
+
+        auto topic = topic_by_name(topicName);
+
+        resp->Serialize(topicName.len);
+        resp->Serialize(topicName.p, topicName.len);
+
+        if (!topic)
+                resp->Serialize(uint16_t(0));
+        else
+        {
+                resp->Serialize(partitionsCnt);
+                resp->reserve(partitionsCnt * (sizeof(uint16_t) + sizeof(uint8_t) + sizeof(uint64_t)));
+
+                for (uint32_t i{0}; i != partitionsCnt; ++i)
+                {
+                        const auto partitionId = *(uint16_t *)p;
+                        p += sizeof(uint16_t);
+                        const auto ts = *(uint64_t *)p;
+                        p += sizeof(uint64_t);
+                        auto partition = topic->partition(partitionId);
+
+                        resp->Serialize(partitionId);
+
+                        if (!partition)
+                        {
+                                resp->Serialize(uint8_t(0xff));
+                                continue;
+                        }
+
+                        auto log = partition->log_.get();
+                        std::lock_guard<Switch::mutex> g(partition->lock);
+
+                        resp->Serialize(uint8_t(0));
+                        resp->Serialize(log->seqnum_for_ts(ts));
+                }
+        }
+
+        *(uint32_t *)resp->At(sizeOffset) = resp->size() - sizeOffset - sizeof(uint32_t);
+
+        auto payload = q->push_back(resp);
+
+        payload->iovCnt = 1;
+        payload->iov[0] = {(void *)resp->data(), resp->size()};
+
+        return try_send_ifnot_blocked(c);
+}
+
+// Stores the dictionary `dict` in the topic directory as compression.<id>.dict, unless it's already there
+static bool persist_compression_dict(const strwlen8_t topicName, const Compression::zstd_dictionary *const dict)
+{
+        const auto path = Buffer::build(basePath_, "/", topicName, "/compression.", dict->id, ".dict");
+        const auto tmpPath = Buffer::build(basePath_, "/", topicName, "/.compression.dict.tmp");
+
+        if (access(path.data(), F_OK) == 0)
+                return true;
+
+        int fd = open(tmpPath.data(), O_WRONLY | O_CREAT | O_TRUNC | O_LARGEFILE, 0664);
+
+        if (fd == -1)
+                return false;
+        else if (write(fd, dict->content.data(), dict->content.size()) != ssize_t(dict->content.size()) || fdatasync(fd) == -1)
+        {
+                close(fd);
+                unlink(tmpPath.data());
+                return false;
+        }
+
+        close(fd);
+        if (Rename(tmpPath.data(), path.data()) == -1)
+        {
+                unlink(tmpPath.data());
+                return false;
+        }
+
+        return true;
+}
+
+// Makes `dict` the topic's current dictionary, by (atomically) replacing the compression.dict link
+//
+// All dictionaries are kept(as compression.<id>.dict), and loaded on startup, because bundles compressed with any of them may still be around.
+// If there is a current dictionary, it is also stored by ID first; a compression.dict created before we kept dictionaries by ID is a regular file
+static bool set_topic_compression_dict(const strwlen8_t topicName, const Compression::zstd_dictionary *const prev, const Compression::zstd_dictionary *const dict)
+{
+        const auto path = Buffer::build(basePath_, "/", topicName, "/compression.dict");
+        const auto tmpPath = Buffer::build(basePath_, "/", topicName, "/.compression.dict.lnk");
+        const auto target = Buffer::build("compression.", dict->id, ".dict");
+
+        if ((prev && !persist_compression_dict(topicName, prev)) || !persist_compression_dict(topicName, dict))
+                return false;
+
+        unlink(tmpPath.data());
+        if (symlink(target.data(), tmpPath.data()) == -1)
+                return false;
+        else if (Rename(tmpPath.data(), path.data()) == -1)
+        {
+                unlink(tmpPath.data());
+                return false;
+        }
+
+        return true;
+}
+
+bool Service::process_compression_dict(connection *const c, const uint8_t *p, const size_t len)
+{
+        if (unlikely(len < sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint8_t)))
+        {
+                if (trace)
+                        SLog("Unexpected len = ", len, "\n");
+
+                return shutdown(c, __LINE__);
+        }
+
+        const auto *const e = p + len;
+        auto q = c->outQ;
+        const auto requestId = *(uint32_t *)p;
+        p += sizeof(uint32_t);
+        const strwlen8_t topicName((char *)p + 1, *p);
+
+        p += topicName.len + sizeof(uint8_t);
+
+        if (unlikely(p + sizeof(uint32_t) >= e))
+                return shutdown(c, __LINE__);
+
+        const auto reqDictId = *(uint32_t *)p;
+        p += sizeof(uint32_t);
+
+        if (unlikely(!Compression::UnpackUInt32Check(p, e)))
+                return shutdown(c, __LINE__);
+
+        const auto dictLen = Compression::UnpackUInt32(p);
+
+        if (unlikely(p + dictLen > e))
+                return shutdown(c, __LINE__);
+
+        auto resp = get_buffer();
+
+        if (!q)
+                q = c->outQ = get_outgoing_queue();
+
+        resp->Serialize(uint8_t(TankAPIMsgType::CompressionDict));
+        const auto sizeOffset = resp->size();
+
+        resp->RoomFor(sizeof(uint32_t));
+        resp->Serialize(requestId);
+        resp->Serialize(topicName.len);
+        resp->Serialize(topicName.p, topicName.len);
+
+        auto topic = topic_by_name(topicName);
+
+        if (!topic)
+                resp->Serialize<uint8_t>(1); // unknown topic
+        else if (dictLen)
+        {
+                const auto prevId = topic->compressionDictId.load(std::memory_order_relaxed);
+                const auto id = dictLen <= MaxCompressionDictSize ? Compression::RegisterZstdDictionary(p, dictLen) : 0;
+
+                if (!id)
+                {
+                        if (dictLen <= MaxCompressionDictSize && Compression::ZstdDictionaryConflicts(p, dictLen))
+                                resp->Serialize<uint8_t>(5); // a different dictionary with the same ID exists
+                        else
+                                resp->Serialize<uint8_t>(3); // invalid dictionary
+                }
+                else if (!set_topic_compression_dict(topicName, prevId && prevId != id ? Compression::ZstdDictionary(prevId) : nullptr, Compression::ZstdDictionary(id)))
+                        resp->Serialize<uint8_t>(4); // system error
+                else
+                {
+                        // Topics are shared by all reactors
+                        topic->compressionDictId.store(id, std::memory_order_relaxed);
+
+                        resp->Serialize<uint8_t>(0);
+                        resp->Serialize<uint32_t>(id);
+                        resp->Serialize<uint8_t>(1);
+                        resp->SerializeVarUInt32(0);
+                }
+        }
+        else
+        {
+                // Dictionaries are identified by their ID across all topics, because that's all that compressed frames record
+                const auto currentId = topic->compressionDictId.load(std::memory_order_relaxed);
+                const auto id = reqDictId ?: currentId;
+                const auto dict = id ? Compression::ZstdDictionary(id) : nullptr;
+
+                if (!dict)
+                        resp->Serialize<uint8_t>(reqDictId ? 6 : 2); // unknown dictionary ID, or the topic has no dictionary
+                else
+                {
+                        resp->Serialize<uint8_t>(0);
+                        resp->Serialize<uint32_t>(id);
+                        resp->Serialize(uint8_t(id == currentId));
+                        resp->SerializeVarUInt32(dict->content.size());
+                        resp->Serialize(dict->content.data(), dict->content.size());
+                }
+        }
+
+        *(uint32_t *)resp->At(sizeOffset) = resp->size() - sizeOffset - sizeof(uint32_t);
+
+        auto payload = q->push_back(resp);
+
+        payload->iovCnt = 1;
+        payload->iov[0] = {(void *)resp->data(), resp->size()};
+
+        return try_send_ifnot_blocked(c);
+}
+
+bool Service::process_replica_reg(connection *const c, const uint8_t *p, const size_t len)
+{
+        if (unlikely(len < sizeof(uint16_t)))
+                return shutdown(c, __LINE__);
+
+        c->replicaId = *(uint16_t *)p;
+
+        if (unlikely(c->replicaId == 0))
+                return shutdown(c, __LINE__);
+
+        return true;
+}
+
+// Invokes l() for each distinct partition of bundles, which are sorted by partition; see Service::append_produce_batch()
+template <typename L>
+static void for_each_partition(const Switch::vector<produce_bundle> &bundles, L &&l)
+{
+        for (uint32_t i{0}, n = bundles.size(); i != n; ++i)
+        {
+                if (!i || bundles[i].partition != bundles[i - 1].partition)
+                        l(bundles[i].partition);
+        }
+}
+
+// Invoked before the staged appends of batch that haven't been committed yet are written with the partition locks released
+// Until they are committed, readers are bounded by the log state before they were staged; see topic_partition_log::unwritten
+static void mark_unwritten(const append_batch &batch)
+{
+        for (const auto &s : batch.segments)
+        {
+                if (!s.committed)
+                {
+                        auto &u = s.log->unwritten;
+
+                        u.lastAssignedSeqNum = s.savedLastAssignedSeqNum;
+                        u.fileSize = s.savedFileSize;
+                        u.bundlesCnt = s.savedBundlesCnt;
+                        u.indexSize = s.savedIndexSize;
+                        u.timeIndexSize = s.savedTimeIndexSize;
+                        u.active = true;
+                }
+        }
+}
+
+#ifdef SWITCH_HAVE_IOURING
+// Consumes all available CQEs
+// User data points to the staged_append of a writev, or is 0 for requests we don't care about(readahead requests, see process_consume())
+static void reap_io_ring(IOURing *const ring)
+{
+        ring->for_each_cqe([](const uint64_t userData, const int res) {
+                if (userData)
+                {
+                        auto s = reinterpret_cast<staged_append *>(userData);
+
+                        s->writevRes = res;
+                        s->writing = false;
+                }
+        });
+}
+
+// Prepares a writev SQE for each staged append of batch that hasn't been committed yet
+// They are submitted along with all other SQEs prepared in this I/O loop iteration, unless they need to be submitted sooner
+static void prep_staged(IOURing *const ring, append_batch &batch)
+{
+        for (auto &s : batch.segments)
+        {
+                if (s.committed)
+                        continue;
+
+                struct io_uring_sqe *sqe;
+
+                while (!(sqe = ring->get_sqe()))
+                {
+                        // The submission queue is full
+                        if (ring->submit() == -1)
+                        {
+                                RFLog("io_uring_enter() failed:", strerror(errno), "\n");
+                                reap_io_ring(ring);
+                        }
+                }
+
+                IOURing::prep_writev(sqe, s.fdh->fd, batch.iov.data() + s.iovOffset, s.iovCnt, uint64_t(-1), uintptr_t(&s));
+                s.writing = true;
+        }
+}
+#endif
+
+// Performs the writev() of all staged appends in batch that haven't been committed yet, and waits for them
+// If io_uring is used, they are all submitted with a single io_uring_enter()
+static void write_staged(append_batch &batch)
+{
+#ifdef SWITCH_HAVE_IOURING
+        if (auto ring = io_ring())
+        {
+                prep_staged(ring, batch);
+
+                while (std::any_of(batch.segments.begin(), batch.segments.end(), [](const staged_append &s) { return s.writing; }))
+                {
+                        if (ring->submit_and_wait(1) == -1)
+                                RFLog("io_uring_enter() failed:", strerror(errno), "\n");
+
+                        reap_io_ring(ring);
+                }
+
+                return;
+        }
+#endif
+
+        for (auto &s : batch.segments)
+        {
+                if (s.committed)
+                        continue;
+
+                s.writevRes = writev(s.fdh->fd, batch.iov.data() + s.iovOffset, s.iovCnt);
+                if (s.writevRes == -1)
+                        s.writevRes = -errno;
+        }
+}
+
+void Service::commit_staged(staged_append &s, const bool durable)
+{
+        if (s.log->commit_staged(s, curTime, durable ? this : nullptr))
+        {
+                append_res res{s.fdh, {s.savedFileSize, s.len}, {s.firstAbsSeqNum, uint16_t(s.msgsCnt)}};
+
+                s.log->partition->consider_append_res(res, expiredCtxList3, this);
+        }
+}
+
+// Commits the staged appends of batch that have been written since mark_unwritten()
+// Invoked while holding the partition locks
+void Service::commit_written(append_batch &batch, const bool durable)
+{
+        for (auto &s : batch.segments)
+        {
+                if (!s.committed)
+                {
+                        s.log->unwritten.active = false;
+                        commit_staged(s, durable);
+                }
+        }
+}
+
+// Acquires the partitions of produceBundles(sorted by partition) for appending, in address order, so that reactors appending to
+// overlapping sets of partitions won't deadlock.
+// If a partition is being appended to, we complete our own pending appends before we wait for it; it may be one of them, and otherwise
+// two reactors waiting for partitions of each other's pending appends would never get to complete them
+void Service::acquire_for_append(connection *const c)
+{
+        for_each_partition(produceBundles, [this, c](topic_partition *const p) {
+                std::unique_lock<Switch::mutex> g(p->lock);
+
+                if (p->appender)
+                {
+                        g.unlock();
+                        complete_pending_appends(true, c);
+                        g.lock();
+                        p->appendDone.wait(g, [p]() { return !p->appender; });
+                }
+
+                p->appender = this;
+        });
+}
+
+// Commits the staged appends of batch once written, sets the status of the bundles that failed, and releases their partitions
+void Service::commit_appended(append_batch &batch, Switch::vector<produce_bundle> &bundles, const bool durable)
+{
+        for_each_partition(bundles, [](topic_partition *const p) { p->lock.lock(); });
+
+        commit_written(batch, durable);
+
+        for (auto &b : bundles)
+        {
+                if (b.segmentIdx != UINT32_MAX && batch.segments[b.segmentIdx].failed)
+                {
+                        // System error
+                        b.status = 10;
+                }
+        }
+
+        for_each_partition(bundles, [](topic_partition *const p) {
+                p->appender = nullptr;
+                p->lock.unlock();
+                p->appendDone.notify_all();
+        });
+}
+
+// Wakes up the wait contexts collected while committing appends
+void Service::wakeup_appended(connection *const produceConnection)
+{
+        if (trace)
+                SLog("Will wake up ", expiredCtxList3.size(), "\n");
+
+        while (expiredCtxList3.size())
+        {
+                auto ctx = expiredCtxList3.Pop();
+
+                // The same context may have been collected for multiple partitions
+                if (!ctx->scheduledForDtor)
+                        wakeup_wait_ctx(ctx, {}, produceConnection);
+        }
+}
+
+// Sets the status of each of the bundles in the produce response resp(queued in payload), and releases it
+// unless it's held for durable acks
+void Service::respond_produce(connection *const c, IOBuffer *const resp, void *const payload, const Switch::vector<produce_bundle> &bundles, const bool durable, const uint32_t ackTimeout)
+{
+        for (const auto &it : bundles)
+                *(uint8_t *)resp->At(it.statusOffset) = it.status;
+
+        if (durable)
+                hold_for_durable_ack(c, resp, payload, bundles, ackTimeout);
+        else
+        {
+                auto p = static_cast<outgoing_queue::payload *>(payload);
+
+                p->iovCnt = 1;
+                p->iov[0] = {(void *)resp->data(), resp->size()};
+        }
+}
+
+// Appends all bundles of a produce request(produceBundles), sets their status in its response resp(queued in payload), and releases it
+//
+// Bundles are grouped by partition, and all bundles of a partition are appended to its current segment with a single writev(), instead
+// of one writev() per bundle. consider_append_res() is invoked once for each partition, and all wait contexts that need to be woken up
+// are woken up in a single pass, once all partitions have been unlocked.
+//
+// The partitions are only locked while the bundles are staged and committed; they are written with the partitions unlocked, so that
+// consumers and wait contexts won't wait for the writes. They are acquired for appending throughout instead; see topic_partition::appender
+// If io_uring is used, we don't wait for the writes; the response is held until they complete, see pending_append
+//
+// If durable is set, all partitions appended to are synced, regardless of their flush policy; see durable_ack
+void Service::append_produce_batch(connection *const c, IOBuffer *const resp, void *const payload, const bool durable, const uint32_t ackTimeout)
+{
+        auto &bundles = produceBundles;
+        auto &batch = appendBatch;
+
+        std::stable_sort(bundles.begin(), bundles.end(), [](const produce_bundle &a, const produce_bundle &b) { return a.partition < b.partition; });
+        acquire_for_append(c);
+        for_each_partition(bundles, [](topic_partition *const p) { p->lock.lock(); });
+
+        batch.clear();
+        for (auto &b : bundles)
+        {
+                auto log = b.partition->log_.get();
+
+                if (batch.segments.size())
+                {
+                        auto &s = batch.segments.back();
+
+                        if (s.log == log && !s.committed && (s.bundlesCnt == 256 || log->should_roll(curTime)))
+                        {
+                                // The bundles staged so far need to be written before the segment is rolled
+                                // (and we don't want to exceed IOV_MAX)
+                                // This is rare enough that we can wait for the writes, even if io_uring is used
+                                mark_unwritten(batch);
+                                for_each_partition(bundles, [](topic_partition *const p) { p->lock.unlock(); });
+                                write_staged(batch);
+                                for_each_partition(bundles, [](topic_partition *const p) { p->lock.lock(); });
+                                commit_written(batch, durable);
+                        }
+                }
+
+                // TODO: route to leader
+                try
+                {
+                        log->stage_bundle(curTime, b, batch);
+                }
+                catch (const std::exception &e)
+                {
+                        RFLog("Failed, cought exception:", e.what(), "\n");
+                        b.status = 10;
+                }
+        }
+
+        mark_unwritten(batch);
+        for_each_partition(bundles, [](topic_partition *const p) { p->lock.unlock(); });
 
-        p += topicName.len + sizeof(uint8_t);
+#ifdef SWITCH_HAVE_IOURING
+        if (auto ring = io_ring())
+        {
+                if (std::any_of(batch.segments.begin(), batch.segments.end(), [](const staged_append &s) { return !s.committed; }))
+                {
+                        auto pa = new pending_append();
+
+                        pa->c = c;
+                        pa->resp = resp;
+                        pa->payload = payload;
+                        pa->inB = std::exchange(c->inB, nullptr);
+                        pa->durable = durable;
+                        pa->ackTimeout = ackTimeout;
+                        std::swap(pa->bundles, bundles);
+                        std::swap(pa->batch, batch);
+                        prep_staged(ring, pa->batch);
 
-        if (!q)
-                q = c->outQ = get_outgoing_queue();
+                        if (trace)
+                                SLog("Pending append of ", pa->bundles.size(), " bundles\n");
 
-        resp->Serialize(uint8_t(TankAPIMsgType::DiscoverPartitions));
-        const auto sizeOffset = resp->size();
+                        // The response has no iovecs until it's released
+                        static_cast<outgoing_queue::payload *>(payload)->iovCnt = 0;
+                        ++c->pendingAppends;
+                        pendingAppends.push_back(pa);
+                        return;
+                }
+        }
+#endif
 
-        resp->RoomFor(sizeof(uint32_t));
-        resp->Serialize(requestId);
+        write_staged(batch);
+        commit_appended(batch, bundles, durable);
+        batch.clear();
 
-        auto topic = topic_by_name(topicName);
+        if (trace)
+                SLog("Appended ", bundles.size(), " bundles\n");
 
-        resp->Serialize(topicName.len);
-        resp->Serialize(topicName.p, topicName.len);
+        respond_produce(c, resp, payload, bundles, durable, ackTimeout);
+        wakeup_appended(c);
+}
 
-        if (!topic)
-                resp->Serialize(uint16_t(0));
-        else
+// Submits the SQEs prepared so far, reaps all available CQEs, and completes the pending appends all writes of which have completed
+// If wait is set, it waits until all pending appends are completed
+//
+// The connection produceConnection is processing a produce request; see wakeup_wait_ctx()
+void Service::complete_pending_appends(const bool wait, connection *const produceConnection)
+{
+#ifdef SWITCH_HAVE_IOURING
+        auto ring = io_ring();
+
+        if (!ring)
+                return;
+
+        for (;;)
         {
-                const auto n = topic->partitions_->size();
+                if ((wait && pendingAppends.size() ? ring->submit_and_wait(1) : ring->submit()) == -1)
+                        RFLog("io_uring_enter() failed:", strerror(errno), "\n");
 
-                resp->Serialize(uint16_t(n));
-                resp->reserve(n * (sizeof(uint64_t) + sizeof(uint64_t)));
+                reap_io_ring(ring);
 
-                for (const auto it : *topic->partitions_)
+                for (uint32_t i{0}; i < pendingAppends.size();)
                 {
-                        auto log = it->log_.get();
+                        auto pa = pendingAppends[i];
+                        auto c = pa->c;
 
-                        resp->Serialize(log->firstAvailableSeqNum);
-                        resp->Serialize(log->lastAssignedSeqNum);
-                }
-        }
+                        if (std::any_of(pa->batch.segments.begin(), pa->batch.segments.end(), [](const staged_append &s) { return s.writing; }))
+                        {
+                                ++i;
+                                continue;
+                        }
 
-        *(uint32_t *)resp->At(sizeOffset) = resp->size() - sizeOffset - sizeof(uint32_t);
+                        pendingAppends[i] = pendingAppends.back();
+                        pendingAppends.pop_back();
 
-        auto payload = q->push_back(resp);
+                        commit_appended(pa->batch, pa->bundles, pa->durable);
 
-        payload->iovCnt = 1;
-        payload->iov[0] = {(void *)resp->data(), resp->size()};
+                        if (auto b = pa->inB)
+                        {
+                                b->clear();
+                                put_buffer(b);
+                        }
 
-        return try_send_ifnot_blocked(c);
-}
+                        --c->pendingAppends;
+                        if (c->fd == -1)
+                        {
+                                // cleanup_connection() was invoked while we were waiting; outQ and the response were released
+                                wakeup_appended(produceConnection);
 
-bool Service::process_replica_reg(connection *const c, const uint8_t *p, const size_t len)
-{
-        if (unlikely(len < sizeof(uint16_t)))
-                return shutdown(c, __LINE__);
+                                if (!c->pendingDurableAcks && !c->pendingAppends && !(c->state.flags & (1u << uint8_t(connection::State::Flags::WarmingUp))))
+                                        put_connection(c);
+                        }
+                        else
+                        {
+                                respond_produce(c, pa->resp, pa->payload, pa->bundles, pa->durable, pa->ackTimeout);
+                                wakeup_appended(produceConnection);
 
-        c->replicaId = *(uint16_t *)p;
+                                if (c != produceConnection)
+                                        try_send_ifnot_blocked(c);
+                        }
 
-        if (unlikely(c->replicaId == 0))
-                return shutdown(c, __LINE__);
+                        delete pa;
+                }
 
-        return true;
+                if (!wait || pendingAppends.empty())
+                        return;
+        }
+#endif
 }
 
 bool Service::process_produce(const TankAPIMsgType msg, connection *const c, const uint8_t *p, const size_t len)
@@ -3960,8 +6517,6 @@ bool Service::process_produce(const TankAPIMsgType msg, connection *const c, con
         respHeader->RoomFor(sizeof(uint32_t));
 
         (void)clientVersion;
-        (void)requiredAcks;
-        (void)ackTimeout;
 
         if (!q)
                 q = c->outQ = get_outgoing_queue();
@@ -3981,6 +6536,8 @@ bool Service::process_produce(const TankAPIMsgType msg, connection *const c, con
         if (trace)
                 SLog("Parsing ", topicsCnt, "\n");
 
+        produceBundles.clear();
+
         for (uint32_t i{0}; i != topicsCnt; ++i)
         {
                 if (unlikely(p + (*p) >= __end))
@@ -4125,7 +6682,7 @@ bool Service::process_produce(const TankAPIMsgType msg, connection *const c, con
                                                 SLog("codec = ", codec, ", will decompress\n");
 
                                         decompressionBuf.clear();
-                                        Compression::UnCompress(Compression::Algo::SNAPPY, p, e - p, &decompressionBuf);
+                                        Compression::UnCompress(Compression::AlgoForCodec(codec), p, e - p, &decompressionBuf);
                                         msgSetContent.Set(reinterpret_cast<const uint8_t *>(decompressionBuf.data()), decompressionBuf.size());
                                 }
                                 else
@@ -4241,46 +6798,30 @@ bool Service::process_produce(const TankAPIMsgType msg, connection *const c, con
                         // 1. Always use sparse bundles when compacting
                         // 2. use TankClient::produce_with_base() for mirroring
                         // 3. Expect that everything will work out otherwise if you are just building Tank apps.
-                        [[maybe_unused]] const uint64_t b = trace ? Timings::Microseconds::Tick() : 0;
-                        const auto res = partition->append_bundle_to_leader(curTime, bundle, bundleLen, msgSetSize, expiredCtxList3, firstMsgSeqNum, lastMsgSeqNum);
-
-                        if (unlikely(!res.fdh))
-                        {
-                                if (res.dataRange.len == UINT32_MAX)
-                                {
-                                        // Invalid request(offsets)
-                                        respHeader->Serialize(uint8_t(2));
-                                }
-                                else
-                                {
-                                        // System error
-                                        respHeader->Serialize(uint8_t(10));
-                                }
-                        }
-                        else
-                        {
-                                // success
-                                respHeader->Serialize(uint8_t(0));
-                        }
-
-                        if (trace)
-                                SLog("Took ", duration_repr(Timings::Microseconds::Since(b)), " for ", msgSetSize, " msgs in bundle message set: ", expiredCtxList3.size(), " ", res.fdh ? res.fdh->use_count() : 0, "\n");
-
-
-                        while (expiredCtxList3.size())
-                        {
-                                auto ctx = expiredCtxList3.Pop();
-
-                                wakeup_wait_ctx(ctx, res, c);
-                        }
+                        // The bundle is appended in append_produce_batch(), along with all other bundles of this request
+                        produceBundles.push_back({partition, bundle, bundleLen, msgSetSize, firstMsgSeqNum, lastMsgSeqNum, respHeader->size(), 0, UINT32_MAX, {}, 0});
+                        respHeader->Serialize(uint8_t(0));
 
                         p = e; // to next partition
                 }
         }
+
         *(uint32_t *)respHeader->At(sizeOffset) = respHeader->size() - sizeOffset - sizeof(uint32_t);
 
-        payload->iovCnt = 1;
-        payload->iov[0] = {(void *)respHeader->data(), respHeader->size()};
+        if (produceBundles.size())
+        {
+                [[maybe_unused]] const uint64_t b = trace ? Timings::Microseconds::Tick() : 0;
+
+                append_produce_batch(c, respHeader, payload, requiredAcks == DurableAcks, ackTimeout);
+
+                if (trace)
+                        SLog("Took ", duration_repr(Timings::Microseconds::Since(b)), " to append bundles\n");
+        }
+        else
+        {
+                payload->iovCnt = 1;
+                payload->iov[0] = {(void *)respHeader->data(), respHeader->size()};
+        }
 
         if (trace)
         {
@@ -4291,6 +6832,113 @@ bool Service::process_produce(const TankAPIMsgType msg, connection *const c, con
         return try_send_ifnot_blocked(c);
 }
 
+// Holds the produce response resp(queued in payload) until all bundles appended by the request are durable, or ackTimeout ms(if not 0) elapse
+// The appended partitions have already been scheduled for syncing; see append_produce_batch()
+void Service::hold_for_durable_ack(connection *const c, IOBuffer *const resp, void *const payload, const Switch::vector<produce_bundle> &bundles, const uint32_t ackTimeout)
+{
+        auto a = new durable_ack();
+
+        a->c = c;
+        a->resp = resp;
+        a->payload = payload;
+        a->expires = ackTimeout ? Timings::Milliseconds::Tick() + ackTimeout : UINT64_MAX;
+
+        for (const auto &b : bundles)
+        {
+                if (b.status)
+                        continue;
+
+                auto it = std::find_if(a->partitions.begin(), a->partitions.end(), [p = b.partition](const durable_ack::partition_ack &pa) { return pa.partition == p; });
+
+                if (it == a->partitions.end())
+                        a->partitions.push_back({b.partition, b.lastAbsSeqNum, b.statusOffset});
+                else
+                        it->seqNum = std::max(it->seqNum, b.lastAbsSeqNum);
+        }
+
+        // May have been synced already
+        const bool synced = std::all_of(a->partitions.begin(), a->partitions.end(), [](const durable_ack::partition_ack &pa) {
+                return pa.partition->log_->durableSeqNum.load(std::memory_order_acquire) >= pa.seqNum;
+        });
+        auto p = static_cast<outgoing_queue::payload *>(payload);
+
+        if (synced)
+        {
+                p->iovCnt = 1;
+                p->iov[0] = {(void *)resp->data(), resp->size()};
+                delete a;
+                return;
+        }
+
+        // The response has no iovecs until it's released
+        p->iovCnt = 0;
+        ++c->pendingDurableAcks;
+        durableAcks.push_back(a);
+}
+
+void Service::consider_durable_acks()
+{
+        const auto now = Timings::Milliseconds::Tick();
+
+        for (uint32_t i{0}; i < durableAcks.size();)
+        {
+                auto a = durableAcks[i];
+                auto c = a->c;
+                bool synced{true};
+
+                if (c->fd != -1)
+                {
+                        for (const auto &it : a->partitions)
+                        {
+                                if (it.partition->log_->durableSeqNum.load(std::memory_order_acquire) < it.seqNum)
+                                {
+                                        synced = false;
+                                        break;
+                                }
+                        }
+
+                        if (!synced)
+                        {
+                                if (now < a->expires)
+                                {
+                                        ++i;
+                                        continue;
+                                }
+
+                                if (trace)
+                                        SLog("Durable ack expired\n");
+
+                                for (const auto &it : a->partitions)
+                                {
+                                        if (it.partition->log_->durableSeqNum.load(std::memory_order_acquire) < it.seqNum)
+                                                *(uint8_t *)a->resp->At(it.statusOffset) = 3;
+                                }
+                        }
+                }
+
+                durableAcks[i] = durableAcks.back();
+                durableAcks.pop_back();
+
+                --c->pendingDurableAcks;
+                if (c->fd == -1)
+                {
+                        // cleanup_connection() was invoked while we were waiting; outQ and the response were released
+                        if (!c->pendingDurableAcks && !c->pendingAppends && !(c->state.flags & (1u << uint8_t(connection::State::Flags::WarmingUp))))
+                                put_connection(c);
+                }
+                else
+                {
+                        auto payload = static_cast<outgoing_queue::payload *>(a->payload);
+
+                        payload->iovCnt = 1;
+                        payload->iov[0] = {(void *)a->resp->data(), a->resp->size()};
+                        try_send_ifnot_blocked(c);
+                }
+
+                delete a;
+        }
+}
+
 bool Service::process_msg(connection *const c, const uint8_t msg, const uint8_t *const data, const size_t len)
 {
         if (trace)
@@ -4314,6 +6962,12 @@ bool Service::process_msg(connection *const c, const uint8_t msg, const uint8_t
                 case TankAPIMsgType::DiscoverPartitions:
                         return process_discover_partitions(c, data, len);
 
+                case TankAPIMsgType::SeqNumsForTS:
+                        return process_seqnums_for_ts(c, data, len);
+
+                case TankAPIMsgType::CompressionDict:
+                        return process_compression_dict(c, data, len);
+
                 case TankAPIMsgType::CreateTopic:
                         return process_create_topic(c, data, len);
 
@@ -4370,6 +7024,8 @@ void Service::wakeup_wait_ctx(wait_ctx *const wctx, const append_res &appendRes,
                         if (trace)
                                 SLog("partition ", p->idx, "\n");
 
+                        std::lock_guard<Switch::mutex> g(p->lock);
+
                         respHeader->Serialize(p->idx);
                         respHeader->Serialize(uint8_t(0));
                         if (it->fdh)
@@ -4383,6 +7039,7 @@ void Service::wakeup_wait_ctx(wait_ctx *const wctx, const append_res &appendRes,
                                 respHeader->Serialize(it->range.len);
 
                                 sum += it->range.len;
+                                c->update_cursor(p, it->nextSeqNum, it->fdh, it->range.stop());
 
                                 const auto __v = it->fdh->use_count();
 
@@ -4466,6 +7123,8 @@ void Service::abort_wait_ctx(wait_ctx *const wctx)
                         if (trace)
                                 SLog("partition ", p->idx, "\n");
 
+                        std::lock_guard<Switch::mutex> g(p->lock);
+
                         if (it->fdh)
                         {
                                 it->fdh->Release();
@@ -4502,7 +7161,7 @@ void Service::abort_wait_ctx(wait_ctx *const wctx)
 	// 2. tank accepts the connection, sets NeedOutAvail and add with (POLLIN|POLLOUT)
 	// 3. tank reads the request, processes it, and because there is no content available
 	// 	register_consumer_wait() to be fired in about 10ms
-	// 4. (nowMS > nextExpWaitCtxCheck) is true, and wait context is now aborted
+	// 4. the wait context expires, and is now aborted
 	//  but this try_send_ifnot_blocked() won't schedule data immediately
 	// because NeedOutAvail is still set, because POLLOUT hasn't yet become available.
 	//
@@ -4528,6 +7187,7 @@ void Service::destroy_wait_ctx(wait_ctx *const wctx)
         {
                 auto &it = wctx->partitions[i];
                 auto p = it.partition;
+                std::lock_guard<Switch::mutex> g(p->lock);
 
                 if (it.fdh)
                 {
@@ -4542,10 +7202,12 @@ void Service::destroy_wait_ctx(wait_ctx *const wctx)
         }
 
         if (switch_dlist_any(&wctx->expList))
-                switch_dlist_del(&wctx->expList);
+                waitCtxTimers.remove(wctx);
 	
 	// Defer put_waitctx() until the next iteration
-	wctx->scheduledForDtor = true;
+	// Bumping gen invalidates any wakeups scheduled by other reactors for this context; see schedule_wakeup()
+	__atomic_store_n(&wctx->scheduledForDtor, true, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&wctx->gen, 1, __ATOMIC_RELEASE);
 	waitCtxDeferredGC.push_back(wctx);
 }
 
@@ -4574,6 +7236,21 @@ void Service::cleanup_connection(connection *const c)
         if (auto q = std::exchange(c->outQ, nullptr))
                 put_outgoing_queue(q);
 
+        c->reset_cursors();
+
+        if (c->state.flags & (1u << uint8_t(connection::State::Flags::WarmingUp)))
+        {
+                // A disk thread is still paging-in a range for this connection
+                // warmed_up() will release it
+                return;
+        }
+
+        if (c->pendingDurableAcks || c->pendingAppends)
+        {
+                // consider_durable_acks() or complete_pending_appends() will release it
+                return;
+        }
+
         put_connection(c);
 }
 
@@ -4659,49 +7336,176 @@ bool Service::flush_iov(connection *const c, struct iovec *const iov, const uint
                                 return shutdown(c, __LINE__);
                 }
 
-                for (;;)
-                {
-                next_gather:
-                        auto &it = q->front();
-                        auto ptr = it.iov + it.iovIdx;
+                for (;;)
+                {
+                next_gather:
+                        auto &it = q->front();
+                        auto ptr = it.iov + it.iovIdx;
+
+                        while (r >= ptr->iov_len)
+                        {
+                                r -= ptr->iov_len;
+
+                                if (++it.iovIdx == it.iovCnt)
+                                {
+                                        put_buffer(it.buf);
+                                        q->pop_front();
+
+                                        if (!r)
+                                        {
+                                                // done
+						return true;
+                                        }
+                                        else
+                                        {
+                                                // flushed data for next payload
+                                                goto next_gather;
+                                        }
+                                }
+                                else
+                                        ++ptr;
+                        }
+
+                        ptr->iov_base = (char *)ptr->iov_base + r;
+                        ptr->iov_len -= r;
+
+                        if (trace)
+                                SLog("Deactivating Cork\n");
+
+                        Switch::SetTCPCork(fd, 0);
+                        poll_outavail(c);
+                        return true;
+                }
+
+                break;
+        }
+}
+
+// We probe the first and last byte of the range with RWF_NOWAIT, which fails with EAGAIN if the data is not in the page cache
+// try_send() probes exactly the range it will stream with the next sendfile()
+//
+// It is used by all reactors and the compaction threads, hence the atomic
+static bool range_is_resident(int fd, const range32_t range)
+{
+        static std::atomic<bool> supported{true};
+        const uint64_t offsets[] = {range.offset, range.offset + range.len - 1};
+        uint8_t b;
+        struct iovec iov = {&b, 1};
+
+        if (!range.len || !supported.load(std::memory_order_relaxed))
+                return true;
+
+        for (const auto o : offsets)
+        {
+                if (preadv2(fd, &iov, 1, o, RWF_NOWAIT) == -1)
+                {
+                        if (errno == EAGAIN)
+                                return false;
+                        else if (errno == EOPNOTSUPP || errno == ENOSYS || errno == EINVAL)
+                        {
+                                // Not supported by this kernel or filesystem; never probe again
+                                supported.store(false, std::memory_order_relaxed);
+                                return true;
+                        }
+                }
+        }
+
+        return true;
+}
+
+static void disk_thread()
+{
+        static constexpr size_t bufSize{256 * 1024};
+        auto buf = std::make_unique<uint8_t[]>(bufSize);
+
+        for (;;)
+        {
+                disk_task task;
+
+                {
+                        std::unique_lock<Switch::mutex> g(diskTasksLock);
+
+                        diskTasksCond.wait(g, [] { return !diskTasks.empty() || diskThreadsExit; });
+                        if (diskThreadsExit)
+                                return;
+
+                        task = diskTasks.front();
+                        diskTasks.pop_front();
+                }
+
+                // Reading the range is the only reliable way to make sure it's paged-in; readahead() is only a hint
+                const auto fd = task.fdh->fd;
+                const auto b = trace ? Timings::Microseconds::Tick() : 0;
+
+                for (auto o = task.range.offset, e = task.range.stop(); o < e;)
+                {
+                        const auto r = pread64(fd, buf.get(), std::min<size_t>(bufSize, e - o), o);
+
+                        if (r <= 0)
+                                break;
+
+                        o += r;
+                }
+
+                if (trace)
+                        SLog("Paged-in ", task.range, " in ", duration_repr(Timings::Microseconds::Since(b)), "\n");
+
+                task.fdh->Release();
+                task.reactor->run_on_reactor(new mainthread_closure([reactor = task.reactor, c = task.c]() {
+                        reactor->warmed_up(c);
+                }));
+        }
+}
+
+void Service::warm_up(connection *const c, fd_handle *const fdh, const range32_t range)
+{
+        if (trace)
+                SLog("Range ", range, " is not resident; will page it in\n");
+
+        c->state.flags |= 1u << uint8_t(connection::State::Flags::WarmingUp);
+        if (c->state.flags & (1u << uint8_t(connection::State::Flags::NeedOutAvail)))
+        {
+                // No point in polling for POLLOUT until we are done
+                c->state.flags &= ~(1u << uint8_t(connection::State::Flags::NeedOutAvail));
+                poller.SetDataAndEvents(c->fd, c, POLLIN);
+        }
+
+        fdh->Retain();
 
-                        while (r >= ptr->iov_len)
-                        {
-                                r -= ptr->iov_len;
+        {
+                std::lock_guard<Switch::mutex> g(diskTasksLock);
 
-                                if (++it.iovIdx == it.iovCnt)
-                                {
-                                        put_buffer(it.buf);
-                                        q->pop_front();
+                diskTasks.push_back({fdh, {range.offset, std::min<uint32_t>(range.len, diskTaskMaxSpan)}, this, c});
+        }
 
-                                        if (!r)
-                                        {
-                                                // done
-						return true;
-                                        }
-                                        else
-                                        {
-                                                // flushed data for next payload
-                                                goto next_gather;
-                                        }
-                                }
-                                else
-                                        ++ptr;
-                        }
+        diskTasksCond.notify_one();
+}
 
-                        ptr->iov_base = (char *)ptr->iov_base + r;
-                        ptr->iov_len -= r;
+void Service::warmed_up(connection *const c)
+{
+        c->state.flags &= ~(1u << uint8_t(connection::State::Flags::WarmingUp));
 
-                        if (trace)
-                                SLog("Deactivating Cork\n");
+        if (c->fd == -1)
+        {
+                // cleanup_connection() was invoked while we were waiting for the disk thread
+                if (!c->pendingDurableAcks && !c->pendingAppends)
+                        put_connection(c);
+                return;
+        }
 
-                        Switch::SetTCPCork(fd, 0);
-                        poll_outavail(c);
-                        return true;
-                }
+        if (auto q = c->outQ)
+        {
+                if (q->size() && !q->front().payloadBuf)
+                {
+                        // Don't probe the span the disk thread paged-in again, even if some pages were evicted in the meantime
+                        // try_send() hasn't streamed anything from the range since warm_up(), so that's where it begins
+                        auto &fr = q->front().file_range;
 
-                break;
+                        fr.residentUpto = fr.range.offset + std::min<uint32_t>(fr.range.len, diskTaskMaxSpan);
+                }
         }
+
+        try_send(c);
 }
 
 // this method's implementation is somewhat more complex that it perhaps ought to be, but we need to
@@ -4715,6 +7519,12 @@ bool Service::try_send(connection *const c)
         struct iovec iov[512];
         uint32_t iovCnt{0};
 
+        if (c->state.flags & (1u << uint8_t(connection::State::Flags::WarmingUp)))
+        {
+                // We 'll try again once the disk thread is done; see warmed_up()
+                return true;
+        }
+
         if (c->state.flags & (1u << uint8_t(connection::State::Flags::PendingIntro)))
                 introduce_self(c, haveCork);
 
@@ -4732,13 +7542,22 @@ bool Service::try_send(connection *const c)
         if (trace)
                 SLog("Attempting to send ", q->size(), "\n");
 
-        const auto end = q->backIdx;
+        const auto end = q->end();
 	[[maybe_unused]] size_t transmitted{0};
         static constexpr size_t transmit_trheshold{24 * 1024 * 1024};
+        bool held{false};
 
-        for (auto idx = q->frontIdx; idx != end; idx = q->next(idx))
+        for (auto idx = q->begin(); idx != end; ++idx)
         {
-                auto &it = q->A[idx];
+                auto &it = *idx;
+
+                if (it.payloadBuf && !it.iovCnt)
+                {
+                        // A produce response held until its bundles are durable; nothing past it can be sent until then
+                        // See hold_for_durable_ack()
+                        held = true;
+                        break;
+                }
 
                 if (it.payloadBuf)
                 {
@@ -4871,7 +7690,27 @@ bool Service::try_send(connection *const c)
                                 // other connections for too long.
                                 //
                                 // https://github.com/phaistos-networks/TANK/issues/14#issuecomment-301000261
-                                const auto outLen = std::min<size_t>(range.len, maxSpan);
+                                auto outLen = std::min<size_t>(range.len, maxSpan);
+
+                                if (diskThreadsCnt && range.offset + outLen > it.file_range.residentUpto)
+                                {
+                                        if (range.offset < it.file_range.residentUpto)
+                                        {
+                                                // Stream what's left of the span a disk thread paged-in first; we 'll probe past it next
+                                                outLen = it.file_range.residentUpto - range.offset;
+                                        }
+                                        else if (!range_is_resident(it.file_range.fdh->fd, {range.offset, uint32_t(outLen)}))
+                                        {
+                                                // sendfile() would block waiting for disk I/O if the range is not in the page cache(e.g a consumer catching up)
+                                                // stalling all other connections. Instead, have a disk thread page it in, and we 'll get back to it when that's done
+                                                // We probe each span we are about to send, because later spans are larger than the first one
+                                                if (haveCork)
+                                                        Switch::SetTCPCork(fd, 0);
+
+                                                warm_up(c, it.file_range.fdh, range);
+                                                return true;
+                                        }
+                                }
 
 #ifdef HAVE_SENDFILE64
                                 off64_t offset = range.offset;
@@ -4958,6 +7797,9 @@ bool Service::try_send(connection *const c)
 						// https://github.com/phaistos-networks/TANK/issues/14#issuecomment-301442619
                                                 if (trace)
                                                         SLog("Bailing, transmitted ", transmitted, " but spent ", sum, " ", duration_repr(sum), "\n");
+
+                                                // Check again next time
+                                                it.file_range.residentUpto = 0;
                                                 goto l2;
                                         }
 
@@ -5059,6 +7901,21 @@ bool Service::try_send(connection *const c)
                 }
         }
 
+        if (held)
+        {
+                // consider_durable_acks() will try again once it's released
+                if (haveCork)
+                        Switch::SetTCPCork(fd, 0);
+
+                if (c->state.flags & (1u << uint8_t(connection::State::Flags::NeedOutAvail)))
+                {
+                        c->state.flags &= ~(1u << uint8_t(connection::State::Flags::NeedOutAvail));
+                        poller.SetDataAndEvents(fd, c, POLLIN);
+                }
+
+                return true;
+        }
+
         put_outgoing_queue(q);
         c->outQ = nullptr;
 
@@ -5103,9 +7960,12 @@ Service::~Service()
         for (auto &it : topics)
                 it.second->Release();
 #endif
+
+        if (reactorEventFd != -1)
+                close(reactorEventFd);
 }
 
-static bool running{true};
+static std::atomic<bool> running{true};
 
 static void sig_handler(int)
 {
@@ -5115,12 +7975,11 @@ static void sig_handler(int)
 // TODO: https://github.com/phaistos-networks/TANK/issues/7
 int Service::start(int argc, char **argv)
 {
-        sockaddr_in sa;
-        uint64_t nextIdleCheck{0}, nextExpWaitCtxCheck{0}, nextPubSubQueueDrain{0}, nextCleanupTrackerPersist{0};
         int r;
         struct stat64 st;
         size_t totalPartitions{0};
         Switch::endpoint listenAddr;
+        uint32_t reactorsCnt{1};
 
 #ifndef LEAN_SWITCH
         // See: https://github.com/markpapadakis/BacktraceResolver
@@ -5191,7 +8050,7 @@ int Service::start(int argc, char **argv)
 
         signal(SIGPIPE, SIG_IGN);
         signal(SIGHUP, SIG_IGN);
-        while ((r = getopt(argc, argv, "p:l:hv")) != -1)
+        while ((r = getopt(argc, argv, "p:l:r:uD:c:m:t:g:hv")) != -1)
         {
                 switch (r)
                 {
@@ -5209,9 +8068,90 @@ int Service::start(int argc, char **argv)
                                 }
                                 break;
 
+                        case 'r':
+                                reactorsCnt = strwlen32_t(optarg).AsUint32();
+                                if (!reactorsCnt || reactorsCnt > 64)
+                                {
+                                        Print("Invalid reactors count ", optarg, "; expected a value in [1, 64]\n");
+                                        return 1;
+                                }
+                                break;
+
+                        case 'D':
+                                diskThreadsCnt = strwlen32_t(optarg).AsUint32();
+                                if (diskThreadsCnt > 64)
+                                {
+                                        Print("Invalid disk threads count ", optarg, "; expected a value in [0, 64]\n");
+                                        return 1;
+                                }
+                                break;
+
+                        case 'c':
+                                compactionThreadsCnt = strwlen32_t(optarg).AsUint32();
+                                if (!compactionThreadsCnt || compactionThreadsCnt > 64)
+                                {
+                                        Print("Invalid compaction threads count ", optarg, "; expected a value in [1, 64]\n");
+                                        return 1;
+                                }
+                                break;
+
+                        case 'm':
+                                try
+                                {
+                                        compactionMemBudget = parse_size(strwlen32_t(optarg));
+                                }
+                                catch (...)
+                                {
+                                        compactionMemBudget = 0;
+                                }
+
+                                if (!compactionMemBudget)
+                                {
+                                        Print("Invalid compaction memory budget ", optarg, "\n");
+                                        return 1;
+                                }
+                                break;
+
+                        case 't':
+                                try
+                                {
+                                        compactionIOBudget = parse_size(strwlen32_t(optarg));
+                                }
+                                catch (...)
+                                {
+                                        Print("Invalid compaction I/O rate ", optarg, "\n");
+                                        return 1;
+                                }
+                                break;
+
+                        case 'g':
+                                flushGroupUs = strwlen32_t(optarg).AsUint32() * 1000;
+                                if (flushGroupUs > 1000 * 1000)
+                                {
+                                        Print("Invalid group sync interval ", optarg, "; expected a value in [0, 1000]\n");
+                                        return 1;
+                                }
+                                break;
+
+                        case 'u':
+#ifdef SWITCH_HAVE_IOURING
+                                useIOURing = true;
+#else
+                                Print("io_uring is not supported by this build\n");
+                                return 1;
+#endif
+                                break;
+
                         case 'h':
                                 Print("-p path: Specifies the base path where all topic exist. Used in standalone mode\n");
                                 Print("-l endpoint: Specifies that the service will run in standalone mode, listening for connections to that address\n");
+                                Print("-r reactors: Number of I/O threads(event loops) accepting and serving connections. Default is 1\n");
+                                Print("-D threads: Number of disk threads used to page-in ranges not in the page cache, so that the I/O loop won't block on disk I/O. Default is 2. Use 0 to disable\n");
+                                Print("-c threads: Number of threads compacting partitions concurrently. Default is 1\n");
+                                Print("-m size: Memory budget for compactions, shared by all compaction threads(e.g 512mb). Default is 512mb. Larger partitions are compacted in multiple passes\n");
+                                Print("-t rate: Limits compaction reads and writes to that many bytes/sec, shared by all compaction threads(e.g 50mb). Default is no limit\n");
+                                Print("-g ms: Sync requests are processed at most once every that many milliseconds, so that syncs of the same partition requested in the meantime(e.g for durable acks) are coalesced into one. Default is 0\n");
+                                Print("-u : Use io_uring(if supported) for segment writes and readahead, in order to reduce the number of syscalls\n");
                                 Print("-v : displays Tank version and exits\n");
                                 Print("-h : this help message\n");
                                 return 0;
@@ -5356,7 +8296,7 @@ int Service::start(int argc, char **argv)
                                                 throw Switch::system_error("Failed to stat(", basePath_, "): ", strerror(errno));
                                         else if (st.st_mode & S_IFDIR)
                                         {
-                                                uint32_t partitionsCnt{0}, min{UINT32_MAX}, max{0};
+                                                uint32_t partitionsCnt{0}, min{UINT32_MAX}, max{0}, dictId{0};
                                                 partition_config partitionConfig;
 
                                                 for (const auto &&name : DirectoryEntries(path))
@@ -5368,6 +8308,16 @@ int Service::start(int argc, char **argv)
                                                                 // topic overrides defaults
                                                                 parse_partition_config(path, &partitionConfig);
                                                         }
+                                                        else if (name.Eq(_S("compression.dict")))
+                                                        {
+                                                                // the topic's current dictionary; a link to one of the compression.<id>.dict files
+                                                                dictId = load_compression_dict(path);
+                                                        }
+                                                        else if (name.BeginsWith(_S("compression.")) && name.EndsWith(_S(".dict")))
+                                                        {
+                                                                // older dictionaries are still needed to decompress bundles
+                                                                load_compression_dict(path);
+                                                        }
                                                         else if (name.IsDigits())
                                                         {
                                                                 if (stat64(path, &st) == -1)
@@ -5391,6 +8341,7 @@ int Service::start(int argc, char **argv)
 							auto t = Switch::make_sharedref<topic>(name, partitionConfig);
 
 							require(t->use_count() == 1);
+                                                        t->compressionDictId = dictId;
 
                                                         collectLock.lock();
                                                         pendingPartitions.push_back({t.get(), partitionsCnt});
@@ -5526,12 +8477,134 @@ int Service::start(int argc, char **argv)
 		Print(R"EOF(Or, you can use tank-cli's "create topic" command to create new topics instread)EOF", "\n");
         }
 
+        if (init_listener(listenAddr, reactorsCnt > 1) == -1)
+                return 1;
+
+        // Secondary reactors get their own copy of the topics map and their own listening socket
+        // bound to the same address; the kernel will distribute incoming connections among them(SO_REUSEPORT)
+        reactors.push_back(this);
+        for (uint32_t i{1}; i < reactorsCnt; ++i)
+        {
+                // Service is over-aligned(see PubSubQueue)
+                auto r = new (aligned_alloc(alignof(Service), sizeof(Service))) Service();
+
+                r->reactorIdx = i;
+                r->opMode = opMode;
+                for (auto &it : topics)
+                {
+#ifdef LEAN_SWITCH
+                        auto t = it.second;
+#else
+                        auto t = it.value();
+#endif
+
+                        t->Retain();
+                        r->register_topic(t);
+                }
+
+                if (r->init_listener(listenAddr, true) == -1)
+                        return 1;
+
+                reactors.push_back(r);
+        }
+
+        for (auto r : reactors)
+        {
+                r->reactorEventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+                if (r->reactorEventFd == -1)
+                {
+                        Print("eventfd() failed:", strerror(errno), "\n");
+                        return 1;
+                }
+
+                r->poller.AddFd(r->reactorEventFd, POLLIN, &r->reactorEventFd);
+        }
+
+        std::vector<std::thread> threads;
+
+        for (uint32_t i{0}; i != diskThreadsCnt; ++i)
+                threads.push_back(std::thread(disk_thread));
+
+        housekeepingRunning = true;
+        std::thread housekeeper(housekeeping_thread);
+
+        signal(SIGINT, sig_handler);
+        for (uint32_t i{1}; i < reactors.size(); ++i)
+        {
+                threads.push_back(std::thread([r = reactors[i]] {
+                        if (r->run_reactor())
+                                running = false;
+                }));
+        }
+
+        const auto res = run_reactor();
+
+        running = false;
+        {
+                std::lock_guard<Switch::mutex> g(diskTasksLock);
+
+                diskThreadsExit = true;
+        }
+        diskTasksCond.notify_all();
+
+        for (uint32_t i{1}; i < reactors.size(); ++i)
+                reactors[i]->run_on_reactor(new mainthread_closure([] {}));
+
+        for (auto &it : threads)
+                it.join();
+
+        {
+                std::lock_guard<Switch::mutex> g(housekeepingLock);
+
+                housekeepingExit = true;
+        }
+        housekeepingCond.notify_all();
+        housekeeper.join();
+
+        {
+                std::lock_guard<Switch::mutex> g(flushersLock);
+
+                flushersExit = true;
+        }
+
+        for (auto f : flushers)
+        {
+                const uint64_t v{1};
+
+                if (write(f->eventFd, &v, sizeof(v)) == -1)
+                        Print("Failed to signal flusher:", strerror(errno), "\n");
+
+                f->thread.join();
+                close(f->eventFd);
+                delete f;
+        }
+        flushers.clear();
+
+        for (uint32_t i{1}; i < reactors.size(); ++i)
+        {
+                reactors[i]->~Service();
+                free(reactors[i]);
+        }
+        reactors.clear();
+
+        if (res)
+                return res;
+
+        Print("TANK terminated\n");
+        return 0;
+}
+
+int Service::init_listener(const Switch::endpoint listenAddr, const bool reusePort)
+{
+        sockaddr_in sa;
+        int one{1};
+
         listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
 
         if (listenFd == -1)
         {
                 Print("socket() failed:", strerror(errno), "\n");
-                return 1;
+                return -1;
         }
 
         require(listenFd != -1);
@@ -5544,45 +8617,94 @@ int Service::start(int argc, char **argv)
         if (Switch::SetReuseAddr(listenFd, 1) == -1)
         {
                 Print("SO_REUSEADDR: ", strerror(errno), "\n");
-                return 1;
+                return -1;
+        }
+        else if (reusePort && setsockopt(listenFd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) == -1)
+        {
+                Print("SO_REUSEPORT: ", strerror(errno), "\n");
+                return -1;
         }
         else if (bind(listenFd, (sockaddr *)&sa, sizeof(sa)))
         {
                 Print("bind() failed:", strerror(errno), "\n");
-                return 1;
+                return -1;
         }
         else if (listen(listenFd, 128))
         {
                 Print("listen() failed:", strerror(errno), "\n");
-                return 1;
+                return -1;
         }
 
-        std::thread([] {
-                Switch::vector<std::pair<int, int>> local;
+        poller.AddFd(listenFd, POLLIN, &listenFd);
+        return 0;
+}
 
-                for (;;)
-                {
-                        Timings::Seconds::Sleep(1);
+void Service::run_on_reactor(mainthread_closure *const closure)
+{
+        reactorClosures.push_back(closure);
 
-                        mboxLock.lock();
-                        std::swap(local, mbox);
-                        require(mbox.empty());
-                        mboxLock.unlock();
+        // Only signal the eventfd if the reactor hasn't been signaled already since it last drained the closures queue
+        if (!reactorWakeupPending.exchange(true))
+        {
+                const uint64_t v{1};
 
-                        for (auto &it : local)
-                        {
-                                fdatasync(it.first);
-                                fdatasync(it.second);
-                        }
+                if (write(reactorEventFd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+                        RFLog("Failed to signal reactor:", strerror(errno), "\n");
+        }
+}
+
+// Invoked by another reactor, while holding the lock of a partition the wait context is waiting on
+// We can't wake up the context there, because we own its connection, so we 'll do it in our own thread.
+// gen is captured so that we can tell if the context has been destroyed(and possibly reused) in the meantime.
+// We may race with destroy_wait_ctx(), so gen and scheduledForDtor are accessed atomically
+void Service::schedule_wakeup(wait_ctx *const ctx)
+{
+        const auto gen = __atomic_load_n(&ctx->gen, __ATOMIC_ACQUIRE);
+
+        run_on_reactor(new mainthread_closure([this, ctx, gen]() {
+                if (!__atomic_load_n(&ctx->scheduledForDtor, __ATOMIC_RELAXED) && __atomic_load_n(&ctx->gen, __ATOMIC_RELAXED) == gen)
+                        wakeup_wait_ctx(ctx, {}, nullptr);
+        }));
+}
+
+void Service::drain_reactor_closures()
+{
+        reactorWakeupPending = false;
+
+        if (auto it = reactorClosures.drain())
+        {
+                mainthread_closure *rh{nullptr};
+
+                // restore submission order
+                while (it)
+                {
+                        auto t{it};
 
-                        local.clear();
+                        it = t->next;
+                        t->next = rh;
+                        rh = t;
                 }
 
-        }).detach();
+                do
+                {
+                        auto next = rh->next;
 
-        poller.AddFd(listenFd, POLLIN, &listenFd);
+                        (*rh)();
+                        delete rh;
+                        rh = next;
+                } while (rh);
+        }
+}
+
+int Service::run_reactor()
+{
+        sockaddr_in sa;
+        uint64_t nextIdleCheck{0}, nextPubSubQueueDrain{0}, nextCleanupTrackerPersist{0}, nextDurableAcksCheck{0};
+
+#ifdef SWITCH_HAVE_IOURING
+        init_io_ring(reactorEventFd);
+#endif
 
-        signal(SIGINT, sig_handler);
         while (likely(running))
         {
 		// Deferred , see waitCtxDeferredGC decl. comments
@@ -5596,7 +8718,9 @@ int Service::start(int argc, char **argv)
 		waitCtxDeferredGC.clear();
 
 
-                const auto r = poller.Poll(500);
+                // Don't block for longer than it takes for the next wait context to expire
+                // Also, check for expired durable acks every 100ms
+                const auto r = poller.Poll(waitCtxTimers.next_timeout(Timings::Milliseconds::Tick(), durableAcks.size() ? 100 : 500));
 
                 if (r == -1)
                 {
@@ -5609,6 +8733,15 @@ int Service::start(int argc, char **argv)
 
                 const auto nowMS = Timings::Milliseconds::Tick();
 
+                if (reactorClosures.any())
+                        drain_reactor_closures();
+
+                if (durableAcks.size() && nowMS >= nextDurableAcksCheck)
+                {
+                        consider_durable_acks();
+                        nextDurableAcksCheck = nowMS + 100;
+                }
+
 #if 0
 		if (1)
 		{
@@ -5631,7 +8764,7 @@ int Service::start(int argc, char **argv)
 		}
 #endif
 
-                if (nowMS > nextPubSubQueueDrain)
+                if (reactorIdx == 0 && nowMS > nextPubSubQueueDrain)
                 {
                         if (auto it = mainThreadClosures.drain())
                         {
@@ -5665,7 +8798,7 @@ int Service::start(int argc, char **argv)
                         nextPubSubQueueDrain = nowMS + 120;
                 }
 
-                if (nowMS > nextCleanupTrackerPersist)
+                if (reactorIdx == 0 && nowMS > nextCleanupTrackerPersist)
                 {
                         if (cleanupTrackerIsDirty)
                         {
@@ -5779,6 +8912,16 @@ int Service::start(int argc, char **argv)
 
                                 continue;
                         }
+                        else if (fd == reactorEventFd)
+                        {
+                                uint64_t v;
+
+                                if (read(fd, &v, sizeof(v)) == -1 && errno != EAGAIN)
+                                        RFLog("Failed to read from eventfd:", strerror(errno), "\n");
+
+                                drain_reactor_closures();
+                                continue;
+                        }
 
                         if (events & (POLLHUP | POLLERR))
                         {
@@ -5871,7 +9014,18 @@ int Service::start(int argc, char **argv)
                                                         goto nextEvent;
 
                                                 p += msgLen;
-                                                if (p == e)
+                                                if (c->inB != b)
+                                                {
+                                                        // process_produce() retained the buffer until the bundles it staged are written; see pending_append
+                                                        // Whatever follows the request is moved to a new buffer
+                                                        if (p == e)
+                                                                break;
+
+                                                        b = c->inB = get_buffer();
+                                                        b->Serialize(p, e - p);
+                                                        e = (uint8_t *)b->end();
+                                                }
+                                                else if (p == e)
                                                 {
                                                         b->clear();
                                                         Drequire(b->offset() == 0);
@@ -5918,38 +9072,23 @@ int Service::start(int argc, char **argv)
                         }
                 }
 
-                if (nowMS > nextExpWaitCtxCheck)
-                {
-			if (trace)
-				SLog("Considering waitExpList\n");
-
-                        nextExpWaitCtxCheck = nowMS + 200;
-
-			expiredCtxList2.clear();
-                        for (auto it = waitExpList.prev; it != &waitExpList; it = it->prev)
-                        {
-                                auto ctx = switch_list_entry(wait_ctx, expList, it);
+                expiredCtxList2.clear();
+                waitCtxTimers.advance(nowMS, [this](wait_ctx *const ctx) {
+                        if (trace)
+                                SLog("Will expire ", ptr_repr(ctx), "\n");
 
-                                if (nowMS > ctx->expiration)
-				{
-                                        expiredCtxList2.push_back(ctx);
-					if (trace)
-						SLog("Will expire ", ptr_repr(ctx), "\n");
-				}
+                        expiredCtxList2.push_back(ctx);
+                });
 
-				// In the past, we 'd break if nowMS <= ctx->expiration
-				// This assumption holds iff all expirations were for the same time
-				// but it often is not, so that leads to all kinds of problems.
-				//
-				// TODO: we need a timer wheel here
-                        }
+                while (expiredCtxList2.size())
+                        abort_wait_ctx(expiredCtxList2.Pop());
 
-                        while (expiredCtxList2.size())
-                                abort_wait_ctx(expiredCtxList2.Pop());
-                }
+                // All SQEs prepared in this iteration are submitted with a single io_uring_enter()
+                // We don't wait for the writes; reactorEventFd is signaled as they complete
+                complete_pending_appends(false);
         }
 
-        Print("TANK terminated\n");
+        complete_pending_appends(true);
         return 0;
 }
 
@@ -1,5 +1,8 @@
 #pragma once
 #include "common.h"
+#include <atomic>
+#include <compress.h>
+#include <condition_variable>
 #include <fs.h>
 #include <network.h>
 #include <switch.h>
@@ -52,12 +55,50 @@ struct index_record
         uint32_t absPhysical;
 };
 
+// The optional per-bundle index(see partition_config::bundleIndex) has a record for every bundle in a segment, so
+// that we can locate the bundle that holds a sequence number, and where the bundles up to another sequence number end, with
+// a binary search instead of parsing bundle headers from the log. See lookup_bundles()
+struct bundle_index_record
+{
+        // absolute sequence numbers of the first and last message in the bundle
+        uint64_t firstSeqNum, lastSeqNum;
+        uint32_t fileOffset;
+
+        // includes the encoded bundle length
+        uint32_t len : 31;
+        uint32_t sparse : 1;
+};
+
+// A time index has a record for every index_record of a segment's index, where `ts` is the max timestamp of the first messages
+// of all bundles that precede absPhysical. The timestamps are non-decreasing, so we can locate the
+// bundle where to begin searching for the first message with timestamp >= a target; see topic_partition_log::seqnum_for_ts()
+//
+// The time index of an immutable segment ends with a record where absPhysical is the log file size, and its ts
+// also accounts for all messages of the bundles past the previous record, so that it is the segment's max timestamp
+// given non-decreasing timestamps. See topic_partition_log::seqnum_for_ts()
+struct time_index_record
+{
+        uint64_t ts;
+        uint32_t relSeqNum;
+        uint32_t absPhysical;
+};
+
+// The key map of a partition's clean head(.compaction.keys) begins with this header, followed by a {key:str8, seqNum:u64} record
+// for each key in the clean head, sorted by key. See compact_partition()
+struct compaction_keys_header
+{
+        uint64_t cleanMaxSeqNum;
+};
+
 struct ro_segment_lookup_res
 {
         index_record record;
         uint32_t span;
 };
 
+// fdatasync() and close() fd, on the housekeeping thread if it's running; see housekeeping_thread()
+void retire_fd(int);
+
 struct fd_handle
     : public RefCounted<fd_handle>
 {
@@ -71,13 +112,38 @@ struct fd_handle
         ~fd_handle()
         {
                 if (fd != -1)
-		{
-			fdatasync(fd);
-                        close(fd);
-		}
+                        retire_fd(fd);
         }
 };
 
+// The files of a partition's next segment are created and preallocated ahead of time by the housekeeping thread, so that
+// rolling the current segment only requires renaming them(.next.log, .next.index, .next.tindex); see schedule_spare_segment()
+struct spare_segment
+    : public RefCounted<spare_segment>
+{
+        enum class State : uint8_t
+        {
+                Pending = 0,
+                Ready,
+                Failed
+        };
+
+        // Set by the housekeeping thread once the files are ready, or if we failed to create them
+        std::atomic<State> state{State::Pending};
+
+        // The partition's directory, including the trailing '/'
+        std::string basePath;
+        uint32_t indexCapacity;
+
+        // The log is preallocated by that many bytes, and logPreallocated is set if we succeeded
+        uint64_t logPrealloc, logPreallocated{0};
+
+        int logFd{-1}, indexFd{-1}, timeIndexFd{-1};
+        index_record *indexData{nullptr};
+
+        ~spare_segment();
+};
+
 // A read-only (immutable, frozen-sealed) partition commit log(Segment) (and the index file for quick lookups)
 // we don't need to acquire a lock to access this
 //
@@ -128,9 +194,28 @@ struct ro_segment
                 index_record lastRecorded;
         } index;
 
+        // The per-bundle index(.bindex), if partition_config::bundleIndex is set
+        // It's not available for segments created by compaction until they are loaded again
+        struct
+        {
+                const bundle_index_record *data;
+                uint32_t size;
+        } bundles;
+
+        // The time index(.tindex)
+        struct
+        {
+                const time_index_record *data;
+                uint32_t size;
+        } timeIndex;
+
         ro_segment(const uint64_t absSeqNum, const uint64_t lastAbsSeqNum, const uint32_t creationTS)
             : baseSeqNum{absSeqNum}, lastAvailSeqNum{lastAbsSeqNum}, createdTS{creationTS}, haveWideEntries{false}
         {
+                bundles.data = nullptr;
+                bundles.size = 0;
+                timeIndex.data = nullptr;
+                timeIndex.size = 0;
         }
 
         ro_segment(const uint64_t absSeqNum, const uint64_t lastAbsSeqNum, const strwlen32_t base, const uint32_t, const bool haveWideEntries);
@@ -139,8 +224,20 @@ struct ro_segment
         {
                 if (index.data && index.data != MAP_FAILED)
                         munmap((void *)index.data, index.fileSize);
+                if (bundles.data)
+                        munmap((void *)bundles.data, bundles.size * sizeof(bundle_index_record));
+                if (timeIndex.data)
+                        munmap((void *)timeIndex.data, timeIndex.size * sizeof(time_index_record));
         }
 
+        // Maps the segment's per-bundle index, and (re)builds it first if it is missing or doesn't match the log
+        void map_bundle_index(const strwlen32_t base);
+
+        void map_time_index(const char *const path);
+
+        // Persists the per-bundle index and maps it
+        void set_bundle_index(const strwlen32_t base, const bundle_index_record *const all, const uint32_t cnt);
+
         // Locate the (relative seq.num, abs.file offset) for the LAST index record where record.relSqNum <= targetRelSeqNum
         std::pair<uint32_t, uint32_t> snapDown(const uint64_t absSeqNum) const;
 
@@ -162,6 +259,79 @@ struct append_res
         range_base<uint64_t, uint16_t> msgSeqNumRange;
 };
 
+struct topic_partition;
+struct topic_partition_log;
+class Service;
+
+// A bundle of a produce request
+// All bundles of a request are appended together, see Service::append_produce_batch()
+struct produce_bundle
+{
+        topic_partition *partition;
+        const uint8_t *data;
+        uint32_t len;
+        uint32_t msgsCnt;
+        uint64_t firstMsgSeqNum, lastMsgSeqNum;
+
+        // Offset of this bundle's status in the produce response
+        uint32_t statusOffset;
+        uint8_t status;
+
+        // Index in append_batch::segments, or UINT32_MAX if it was rejected
+        uint32_t segmentIdx;
+
+        // The bundle length, encoded as a varint, precedes the bundle in the segment log
+        uint8_t varint[8];
+        uint8_t varintLen;
+
+        // The sequence number of the bundle's last message, once staged
+        uint64_t lastAbsSeqNum;
+};
+
+// One or more consecutive bundles staged for appending to the current segment of a partition log
+// They are appended with a single writev()
+//
+// The log's state(lastAssignedSeqNum, cur.fileSize, cur.index, etc) is updated as bundles are staged, so that
+// should_roll() and the index interval checks consider them. It is restored if the writev() fails.
+// Readers don't consider them until they are committed; see topic_partition_log::unwritten
+struct staged_append
+{
+        topic_partition_log *log;
+        Switch::shared_refptr<fd_handle> fdh;
+        // The segment's index; it must also be synced before durableSeqNum can advance past the staged bundles,
+        // even if the segment is rolled in the meantime. See topic_partition_log::schedule_flush()
+        Switch::shared_refptr<fd_handle> indexFdh;
+        uint64_t firstAbsSeqNum, lastAbsSeqNum;
+        uint32_t len, msgsCnt, bundlesCnt;
+
+        // Offset and count in append_batch::iov
+        uint32_t iovOffset, iovCnt;
+
+        // Log state before the first bundle was staged
+        uint64_t savedLastAssignedSeqNum;
+        uint32_t savedFileSize, savedSinceLastUpdate, savedIndexSize, savedBundlesCnt, savedTimeIndexSize;
+        uint64_t savedMaxTS;
+
+        // -errno on failure
+        ssize_t writevRes;
+        bool committed, failed;
+
+        // Set while the writev() is in flight via io_uring; the SQE's user data points to this
+        bool writing;
+};
+
+struct append_batch
+{
+        Switch::vector<staged_append> segments;
+        Switch::vector<struct iovec> iov;
+
+        void clear()
+        {
+                segments.clear();
+                iov.clear();
+        }
+};
+
 struct lookup_res
 {
         enum class Fault : uint8_t
@@ -190,8 +360,13 @@ struct lookup_res
         // The last committed absolute sequence number
         uint64_t highWatermark;
 
+        // Set if fileOffset was resolved to the exact bundle using the per-bundle index, in which case
+        // adjust_range_start() won't need to scan the log
+        bool exact{false};
+        bool firstBundleIsSparse{false};
+
         lookup_res(lookup_res &&o)
-            : fault{o.fault}, fileOffsetCeiling{o.fileOffsetCeiling}, fdh(std::move(o.fdh)), absBaseSeqNum{o.absBaseSeqNum}, fileOffset{o.fileOffset}, highWatermark{o.highWatermark}
+            : fault{o.fault}, fileOffsetCeiling{o.fileOffsetCeiling}, fdh(std::move(o.fdh)), absBaseSeqNum{o.absBaseSeqNum}, fileOffset{o.fileOffset}, highWatermark{o.highWatermark}, exact{o.exact}, firstBundleIsSparse{o.firstBundleIsSparse}
         {
         }
 
@@ -232,8 +407,17 @@ struct partition_config
         size_t curSegmentMaxAge{86400 * 7};  // 1 week (soft limit)
         size_t flushIntervalMsgs{0};         // never
         size_t flushIntervalSecs{0};         // never
+        size_t writebackSize{8 * 1024 * 1024}; // initiate writeback whenever that many bytes are appended(0 for never)
 	CleanupPolicy logCleanupPolicy{CleanupPolicy::DELETE};
 	float logCleanRatioMin{0.5};
+        // Maintain a per-bundle index(.bindex) for each segment
+        bool bundleIndex{false};
+        // The current segment's log is preallocated in chunks of that many bytes(0 to disable)
+        uint64_t segmentPreallocSize{64 * 1024 * 1024};
+        // Codec used for the bundles compact_partition() writes
+        Compression::Algo compactionCodec{Compression::Algo::SNAPPY};
+        // If set, segments with uncompressed bundles are rewritten with merged bundles compressed with that codec when sealed; see recompress_segment()
+        Compression::Algo recompressCodec{Compression::Algo::UNKNOWN};
 } config;
 
 static void PrintImpl(Buffer &out, const lookup_res &res)
@@ -255,9 +439,56 @@ struct topic_partition_log
         // This will be initialized from the latest segment in initPartition()
         uint64_t lastAssignedSeqNum{0};
 
+        // Set while Service::append_produce_batch() writes the bundles staged for the current segment with the partition lock released.
+        // The log state already accounts for them, so readers are bounded by the state before they were staged instead; see committed_seqnum()
+        struct
+        {
+                bool active{false};
+                uint64_t lastAssignedSeqNum;
+                uint32_t fileSize, bundlesCnt, indexSize, timeIndexSize;
+        } unwritten;
+
+        uint64_t committed_seqnum() const
+        {
+                return unwritten.active ? unwritten.lastAssignedSeqNum : lastAssignedSeqNum;
+        }
+
+        uint32_t committed_file_size() const
+        {
+                return unwritten.active ? unwritten.fileSize : cur.fileSize;
+        }
+
+        uint32_t committed_bundles_cnt() const
+        {
+                return unwritten.active ? unwritten.bundlesCnt : cur.bundles.size();
+        }
+
+        uint32_t committed_index_size() const
+        {
+                return unwritten.active ? unwritten.indexSize : cur.index.size;
+        }
+
+        uint32_t committed_time_index_size() const
+        {
+                return unwritten.active ? unwritten.timeIndexSize : cur.timeIndex.records.size();
+        }
+
 	topic_partition *partition;
+	// Set while the compaction threads are rewriting ro segments(compacting, or recompressing a segment)
 	bool compacting{false};
 
+	// Sealed segments to be recompressed once the compaction threads are done with the partition; see partition_config::recompressCodec
+	std::vector<ro_segment *> pendingRecompressions;
+
+	// Retained; see spare_segment
+	spare_segment *spare{nullptr};
+
+	// The flusher thread of the device the partition is stored in; resolved on the first flush
+	struct flusher *flusher_{nullptr};
+
+	// All messages up to durableSeqNum have been synced; advanced by the flusher
+	std::atomic<uint64_t> durableSeqNum{0};
+
 	// Whenever we cleanup, we update lastCleanupMaxSeqNum with the lastAvailSeqNum of the latest ro segment compacted
 	uint64_t lastCleanupMaxSeqNum{0};
 
@@ -274,6 +505,9 @@ struct topic_partition_log
                 uint64_t baseSeqNum;
                 uint32_t fileSize;
 
+                // Blocks up to that offset are allocated, though the file size is not extended; see prealloc_cur_segment()
+                uint64_t preallocated;
+
                 // We are going to be updating the index and skiplist frequently
                 // This is always initialized to UINT32_MAX, so that we always index the first bundle in the segment, for impl.simplicity
                 uint32_t sinceLastUpdate;
@@ -287,37 +521,49 @@ struct topic_partition_log
 
                 struct
                 {
+                        // fdh owns fd; it is retained by flush requests; see flush_req
                         int fd;
+                        Switch::shared_refptr<fd_handle> fdh;
 
                         // relative sequence number => file physical offset
                         // relative sequence number = absSeqNum - baseSeqNum
-                        Switch::vector<std::pair<uint32_t, uint32_t>> skipList;
+                        //
+                        // The index file is preallocated to partition_config::maxIndexSize and accessed via a shared mapping, so that
+                        // we can append entries without syscalls, and look them up with a single binary search. Unused entries are zeroed.
+                        // It is truncated to size entries when the segment is rolled; see map_cur_index() and close_cur_index()
+                        index_record *data;
+                        uint32_t size, capacity;
 
 			// see above
 			bool haveWideEntries;
+                } index;
 
-                        // We may access the index both directly, if ondisk is valid, and via the skipList
-                        // This is so that we won't have to restore the skiplist on init
-                        struct
-                        {
-                                const uint8_t *data;
-                                uint32_t span;
+                // The per-bundle index, if config.bundleIndex is set
+                // It is persisted when the segment is rolled, and rebuilt from the log on startup
+                Switch::vector<bundle_index_record> bundles;
 
-                                // last recorded tuple in the index; we need this here
-                                struct
-                                {
-                                        uint32_t relSeqNum;
-                                        uint32_t absPhysical;
-                                } lastRecorded;
+                // A record is appended to the time index whenever one is appended to the index
+                // The records are also written to the .tindex file in batches, and when the segment is rolled; see time_index_record
+                // Records lost in a crash are restored from the index and the log on startup
+                struct
+                {
+                        int fd;
+                        Switch::vector<time_index_record> records;
 
-                        } ondisk;
+                        // records[0, persisted) have been written to the .tindex file; see persist_cur_time_index()
+                        uint32_t persisted;
 
-                } index;
+                        // max first-message timestamp of all bundles in the segment
+                        uint64_t maxTS;
+                } timeIndex;
 
                 struct
                 {
                         uint64_t pendingFlushMsgs{0};
                         uint32_t nextFlushTS;
+
+                        // The last range of the log we initiated writeback for; see schedule_writeback()
+                        range32_t writeback;
                 } flush_state;
 
         } cur; // the _current_ (latest) segment
@@ -340,32 +586,68 @@ struct topic_partition_log
                                 delete it;
                 }
 
-		if (cur.index.fd != -1)
-		{
-			fdatasync(cur.index.fd);
-			close(cur.index.fd);
-		}
+		close_cur_index();
+
+                if (cur.timeIndex.fd != -1)
+                {
+                        persist_cur_time_index();
+                        close(cur.timeIndex.fd);
+                }
+
+                if (spare)
+                        spare->Release();
         }
 
+        void map_cur_index();
+
+        void close_cur_index();
+
+        bool persist_cur_time_index();
+
+        void schedule_spare_segment();
+
+        void prealloc_cur_segment(const uint64_t);
+
         lookup_res read_cur(const uint64_t absSeqNum, const uint32_t maxSize, const uint64_t maxAbsSeqNum);
 
         lookup_res range_for(uint64_t absSeqNum, const uint32_t maxSize, uint64_t maxAbsSeqNum);
 
-        append_res append_bundle(const time_t, const void *bundle, const size_t bundleSize, const uint32_t bundleMsgsCnt, const uint64_t, const uint64_t);
+        void stage_bundle(const time_t, produce_bundle &, append_batch &);
+
+        bool commit_staged(staged_append &, const time_t, Service *);
 
         bool should_roll(const uint32_t) const;
 
+        uint64_t seqnum_for_ts(const uint64_t);
+
 	bool may_switch_index_wide(const uint64_t);
 
-        void schedule_flush(const uint32_t);
+        void schedule_flush(const uint32_t, const staged_append &, Service * = nullptr);
+
+        void schedule_writeback();
 
         void consider_ro_segments();
 
-	void compact(const char *);
+	void compact(const char *, ro_segment * = nullptr);
+
+	void consider_pending_recompressions();
 };
 
 struct connection;
 struct topic_partition;
+class Service;
+
+// Almost all consumers will ask for the message right after the last message of the previous response.
+// We track, for each connection and partition, where the last response ended if it ended at the end of the
+// current segment, so that a request for that sequence number won't require an index lookup and adjust_range_start() preads
+// It is only valid if fdh is still the current segment's fdh(i.e the segment hasn't been rolled)
+struct consume_cursor
+{
+        const topic_partition *partition;
+        uint64_t absSeqNum;
+        fd_handle *fdh; // retained
+        uint32_t fileOffset;
+};
 
 // In order to support minBytes semantics, we will
 // need to track produced data for each tracked topic partition, so that
@@ -376,6 +658,8 @@ struct wait_ctx_partition
         uint64_t seqNum;
         range32_t range;
         topic_partition *partition;
+        // The sequence number of the first message right after range
+        uint64_t nextSeqNum;
 };
 
 struct wait_ctx
@@ -387,14 +671,161 @@ struct wait_ctx
         uint64_t expiration; // in MS
         uint32_t minBytes;
 
+        // The reactor that owns c
+        // If a bundle is appended by another reactor, the wakeup is handed off to this reactor (see Service::schedule_wakeup())
+        Service *reactor;
+
+        // Incremented by destroy_wait_ctx(), so that a handed off wakeup can tell if the context
+        // was destroyed (and possibly reused) in the meantime
+        // Other reactors read it in Service::schedule_wakeup(), so it's accessed atomically(as is scheduledForDtor)
+        uint32_t gen;
+
         // A request may involve multiple partitions
         // minBytes applies to the sum of all captured content for all specified partitions
+        // Partitions may be appended to by different reactors, so this is updated atomically
         uint32_t capturedSize;
 
         uint8_t partitionsCnt;
         wait_ctx_partition partitions[0];
 };
 
+// Hierarchical timing wheel for wait_ctx expirations, with millisecond resolution
+//
+// There are 4 levels of 256 slots each; a slot in level L spans 256^L milliseconds.
+// A context is placed in the lowest level where its expiration and the wheel's current time
+// only differ in that level's bits, and it is cascaded to lower levels as the wheel advances.
+// Expirations more than 2^32ms away are tracked in `far`, until they are close enough.
+struct wait_ctx_timers
+{
+        static constexpr uint8_t LevelBits{8};
+        static constexpr uint32_t SlotsCnt{1u << LevelBits};
+        static constexpr uint8_t LevelsCnt{4};
+
+        switch_dlist slots[LevelsCnt][SlotsCnt];
+        switch_dlist far;
+        // All timers that expire at or before cur have been fired
+        uint64_t cur;
+        uint32_t size{0};
+
+        void init(const uint64_t now)
+        {
+                for (auto &level : slots)
+                {
+                        for (auto &it : level)
+                                switch_dlist_init(&it);
+                }
+                switch_dlist_init(&far);
+                cur = now;
+                size = 0;
+        }
+
+        void place(switch_dlist *const node, uint64_t expiration)
+        {
+                if (expiration <= cur)
+                        expiration = cur + 1;
+
+                for (uint8_t l{0}; l != LevelsCnt; ++l)
+                {
+                        const uint8_t shift = (l + 1) * LevelBits;
+
+                        if ((expiration >> shift) == (cur >> shift))
+                        {
+                                switch_dlist_insert_before(&slots[l][(expiration >> (l * LevelBits)) & (SlotsCnt - 1)], node);
+                                return;
+                        }
+                }
+
+                switch_dlist_insert_before(&far, node);
+        }
+
+        void add(wait_ctx *const ctx)
+        {
+                place(&ctx->expList, ctx->expiration);
+                ++size;
+        }
+
+        void remove(wait_ctx *const ctx)
+        {
+                switch_dlist_del_and_reset(&ctx->expList);
+                --size;
+        }
+
+        void cascade(switch_dlist *const l)
+        {
+                switch_dlist tmp;
+
+                if (switch_dlist_isempty(l))
+                        return;
+
+                // place() may move a node back to the same list(far), so we need to detach them all first
+                tmp.next = l->next;
+                tmp.prev = l->prev;
+                tmp.next->prev = &tmp;
+                tmp.prev->next = &tmp;
+                switch_dlist_init(l);
+
+                while (auto it = switch_dlist_popfirst(&tmp))
+                        place(it, switch_list_entry(wait_ctx, expList, it)->expiration);
+        }
+
+        // Advances the wheel to `now`, and invokes l() for every expired context
+        // The context is removed from the wheel before l() is invoked
+        template <typename L>
+        void advance(const uint64_t now, L &&l)
+        {
+                if (!size)
+                {
+                        cur = std::max(cur, now);
+                        return;
+                }
+
+                while (cur < now)
+                {
+                        uint8_t top{1};
+
+                        ++cur;
+
+                        // Cascade, from the highest level down, every level whose slot boundary we just crossed
+                        while (top != LevelsCnt && !(cur & ((uint64_t(1) << (top * LevelBits)) - 1)))
+                                ++top;
+
+                        if (top == LevelsCnt && !(cur & ((uint64_t(1) << (LevelsCnt * LevelBits)) - 1)))
+                                cascade(&far);
+
+                        for (uint8_t k = top - 1; k; --k)
+                                cascade(&slots[k][(cur >> (k * LevelBits)) & (SlotsCnt - 1)]);
+
+                        for (auto s = &slots[0][cur & (SlotsCnt - 1)]; auto it = switch_dlist_popfirst(s);)
+                        {
+                                switch_dlist_init(it);
+                                --size;
+                                l(switch_list_entry(wait_ctx, expList, it));
+                        }
+                }
+        }
+
+        // How long (in ms) can we block until the next timer needs to fire, but no longer than `max`
+        uint64_t next_timeout(const uint64_t now, const uint64_t max) const
+        {
+                uint64_t target;
+
+                if (!size)
+                        return max;
+
+                target = (cur | (SlotsCnt - 1)) + 1;
+                for (uint32_t i = (cur & (SlotsCnt - 1)) + 1; i < SlotsCnt; ++i)
+                {
+                        if (switch_dlist_any(&slots[0][i]))
+                        {
+                                target = (cur & ~uint64_t(SlotsCnt - 1)) + i;
+                                break;
+                        }
+                }
+
+                return target <= now ? 0 : std::min(max, target - now);
+        }
+};
+
 struct topic;
 struct topic_partition
     : public RefCounted<topic_partition>
@@ -445,21 +876,30 @@ struct topic_partition
 
         auto highwater_mark() const
         {
-                return log_->lastAssignedSeqNum;
+                return log_->committed_seqnum();
         }
 
         Switch::vector<wait_ctx *> waitingList;
 
+        // Partitions are not owned by any reactor; connections are.
+        // This serializes access to log_, waitingList and the wait_ctx_partition of each wait context in waitingList
+        mutable Switch::mutex lock;
+
+        // The reactor appending to the partition, if any; appends are serialized. It's set while the reactor stages, writes and commits
+        // bundles, but lock is only held to stage and commit them, so that consumers won't wait for the writes.
+        // The writes may complete in a later I/O loop iteration of the reactor; see pending_append
+        // Other reactors wait on appendDone until it's reset; see Service::acquire_for_append()
+        Service *appender{nullptr};
+        std::condition_variable appendDone;
+
         Switch::shared_refptr<replica> replicaByBrokerId(const uint16_t brokerId)
         {
                 return replicasMap[brokerId];
         }
 
-        void consider_append_res(append_res &res, Switch::vector<wait_ctx *> &waitCtxWorkL);
+        void consider_append_res(append_res &res, Switch::vector<wait_ctx *> &waitCtxWorkL, const Service *);
 
-        append_res append_bundle_to_leader(const time_t, const uint8_t *const bundle, const size_t bundleLen, const uint32_t bundleMsgsCnt, Switch::vector<wait_ctx *> &waitCtxWorkL, const uint64_t, const uint64_t);
-
-        lookup_res read_from_local(const bool fetchOnlyFromLeader, const bool fetchOnlyComittted, const uint64_t absSeqNum, const uint32_t fetchSize);
+        lookup_res read_from_local(const bool fetchOnlyFromLeader, const bool fetchOnlyComittted, const uint64_t absSeqNum, const uint32_t fetchSize, const consume_cursor *const cursor);
 };
 
 struct topic
@@ -468,6 +908,10 @@ struct topic
         const strwlen8_t name_;
         Switch::vector<topic_partition *> *partitions_;
 	partition_config partitionConf;
+        // ID of the topic's current trained Zstd dictionary, or 0
+        // All of the topic's dictionaries are stored as compression.<id>.dict in the topic directory, and compression.dict links to the current one
+        // The dictionaries themselves live in the Compression::RegisterZstdDictionary() registry
+        std::atomic<uint32_t> compressionDictId{0};
 
         topic(const strwlen8_t name, const partition_config c)
             : name_{name.Copy(), name.len}, partitionConf{c}
@@ -533,20 +977,25 @@ struct topic
         }
 };
 
-// We could have used Switch::deque<> but let's just use something simpler
-// TODO: Maybe we should just use a linked list instead
+// A queue of payloads, stored in linked fixed-size chunks, so that it can grow as needed(e.g
+// when a consumer pipelines many requests) and a payload's address won't change while it's in the queue.
+// Exhausted chunks are kept for reuse, and trimmed when the queue is returned to the pool; see Service::put_outgoing_queue()
 struct outgoing_queue
 {
         struct content_file_range
         {
                 fd_handle *fdh;
                 range32_t range;
+                // The end of the span of the file a disk thread has paged-in for the range; past it(or if it's 0)
+                // try_send() probes each span before it streams it. See Service::warmed_up()
+                uint32_t residentUpto;
 
                 content_file_range &operator=(const content_file_range &o)
                 {
                         fdh = o.fdh;
 			fdh->Retain();
                         range = o.range;
+                        residentUpto = o.residentUpto;
                         return *this;
                 }
 
@@ -554,6 +1003,7 @@ struct outgoing_queue
                 {
                         fdh = o.fdh;
                         range = o.range;
+                        residentUpto = o.residentUpto;
 
 			o.fdh = nullptr;
 			o.range.reset();
@@ -571,12 +1021,13 @@ struct outgoing_queue
                         {
                                 IOBuffer *buf;
 
-                                struct
-                                {
-                                        struct iovec iov[64]; // https://github.com/phaistos-networks/TANK/issues/12
-                                        uint8_t iovIdx;
-                                        uint8_t iovCnt;
-                                };
+                                // Points to inlineIOV, unless more than sizeof_array(inlineIOV) iovecs are needed(see set_iov()), in which
+                                // case it's allocated on demand, and released by the queue when the payload is popped
+                                // https://github.com/phaistos-networks/TANK/issues/12
+                                struct iovec *iov;
+                                uint16_t iovIdx;
+                                uint16_t iovCnt;
+                                struct iovec inlineIOV[2];
                         };
 
                         content_file_range file_range;
@@ -584,6 +1035,9 @@ struct outgoing_queue
 
 		void set_iov(const range32_t *const l, const uint32_t cnt)
                 {
+                        if (cnt > sizeof_array(inlineIOV))
+                                iov = static_cast<struct iovec *>(malloc(sizeof(struct iovec) * cnt));
+
                         iovCnt = cnt;
 
                         for (uint32_t i{0}; i != cnt; ++i)
@@ -595,6 +1049,15 @@ struct outgoing_queue
                         }
                 }
 
+                void release_iov()
+                {
+                        if (payloadBuf && iov != inlineIOV)
+                        {
+                                free(iov);
+                                iov = inlineIOV;
+                        }
+                }
+
                 payload()
                     : payloadBuf{false}
                 {
@@ -604,6 +1067,7 @@ struct outgoing_queue
                 {
                         payloadBuf = true;
                         buf = b;
+                        iov = inlineIOV;
 			iovCnt = iovIdx = 0;
                 }
 
@@ -612,6 +1076,7 @@ struct outgoing_queue
                         payloadBuf = false;
                         file_range.fdh = fdh;
                         file_range.range = r;
+                        file_range.residentUpto = 0;
                         file_range.fdh->Retain();
                 }
 
@@ -626,9 +1091,17 @@ struct outgoing_queue
                                 buf = o.buf;
 				iovCnt = o.iovCnt;
 				iovIdx = o.iovIdx;
-				memcpy(iov, o.iov, iovCnt * sizeof(struct iovec));
+
+                                if (o.iov == o.inlineIOV)
+                                {
+                                        iov = inlineIOV;
+                                        memcpy(inlineIOV, o.inlineIOV, iovCnt * sizeof(struct iovec));
+                                }
+                                else
+                                        iov = o.iov;
 
 				o.buf = nullptr;
+                                o.iov = o.inlineIOV;
 				o.iovCnt = o.iovIdx = 0;
 			}
                         else
@@ -645,104 +1118,157 @@ struct outgoing_queue
         using reference = payload &;
         using reference_const = const payload &;
 
-        payload A[128]; // fixed size
-        uint8_t backIdx{0}, frontIdx{0}, size_{0};
-        static constexpr size_t capacity{sizeof_array(A)};
+        struct chunk
+        {
+                static constexpr uint32_t capacity{32};
+
+                payload A[capacity];
+                chunk *prev, *next;
+        };
+
+        // (front, frontIdx) is the first payload, and (back, backIdx) is right past the last payload
+        // frontIdx is only ever chunk::capacity if the queue is empty
+        chunk *front_{nullptr}, *back_{nullptr};
+        uint32_t frontIdx{0}, backIdx{0}, size_{0};
 
+        // Exhausted chunks, linked via prev
+        // Their next is not reset until they are reused, so that an iterator to a payload
+        // in a chunk that was exhausted while iterating can still be advanced; see try_send()
+        chunk *spare{nullptr};
 
-        inline uint32_t prev(const uint32_t idx) const noexcept
+        struct iterator
         {
-                return (idx + (capacity - 1)) & (capacity - 1);
-        }
+                chunk *c;
+                uint32_t idx;
 
-        inline uint32_t next(const uint32_t idx) const noexcept
+                inline reference operator*() const noexcept
+                {
+                        return c->A[idx];
+                }
+
+                inline iterator &operator++() noexcept
+                {
+                        if (++idx == chunk::capacity && c->next)
+                        {
+                                c = c->next;
+                                idx = 0;
+                        }
+                        return *this;
+                }
+
+                inline bool operator!=(const iterator &o) const noexcept
+                {
+                        return c != o.c || idx != o.idx;
+                }
+        };
+
+        inline iterator begin() const noexcept
         {
-                return (idx + 1) & (capacity - 1);
+                return {front_, frontIdx};
         }
 
-        inline reference front() noexcept
+        inline iterator end() const noexcept
         {
-                return A[frontIdx];
+                return {back_, backIdx};
         }
 
-        inline reference_const front() const noexcept
+        chunk *new_chunk()
         {
-                return A[frontIdx];
+                auto c = spare;
+
+                if (c)
+                        spare = c->prev;
+                else
+                        c = new chunk();
+
+                c->prev = c->next = nullptr;
+                return c;
         }
 
-        inline reference back() noexcept 
+        void put_chunk(chunk *const c)
         {
-                return A[prev(backIdx)];
+                c->prev = spare;
+                spare = c;
         }
 
-        inline reference_const back() const noexcept
+        inline reference front() noexcept
         {
-                return A[prev(backIdx)];
+                return front_->A[frontIdx];
         }
 
-        inline reference at(const size_t idx) noexcept
+        inline reference_const front() const noexcept
         {
-                return A[(frontIdx + idx) & (capacity - 1)];
+                return front_->A[frontIdx];
         }
 
-        inline reference_const at(const size_t idx) const noexcept
+        inline reference back() noexcept 
         {
-                return A[(frontIdx + idx) & (capacity - 1)];
+                return backIdx ? back_->A[backIdx - 1] : back_->prev->A[chunk::capacity - 1];
         }
 
-	inline void did_push() noexcept
+        inline reference_const back() const noexcept
         {
-		++size_;
+                return backIdx ? back_->A[backIdx - 1] : back_->prev->A[chunk::capacity - 1];
         }
 
-	inline void did_pop() noexcept
-	{
-		--size_;
-	}
-
         payload &push_back(const payload &v) = delete;
 
         auto push_back(payload &&v)
         {
-                if (unlikely(size_ == capacity))
-                        throw Switch::system_error("Queue full");
+                if (!size_)
+                {
+                        // No iterators can be outstanding here, so we can just rewind
+                        frontIdx = backIdx = 0;
+                }
+                else if (backIdx == chunk::capacity)
+                {
+                        auto c = new_chunk();
 
-		payload *const res = A + backIdx;
+                        c->prev = back_;
+                        back_->next = c;
+                        back_ = c;
+                        backIdx = 0;
+                }
 
-                *res= std::move(v);
-                backIdx = next(backIdx);
-		did_push();
+		payload *const res = back_->A + backIdx;
+
+                *res = std::move(v);
+                ++backIdx;
+                ++size_;
 
 		return res;
         }
 
-        void push_front(const payload &v) = delete;
-
-        void push_front(payload &&v)
+        inline void pop_back() noexcept
         {
-                if (unlikely(size_ == capacity))
-                        throw Switch::system_error("Queue full");
+                if (!backIdx)
+                {
+                        auto c = back_;
 
-                frontIdx = prev(frontIdx);
-                A[frontIdx] = std::move(v);
-		did_push();
-        }
+                        back_ = c->prev;
+                        back_->next = nullptr;
+                        backIdx = chunk::capacity;
+                        put_chunk(c);
+                }
 
-        inline void pop_back() noexcept
-        {
-                backIdx = prev(backIdx);
-		did_pop();
+                back_->A[--backIdx].release_iov();
+                --size_;
         }
 
         inline void pop_front() noexcept
         {
-                frontIdx = next(frontIdx);
-		did_pop();
-        }
+                front_->A[frontIdx].release_iov();
+                --size_;
 
-        inline bool full() const noexcept
-        {
-                return size_ == capacity;
+                if (++frontIdx == chunk::capacity && front_ != back_)
+                {
+                        auto c = front_;
+
+                        front_ = c->next;
+                        front_->prev = nullptr;
+                        frontIdx = 0;
+                        put_chunk(c);
+                }
         }
 
         inline bool empty() const noexcept
@@ -758,25 +1284,103 @@ struct outgoing_queue
         template <typename L>
         void clear(L &&l)
         {
-                while (frontIdx != backIdx)
+                for (auto it = begin(), e = end(); it != e; ++it)
                 {
-                        auto &p = A[frontIdx];
+                        auto &p = *it;
 
                         if (p.payloadBuf)
+                        {
                                 l(p.buf);
+                                p.release_iov();
+                        }
                         else
                                 p.file_range.fdh->Release();
+                }
+
+                // Keep a single chunk around
+                for (auto c = front_->next; c;)
+                {
+                        auto next = c->next;
 
-                        frontIdx = next(frontIdx);
+                        delete c;
+                        c = next;
                 }
 
+                while (spare)
+                {
+                        auto c = spare;
+
+                        spare = c->prev;
+                        delete c;
+                }
+
+                front_->prev = front_->next = nullptr;
+                back_ = front_;
                 size_ = 0;
                 frontIdx = backIdx = 0;
         }
 
         outgoing_queue()
         {
+                front_ = back_ = new_chunk();
         }
+
+        ~outgoing_queue()
+        {
+                while (front_)
+                {
+                        auto c = front_;
+
+                        front_ = c->next;
+                        delete c;
+                }
+
+                while (spare)
+                {
+                        auto c = spare;
+
+                        spare = c->prev;
+                        delete c;
+                }
+        }
+};
+
+// A produce request with requiredAcks == DurableAcks is not acknowledged until all the bundles it appended are synced
+// Its response is held in the connection's outQ(with no iovecs, so that it, and any responses queued after it, won't be sent), until then,
+// or until it expires, in which case the status of partitions not yet synced is set to 3; see Service::consider_durable_acks()
+static constexpr uint8_t DurableAcks{0xff};
+
+// A produce request the bundles of which are being written via io_uring
+// Its response is held in the connection's outQ until the writes complete and the bundles are committed, in the same or a later
+// I/O loop iteration; see Service::complete_pending_appends()
+struct pending_append
+{
+        struct connection *c;
+        IOBuffer *resp;
+        void *payload; // outgoing_queue::payload
+        // The request; the staged iovecs point into it
+        IOBuffer *inB;
+        bool durable;
+        uint32_t ackTimeout;
+        Switch::vector<produce_bundle> bundles;
+        append_batch batch;
+};
+
+struct durable_ack
+{
+        struct connection *c;
+        IOBuffer *resp;
+        void *payload; // outgoing_queue::payload
+        uint64_t expires;
+
+        struct partition_ack
+        {
+                topic_partition *partition;
+                uint64_t seqNum;
+                uint32_t statusOffset;
+        };
+
+        Switch::vector<partition_ack> partitions;
 };
 
 struct connection
@@ -799,12 +1403,120 @@ struct connection
                 {
                         PendingIntro = 0,
                         NeedOutAvail,
-			ConsideredReqHeader
+			ConsideredReqHeader,
+                        // The range at the front of outQ is being paged-in by a disk thread; see Service::warm_up()
+                        WarmingUp
                 };
 
                 uint8_t flags;
                 uint64_t lastInputTS;
         } state;
+
+        // Produce responses held in outQ until the bundles they acknowledge are durable; see durable_ack
+        // The connection is not released until they are all resolved
+        uint32_t pendingDurableAcks{0};
+
+        // Likewise, produce responses held until their bundles are written; see pending_append
+        uint32_t pendingAppends{0};
+
+        // See consume_cursor
+        Switch::vector<consume_cursor> cursors;
+
+        const consume_cursor *cursor_for(const topic_partition *const p) const
+        {
+                for (const auto &it : cursors)
+                {
+                        if (it.partition == p)
+                                return &it;
+                }
+
+                return nullptr;
+        }
+
+        void update_cursor(const topic_partition *const p, const uint64_t absSeqNum, fd_handle *const fdh, const uint32_t fileOffset)
+        {
+                consume_cursor *cursor{nullptr};
+
+                for (auto &it : cursors)
+                {
+                        if (it.partition == p)
+                        {
+                                cursor = &it;
+                                break;
+                        }
+                }
+
+                if (!cursor)
+                {
+                        if (cursors.size() == 64)
+                        {
+                                // Evict the oldest
+                                cursors.front().fdh->Release();
+                                cursors.pop_front();
+                        }
+
+                        cursors.push_back({p, 0, nullptr, 0});
+                        cursor = &cursors.back();
+                }
+
+                fdh->Retain();
+                if (cursor->fdh)
+                        cursor->fdh->Release();
+
+                cursor->absSeqNum = absSeqNum;
+                cursor->fdh = fdh;
+                cursor->fileOffset = fileOffset;
+        }
+
+        void reset_cursors()
+        {
+                for (auto &it : cursors)
+                        it.fdh->Release();
+                cursors.clear();
+        }
+};
+
+// basic type-erasure for the callable of std::bind
+struct mainthread_closure
+{
+        struct callable
+        {
+                virtual void invoke() = 0;
+                virtual ~callable()
+                {
+                }
+        };
+
+        template <typename T>
+        struct internal
+            : public callable
+        {
+                T v;
+
+                internal(T &&call)
+                    : v(std::move(call))
+                {
+                }
+
+                virtual void invoke() override
+                {
+                        v();
+                }
+        };
+
+        template <typename T>
+        mainthread_closure(T &&foo)
+            : L{new internal<T>(std::move(foo))}
+        {
+        }
+
+        void operator()()
+        {
+                L->invoke();
+        }
+
+        mainthread_closure *next;
+        std::unique_ptr<callable> L;
 };
 
 class Service final
@@ -827,7 +1539,8 @@ class Service final
         Switch::vector<IOBuffer *> bufs;
         Switch::vector<connection *> connsPool;
         Switch::vector<outgoing_queue *> outgoingQueuesPool;
-        switch_dlist allConnections, waitExpList;
+        switch_dlist allConnections;
+        wait_ctx_timers waitCtxTimers;
 	// In the past, it was possible, however improbably, that
 	// we 'd invoke destroy_wait_ctx() twice on the same context, or would otherwise
 	// use or re-use the same context while it was either invalid, or was reused
@@ -842,9 +1555,27 @@ class Service final
 	// It's nonethless great that we figured out this edge case(no evidence that this
 	// has ever happened) and we are dealing with it here.
         Switch::vector<wait_ctx *> expiredCtxList, expiredCtxList2, expiredCtxList3, waitCtxDeferredGC;
-        uint32_t nextDistinctPartitionId{0};
+
+        // See process_produce() and append_produce_batch()
+        Switch::vector<produce_bundle> produceBundles;
+        append_batch appendBatch;
+        Switch::vector<durable_ack *> durableAcks;
+        Switch::vector<pending_append *> pendingAppends;
+        static std::atomic<uint32_t> nextDistinctPartitionId;
         int listenFd;
         EPoller poller;
+
+        // Each Service instance is a reactor; it runs its own I/O loop in its own thread, and
+        // owns the connections accepted from its listening socket. The first one is the primary reactor, which
+        // initializes topics and partitions, and also handles the background tasks.
+        // See -r option
+        uint8_t reactorIdx{0};
+
+        // Closures scheduled to run in this reactor by other reactors
+        // reactorEventFd is used to wake up the reactor if it is blocked in poller.Poll()
+        PubSubQueue<mainthread_closure> reactorClosures;
+        std::atomic<bool> reactorWakeupPending{false};
+        int reactorEventFd{-1};
         Switch::vector<topic_partition *> deferList;
 	range32_t patchList[1024];
 	time_t curTime;
@@ -854,6 +1585,8 @@ class Service final
 
         static void parse_partition_config(const strwlen32_t, partition_config *);
 
+        static uint32_t load_compression_dict(const char *);
+
         auto get_outgoing_queue()
         {
                 return outgoingQueuesPool.size() ? outgoingQueuesPool.Pop() : new outgoing_queue();
@@ -949,12 +1682,16 @@ class Service final
                 return nullptr;
         }
 
-        bool process_consume(connection *const c, const uint8_t *p, const size_t len);
+        bool process_consume(connection *const c, const uint8_t *p, const size_t len, const bool mustRespond = false);
 
         bool process_replica_reg(connection *const c, const uint8_t *p, const size_t len);
 
         bool process_discover_partitions(connection *const c, const uint8_t *p, const size_t len);
 
+        bool process_seqnums_for_ts(connection *const c, const uint8_t *p, const size_t len);
+
+        bool process_compression_dict(connection *const c, const uint8_t *p, const size_t len);
+
         bool process_create_topic(connection *const c, const uint8_t *p, const size_t len);
 
         wait_ctx *get_waitctx(const uint8_t totalPartitions)
@@ -962,7 +1699,12 @@ class Service final
                 if (waitCtxPool[totalPartitions].size())
                         return waitCtxPool[totalPartitions].Pop();
                 else
-                        return (wait_ctx *)malloc(sizeof(wait_ctx) + totalPartitions * sizeof(wait_ctx_partition));
+                {
+                        auto ctx = (wait_ctx *)malloc(sizeof(wait_ctx) + totalPartitions * sizeof(wait_ctx_partition));
+
+                        ctx->gen = 0;
+                        return ctx;
+                }
         }
 
         void put_waitctx(wait_ctx *const ctx)
@@ -970,10 +1712,28 @@ class Service final
                 waitCtxPool[ctx->partitionsCnt].push_back(ctx);
         }
 
-        bool register_consumer_wait(connection *const c, const uint32_t requestId, const uint64_t maxWait, const uint32_t minBytes, topic_partition **const partitions, const uint32_t totalPartitions);
+        bool register_consumer_wait(connection *const c, const uint32_t requestId, const uint64_t maxWait, const uint32_t minBytes, topic_partition **const partitions, const uint64_t *const, const uint32_t totalPartitions);
 
         bool process_produce(const TankAPIMsgType, connection *const c, const uint8_t *p, const size_t len);
 
+        void append_produce_batch(connection *const c, IOBuffer *, void *, const bool, const uint32_t);
+
+        void acquire_for_append(connection *);
+
+        void commit_staged(staged_append &, const bool);
+
+        void commit_written(append_batch &, const bool);
+
+        void commit_appended(append_batch &, Switch::vector<produce_bundle> &, const bool);
+
+        void wakeup_appended(connection *);
+
+        void respond_produce(connection *, IOBuffer *, void *, const Switch::vector<produce_bundle> &, const bool, const uint32_t);
+
+        void complete_pending_appends(const bool, connection * = nullptr);
+
+        void hold_for_durable_ack(connection *, IOBuffer *, void *, const Switch::vector<produce_bundle> &, const uint32_t);
+
         bool process_msg(connection *const c, const uint8_t msg, const uint8_t *const data, const size_t len);
 
         void wakeup_wait_ctx(wait_ctx *const wctx, const append_res &appendRes, connection *);
@@ -1005,8 +1765,16 @@ class Service final
 
         bool try_send(connection *const c);
 
+        void warm_up(connection *, fd_handle *, const range32_t);
+
+        int init_listener(const Switch::endpoint, const bool);
+
+        void drain_reactor_closures();
+
+        int run_reactor();
+
 	protected:
-	static void rebuild_index(int, int);
+	static void rebuild_index(int, int, int = -1, const bool = false);
 
 	static uint32_t verify_log(int);
 
@@ -1016,10 +1784,22 @@ class Service final
         Service()
         {
                 switch_dlist_init(&allConnections);
-                switch_dlist_init(&waitExpList);
+                waitCtxTimers.init(Timings::Milliseconds::Tick());
         }
 
         ~Service();
 
         int start(int argc, char **argv);
+
+        // Can be invoked from any thread
+        void run_on_reactor(mainthread_closure *);
+
+        void schedule_wakeup(wait_ctx *);
+
+        // Invoked by a disk thread (via run_on_reactor()) once a range scheduled by warm_up() is paged-in
+        void warmed_up(connection *);
+
+        // Invoked by a flusher thread (via run_on_reactor()) once syncs requested for durable acks have completed, and periodically
+        // for expired durable acks
+        void consider_durable_acks();
 };
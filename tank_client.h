@@ -5,11 +5,13 @@
 #include <network.h>
 #include <queue>
 #include <set>
+#include <string>
 #include <switch.h>
 #include <switch_dictionary.h>
 #include <switch_ll.h>
 #include <switch_mallocators.h>
 #include <switch_vector.h>
+#include <unordered_map>
 #include <vector>
 
 // Tank, because its a large container of liquid or gas
@@ -180,12 +182,35 @@ class TankClient final
                 range_base<std::pair<uint64_t, uint64_t> *, uint16_t> watermarks;
         };
 
+	struct partition_seqnum
+	{
+		uint16_t partition;
+		uint64_t seqNum;
+	};
+
+	// For each partition, the sequence number of the first message with timestamp >= the requested timestamp
+	// If there is no such message, seqNum is set to the partition's last assigned sequence number + 1
+	struct seqnums_for_ts_result
+	{
+		uint32_t clientReqId;
+		strwlen8_t topic;
+		range_base<partition_seqnum *, uint16_t> partitions;
+	};
+
 	struct created_topic
 	{
 		uint32_t clientReqId;
 		strwlen8_t topic;
 	};
 
+	// dictId is the ID of the topic's trained Zstd dictionary, or 0 if the topic has none
+	struct compression_dict_result
+	{
+		uint32_t clientReqId;
+		strwlen8_t topic;
+		uint32_t dictId;
+	};
+
         struct produce_ack
         {
                 uint32_t clientReqId;
@@ -230,6 +255,78 @@ class TankClient final
                 } next;
         };
 
+        // With set_lazy_consume(true), consume responses are reported as partition_chunk's(see consumed_chunks()), instead of partition_content's
+        // A chunk references the bundles streamed for the partition as they are in the connection's input buffer; nothing is decoded or
+        // decompressed until a msgs_cursor is advanced over it, so applications that only need the next few messages, or look for specific keys,
+        // only pay for the bundles they get to. Like consumed(), chunks are only valid until the next poll()
+        struct partition_chunk
+        {
+                uint32_t clientReqId;
+                strwlen8_t topic;
+                uint16_t partition;
+                // bundles streamed from the commit log (may end with a partial bundle)
+                range_base<const uint8_t *, uint32_t> content;
+                // sequence number of the first message of the first bundle; 0 if the first bundle is sparse and encodes it
+                uint64_t baseSeqNum;
+                uint64_t highWaterMark;
+                // the sequence number requested; see consume()
+                uint64_t requestedSeqNum;
+                bool respComplete;
+        };
+
+        // Decodes the messages of a partition_chunk, one at a time
+        // Messages of uncompressed bundles reference the chunk's content. Messages of compressed bundles reference the cursor's own
+        // decompression buffer, so they are only valid until the cursor advances to the next bundle
+        class msgs_cursor final
+        {
+              private:
+                const partition_chunk *const chunk;
+                const uint8_t *p, *msgP{nullptr}, *msgSetEnd{nullptr};
+                uint64_t logBaseSeqNum, firstMsgSeqNum{0}, lastMsgSeqNum{0}, ts{0};
+                uint32_t msgIdx{0}, msgsSetSize{0};
+                bool sparseBundle{false}, exhausted{false};
+                uint64_t lastSeqNum{0};
+                bool haveLast{false};
+                uint32_t minFetchSize{128};
+                uint32_t missingDictId{0};
+                IOBuffer rawData;
+
+                bool next_bundle();
+
+              public:
+                msgs_cursor(const partition_chunk &c)
+                    : chunk{&c}, p{c.content.offset}, logBaseSeqNum{c.baseSeqNum}
+                {
+                }
+
+                // Returns false once there are no more messages to decode from the chunk
+                bool next(consumed_msg &out);
+
+                // Where to consume from next; if not all messages were decoded, it is the sequence number of the message after the last one
+                // returned by next(), so that the rest of the chunk will be streamed again. Same semantics as partition_content::next
+                uint64_t next_seqnum() const noexcept
+                {
+                        const auto requestedSeqNum = chunk->requestedSeqNum;
+
+                        if (haveLast)
+                                return requestedSeqNum == UINT64_MAX ? lastSeqNum + 1 : std::max(requestedSeqNum, lastSeqNum + 1);
+                        else
+                                return requestedSeqNum == UINT64_MAX ? chunk->highWaterMark + 1 : requestedSeqNum;
+                }
+
+                uint32_t min_fetch_size() const noexcept
+                {
+                        return minFetchSize;
+                }
+
+                // If set, the cursor stopped at a bundle compressed with the Zstd dictionary with that ID, which the client doesn't have
+                // Fetch it with fetch_compression_dict(topic, id), and consume from next_seqnum() again once it's available
+                uint32_t missing_compression_dict() const noexcept
+                {
+                        return missingDictId;
+                }
+        };
+
         struct fault
         {
                 uint32_t clientReqId;
@@ -243,7 +340,12 @@ class TankClient final
                         BoundaryCheck,
 			InvalidReq,
 			SystemFail,
-			AlreadyExists
+			AlreadyExists,
+			// The bundles were appended, but not synced within the ack timeout; see set_durable_acks()
+			NotDurable,
+			// A bundle consumed from the partition was compressed with a Zstd dictionary the client doesn't have. The client
+			// fetches it on the next poll()(see compression_dicts()); consume from the partition's next.seqNum again once it's available
+			UnknownCompressionDict
                 } type;
 
                 enum class Req : uint8_t
@@ -263,6 +365,9 @@ class TankClient final
                                 uint64_t firstAvailSeqNum;
                                 uint64_t highWaterMark;
                         };
+
+                        // Set when fault is UnknownCompressionDict
+                        uint32_t dictId;
                 } ctx;
 
 
@@ -286,7 +391,8 @@ class TankClient final
         {
                 struct
                 {
-			uint32_t next{1};
+			// atomic, because submit_produce() may be called by other threads
+			std::atomic<uint32_t> next{1};
                 } client;
 
                 struct
@@ -395,6 +501,10 @@ class TankClient final
         uint64_t nextInflightReqsTimeoutCheckTs{0};
         RetryStrategy retryStrategy{RetryStrategy::RetryAlways};
         CompressionStrategy compressionStrategy{CompressionStrategy::CompressIntelligently};
+        Compression::Algo compressionAlgo{Compression::Algo::SNAPPY};
+        // See set_durable_acks()
+        uint8_t requiredAcks{0};
+        uint32_t ackTimeout{0};
         Switch::unordered_map<Switch::endpoint, broker *> bsMap;
         Switch::unordered_map<strwlen8_t, Switch::endpoint> leadersMap;
         Switch::endpoint defaultLeader{};
@@ -408,10 +518,75 @@ class TankClient final
         simple_allocator resultsAllocator{2 * 1024 * 1024};
 	Switch::vector<void *> resultsAllocations;
         Switch::vector<partition_content> consumedPartitionContent;
+	// See set_lazy_consume()
+	bool lazyConsume{false};
+	Switch::vector<partition_chunk> consumedChunks;
+	// See set_produce_linger()
+	struct batched_msg
+	{
+		uint64_t ts;
+		uint32_t keyOffset;
+		uint8_t keyLen;
+		uint32_t contentOffset;
+		uint32_t contentLen;
+	};
+
+	// Also used for messages submitted with submit_produce()
+	struct produce_batch
+	{
+		// see produceSubmissions
+		produce_batch *next{nullptr};
+		std::string topic;
+		uint16_t partition;
+		// all messages accumulated in the batch are acknowledged with this id
+		uint32_t clientReqId;
+		// when the first message was accumulated
+		uint64_t createdMS;
+		// keys and contents of the accumulated messages
+		IOBuffer data;
+		std::vector<batched_msg> msgs;
+	};
+
+	struct
+	{
+		uint32_t lingerMS{0};
+		uint32_t maxBytes;
+		uint32_t maxMsgs;
+	} produceLinger;
+
+	// (topic, partition) => batch
+	std::unordered_map<std::string, produce_batch *> produceBatches;
+	std::vector<msg> batchMsgs;
+	// See submit_produce()
+	PubSubQueue<produce_batch> produceSubmissions;
+
+	// See set_decompression_threads()
+	struct decompression_job
+	{
+		const uint8_t *content;
+		uint32_t len;
+		uint8_t codec;
+		bool decompressed;
+		IOBuffer *out;
+	};
+
+	struct decompression_pool;
+
+	decompression_pool *decompressionPool{nullptr};
+	Switch::vector<decompression_job> decompressionJobs;
+	uint32_t nextDecompressionJob{0};
         Switch::vector<fault> capturedFaults;
         Switch::vector<produce_ack> produceAcks;
         Switch::vector<discovered_topic_partitions> discoverPartitionsResults;
 	Switch::vector<created_topic> createdTopicsResults;
+	Switch::vector<seqnums_for_ts_result> seqNumsForTSResults;
+	Switch::vector<compression_dict_result> compressionDictsResults;
+	// topic => ID of the dictionary(registered with Compression::RegisterZstdDictionary()) its bundles are compressed with
+	std::unordered_map<std::string, uint32_t> topicCompressionDicts;
+	// (topic, ID) of dictionaries consumed bundles were compressed with, to be fetched on the next poll(); see fault::Type::UnknownCompressionDict
+	std::vector<std::pair<std::string, uint32_t>> missingCompressionDicts;
+	// IDs of the dictionaries fetched because of missingCompressionDicts, so that each is only fetched once
+	std::set<uint32_t> fetchedMissingCompressionDicts;
         Switch::vector<consumed_msg> consumptionList;
         Switch::vector<consume_ctx> consumeOut;
         Switch::vector<produce_ctx> produceOut;
@@ -447,7 +622,11 @@ class TankClient final
 
         broker *broker_state(const Switch::endpoint e);
 
-        static uint8_t choose_compression_codec(const msg *const, const size_t);
+        uint8_t choose_compression_codec(const msg *const, const size_t, const uint32_t) const;
+
+        uint32_t compression_dict_for(const strwlen8_t topic) const;
+
+        uint32_t compression_dict_req(const strwlen8_t topic, const uint32_t dictId, const strwlen32_t dict);
 
         // this is somewhat complicated, because we want to use varint for the bundle length and we want to
         // encode this efficiently (no copying or moving data across buffers)
@@ -485,10 +664,26 @@ class TankClient final
 
         bool process_consume(connection *const c, const uint8_t *const content, const size_t len);
 
+        void decompress_bundles(const uint8_t *p, const uint8_t *bundles, const uint64_t *const reqSeqNums);
+
+        IOBuffer *decompressed_bundle(const uint8_t *const content);
+
+        bool produce_batch_now(produce_batch *const batch);
+
+        void flush_due_produce_batches();
+
+        static void append_to_batch(produce_batch *const batch, const std::vector<msg> &msgs);
+
+        void drain_produce_submissions();
+
         bool process_discover_partitions(connection *const c, const uint8_t *const content, const size_t len);
 
         bool process_create_topic(connection *const c, const uint8_t *const content, const size_t len);
 
+        bool process_seqnums_for_ts(connection *const c, const uint8_t *const content, const size_t len);
+
+        bool process_compression_dict(connection *const c, const uint8_t *const content, const size_t len);
+
         bool process(connection *const c, const uint8_t msg, const uint8_t *const content, const size_t len);
 
         auto get_buffer()
@@ -591,6 +786,12 @@ class TankClient final
                 return consumedPartitionContent;
         }
 
+        // Only used if set_lazy_consume(true)
+        const auto &consumed_chunks() const noexcept
+        {
+                return consumedChunks;
+        }
+
         const auto &faults() const noexcept
         {
                 return capturedFaults;
@@ -611,6 +812,16 @@ class TankClient final
 		return createdTopicsResults;
 	}
 
+	const auto &seqnums_for_ts() const noexcept
+	{
+		return seqNumsForTSResults;
+	}
+
+	const auto &compression_dicts() const noexcept
+	{
+		return compressionDictsResults;
+	}
+
         void poll(uint32_t timeoutMS);
 
 
@@ -621,6 +832,22 @@ class TankClient final
 
         [[gnu::warn_unused_result]] uint32_t produce_to(const topic_partition &to, const std::vector<msg> &msgs);
 
+        // Accumulates the messages into the partition's batch; see set_produce_linger()
+        // Returns the id the batch will be acknowledged with; messages accumulated into the same batch share the same id
+        // Returns 0 if the batch was produced right away(batch size limits) and that failed, like produce_to() does
+        // If no linger is set, this is the same as produce_to(), except that messages still accumulated for the partition are produced first
+        [[gnu::warn_unused_result]] uint32_t produce_batched(const topic_partition &to, const std::vector<msg> &msgs);
+
+        // Produces all accumulated batches, regardless of their linger
+        // Batches that can't be produced are reported as Network faults for the ids produce_batched() returned for them
+        void flush_produce_batches();
+
+        // Unlike all other methods, this can be called from any thread, concurrently with the thread that poll()s
+        // The messages are copied and queued, and the thread that poll()s produces them(as one bundle) in its next poll(), which
+        // is interrupted if it is blocked waiting for I/O. Returns the id the request will be acknowledged(or faulted) with; see produce_acks()
+        // This way, a single client, and so a single connection to each broker, can be shared by all threads of a process
+        uint32_t submit_produce(const topic_partition &to, const std::vector<msg> &msgs);
+
 
 
 	// This is needed for Tank system tools. Applications should never need to use this method
@@ -639,6 +866,34 @@ class TankClient final
 
 	[[gnu::warn_unused_result]] uint32_t discover_partitions(const strwlen8_t topic);
 
+	// Looks up the sequence number of the first message with timestamp >= ts for each (partition, ts)
+	// See seqnums_for_ts()
+	[[gnu::warn_unused_result]] uint32_t seqnums_for_ts(const strwlen8_t topic, const std::vector<std::pair<uint16_t, uint64_t>> &partitions);
+
+	// Fetches the topic's current trained Zstd dictionary; see compression_dicts()
+	// Once fetched, bundles produced to the topic are compressed with Zstd and that dictionary, and bundles consumed from it can be decompressed
+	//
+	// If dictId is set, the dictionary with that ID is fetched instead, e.g to decompress bundles compressed with a dictionary
+	// the topic used before its current one. It's only used to decompress bundles, and the result's dictId is 0 if there's no such dictionary
+	[[gnu::warn_unused_result]] uint32_t fetch_compression_dict(const strwlen8_t topic, const uint32_t dictId = 0)
+	{
+		return compression_dict_req(topic, dictId, {});
+	}
+
+	// Uploads a trained Zstd dictionary(e.g generated with `zstd --train` or `tank-cli train_dict`) for the topic to the broker, which
+	// stores it in the topic's directory. The dictionary is also used for the topic, as if it was fetched
+	[[gnu::warn_unused_result]] uint32_t store_compression_dict(const strwlen8_t topic, const strwlen32_t dict)
+	{
+		if (!dict)
+			throw Switch::data_error("Empty compression dictionary");
+
+		return compression_dict_req(topic, 0, dict);
+	}
+
+	// Uses a dictionary that is already available(e.g read from the topic's compression.dict) for the topic, without asking the broker
+	// The broker must have the same dictionary, otherwise it won't be able to decompress those bundles when compacting the partition
+	void set_compression_dict(const strwlen8_t topic, const strwlen32_t dict);
+
 	[[gnu::warn_unused_result]] uint32_t create_topic(const strwlen8_t topic, const uint16_t numPartitions, const strwlen32_t configuration);
 
 
@@ -659,6 +914,24 @@ class TankClient final
                 compressionStrategy = c;
         }
 
+        // The codec used for bundles the compression strategy decides to compress
+        // LZ4 is cheaper to encode than Snappy, Zstd gets far better compression ratios
+        void set_compression_codec(const Compression::Algo a)
+        {
+                if (a == Compression::Algo::UNKNOWN)
+                        throw Switch::range_error("Unsupported compression codec");
+
+                compressionAlgo = a;
+        }
+
+        // If enabled, produce requests are only acknowledged once the broker has synced the bundles they appended
+        // If timeoutMs is not 0 and they haven't been synced by then, a NotDurable fault is captured for those partitions instead
+        void set_durable_acks(const bool v, const uint32_t timeoutMs = 0)
+        {
+                requiredAcks = v ? 0xff : 0;
+                ackTimeout = v ? timeoutMs : 0;
+        }
+
 	void set_sock_sndbuf_size(const int v)
 	{
 		sndBufSize = v;
@@ -676,6 +949,27 @@ class TankClient final
 		allowStreamingConsumeResponses = v;
 	}
 
+	// Messages produced with produce_batched() are accumulated into per-partition batches, instead of being produced right away. A batch is
+	// produced(as one bundle, compressed according to the compression strategy) once lingerMS have elapsed since its first message was
+	// accumulated, or as soon as it holds batchBytes of keys and contents, or batchMsgs messages. Batches are only produced from within poll()
+	// or produce_batched(), so the application needs to keep poll()ing
+	void set_produce_linger(const uint32_t lingerMS, const uint32_t batchBytes = 256 * 1024, const uint32_t batchMsgs = 1024)
+	{
+		produceLinger.lingerMS = lingerMS;
+		produceLinger.maxBytes = batchBytes;
+		produceLinger.maxMsgs = batchMsgs;
+	}
+
+	// If threadsCnt is not 0, bundles of large consume responses are decompressed in parallel by that many threads(in addition to the
+	// thread that poll()s), before the messages are parsed in order as usual. Useful for consumers catching up with large fetch sizes
+	void set_decompression_threads(const uint32_t threadsCnt);
+
+	// If set, consume responses are reported in consumed_chunks() and decoded on demand with msgs_cursor, instead of consumed()
+	void set_lazy_consume(const bool v)
+	{
+		lazyConsume = v;
+	}
+
         void set_default_leader(const strwlen32_t e)
         {
                 set_default_leader(Switch::ParseSrvEndpoint(e, {_S("tank")}, 11011));